@@ -41,6 +41,9 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "ram-image.h"
+#include "ram-compress.h"
+#include "qemu-error.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -91,6 +94,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_IMAGE    0x40
+#define RAM_SAVE_FLAG_ZPAGES   0x80
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -174,6 +179,133 @@ static int ram_save_block(QEMUFile *f)
     return bytes_sent;
 }
 
+/* Deflates runs of pages in worker threads when migrate_set_compress is
+ * on.  Jobs are written out in the order they were queued. */
+static RAMCompressPool *compress_pool;
+
+/* Block of the last record written from compress_pool */
+static RAMBlock *stream_block;
+
+static void ram_put_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flags)
+{
+    int cont = (block == stream_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+    qemu_put_be64(f, offset | cont | flags);
+    if (!cont) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    }
+    stream_block = block;
+}
+
+static void ram_put_job(QEMUFile *f, RAMCompressJob *job)
+{
+    RAMBlock *block = job->opaque;
+    ram_addr_t offset;
+
+    if (job->op == RAM_COMPRESS_NONE) {
+        ram_put_header(f, block, job->offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, job->ch);
+    } else if (job->ret == 0) {
+        ram_put_header(f, block, job->offset, RAM_SAVE_FLAG_ZPAGES);
+        qemu_put_be32(f, job->len);
+        qemu_put_be32(f, job->buf_len);
+        qemu_put_buffer(f, job->buf, job->buf_len);
+    } else {
+        for (offset = 0; offset < job->len; offset += TARGET_PAGE_SIZE) {
+            ram_put_header(f, block, job->offset + offset,
+                           RAM_SAVE_FLAG_PAGE);
+            qemu_put_buffer(f, job->host + offset, TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+static void ram_compress_flush(QEMUFile *f)
+{
+    RAMCompressJob *job;
+
+    while ((job = ram_compress_wait(compress_pool)) != NULL) {
+        ram_put_job(f, job);
+        ram_compress_retire(compress_pool);
+    }
+}
+
+/* Like ram_save_block(), but queues the next run of dirty pages for the
+ * compression workers.  Duplicate pages still go out as a single byte. */
+static int ram_save_compressed_block(QEMUFile *f)
+{
+    RAMBlock *block = last_block;
+    ram_addr_t offset = last_offset;
+    ram_addr_t current_addr;
+    RAMCompressJob *job;
+    int bytes_sent = 0;
+
+    if (!block)
+        block = QLIST_FIRST(&ram_list.blocks);
+
+    /* Make room by writing out the oldest job */
+    while ((job = ram_compress_next(compress_pool)) == NULL) {
+        ram_put_job(f, ram_compress_wait(compress_pool));
+        ram_compress_retire(compress_pool);
+    }
+
+    current_addr = block->offset + offset;
+
+    do {
+        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
+            uint8_t *p = block->host + offset;
+            ram_addr_t len = TARGET_PAGE_SIZE;
+
+            job->opaque = block;
+            job->offset = offset;
+            job->host = p;
+
+            if (is_dup_page(p, *p)) {
+                job->op = RAM_COMPRESS_NONE;
+                job->ch = *p;
+                bytes_sent = 1;
+            } else {
+                /* Extend the run up to the next clean or duplicate page */
+                while (len < RAM_COMPRESS_MAX_LEN &&
+                       offset + len < block->length &&
+                       cpu_physical_memory_get_dirty(current_addr + len,
+                                                     MIGRATION_DIRTY_FLAG) &&
+                       !is_dup_page(p + len, p[len])) {
+                    len += TARGET_PAGE_SIZE;
+                }
+                job->op = RAM_COMPRESS_DEFLATE;
+                bytes_sent = len;
+            }
+            job->len = len;
+
+            cpu_physical_memory_reset_dirty(current_addr, current_addr + len,
+                                            MIGRATION_DIRTY_FLAG);
+            ram_compress_submit(compress_pool, job);
+
+            /* Continue after the run */
+            offset += len - TARGET_PAGE_SIZE;
+            break;
+        }
+
+        offset += TARGET_PAGE_SIZE;
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block)
+                block = QLIST_FIRST(&ram_list.blocks);
+        }
+
+        current_addr = block->offset + offset;
+
+    } while (current_addr != last_block->offset + last_offset);
+
+    last_block = block;
+    last_offset = offset;
+
+    return bytes_sent;
+}
+
 static uint64_t bytes_transferred;
 
 static ram_addr_t ram_save_remaining(void)
@@ -248,6 +380,57 @@ static void sort_ram_list(void)
     qemu_free(blocks);
 }
 
+static void ram_save_block_list(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+}
+
+/* RAM goes to a separate image file once the VM has stopped, the stream
+ * only names the image.  Nothing is sent while the guest still runs. */
+static int ram_save_image(QEMUFile *f, int stage, const char *path)
+{
+    uint64_t id;
+    int ret;
+
+    if (stage < 0) {
+        return 0;
+    }
+
+    if (stage == 1) {
+        bytes_transferred = 0;
+        sort_ram_list();
+        ram_save_block_list(f);
+    }
+
+    if (stage == 3) {
+        ret = ram_image_save(path, &id);
+        if (ret < 0) {
+            error_report("could not write RAM image %s: %s", path,
+                         strerror(-ret));
+            qemu_file_set_error(f);
+            return 0;
+        }
+        bytes_transferred = ram_bytes_total();
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_IMAGE);
+        qemu_put_be64(f, id);
+        qemu_put_be32(f, strlen(path));
+        qemu_put_buffer(f, (const uint8_t *)path, strlen(path));
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 1;
+}
+
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
     ram_addr_t addr;
@@ -255,8 +438,14 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     double bwidth = 0;
     uint64_t expected_time = 0;
 
+    if (migrate_ram_image()) {
+        return ram_save_image(f, stage, migrate_ram_image());
+    }
+
     if (stage < 0) {
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_compress_pool_free(compress_pool);
+        compress_pool = NULL;
         return 0;
     }
 
@@ -270,8 +459,17 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         bytes_transferred = 0;
         last_block = NULL;
         last_offset = 0;
+        stream_block = NULL;
         sort_ram_list();
 
+        ram_compress_pool_free(compress_pool);
+        compress_pool = NULL;
+        if (migrate_compress_threads()) {
+            /* Falls back to raw pages if the pool can't be set up */
+            compress_pool = ram_compress_pool_new(migrate_compress_threads(),
+                                                  migrate_compress_level());
+        }
+
         /* Make sure all dirty bits are set */
         QLIST_FOREACH(block, &ram_list.blocks, next) {
             for (addr = block->offset; addr < block->offset + block->length;
@@ -286,13 +484,7 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
-
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
-        }
+        ram_save_block_list(f);
     }
 
     bytes_transferred_last = bytes_transferred;
@@ -301,13 +493,21 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     while (!qemu_file_rate_limit(f)) {
         int bytes_sent;
 
-        bytes_sent = ram_save_block(f);
+        if (compress_pool) {
+            bytes_sent = ram_save_compressed_block(f);
+        } else {
+            bytes_sent = ram_save_block(f);
+        }
         bytes_transferred += bytes_sent;
         if (bytes_sent == 0) { /* no more blocks */
             break;
         }
     }
 
+    if (compress_pool) {
+        ram_compress_flush(f);
+    }
+
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
@@ -322,8 +522,17 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         int bytes_sent;
 
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+        if (compress_pool) {
+            while ((bytes_sent = ram_save_compressed_block(f)) != 0) {
+                bytes_transferred += bytes_sent;
+            }
+            ram_compress_flush(f);
+            ram_compress_pool_free(compress_pool);
+            compress_pool = NULL;
+        } else {
+            while ((bytes_sent = ram_save_block(f)) != 0) {
+                bytes_transferred += bytes_sent;
+            }
         }
         cpu_physical_memory_set_dirty_tracking(0);
     }
@@ -365,14 +574,58 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
-int ram_load(QEMUFile *f, void *opaque, int version_id)
+/* Inflates RAM_SAVE_FLAG_ZPAGES runs, set up by the first one in a
+ * section */
+static RAMCompressPool *decompress_pool;
+
+static int ram_decompress_retire(void)
 {
-    ram_addr_t addr;
-    int flags;
+    RAMCompressJob *job = ram_compress_wait(decompress_pool);
+    int ret = job->ret;
 
-    if (version_id < 3 || version_id > 4) {
-        return -EINVAL;
+    ram_compress_retire(decompress_pool);
+    return ret;
+}
+
+static int ram_decompress_flush(void)
+{
+    int ret = 0;
+
+    while (ram_compress_wait(decompress_pool) != NULL) {
+        if (ram_decompress_retire() < 0) {
+            ret = -EINVAL;
+        }
+    }
+    return ret;
+}
+
+/* A page sent again must not be overwritten by its older copy that is
+ * still being inflated */
+static int ram_decompress_sync(void *host, ram_addr_t len)
+{
+    if (decompress_pool &&
+        ram_compress_pending(decompress_pool, host, len)) {
+        return ram_decompress_flush();
+    }
+    return 0;
+}
+
+static int ram_host_range_valid(uint8_t *host, ram_addr_t len)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (host >= block->host && host < block->host + block->length) {
+            return len <= block->host + block->length - host;
+        }
     }
+    return 0;
+}
+
+static int ram_load_pages(QEMUFile *f, int version_id)
+{
+    ram_addr_t addr;
+    int flags;
 
     do {
         addr = qemu_get_be64(f);
@@ -431,6 +684,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
+            if (ram_decompress_sync(host, TARGET_PAGE_SIZE) < 0) {
+                return -EINVAL;
+            }
+
             ch = qemu_get_byte(f);
             memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
@@ -446,8 +703,66 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = qemu_get_ram_ptr(addr);
             else
                 host = host_from_stream_offset(f, addr, flags);
+            if (!host || ram_decompress_sync(host, TARGET_PAGE_SIZE) < 0) {
+                return -EINVAL;
+            }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_ZPAGES) {
+            RAMCompressJob *job;
+            uint8_t *host;
+            uint32_t len, zlen;
+
+            host = host_from_stream_offset(f, addr, flags);
+            len = qemu_get_be32(f);
+            zlen = qemu_get_be32(f);
+            if (!host || len == 0 || len > RAM_COMPRESS_MAX_LEN ||
+                (len & ~TARGET_PAGE_MASK) || !ram_host_range_valid(host, len)) {
+                return -EINVAL;
+            }
+
+            if (!decompress_pool) {
+                decompress_pool = ram_compress_pool_new(0, -1);
+                if (!decompress_pool) {
+                    return -ENOMEM;
+                }
+            }
+            if (ram_decompress_sync(host, len) < 0) {
+                return -EINVAL;
+            }
+            while ((job = ram_compress_next(decompress_pool)) == NULL) {
+                if (ram_decompress_retire() < 0) {
+                    return -EINVAL;
+                }
+            }
+            if (zlen > job->buf_size) {
+                return -EINVAL;
+            }
+
+            qemu_get_buffer(f, job->buf, zlen);
+            job->op = RAM_COMPRESS_INFLATE;
+            job->host = host;
+            job->len = len;
+            job->buf_len = zlen;
+            ram_compress_submit(decompress_pool, job);
+        } else if (flags & RAM_SAVE_FLAG_IMAGE) {
+            char path[1024];
+            uint64_t id;
+            uint32_t len;
+
+            id = qemu_get_be64(f);
+            len = qemu_get_be32(f);
+            if (len >= sizeof(path)) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, (uint8_t *)path, len);
+            path[len] = 0;
+
+            /* Prefer the image we were started with, it may have moved */
+            if (ram_image_load(ram_image_path ? ram_image_path : path,
+                               id) < 0) {
+                return -EINVAL;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -457,6 +772,27 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret;
+
+    if (version_id < 3 || version_id > 4) {
+        return -EINVAL;
+    }
+
+    ret = ram_load_pages(f, version_id);
+
+    /* Every run has to land before the section is done */
+    if (decompress_pool) {
+        if (ram_decompress_flush() < 0 && ret == 0) {
+            ret = -EINVAL;
+        }
+        ram_compress_pool_free(decompress_pool);
+        decompress_pool = NULL;
+    }
+    return ret;
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
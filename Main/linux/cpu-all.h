@@ -866,6 +866,9 @@ extern ram_addr_t ram_size;
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
 
+/* RAM is a private mapping of the -ram-image file */
+#define RAM_IMAGE_MASK      (1 << 1)
+
 typedef struct RAMBlock {
     uint8_t *host;
     ram_addr_t offset;
@@ -886,6 +889,7 @@ extern RAMList ram_list;
 
 extern const char *mem_path;
 extern int mem_prealloc;
+extern const char *ram_image_path;
 
 /* physical memory access */
 
@@ -970,6 +974,10 @@ int cpu_physical_log_stop(target_phys_addr_t start_addr,
                           ram_addr_t size);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+
+void mmio_profile_set_enabled(bool enabled, bool timing);
+void mmio_profile_reset(void);
+void mmio_profile_print(FILE *f, fprintf_function cpu_fprintf);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
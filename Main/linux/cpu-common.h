@@ -64,6 +64,7 @@ int cpu_register_io_memory(CPUReadMemoryFunc * const *mem_read,
                            CPUWriteMemoryFunc * const *mem_write,
                            void *opaque, enum device_endian endian);
 void cpu_unregister_io_memory(int table_address);
+void cpu_io_memory_set_name(int table_address, const char *name);
 
 void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                             int len, int is_write);
@@ -51,6 +51,8 @@
 #include <libutil.h>
 #endif
 #endif
+#else /* !CONFIG_USER_ONLY */
+#include "ram-image.h"
 #endif
 
 //#define DEBUG_TB_INVALIDATE
@@ -202,6 +204,9 @@ CPUReadMemoryFunc *io_mem_read[IO_MEM_NB_ENTRIES][4];
 void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 static char io_mem_used[IO_MEM_NB_ENTRIES];
 static int io_mem_watch;
+/* For the MMIO profiler: who owns each io zone and where it was mapped */
+static const char *io_mem_name[IO_MEM_NB_ENTRIES];
+static target_phys_addr_t io_mem_base[IO_MEM_NB_ENTRIES];
 #endif
 
 /* log support */
@@ -2616,9 +2621,16 @@ void cpu_register_physical_memory_offset(target_phys_addr_t start_addr,
     CPUState *env;
     ram_addr_t orig_size = size;
     subpage_t *subpage;
+    int io_index;
 
     cpu_notify_set_memory(start_addr, size, phys_offset);
 
+    io_index = (phys_offset & ~TARGET_PAGE_MASK) >> IO_MEM_SHIFT;
+    if (io_index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT) &&
+        io_mem_base[io_index] == -1) {
+        io_mem_base[io_index] = start_addr;
+    }
+
     if (phys_offset == IO_MEM_UNASSIGNED) {
         region_offset = start_addr;
     }
@@ -2878,7 +2890,14 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
     } else {
-        if (mem_path) {
+#ifndef _WIN32
+        if (ram_image_path) {
+            new_block->host = ram_image_alloc(new_block, size);
+        }
+#endif
+        if (new_block->host) {
+            ;
+        } else if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
             new_block->host = file_ram_alloc(new_block, size, mem_path);
             if (!new_block->host) {
@@ -2932,6 +2951,10 @@ void qemu_ram_free(ram_addr_t addr)
             QLIST_REMOVE(block, next);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
+#ifndef _WIN32
+            } else if (block->flags & RAM_IMAGE_MASK) {
+                munmap(block->host, block->length);
+#endif
             } else if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
                 if (block->fd) {
@@ -3571,6 +3594,398 @@ static void swapendian_del(int io_index)
     }
 }
 
+/*
+ * MMIO profiler.  While it is on, every io zone that belongs to a device
+ * is wrapped the same way as for the endian swap above, and the wrapper
+ * counts the accesses per zone and per register offset.  When it is off
+ * the dispatch tables hold the device functions again, so the access path
+ * is exactly what it is without the profiler.  With timing on, every
+ * MMIO_PROFILE_SAMPLE'th access is also timed with the host clock.
+ */
+
+#define MMIO_PROFILE_SAMPLE 64
+#define MMIO_PROFILE_TOP    20
+
+typedef struct MMIOProfileReg {
+    target_phys_addr_t addr;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t samples;
+    int64_t ns;
+} MMIOProfileReg;
+
+typedef struct MMIOProfile {
+    CPUReadMemoryFunc *read[3];
+    CPUWriteMemoryFunc *write[3];
+    void *opaque;
+    int io_index;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t samples;
+    int64_t ns;
+    /* Open addressing on the offset, a slot with no accesses is free */
+    MMIOProfileReg *regs;
+    unsigned int nregs;
+    unsigned int size;
+} MMIOProfile;
+
+static MMIOProfile *mmio_profile[IO_MEM_NB_ENTRIES];
+static int mmio_profile_enabled;
+static int mmio_profile_timing;
+static unsigned int mmio_profile_tick;
+
+static MMIOProfileReg *mmio_profile_reg(MMIOProfile *p,
+                                        target_phys_addr_t addr);
+
+static void mmio_profile_grow(MMIOProfile *p)
+{
+    MMIOProfileReg *old = p->regs;
+    unsigned int i, n = p->size;
+
+    p->size = n ? n * 2 : 64;
+    p->regs = qemu_mallocz(p->size * sizeof(MMIOProfileReg));
+    p->nregs = 0;
+    for (i = 0; i < n; i++) {
+        if (old[i].reads || old[i].writes) {
+            *mmio_profile_reg(p, old[i].addr) = old[i];
+        }
+    }
+    qemu_free(old);
+}
+
+static MMIOProfileReg *mmio_profile_reg(MMIOProfile *p,
+                                        target_phys_addr_t addr)
+{
+    MMIOProfileReg *r;
+    unsigned int i;
+
+    if (p->nregs * 2 >= p->size) {
+        mmio_profile_grow(p);
+    }
+    i = (addr >> 2) ^ (addr >> 12);
+    for (;; i++) {
+        r = &p->regs[i & (p->size - 1)];
+        if (!r->reads && !r->writes) {
+            r->addr = addr;
+            p->nregs++;
+            return r;
+        }
+        if (r->addr == addr) {
+            return r;
+        }
+    }
+}
+
+static inline int mmio_profile_sample(void)
+{
+    return mmio_profile_timing &&
+           !(++mmio_profile_tick & (MMIO_PROFILE_SAMPLE - 1));
+}
+
+static uint32_t mmio_profile_read(MMIOProfile *p, target_phys_addr_t addr,
+                                  int len)
+{
+    MMIOProfileReg *r = mmio_profile_reg(p, addr);
+    uint32_t val;
+    int64_t t;
+
+    p->reads++;
+    r->reads++;
+    if (!mmio_profile_sample()) {
+        return p->read[len](p->opaque, addr);
+    }
+
+    t = get_clock();
+    val = p->read[len](p->opaque, addr);
+    t = get_clock() - t;
+    p->samples++;
+    p->ns += t;
+    r->samples++;
+    r->ns += t;
+    return val;
+}
+
+static void mmio_profile_write(MMIOProfile *p, target_phys_addr_t addr,
+                               uint32_t val, int len)
+{
+    MMIOProfileReg *r = mmio_profile_reg(p, addr);
+    int64_t t;
+
+    p->writes++;
+    r->writes++;
+    if (!mmio_profile_sample()) {
+        p->write[len](p->opaque, addr, val);
+        return;
+    }
+
+    t = get_clock();
+    p->write[len](p->opaque, addr, val);
+    t = get_clock() - t;
+    p->samples++;
+    p->ns += t;
+    r->samples++;
+    r->ns += t;
+}
+
+static uint32_t mmio_profile_readb(void *opaque, target_phys_addr_t addr)
+{
+    return mmio_profile_read(opaque, addr, 0);
+}
+
+static uint32_t mmio_profile_readw(void *opaque, target_phys_addr_t addr)
+{
+    return mmio_profile_read(opaque, addr, 1);
+}
+
+static uint32_t mmio_profile_readl(void *opaque, target_phys_addr_t addr)
+{
+    return mmio_profile_read(opaque, addr, 2);
+}
+
+static CPUReadMemoryFunc * const mmio_profile_readfn[3]={
+    mmio_profile_readb,
+    mmio_profile_readw,
+    mmio_profile_readl
+};
+
+static void mmio_profile_writeb(void *opaque, target_phys_addr_t addr,
+                                uint32_t val)
+{
+    mmio_profile_write(opaque, addr, val, 0);
+}
+
+static void mmio_profile_writew(void *opaque, target_phys_addr_t addr,
+                                uint32_t val)
+{
+    mmio_profile_write(opaque, addr, val, 1);
+}
+
+static void mmio_profile_writel(void *opaque, target_phys_addr_t addr,
+                                uint32_t val)
+{
+    mmio_profile_write(opaque, addr, val, 2);
+}
+
+static CPUWriteMemoryFunc * const mmio_profile_writefn[3]={
+    mmio_profile_writeb,
+    mmio_profile_writew,
+    mmio_profile_writel
+};
+
+/* Wrap a device zone; the fixed zones, the watchpoint zone and the
+   subpage containers (whose subregions have zones of their own) are left
+   alone. */
+static void mmio_profile_add(int io_index)
+{
+    MMIOProfile *p;
+    int i;
+
+    if (!io_mem_used[io_index] ||
+        io_index <= (io_mem_watch >> IO_MEM_SHIFT) ||
+        io_mem_read[io_index][0] == subpage_read[0] ||
+        io_mem_read[io_index][0] == mmio_profile_readfn[0]) {
+        return;
+    }
+
+    p = mmio_profile[io_index];
+    if (!p) {
+        p = mmio_profile[io_index] = qemu_mallocz(sizeof(MMIOProfile));
+        p->io_index = io_index;
+    }
+    p->opaque = io_mem_opaque[io_index];
+    for (i = 0; i < 3; i++) {
+        p->read[i] = io_mem_read[io_index][i];
+        p->write[i] = io_mem_write[io_index][i];
+
+        io_mem_read[io_index][i] = mmio_profile_readfn[i];
+        io_mem_write[io_index][i] = mmio_profile_writefn[i];
+    }
+    io_mem_opaque[io_index] = p;
+}
+
+/* Put the device functions back, keeping the counts */
+static void mmio_profile_remove(int io_index)
+{
+    MMIOProfile *p = mmio_profile[io_index];
+    int i;
+
+    if (io_mem_read[io_index][0] != mmio_profile_readfn[0]) {
+        return;
+    }
+    for (i = 0; i < 3; i++) {
+        io_mem_read[io_index][i] = p->read[i];
+        io_mem_write[io_index][i] = p->write[i];
+    }
+    io_mem_opaque[io_index] = p->opaque;
+}
+
+static void mmio_profile_del(int io_index)
+{
+    MMIOProfile *p = mmio_profile[io_index];
+
+    mmio_profile_remove(io_index);
+    if (p) {
+        qemu_free(p->regs);
+        qemu_free(p);
+        mmio_profile[io_index] = NULL;
+    }
+}
+
+void mmio_profile_set_enabled(bool enabled, bool timing)
+{
+    int i;
+
+    mmio_profile_timing = enabled && timing;
+    if (enabled == mmio_profile_enabled) {
+        return;
+    }
+    mmio_profile_enabled = enabled;
+    for (i = 0; i < IO_MEM_NB_ENTRIES; i++) {
+        if (enabled) {
+            mmio_profile_add(i);
+        } else {
+            mmio_profile_remove(i);
+        }
+    }
+}
+
+void mmio_profile_reset(void)
+{
+    MMIOProfile *p;
+    int i;
+
+    for (i = 0; i < IO_MEM_NB_ENTRIES; i++) {
+        p = mmio_profile[i];
+        if (p) {
+            p->reads = p->writes = p->samples = 0;
+            p->ns = 0;
+            qemu_free(p->regs);
+            p->regs = NULL;
+            p->nregs = p->size = 0;
+        }
+    }
+}
+
+typedef struct MMIOProfileHot {
+    MMIOProfile *zone;
+    MMIOProfileReg *reg;
+} MMIOProfileHot;
+
+static int mmio_profile_zone_cmp(const void *a, const void *b)
+{
+    const MMIOProfile *x = *(MMIOProfile * const *)a;
+    const MMIOProfile *y = *(MMIOProfile * const *)b;
+    uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+
+    if (nx != ny) {
+        return nx < ny ? 1 : -1;
+    }
+    return x->io_index - y->io_index;
+}
+
+static int mmio_profile_reg_cmp(const void *a, const void *b)
+{
+    const MMIOProfileReg *x = ((const MMIOProfileHot *)a)->reg;
+    const MMIOProfileReg *y = ((const MMIOProfileHot *)b)->reg;
+    uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+
+    if (nx != ny) {
+        return nx < ny ? 1 : -1;
+    }
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Host time spent in the device, extrapolated from the timed accesses */
+static int64_t mmio_profile_us(uint64_t count, uint64_t samples, int64_t ns)
+{
+    return samples ? (int64_t)((double)ns * count / samples / 1000) : 0;
+}
+
+static const char *mmio_profile_name(int io_index, char *buf, size_t len)
+{
+    if (io_mem_name[io_index]) {
+        return io_mem_name[io_index];
+    }
+    snprintf(buf, len, "io%d", io_index);
+    return buf;
+}
+
+void mmio_profile_print(FILE *f, fprintf_function cpu_fprintf)
+{
+    MMIOProfile *zones[IO_MEM_NB_ENTRIES];
+    MMIOProfileHot *hot;
+    MMIOProfile *p;
+    char buf[16];
+    int width = sizeof(target_phys_addr_t) * 2;
+    int i, n = 0, nhot = 0, timed = 0;
+    unsigned int j;
+
+    for (i = 0; i < IO_MEM_NB_ENTRIES; i++) {
+        p = mmio_profile[i];
+        if (p && (p->reads || p->writes)) {
+            zones[n++] = p;
+            nhot += p->nregs;
+            timed |= p->samples != 0;
+        }
+    }
+
+    cpu_fprintf(f, "MMIO profile %s", mmio_profile_enabled ? "on" : "off");
+    if (mmio_profile_timing) {
+        cpu_fprintf(f, ", timing 1 in %d accesses", MMIO_PROFILE_SAMPLE);
+    }
+    cpu_fprintf(f, "\n");
+    if (!n) {
+        return;
+    }
+
+    qsort(zones, n, sizeof(zones[0]), mmio_profile_zone_cmp);
+    cpu_fprintf(f, "%-24s %-*s %12s %12s%s\n", "device", width, "base",
+                "reads", "writes", timed ? "    host us" : "");
+    for (i = 0; i < n && i < MMIO_PROFILE_TOP; i++) {
+        p = zones[i];
+        cpu_fprintf(f, "%-24s " TARGET_FMT_plx " %12" PRIu64 " %12" PRIu64,
+                    mmio_profile_name(p->io_index, buf, sizeof(buf)),
+                    io_mem_base[p->io_index], p->reads, p->writes);
+        if (timed) {
+            cpu_fprintf(f, " %10" PRId64, mmio_profile_us(p->reads + p->writes,
+                                                         p->samples, p->ns));
+        }
+        cpu_fprintf(f, "\n");
+    }
+
+    hot = qemu_malloc(nhot * sizeof(MMIOProfileHot));
+    nhot = 0;
+    for (i = 0; i < n; i++) {
+        p = zones[i];
+        for (j = 0; j < p->size; j++) {
+            if (p->regs[j].reads || p->regs[j].writes) {
+                hot[nhot].zone = p;
+                hot[nhot].reg = &p->regs[j];
+                nhot++;
+            }
+        }
+    }
+    qsort(hot, nhot, sizeof(hot[0]), mmio_profile_reg_cmp);
+    cpu_fprintf(f, "\n%-24s %-*s %12s %12s%s\n", "register", width,
+                "address", "reads", "writes", timed ? "    host us" : "");
+    for (i = 0; i < nhot && i < MMIO_PROFILE_TOP; i++) {
+        MMIOProfileReg *r = hot[i].reg;
+
+        p = hot[i].zone;
+        cpu_fprintf(f, "%-15s+0x%-6x " TARGET_FMT_plx " %12" PRIu64
+                    " %12" PRIu64,
+                    mmio_profile_name(p->io_index, buf, sizeof(buf)),
+                    (unsigned int)r->addr, io_mem_base[p->io_index] + r->addr,
+                    r->reads, r->writes);
+        if (timed) {
+            cpu_fprintf(f, " %10" PRId64, mmio_profile_us(r->reads + r->writes,
+                                                         r->samples, r->ns));
+        }
+        cpu_fprintf(f, "\n");
+    }
+    qemu_free(hot);
+}
+
 /* mem_read and mem_write are arrays of functions containing the
    function to access byte (index 0), word (index 1) and dword (index
    2). Functions can be omitted with a NULL function pointer.
@@ -3593,6 +4008,7 @@ static int cpu_register_io_memory_fixed(int io_index,
         io_index >>= IO_MEM_SHIFT;
         if (io_index >= IO_MEM_NB_ENTRIES)
             return -1;
+        mmio_profile_del(io_index);
     }
 
     for (i = 0; i < 3; ++i) {
@@ -3621,6 +4037,10 @@ static int cpu_register_io_memory_fixed(int io_index,
         break;
     }
 
+    if (mmio_profile_enabled) {
+        mmio_profile_add(io_index);
+    }
+
     return (io_index << IO_MEM_SHIFT);
 }
 
@@ -3636,6 +4056,7 @@ void cpu_unregister_io_memory(int io_table_address)
     int i;
     int io_index = io_table_address >> IO_MEM_SHIFT;
 
+    mmio_profile_del(io_index);
     swapendian_del(io_index);
 
     for (i=0;i < 3; i++) {
@@ -3644,6 +4065,16 @@ void cpu_unregister_io_memory(int io_table_address)
     }
     io_mem_opaque[io_index] = NULL;
     io_mem_used[io_index] = 0;
+    io_mem_name[io_index] = NULL;
+    io_mem_base[io_index] = -1;
+}
+
+/* Name the io zone after its device in the MMIO profile; name must stay
+   valid as long as the zone is registered. */
+void cpu_io_memory_set_name(int io_table_address, const char *name)
+{
+    io_mem_name[(io_table_address >> IO_MEM_SHIFT) &
+                (IO_MEM_NB_ENTRIES - 1)] = name;
 }
 
 static void io_mem_init(void)
@@ -3661,6 +4092,8 @@ static void io_mem_init(void)
                                  DEVICE_NATIVE_ENDIAN);
     for (i=0; i<5; i++)
         io_mem_used[i] = 1;
+    for (i = 0; i < IO_MEM_NB_ENTRIES; i++)
+        io_mem_base[i] = -1;
 
     io_mem_watch = cpu_register_io_memory(watch_mem_read,
                                           watch_mem_write, NULL,
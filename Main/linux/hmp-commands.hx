@@ -185,14 +185,16 @@ ETEXI
         .name       = "trace-event",
         .args_type  = "name:s,option:b",
         .params     = "name on|off",
-        .help       = "changes status of a specific trace event",
+        .help       = "changes status of a specific trace event, or of all "
+                      "events starting with name when it ends with '*'",
         .mhandler.cmd = do_change_trace_event_state,
     },
 
 STEXI
 @item trace-event
 @findex trace-event
-changes status of a trace event
+changes status of a trace event.  A name ending with @code{*} changes all
+events starting with the rest of the name, e.g. @code{s5l8930_cdma*}.
 ETEXI
 
     {
@@ -208,6 +210,43 @@ STEXI
 @findex trace-file
 Open, close, or flush the trace file.  If no argument is given, the status of the trace file is displayed.
 ETEXI
+#endif
+
+    {
+        .name       = "mmio-profile",
+        .args_type  = "op:s",
+        .params     = "on|time|off|reset",
+        .help       = "count MMIO accesses per device and register ('time' also samples host time)",
+        .mhandler.cmd = do_mmio_profile,
+    },
+
+STEXI
+@item mmio-profile on|time|off|reset
+@findex mmio-profile
+Count guest accesses to each MMIO device and register offset.  With
+@code{time}, one access in 64 is also timed with the host clock.  @code{off}
+stops counting and keeps the counts, @code{reset} clears them.  The results
+are shown by @code{info mmio-profile}.  While off, MMIO dispatch is not
+affected at all.
+ETEXI
+
+#if defined(TARGET_ARM)
+    {
+        .name       = "aes-capture",
+        .args_type  = "op:s?,arg:F?",
+        .params     = "on|off [dir]",
+        .help       = "start or stop capturing S5L8930 AES buffers to dir (default /tmp/aes)",
+        .mhandler.cmd = do_aes_capture,
+    },
+
+STEXI
+@item aes-capture on|off [@var{dir}]
+@findex aes-capture
+Start or stop writing the input, key and output buffers of each S5L8930 CDMA
+AES operation to @var{dir}.  Files are written by a background thread; if it
+falls behind, records are dropped.  If no argument is given, the capture
+status is displayed.
+ETEXI
 #endif
 
     {
@@ -818,6 +857,44 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_ram_image",
+        .args_type  = "path:F?",
+        .params     = "[path]",
+        .help       = "write guest RAM to a mappable image file instead of "
+                      "the migration stream (no path: stream RAM again)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_ram_image,
+    },
+
+STEXI
+@item migrate_set_ram_image [@var{path}]
+@findex migrate_set_ram_image
+Write guest RAM to @var{path} when the VM is stopped at the end of
+following migrations and savevm, instead of sending it in the stream.
+Restore with @option{-ram-image} @var{path} to share the image between
+instances.  Without @var{path}, RAM is sent in the stream again.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "compress RAM pages with zlib in this many threads "
+                      "during migration (0 sends pages uncompressed)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compress,
+    },
+
+STEXI
+@item migrate_set_compress @var{threads} [@var{level}]
+@findex migrate_set_compress
+Compress RAM pages in @var{threads} worker threads with zlib @var{level}
+(1 to 9, default 1) in following migrations and savevm.  The destination
+decompresses in one thread per host CPU.  0 sends pages uncompressed,
+which older versions can still load.
 ETEXI
 
     {
@@ -1310,6 +1387,8 @@ show virtual to physical memory mappings (i386, SH4 and SPARC only)
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info mmio-profile
+show the most accessed MMIO devices and registers, see @code{mmio-profile}
 @item info kvm
 show KVM information
 @item info numa
@@ -1352,6 +1431,10 @@ show device tree
 show qdev device model list
 @item info roms
 show roms
+@item info h2fmi
+show H2FMI NAND read and page cache statistics (ARM only)
+@item info uart
+show bytes and chardev writes per S5L8900 UART (ARM only)
 @end table
 ETEXI
 
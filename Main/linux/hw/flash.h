@@ -5,6 +5,8 @@ void pflash_set_rxlen(void *opaque, uint32_t rxLen);
 void pflash_cmd_set(void *opaque, uint32_t *cmd);
 uint32_t pflash_cmd_len(void *opaque);
 uint32_t pflash_cmd_parse(void *opaque);
+uint32_t pflash_spi_remaining(void *opaque);
+uint32_t pflash_spi_read(void *opaque, uint8_t *buf, uint32_t len);
 pflash_t *pflash_spi_register(  ram_addr_t off,
                                 BlockDriverState *bs, uint32_t sector_len,
                                 int nb_blocs, int nb_mappings, int width,
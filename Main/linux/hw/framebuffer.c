@@ -18,9 +18,11 @@
 #include "console.h"
 #include "framebuffer.h"
 
-/* Render an image from a shared memory framebuffer.  */
-   
-void framebuffer_update_display(
+/* Render an image from a shared memory framebuffer.  If update_fn is
+   non-NULL it is called once for every contiguous run of redrawn rows,
+   so that callers can push partial rectangles to the display.  */
+
+void framebuffer_update_display_runs(
     DisplayState *ds,
     target_phys_addr_t base,
     int cols, /* Width in pixels.  */
@@ -32,13 +34,16 @@ void framebuffer_update_display(
     drawfn fn,
     void *opaque,
     int *first_row, /* Input and output.  */
-    int *last_row /* Output only */)
+    int *last_row, /* Output only */
+    fbupdatefn update_fn,
+    void *update_opaque)
 {
     target_phys_addr_t src_len;
     uint8_t *dest;
     uint8_t *src;
     uint8_t *src_base;
     int first, last = 0;
+    int run_first = -1;
     int dirty;
     int i;
     ram_addr_t addr;
@@ -99,12 +104,20 @@ void framebuffer_update_display(
             fn(opaque, dest, src, cols, dest_col_pitch);
             if (first == -1)
                 first = i;
+            if (run_first == -1)
+                run_first = i;
             last = i;
+        } else if (run_first != -1) {
+            if (update_fn)
+                update_fn(update_opaque, run_first, i - 1);
+            run_first = -1;
         }
         addr += src_width;
         src += src_width;
         dest += dest_row_pitch;
     }
+    if (run_first != -1 && update_fn)
+        update_fn(update_opaque, run_first, rows - 1);
     cpu_physical_memory_unmap(src_base, src_len, 0, 0);
     if (first < 0) {
         return;
@@ -114,3 +127,23 @@ void framebuffer_update_display(
     *last_row = last;
     return;
 }
+
+void framebuffer_update_display(
+    DisplayState *ds,
+    target_phys_addr_t base,
+    int cols,
+    int rows,
+    int src_width,
+    int dest_row_pitch,
+    int dest_col_pitch,
+    int invalidate,
+    drawfn fn,
+    void *opaque,
+    int *first_row,
+    int *last_row)
+{
+    framebuffer_update_display_runs(ds, base, cols, rows, src_width,
+                                    dest_row_pitch, dest_col_pitch,
+                                    invalidate, fn, opaque,
+                                    first_row, last_row, NULL, NULL);
+}
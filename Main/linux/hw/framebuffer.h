@@ -4,6 +4,7 @@
 /* Framebuffer device helper routines.  */
 
 typedef void (*drawfn)(void *, uint8_t *, const uint8_t *, int, int);
+typedef void (*fbupdatefn)(void *, int, int);
 
 void framebuffer_update_display(
     DisplayState *ds,
@@ -19,4 +20,20 @@ void framebuffer_update_display(
     int *first_row,
     int *last_row);
 
+void framebuffer_update_display_runs(
+    DisplayState *ds,
+    target_phys_addr_t base,
+    int cols,
+    int rows,
+    int src_width,
+    int dest_row_pitch,
+    int dest_col_pitch,
+    int invalidate,
+    drawfn fn,
+    void *opaque,
+    int *first_row,
+    int *last_row,
+    fbupdatefn update_fn,
+    void *update_opaque);
+
 #endif
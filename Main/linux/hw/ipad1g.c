@@ -17,26 +17,14 @@
 #include "boards.h"
 #include "loader.h"
 #include "flash.h"
-#include "framebuffer.h"
 
 #include "ipad1g.h"
 #include "s5l8930.h"
 
-uint32_t g_debug = (//S5L8930_DEBUG_PMGR | //S5L8930_DEBUG_SHA1
-					S5L8930_DEBUG_CDMA// | S5L8930_DEBUG_PMGR
-					//| S5L8930_DEBUG_CLK
-                    //0xffffffff |
-					
-                    );
-uint32_t g_dlevel = 0;
-FILE *g_debug_fp = NULL;
-
 typedef struct ipad1g_state {
 	struct s5l8930_state *cpu;
 } ipad1g_s;
 
-static target_phys_addr_t frame_base = 0;
-
 #if 0
 extern s5l8900_gpio_s s5l8900_gpio_state[32];
 
@@ -84,213 +72,6 @@ static struct keymap map[0xE0] = {
     [0xcd] = {6,3}, /* right */
 };
 #endif
-/**************************************************************************/
-/* LCD Module */
-/**************************************************************************/
-
-#include "pixel_ops.h"
-#define draw_line_func drawfn
-
-#define DEPTH 8
-#include "omap_lcd_template.h"
-#define DEPTH 15
-#include "omap_lcd_template.h"
-#define DEPTH 16
-#include "omap_lcd_template.h"
-#define DEPTH 32
-#include "omap_lcd_template.h"
-
-static draw_line_func draw_line_table2[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line2_8,
-    [15]    = draw_line2_15,
-    [16]    = draw_line2_16,
-    [32]    = draw_line2_32,
-}, draw_line_table4[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line4_8,
-    [15]    = draw_line4_15,
-    [16]    = draw_line4_16,
-    [32]    = draw_line4_32,
-}, draw_line_table8[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line8_8,
-    [15]    = draw_line8_15,
-    [16]    = draw_line8_16,
-    [32]    = draw_line8_32,
-}, draw_line_table12[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line12_8,
-    [15]    = draw_line12_15,
-    [16]    = draw_line12_16,
-    [32]    = draw_line12_32,
-}, draw_line_table16[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line16_8,
-    [15]    = draw_line16_15,
-    [16]    = draw_line16_16,
-    [32]    = draw_line16_32,
-};
-
-static uint32_t clcd_init = 0;
-
-static void ipad1g_clcd_update_display(void *opaque)
-{
-    ipad1g_clcd_s *lcd = (ipad1g_clcd_s *) opaque;
-    draw_line_func draw_line;
-    int src_width, dest_width;
-    int height, first, last;
-    int width, linesize, bpp;
-
-	(void)draw_line_table12; // Unused var.
-
-/*
-	if(clcd_init < 100){
-		clcd_init++;
-		return;
-	}
-*/
-    if (!lcd || !lcd->ds || !ds_get_bits_per_pixel(lcd->ds) || !frame_base)
-        return;
-
-    switch (ds_get_bits_per_pixel(lcd->ds)) {
-    case 8:
-        dest_width = 1;
-        break;
-    case 15:
-        dest_width = 2;
-        break;
-    case 16:
-        dest_width = 2;
-        break;
-    case 24:
-        dest_width = 3;
-        break;
-    case 32:
-        dest_width = 4;
-        break;
-    default:
-        fprintf(stderr, "%s: Bad color depth\n", __FUNCTION__);
-        exit(1);
-    }
-
-    /* Colour depth */
-    switch (4) {
-    case 1:
-        draw_line = draw_line_table2[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 2;
-        break;
-
-    case 2:
-        draw_line = draw_line_table4[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 4;
-        break;
-
-    case 3:
-        draw_line = draw_line_table8[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 8;
-        break;
-
-    case 4 ... 7:
-        draw_line = draw_line_table16[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 16;
-        break;
-
-    default:
-		fprintf(stderr, "%s: Bad color depth\n", __FUNCTION__);
-        /* Unsupported at the moment.  */
-        return;
-    }
-
-    /* Resolution */
-    first = last = 0;
-    width = 1024;
-    height = 768;
-    lcd->invalidate = 1;
-
-    /* Content */
-    if (!ds_get_bits_per_pixel(lcd->ds))
-        return;
-
-    src_width =  width * bpp >> 3;
-    linesize = ds_get_linesize(lcd->ds);
-
-    framebuffer_update_display(lcd->ds, frame_base,
-                               width, height,
-                               src_width,       /* Length of source line, in bytes.  */
-                               linesize,        /* Bytes between adjacent horizontal output pixels.  */
-                               dest_width,      /* Bytes between adjacent vertical output pixels.  */
-                               lcd->invalidate,
-                               draw_line, lcd->palette,
-                               &first, &last);
-    if (first >= 0) {
-        //fprintf(stderr, "dpy_update()\n");
-        dpy_update(lcd->ds, 0, 0, width, height);
-    }
-    lcd->invalidate = 0;
-}
-
-static void ipad1g_clcd_invalidate_display(void *opaque) {
-    ipad1g_clcd_s *ipad1g_clcd = opaque;
-    ipad1g_clcd->invalidate = 1;
-}
-
-// Not implemented
-static void ipad1g_clcd_screen_dump(void *opaque, const char *filename) {
-
-}
-
-static uint32_t clcd_read(void *opaque, target_phys_addr_t offset)
-{
-    //ipad1g_clcd_s *s = (ipad1g_clcd_s *)opaque;
-	//fprintf(stderr, "%s: offset 0x%08x\n", __FUNCTION__, offset);
-
-    return 0;
-}
-
-static void clcd_write(void *opaque, target_phys_addr_t offset, uint32_t value)
-{
-    //ipad1g_clcd_s *s = (ipad1g_clcd_s *)opaque;
-	fprintf(stderr, "%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, offset, value);
-	
-    frame_base = CLCD_FRAMEBUFFER;
-
-//	if(offset == 0x78) // Window 2 framebuffer. Doesn't detect active window yet!
-/*
-	{
-		// Framebuffer Address
-		//fprintf(stderr, "%s: Found framebuffer at 0x%08x.\n", __func__, value);
-		frame_base = value;
-	}
-*/
-}
-
-static CPUReadMemoryFunc *clcd_readfn[] = {
-    clcd_read,
-    clcd_read,
-    clcd_read,
-};
-
-static CPUWriteMemoryFunc *clcd_writefn[] = {
-    clcd_write,
-    clcd_write,
-    clcd_write,
-};
-
-static ipad1g_clcd_s * ipad1g_clcd_init(target_phys_addr_t base)
-{
-    ipad1g_clcd_s *lcd = qemu_mallocz(sizeof(ipad1g_clcd_s));
-    int io;
-
-    io = cpu_register_io_memory(clcd_readfn, clcd_writefn, lcd, DEVICE_LITTLE_ENDIAN);
-    cpu_register_physical_memory(base, 0xffff, io);
-
-    lcd->ds = graphic_console_init(ipad1g_clcd_update_display,
-                                   ipad1g_clcd_invalidate_display,
-                                   ipad1g_clcd_screen_dump, NULL, lcd);
-    return lcd;
-}
-
 #if 0
 typedef struct iphone2gKeyState_s {
     struct  keymap *map;
@@ -389,8 +170,6 @@ static void ipad1g_init(ram_addr_t ram_size,
 
     struct ipad1g_state *s = (struct ipad1g_state *) qemu_mallocz(sizeof(*s));
 
-    g_debug_fp = stderr;
-
 	cpu = s5l8930_init();
 
     llb_size = 0x100000; //get_image_size(option_rom[0].name);
@@ -434,7 +213,8 @@ static void ipad1g_init(ram_addr_t ram_size,
     //cpu_register_physical_memory(0x0, RAM_SIZE, ramoff | IO_MEM_RAM);
 
     /* Init LCD */
-    ipad1g_clcd_init(CLCD_BASE_ADDR);
+    s5l8900_lcd_init(CLCD_BASE_ADDR, 0xffff, CLCD_WIDTH, CLCD_HEIGHT,
+            CLCD_FRAMEBUFFER);
 
 	cpu->env->regs[15] = llb_base;
 }
@@ -12,13 +12,7 @@
 
 #define CLCD_BASE_ADDR  	0x89100000
 #define CLCD_FRAMEBUFFER	0x4F700000
-
-typedef struct ipad1g_clcd_s {
-    DisplayState *ds;
-    uint16_t palette[256];
-    int invalidate;
-    uint32_t lcd_ctrl;
-    qemu_irq irq;
-} ipad1g_clcd_s;
+#define CLCD_WIDTH			1024
+#define CLCD_HEIGHT			768
 
 #endif
@@ -17,10 +17,11 @@
 #include "boards.h"
 #include "loader.h"
 #include "flash.h"
-#include "framebuffer.h"
 
 #include "iphone2g.h"
 #include "s5l8900.h"
+#include "s5l8900_aes.h"
+#include "s5l8900_sha1.h"
 
 #define VROM_BASE_ADDR 	0x20000000
 #define IBOOT_BASE_ADDR 0x18000000
@@ -29,19 +30,10 @@
 #define RAM_SIZE 	   	0x08000000
 #define NOR_BASE_ADDR   0x24000000
 
-uint32_t g_debug = ( 0 //S5L8900_DEBUG_CLK
-                    //0xffffffff |
-                    );
-uint32_t g_dlevel = 0;
-FILE *g_debug_fp = NULL;
-
-static target_phys_addr_t frame_base = 0;
-
 struct iphone2g_s {
     struct s5l8900_state *cpu;
 };
 
-extern s5l8900_gpio_s s5l8900_gpio_state[32];
 
 struct  keymap {
     int column;
@@ -86,197 +78,6 @@ static struct keymap map[0xE0] = {
     [0xcb] = {6,2}, /* left */
     [0xcd] = {6,3}, /* right */
 };
-/**************************************************************************/
-/* LCD Module */
-/**************************************************************************/
-
-#include "pixel_ops.h"
-#define draw_line_func drawfn
-
-#define DEPTH 8
-#include "omap_lcd_template.h"
-#define DEPTH 15
-#include "omap_lcd_template.h"
-#define DEPTH 16
-#include "omap_lcd_template.h"
-#define DEPTH 32
-#include "omap_lcd_template.h"
-
-static draw_line_func draw_line_table2[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line2_8,
-    [15]    = draw_line2_15,
-    [16]    = draw_line2_16,
-    [32]    = draw_line2_32,
-}, draw_line_table4[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line4_8,
-    [15]    = draw_line4_15,
-    [16]    = draw_line4_16,
-    [32]    = draw_line4_32,
-}, draw_line_table8[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line8_8,
-    [15]    = draw_line8_15,
-    [16]    = draw_line8_16,
-    [32]    = draw_line8_32,
-}, draw_line_table12[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line12_8,
-    [15]    = draw_line12_15,
-    [16]    = draw_line12_16,
-    [32]    = draw_line12_32,
-}, draw_line_table16[33] = {
-    [0 ... 32]  = 0,
-    [8]     = draw_line16_8,
-    [15]    = draw_line16_15,
-    [16]    = draw_line16_16,
-    [32]    = draw_line16_32,
-};
-
-static void iphone2g_lcd_update_display(void *opaque)
-{
-    iphone2g_lcd_s *lcd = (iphone2g_lcd_s *) opaque;
-    draw_line_func draw_line;
-    int src_width, dest_width;
-    int height, first, last;
-    int width, linesize, bpp;
-
-	(void)draw_line_table12; // Unused var.
-
-    if (!lcd || !lcd->ds || !ds_get_bits_per_pixel(lcd->ds) || !frame_base)
-        return;
-
-    switch (ds_get_bits_per_pixel(lcd->ds)) {
-    case 8:
-        dest_width = 1;
-        break;
-    case 15:
-        dest_width = 2;
-        break;
-    case 16:
-        dest_width = 2;
-        break;
-    case 24:
-        dest_width = 3;
-        break;
-    case 32:
-        dest_width = 4;
-        break;
-    default:
-        fprintf(stderr, "%s: Bad color depth\n", __FUNCTION__);
-        exit(1);
-    }
-
-    /* Colour depth */
-    switch (4) {
-    case 1:
-        draw_line = draw_line_table2[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 2;
-        break;
-
-    case 2:
-        draw_line = draw_line_table4[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 4;
-        break;
-
-    case 3:
-        draw_line = draw_line_table8[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 8;
-        break;
-
-    case 4 ... 7:
-        draw_line = draw_line_table16[ds_get_bits_per_pixel(lcd->ds)];
-        bpp = 16;
-        break;
-
-    default:
-		fprintf(stderr, "%s: Bad color depth\n", __FUNCTION__);
-        /* Unsupported at the moment.  */
-        return;
-    }
-
-    /* Resolution */
-    first = last = 0;
-    width = 320;
-    height = 480;
-    lcd->invalidate = 1;
-
-    /* Content */
-    if (!ds_get_bits_per_pixel(lcd->ds))
-        return;
-
-    src_width =  width * bpp >> 3;
-    linesize = ds_get_linesize(lcd->ds);
-
-    framebuffer_update_display(lcd->ds, frame_base,
-                               width, height,
-                               src_width,       /* Length of source line, in bytes.  */
-                               linesize,        /* Bytes between adjacent horizontal output pixels.  */
-                               dest_width,      /* Bytes between adjacent vertical output pixels.  */
-                               lcd->invalidate,
-                               draw_line, lcd->palette,
-                               &first, &last);
-    if (first >= 0) {
-        //fprintf(stderr, "dpy_update()\n");
-        dpy_update(lcd->ds, 0, 0, width, height);
-    }
-    lcd->invalidate = 0;
-}
-
-static void iphone2g_lcd_invalidate_display(void *opaque) {
-    iphone2g_lcd_s *iphone2g_lcd = opaque;
-    iphone2g_lcd->invalidate = 1;
-}
-
-// Not implemented
-static void iphone2g_lcd_screen_dump(void *opaque, const char *filename) {
-
-}
-
-// Not implemented
-static uint32_t lcd_read(void *opaque, target_phys_addr_t offset)
-{
-    //iphone2g_lcd_s *s = (iphone2g_lcd_s *)opaque;
-	//fprintf(stderr, "%s: offset 0x%08x\n", __FUNCTION__, offset);
-
-    return 0;
-}
-
-static void lcd_write(void *opaque, target_phys_addr_t offset, uint32_t value)
-{
-	if(offset == 0x78) // Window 2 framebuffer. Doesn't detect active window yet!
-	{
-		// Framebuffer Address
-		frame_base = value;
-	}
-}
-
-static CPUReadMemoryFunc *lcd_readfn[] = {
-    lcd_read,
-    lcd_read,
-    lcd_read,
-};
-
-static CPUWriteMemoryFunc *lcd_writefn[] = {
-    lcd_write,
-    lcd_write,
-    lcd_write,
-};
-
-static iphone2g_lcd_s * iphone2g_lcd_init(target_phys_addr_t base)
-{
-    iphone2g_lcd_s *lcd = qemu_mallocz(sizeof(iphone2g_lcd_s));
-    int io;
-
-    io = cpu_register_io_memory(lcd_readfn, lcd_writefn, lcd, DEVICE_LITTLE_ENDIAN);
-    cpu_register_physical_memory(base, 0x7FF, io);
-
-    lcd->ds = graphic_console_init(iphone2g_lcd_update_display,
-                                   iphone2g_lcd_invalidate_display,
-                                   iphone2g_lcd_screen_dump, NULL, lcd);
-    return lcd;
-}
 
 static uint32_t aes_read(void *opaque, target_phys_addr_t offset)
 {
@@ -299,47 +100,45 @@ static void aes_write(void *opaque, target_phys_addr_t offset,
                        uint32_t value)
 {
 	struct aes_s *aesop = (struct aes_s *)opaque;
-    static uint8_t keylenop = 0;
 
-	uint8_t inbuf[0x1000];
-	uint8_t *buf;
+	const uint8_t *key = NULL;
+	int keybits = 0;
 
 	//fprintf(stderr, "%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, offset, value);
 
 	switch(offset) {
 			case AES_GO:
-				memset(inbuf, 0, sizeof(inbuf));
-				cpu_physical_memory_read((aesop->inaddr - 0x80000000), (uint8_t *)inbuf, aesop->insize);
-
 				switch(aesop->keytype) {
 						case AESGID:	
 							fprintf(stderr, "%s: No support for GID key\n", __func__);
 							return;			
 						case AESUID:
-						    AES_set_decrypt_key(key_uid, sizeof(key_uid) * 8, &aesop->decryptKey);
+						    key = key_uid;
+							keybits = sizeof(key_uid) * 8;
 							break;
 						case AESCustom:
-							AES_set_decrypt_key((uint8_t *)aesop->custkey, 0x20 * 8, &aesop->decryptKey);
+							key = (uint8_t *)aesop->custkey;
+							keybits = 0x20 * 8;
 							break;
+						default:
+							fprintf(stderr, "%s: Unknown key type 0x%08x\n", __func__, aesop->keytype);
+							return;
 				}
 
-				buf = (uint8_t *) qemu_mallocz(aesop->insize);
-
-				AES_cbc_encrypt(inbuf, buf, aesop->insize, &aesop->decryptKey, (uint8_t *)aesop->ivec, aesop->operation);
+				s5l8900_aes_cbc_phys(key, keybits, aesop->inaddr - 0x80000000, aesop->outaddr - 0x80000000,
+						aesop->insize, (uint8_t *)aesop->ivec, aesop->operation);
 
-				cpu_physical_memory_write((aesop->outaddr - 0x80000000), buf, aesop->insize);
 				memset(aesop->custkey, 0, 0x20);
 				memset(aesop->ivec, 0, 0x10);
-				qemu_free(buf);
-				keylenop = 0;
+				aesop->keylenop = 0;
 				aesop->outsize = aesop->insize;
 				aesop->status = 0xf;
 				break;
 			case AES_KEYLEN:
-				if(keylenop == 1) {
+				if(aesop->keylenop == 1) {
 					aesop->operation = value;
 				}
-				keylenop++;
+				aesop->keylenop++;
 				aesop->keylen = value;
 				break;
 			case AES_INADDR:
@@ -388,6 +187,30 @@ static CPUWriteMemoryFunc *aes_writefn[] = {
     aes_write,
 };
 
+static const VMStateDescription vmstate_iphone2g_aes = {
+    .name = "iphone2g.aes",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(ivec, aes_s, 4),
+        VMSTATE_UINT32(insize, aes_s),
+        VMSTATE_UINT32(inaddr, aes_s),
+        VMSTATE_UINT32(outsize, aes_s),
+        VMSTATE_UINT32(outaddr, aes_s),
+        VMSTATE_UINT32(auxaddr, aes_s),
+        VMSTATE_UINT32(keytype, aes_s),
+        VMSTATE_UINT32(status, aes_s),
+        VMSTATE_UINT32(ctrl, aes_s),
+        VMSTATE_UINT32(unkreg0, aes_s),
+        VMSTATE_UINT32(unkreg1, aes_s),
+        VMSTATE_UINT32(operation, aes_s),
+        VMSTATE_UINT32(keylen, aes_s),
+        VMSTATE_UINT32_ARRAY(custkey, aes_s, 8),
+        VMSTATE_UINT32(keylenop, aes_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void aes_init(target_phys_addr_t base)
 {
 	struct aes_s *aesop = (struct aes_s *) qemu_mallocz(sizeof(aes_s));
@@ -395,6 +218,8 @@ static void aes_init(target_phys_addr_t base)
 
     io = cpu_register_io_memory(aes_readfn, aes_writefn, aesop, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xFF, io);
+    cpu_io_memory_set_name(io, "s5l8900.aes");
+    vmstate_register(NULL, -1, &vmstate_iphone2g_aes, aesop);
 }
 
 typedef struct sha1_status {
@@ -447,23 +272,13 @@ static void sha1_write(void *opaque, target_phys_addr_t offset,
 		case SHA_CONFIG:
 			if((value & 0x2) && (s->config & 0x8))
 			{	
-				uint8_t *hptr;
-
 				if(!s->hresult || !s->insize)
 					return;
 				
 				/* Why do they give us incorrect size? */
 				s->insize += 0x20;
 
-                hptr = (uint8_t *) qemu_mallocz(s->insize);
-                cpu_physical_memory_read(s->hresult, (uint8_t *)hptr, s->insize);
-
-    			SHA_CTX context;
-    			SHA1_Init(&context);
-    			SHA1_Update(&context, (uint8_t*) hptr, s->insize);
-    			SHA1_Final(s->hashout, &context);
-				
-				qemu_free(hptr);
+				s5l8900_sha1_phys(s->hresult, s->insize, s->hashout);
 			} else {
 				s->config = value;
 			}
@@ -498,6 +313,21 @@ static CPUWriteMemoryFunc * const sha1_writefn[] = {
     sha1_write,
 };
 
+static const VMStateDescription vmstate_iphone2g_sha1 = {
+    .name = "iphone2g.sha1",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config, sha1_status_s),
+        VMSTATE_UINT32(reset, sha1_status_s),
+        VMSTATE_UINT32(hresult, sha1_status_s),
+        VMSTATE_UINT32(insize, sha1_status_s),
+        VMSTATE_UINT32(unkstat, sha1_status_s),
+        VMSTATE_BUFFER(hashout, sha1_status_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void sha1_init(target_phys_addr_t base)
 {
     sha1_status_s *s = (sha1_status_s *) qemu_mallocz(sizeof(sha1_status_s));
@@ -505,10 +335,13 @@ static void sha1_init(target_phys_addr_t base)
                                            sha1_writefn,
                                            s, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xFF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.sha1");
+    vmstate_register(NULL, -1, &vmstate_iphone2g_sha1, s);
 }
 
 typedef struct iphone2gKeyState_s {
     struct  keymap *map;
+    s5l8900_gpio_s *gpio;
 } iphone2gKeyState_s;
 
 
@@ -518,37 +351,38 @@ static void iphone2g_keyboard_event (iphone2gKeyState_s *kp, int keycode)
 
        switch(keycode) {
         	case 0x36:
-            	s5l8900_gpio_state[0].gpio_state |= 1 << (BUTTONS_HOME & 0xf);
+            	s5l8900_gpio_set_input(kp->gpio, BUTTONS_HOME, 1);
                 break;
             case 0xb6:
-                s5l8900_gpio_state[0].gpio_state &= ~(1 << (BUTTONS_HOME & 0xf));
+                s5l8900_gpio_set_input(kp->gpio, BUTTONS_HOME, 0);
                 break;
 			case 0x01:
-				s5l8900_gpio_state[0].gpio_state |= 1 << (BUTTONS_HOLD & 0xf);
+				s5l8900_gpio_set_input(kp->gpio, BUTTONS_HOLD, 1);
                 break;
             case 0x81:
-                s5l8900_gpio_state[0].gpio_state &= ~(1 << (BUTTONS_HOLD & 0xf));
+                s5l8900_gpio_set_input(kp->gpio, BUTTONS_HOLD, 0);
                 break;
 			case 0x51:
-            	s5l8900_gpio_state[0].gpio_state &= ~(1 << (BUTTONS_VOLUP & 0xf));
+            	s5l8900_gpio_set_input(kp->gpio, BUTTONS_VOLUP, 0);
                 break;
 			case 0xd1:
-				s5l8900_gpio_state[0].gpio_state |= 1 << (BUTTONS_VOLUP & 0xf);
+				s5l8900_gpio_set_input(kp->gpio, BUTTONS_VOLUP, 1);
 				break;
 			case 0x53:
-				s5l8900_gpio_state[0].gpio_state &= ~(1 << (BUTTONS_VOLDOWN & 0xf));
+				s5l8900_gpio_set_input(kp->gpio, BUTTONS_VOLDOWN, 0);
                 break;
 			case 0xd3:
-				s5l8900_gpio_state[0].gpio_state |= 1 << (BUTTONS_VOLDOWN & 0xf);
+				s5l8900_gpio_set_input(kp->gpio, BUTTONS_VOLDOWN, 1);
 				break;
        }
 
 }
 
-static void iphone2g_register_keyboard(void)
+static void iphone2g_register_keyboard(s5l8900_gpio_s *gpio)
 {
     iphone2gKeyState_s *kp = (iphone2gKeyState_s *) qemu_mallocz(sizeof(iphone2gKeyState_s));
     kp->map = map;
+    kp->gpio = gpio;
     qemu_add_kbd_event_handler((QEMUPutKBDEvent *) iphone2g_keyboard_event, kp);
 }
 
@@ -566,8 +400,6 @@ static void iphone2g_init(ram_addr_t ram_size,
 
     struct iphone2g_s *s = (struct iphone2g_s *) qemu_mallocz(sizeof(*s));
 
-    g_debug_fp = stderr;
-
 	cpu = s5l8900_init();
 
     iboot_size = 0x140000;
@@ -618,7 +450,7 @@ static void iphone2g_init(ram_addr_t ram_size,
     }
 
 	/* Init LCD */
-	iphone2g_lcd_init(LCD_BASE_ADDR);
+	s5l8900_lcd_init(LCD_BASE_ADDR, 0x7FF, LCD_WIDTH, LCD_HEIGHT, 0);
 
 	/* Init AES hardware */
 	aes_init(AES_BASE_ADDR);
@@ -627,7 +459,7 @@ static void iphone2g_init(ram_addr_t ram_size,
 	sha1_init(SHA1_BASE_ADDR);
 	
     /* Button emulation */
-    iphone2g_register_keyboard();
+    iphone2g_register_keyboard(cpu->gpio);
 
 	cpu->env->regs[15] = IBOOT_BASE_ADDR;
 }
@@ -1,10 +1,7 @@
 #ifndef _IPHONE2G_H
 #define _IPHONE2G_H
 
-#include <openssl/sha.h>
-#include <openssl/aes.h>
-
-#define key_uid ((uint8_t[]){0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF})
+static const uint8_t key_uid[] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
 
 #define GET_BITS(x, start, length) ((((uint32_t)(x)) << (32 - ((start) + (length)))) >> (32 - (length)))
 #define GET_KEYLEN(x) GET_BITS(x, 16, 2)
@@ -55,7 +52,6 @@ typedef enum AESKeyLen {
 
 typedef struct aes_s
 {
-    AES_KEY decryptKey;
 	uint32_t ivec[4];
 	uint32_t insize;
 	uint32_t inaddr;
@@ -70,15 +66,7 @@ typedef struct aes_s
 	uint32_t operation;
 	uint32_t keylen;
 	uint32_t custkey[8]; 
+	uint32_t keylenop;
 } aes_s;
 
-
-typedef struct iphone2g_lcd_s {
-    DisplayState *ds;
-    uint16_t palette[256];
-    int invalidate;
-    uint32_t lcd_ctrl;
-    qemu_irq irq;
-} iphone2g_lcd_s;
-
 #endif
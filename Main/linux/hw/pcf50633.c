@@ -8,6 +8,7 @@
 #include "smbus.h"
 #include "s5l8900.h"
 #include "qemu-timer.h"
+#include "trace.h"
 
 
 typedef struct pcf50633State {
@@ -24,7 +25,7 @@ static void pcf50633_reset(void *opaque)
 static void pcf50633_write_data(SMBusDevice *dev, uint8_t cmd,
                                 uint8_t *buf, int len)
 {
-    fprintf(stderr, "%s: cmd 0x%08x len 0x%08x\n", __func__, cmd, len);
+    trace_pcf50633_write_data(cmd, len);
 
     switch (cmd) {
     default:
@@ -36,7 +37,7 @@ static void pcf50633_write_data(SMBusDevice *dev, uint8_t cmd,
 
 static uint8_t pcf50633_read_data(SMBusDevice *dev, uint8_t cmd, int n)
 {
-	fprintf(stderr, "%s: cmd 0x%08x n 0x%08x\n", __func__, cmd, n);
+	trace_pcf50633_read_data(cmd, n);
     switch (cmd) {
     default:
         //hw_error("pcf50633: bad read offset 0x%x\n", cmd);
@@ -48,14 +49,14 @@ static uint8_t pcf50633_read_data(SMBusDevice *dev, uint8_t cmd, int n)
 
 static void pcf50633_quick_cmd(SMBusDevice *dev, uint8_t read)
 {
-    fprintf(stderr, "%s: addr=0x%02x read=%d\n", __func__, dev->i2c.address, read);
+    trace_pcf50633_quick_cmd(dev->i2c.address, read);
 }
 
 static void pcf50633_send_byte(SMBusDevice *dev, uint8_t val)
 {
 	pcf50633State *s = (pcf50633State *)dev;
 
-    fprintf(stderr, "%s: addr=%02x val=%02x\n",__func__, dev->i2c.address, val);
+    trace_pcf50633_send_byte(dev->i2c.address, val);
 
 	s->cmd=val;
 	
@@ -65,7 +66,7 @@ static uint8_t pcf50633_receive_byte(SMBusDevice *dev)
 {
 	pcf50633State *s = (pcf50633State *)dev;
 
-    fprintf(stderr, "%s: addr=0x%02x cmd=0x%02x\n",__func__, dev->i2c.address, s->cmd);
+    trace_pcf50633_receive_byte(dev->i2c.address, s->cmd);
 
 	return 0xff;
 
@@ -96,9 +97,21 @@ static int pcf50633_init1(SMBusDevice *dev)
     return 0;
 }
 
+static const VMStateDescription vmstate_pcf50633 = {
+    .name = "pcf50633",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(smbusdev.i2c, pcf50633State),
+        VMSTATE_UINT32(cmd, pcf50633State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static SMBusDeviceInfo pcf50633_info = {
     .i2c.qdev.name = "pcf50633",
     .i2c.qdev.size = sizeof(pcf50633State),
+    .i2c.qdev.vmsd = &vmstate_pcf50633,
     .init = pcf50633_init1,
     .quick_cmd = pcf50633_quick_cmd,
 	.send_byte = pcf50633_send_byte,
@@ -102,11 +102,31 @@ uint32_t pflash_cmd_len(void *opaque)
 	}
 }
 
-uint32_t pflash_cmd_parse(void *opaque)
+/* Bytes the current command still has to shift out */
+uint32_t pflash_spi_remaining(void *opaque)
+{
+	pflash_t *pfl = (pflash_t *)opaque;
+
+	switch(pfl->cmd) {
+		case NOR_SPI_JEDECID:
+			return pfl->wordRx < 3 ? 3 - pfl->wordRx : 0;
+
+		case NOR_SPI_READ:
+			if(pfl->wordRx >= pfl->chip_len)
+				return 0;
+			return MIN(pfl->rxLen, pfl->chip_len - pfl->wordRx);
+
+		default:
+			return 0;
+	}
+}
+
+/* Shift out up to len bytes of the current command's response in one go */
+uint32_t pflash_spi_read(void *opaque, uint8_t *buf, uint32_t len)
 {
 	pflash_t *pfl = (pflash_t *)opaque;
 	uint8_t *p = pfl->storage;
-	uint32_t retBuf;
+	uint32_t i, n;
 
 	switch(pfl->cmd) {
 		case NOR_SPI_RSRT:
@@ -115,29 +135,25 @@ uint32_t pflash_cmd_parse(void *opaque)
 			return 0;
 
 		case NOR_SPI_RDSR:
-			return 0;
+			/* Never busy */
+			n = MIN(len, 1);
+			memset(buf, 0, n);
+			return n;
 
 		case NOR_SPI_JEDECID:
-			return pfl->ident[pfl->wordRx++];
+			n = MIN(len, pflash_spi_remaining(pfl));
+			for(i = 0; i < n; i++)
+				buf[i] = pfl->ident[pfl->wordRx++];
+			return n;
 
         case NOR_SPI_READ:
-			if(pfl->rxLen == 0)
-				return 0;
+			n = MIN(len, pflash_spi_remaining(pfl));
+			memcpy(buf, p + pfl->wordRx, n);
 
-			/* Adjust remaining */
-			pfl->rxLen--;
-            retBuf = p[pfl->wordRx];
-			/*
-            retBuf |= p[pfl->wordRx + 1] << 8;
-            retBuf |= p[pfl->wordRx + 2] << 16;
-            retBuf |= p[pfl->wordRx + 3] << 24;
-			*/
-
-            //fprintf(stderr, "%s: pflash_spi rxBuf 0x%08x rxLen %x wordRx %x\n", __FUNCTION__, retBuf, pfl->rxLen, pfl->wordRx);
-
-			/* Increment sent */
-			pfl->wordRx++;
-			return retBuf;
+			/* Adjust remaining and sent */
+			pfl->rxLen -= n;
+			pfl->wordRx += n;
+			return n;
 
 	  default:
 		fprintf(stderr, "%s: unknown pflash_spi command 0x%08x\n", __FUNCTION__, pfl->cmd);
@@ -145,7 +161,14 @@ uint32_t pflash_cmd_parse(void *opaque)
 		pfl->wordRx = 0;
 		return 0;
 	}
+}
 
+uint32_t pflash_cmd_parse(void *opaque)
+{
+	uint8_t val = 0;
+
+	pflash_spi_read(opaque, &val, 1);
+	return val;
 }
 
 static void pflash_register_memory(pflash_t *pfl, int rom_mode)
@@ -671,6 +694,26 @@ static int ctz32 (uint32_t n)
 }
 #endif 
 
+/* The array itself lives in a RAM block and migrates with guest memory */
+static const VMStateDescription vmstate_pflash_spi = {
+    .name = "pflash_spi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(wcycle, pflash_t),
+        VMSTATE_INT32(bypass, pflash_t),
+        VMSTATE_INT32(rom_mode, pflash_t),
+        VMSTATE_UINT8(cmd, pflash_t),
+        VMSTATE_UINT8(status, pflash_t),
+        VMSTATE_TIMER(timer, pflash_t),
+        VMSTATE_UINT32(rxLen, pflash_t),
+        VMSTATE_UINT32(wordRx, pflash_t),
+        VMSTATE_UINT32(wordTx, pflash_t),
+        VMSTATE_UINT32_ARRAY(buffer, pflash_t, 1024),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 pflash_t *pflash_spi_register(  ram_addr_t off,
                                 BlockDriverState *bs, uint32_t sector_len,
                                 int nb_blocs, int nb_mappings, int width,
@@ -705,6 +748,7 @@ pflash_t *pflash_spi_register(  ram_addr_t off,
     pfl->wcycle = 0;
     pfl->cmd = 0;
     pfl->status = 0;
+    vmstate_register(NULL, -1, &vmstate_pflash_spi, pfl);
 
 	/* Set Chip ID */
     pfl->ident[0] = id0;
@@ -9,17 +9,13 @@
 #include "primecell.h"
 #include "cpu.h"
 #include "cpu-all.h"
+#include "pl192.h"
 
 
 extern CPUState *getIOPCpuEnv(void);
 extern CPUState *getMainCpuEnv(void);
 
 
-#define PL192_INT_SOURCES   32
-#define PL192_DAISY_IRQ     PL192_INT_SOURCES
-#define PL192_NO_IRQ        PL192_INT_SOURCES+1
-#define PL192_PRIO_LEVELS   16
-
 #define PL192_IRQSTATUS         0x00
 #define PL192_FIQSTATUS         0x04
 #define PL192_RAWINTR           0x08
@@ -58,6 +54,10 @@ typedef struct pl192_state_s {
     uint32_t vect_priority[PL192_INT_SOURCES];
     uint32_t address;
 
+    /* Pending IRQ sources by priority level */
+    pl192_prio_t prio;
+    uint8_t fiq_level;
+
     /* Currently processed interrupt and
        highest priority interrupt */
     uint32_t current;
@@ -110,6 +110,12 @@ static void pl192_raise(pl192_state *s, int is_fiq)
             qemu_irq_raise(s->irq);
         } else {
             if (s->daisy) {
+                /* Nothing to do if the next controller already sees this
+                   vector */
+                if (s->daisy->daisy_input && s->daisy->daisy_callback == s &&
+                    s->daisy->daisy_vectaddr == s->address) {
+                    return;
+                }
                 /* Setup daisy input of the next chained contorller and force
                    it to update it's state */
                 s->daisy->daisy_vectaddr = s->address;
@@ -144,52 +150,36 @@ static void pl192_lower(pl192_state *s, int is_fiq)
     /* Propagate to the previous controller in chain if needed */
     if (s->daisy) {
         if (!is_fiq) {
-            s->daisy->daisy_input = 0;
-            pl192_update(s->daisy);
+            if (s->daisy->daisy_input) {
+                s->daisy->daisy_input = 0;
+                pl192_update(s->daisy);
+            }
         } else {
             pl192_lower(s->daisy, is_fiq);
         }
     }
 }
 
-/* Find interrupt of the highest priority */
-static uint32_t pl192_priority_sorter(pl192_state *s)
-{
-    int i;
-    uint32_t prio_irq[PL192_PRIO_LEVELS];
-
-    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
-        prio_irq[i] = PL192_NO_IRQ;
-    }
-    if (s->daisy_input) {
-        prio_irq[s->daisy_priority] = PL192_DAISY_IRQ;
-    }
-    for (i = PL192_INT_SOURCES - 1; i >= 0; i--) {
-        if (s->irq_status & (1 << i)) {
-            prio_irq[s->vect_priority[i]] = i;
-        }
-    }
-    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
-        if ((s->sw_priority_mask & (1 << i)) &&
-            prio_irq[i] <= PL192_DAISY_IRQ) {
-            return prio_irq[i];
-        }
-    }
-    return PL192_NO_IRQ;
-}
-
 static void pl192_update(pl192_state *s)
 {
+    uint32_t irq_status = s->irq_status;
+
     /* TODO: does SOFTINT affects IRQ_STATUS??? */
     s->irq_status = (s->rawintr | s->softint) & s->intenable & ~s->intselect;
     s->fiq_status = (s->rawintr | s->softint) & s->intenable & s->intselect;
+    pl192_prio_status(&s->prio, s->vect_priority, irq_status, s->irq_status);
     if (s->fiq_status) {
         pl192_raise(s, 1);
-    } else {
+        s->fiq_level = 1;
+    } else if (s->fiq_level) {
         pl192_lower(s, 1);
+        s->fiq_level = 0;
     }
     if (s->irq_status || s->daisy_input) {
-        s->current_highest = pl192_priority_sorter(s);
+        s->current_highest = pl192_prio_highest(&s->prio, s->irq_status,
+                                                s->sw_priority_mask,
+                                                s->daisy_input,
+                                                s->daisy_priority);
         if (s->current_highest < PL192_INT_SOURCES) {
             s->address = s->vect_addr[s->current_highest];
         } else {
@@ -271,6 +261,8 @@ static void pl192_irq_fin(pl192_state *s)
     pl192_unmask_priority(s);
     if (is_daisy) {
         pl192_unmask_priority(s->daisy_callback);
+        /* Its output may change now that it is unmasked */
+        pl192_update(s->daisy_callback);
     }
     pl192_update(s);
 
@@ -362,7 +354,11 @@ static void pl192_write(void *opaque, target_phys_addr_t offset,
         return;
     }
     if (offset >= 0x200 && offset < 0x280) {
-        s->vect_priority[(offset - 0x200) >> 2] = value & 0xf;
+        int source = (offset - 0x200) >> 2;
+
+        pl192_prio_move(&s->prio, s->irq_status, source,
+                        s->vect_priority[source], value & 0xf);
+        s->vect_priority[source] = value & 0xf;
         pl192_update(s);
         return;
     }
@@ -442,9 +438,9 @@ static void pl192_irq_handler(void *opaque, int irq, int level)
     pl192_state *s = (pl192_state *) opaque;
 
     if (level) {
-        s->rawintr |= 1 << irq;
+        s->rawintr |= 1u << irq;
     } else {
-        s->rawintr &= ~(1 << irq);
+        s->rawintr &= ~(1u << irq);
     }
     pl192_update(opaque);
 }
@@ -465,6 +461,7 @@ static void pl192_reset(DeviceState *d)
     s->priority_stack[0] = 0x10;
     s->irq_stack[0] = PL192_NO_IRQ;
     s->priority = 0x10;
+    pl192_prio_rebuild(&s->prio, s->vect_priority, s->irq_status);
 }
 
 static CPUReadMemoryFunc * const pl192_readfn[] = {
@@ -552,6 +549,14 @@ static int pl192_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be32s(f, &s->daisy_priority);
     qemu_get_8s   (f, &s->daisy_input);
 
+    for (i = 0; i < PL192_INT_SOURCES; i++) {
+        if (s->vect_priority[i] >= PL192_PRIO_LEVELS) {
+            return -EINVAL;
+        }
+    }
+    pl192_prio_rebuild(&s->prio, s->vect_priority, s->irq_status);
+    s->fiq_level = s->fiq_status != 0;
+
     return 0;
 }
 
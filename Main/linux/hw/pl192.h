@@ -0,0 +1,102 @@
+#ifndef PL192_H
+#define PL192_H
+
+/*
+ * Priority logic of the PL192 VIC, kept apart from the device so that
+ * tests/pl192-bench.c can run it on the host.
+ *
+ * Instead of sorting all sources on every update, the controller keeps
+ * the set of sources at each priority level and a bitmap of the levels
+ * that have a pending source.  Status changes only touch the levels of the
+ * bits that changed, and the winner is two find-first-set operations.
+ */
+
+#include <stdint.h>
+#include "host-utils.h"
+
+#define PL192_INT_SOURCES   32
+#define PL192_DAISY_IRQ     PL192_INT_SOURCES
+#define PL192_NO_IRQ        PL192_INT_SOURCES+1
+#define PL192_PRIO_LEVELS   16
+
+typedef struct pl192_prio_s {
+    uint32_t sources[PL192_PRIO_LEVELS];    /* sources at each level */
+    uint32_t pending;                       /* levels with a pending source */
+} pl192_prio_t;
+
+static inline void pl192_prio_level(pl192_prio_t *p, uint32_t status,
+                                    uint32_t level)
+{
+    if (status & p->sources[level]) {
+        p->pending |= 1u << level;
+    } else {
+        p->pending &= ~(1u << level);
+    }
+}
+
+/* IRQ status went from old to status */
+static inline void pl192_prio_status(pl192_prio_t *p,
+                                     const uint32_t *vect_priority,
+                                     uint32_t old, uint32_t status)
+{
+    uint32_t changed = old ^ status;
+
+    while (changed) {
+        pl192_prio_level(p, status, vect_priority[ctz32(changed)]);
+        changed &= changed - 1;
+    }
+}
+
+/* Source moved from level old to level prio */
+static inline void pl192_prio_move(pl192_prio_t *p, uint32_t status,
+                                   int source, uint32_t old, uint32_t prio)
+{
+    p->sources[old] &= ~(1u << source);
+    p->sources[prio] |= 1u << source;
+    pl192_prio_level(p, status, old);
+    pl192_prio_level(p, status, prio);
+}
+
+static inline void pl192_prio_rebuild(pl192_prio_t *p,
+                                      const uint32_t *vect_priority,
+                                      uint32_t status)
+{
+    int i;
+
+    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
+        p->sources[i] = 0;
+    }
+    for (i = 0; i < PL192_INT_SOURCES; i++) {
+        p->sources[vect_priority[i]] |= 1u << i;
+    }
+    p->pending = 0;
+    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
+        pl192_prio_level(p, status, i);
+    }
+}
+
+/* Highest priority request: a source, PL192_DAISY_IRQ or PL192_NO_IRQ.
+   Within a level the lowest numbered source wins, and any source wins
+   over the daisy chain input. */
+static inline uint32_t pl192_prio_highest(const pl192_prio_t *p,
+                                          uint32_t status, uint32_t mask,
+                                          int daisy_input,
+                                          uint32_t daisy_priority)
+{
+    uint32_t levels = p->pending;
+    uint32_t level;
+
+    if (daisy_input) {
+        levels |= 1u << daisy_priority;
+    }
+    levels &= mask;
+    if (!levels) {
+        return PL192_NO_IRQ;
+    }
+
+    level = ctz32(levels);
+    status &= p->sources[level];
+    return status ? ctz32(status) : PL192_DAISY_IRQ;
+}
+
+#endif
@@ -20,9 +20,11 @@
 #include "block.h"
 #include "boards.h"
 #include "s5l8900.h"
+#include "s5l8900_ticks.h"
 #include "usb_synopsys.h"
 #include "net.h"
 #include "i2c.h"
+#include "trace.h"
 
 typedef struct s5l8900_clk1_s
 {
@@ -38,101 +40,241 @@ typedef struct s5l8900_clk1_s
 } s5l8900_clk1_s;
 
 
+/*
+ * One of the NUM_TIMERS down counters. Nothing ticks while it runs: the
+ * count is worked out from vm_clock when read, and the block only keeps a
+ * host timer for the earliest deadline of all its channels.
+ */
+typedef struct s5l8900_timer_channel_s
+{
+	uint32_t	config;
+	uint32_t	state;
+	uint32_t	bcount1;
+	uint32_t	bcount2;
+	uint32_t	prescaler;
+	uint32_t	count;		// while stopped
+	int64_t		start;		// vm_clock when the current period began
+
+} s5l8900_timer_channel_s;
+
 typedef struct s5l8900_timer_s
 {
-    uint32_t    ticks_high;
-	uint32_t	ticks_low;
-	uint32_t 	status;
-	uint32_t    config;
-	uint32_t    bcount1;
-	uint32_t    bcount2;
-	uint32_t    prescaler;
+	s5l8900_ticks_s ticks;
 	uint32_t    irqstat;
 
+	s5l8900_timer_channel_s channel[NUM_TIMERS];
     QEMUTimer *st_timer;
-	uint32_t bcreload;
-    uint32_t freq_out;
-    uint64_t tick_interval;
-    uint64_t last_tick;
-    uint64_t next_planned_tick;
-    uint64_t base_time;
 	qemu_irq	irq;
 
 } s5l8900_timer_s;
 
-struct s5l8900_gpio_s s5l8900_gpio_state[32];
+static const uint32_t s5l8900_timer_dividers[] = { 2, 4, 16, 64, 1 };
+
+/* Input clocks per count */
+static uint64_t s5l8900_timer_scale(s5l8900_timer_channel_s *ch)
+{
+	uint32_t sel = (ch->config >> TIMER_CONFIG_DIVIDER_SHIFT) & TIMER_CONFIG_DIVIDER_MASK;
+	uint32_t div = sel < ARRAY_SIZE(s5l8900_timer_dividers) ? s5l8900_timer_dividers[sel] : 1;
+
+	return (uint64_t)div * ((ch->prescaler & TIMER_PRESCALER_MASK) + 1);
+}
+
+/* Length of one period in ns, a count of 0 behaves as 1 */
+static int64_t s5l8900_timer_period(s5l8900_timer_channel_s *ch)
+{
+	uint64_t clocks = (ch->bcount1 ? ch->bcount1 : 1) * s5l8900_timer_scale(ch);
+	int64_t period = muldiv64(clocks, get_ticks_per_sec(), S5L8900_TIMER_CLOCK);
+
+	return period ? period : 1;
+}
+
+static uint32_t s5l8900_timer_count(s5l8900_timer_channel_s *ch, int64_t now)
+{
+	uint64_t elapsed;
+	uint32_t bcount = ch->bcount1 ? ch->bcount1 : 1;
+
+	if (!(ch->state & TIMER_STATE_START))
+		return ch->count;
 
-static void s5l8900_st_tick(void *opaque);
+	elapsed = muldiv64(now - ch->start, S5L8900_TIMER_CLOCK, get_ticks_per_sec())
+		/ s5l8900_timer_scale(ch);
 
-/* Update tick_interval */
-static void s5l8900_st_update(s5l8900_timer_s *s)
+	if (ch->config & TIMER_CONFIG_ONESHOT)
+		return elapsed >= bcount ? 0 : bcount - elapsed;
+
+	return bcount - elapsed % bcount;
+}
+
+/* Move start so that a running channel carries on from the latched count
+   at its current rate and reload value */
+static void s5l8900_timer_rebase(s5l8900_timer_channel_s *ch, int64_t now)
 {
-    s->freq_out = 1000000000 / 100; 
-    s->tick_interval = /* bcount1 * get_ticks / freq  + ((bcount2 * get_ticks / freq)*/
-    muldiv64((s->bcount1 < 1000) ? 1000 : s->bcount1, get_ticks_per_sec(), s->freq_out);
-    s->next_planned_tick = 0;
+	uint32_t bcount = ch->bcount1 ? ch->bcount1 : 1;
+	uint64_t clocks = (uint64_t)(ch->count < bcount ? bcount - ch->count : 0)
+		* s5l8900_timer_scale(ch);
+	int64_t ns = muldiv64(clocks, get_ticks_per_sec(), S5L8900_TIMER_CLOCK);
+
+	// Round up, so the count read back right away is not one ahead
+	if (muldiv64(ns, S5L8900_TIMER_CLOCK, get_ticks_per_sec()) < clocks)
+		ns++;
 
-	//fprintf(stderr, "%s: freq_out 0x%08x tick_interval %lld ticks per sec %lld\n", __func__, s->freq_out, s->tick_interval, get_ticks_per_sec());
+	ch->start = now - ns;
 }
 
-static void s5l8900_st_set_timer(s5l8900_timer_s *s)
+/* Arm the host timer for the next deadline, if any channel runs */
+static void s5l8900_timer_rearm(s5l8900_timer_s *s)
 {
-    uint64_t last = qemu_get_clock_ns(vm_clock) - s->base_time;
+	int64_t next = INT64_MAX;
+	int i;
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		s5l8900_timer_channel_s *ch = &s->channel[i];
+		int64_t deadline;
 
-    s->next_planned_tick = last + (s->tick_interval - last % s->tick_interval);
-    qemu_mod_timer(s->st_timer, s->next_planned_tick + s->base_time);
-    s->last_tick = last;
+		if (!(ch->state & TIMER_STATE_START))
+			continue;
+
+		deadline = ch->start + s5l8900_timer_period(ch);
+		if (deadline < next)
+			next = deadline;
+	}
+
+	if (next == INT64_MAX)
+		qemu_del_timer(s->st_timer);
+	else
+		qemu_mod_timer(s->st_timer, next);
 }
 
-/* counter step */
 static void s5l8900_st_tick(void *opaque)
 {
     s5l8900_timer_s *s = (s5l8900_timer_s *)opaque;
-
-    if (s->status & TIMER_STATE_START) {
+	int64_t now = qemu_get_clock_ns(vm_clock);
+	int i;
+
+	for (i = 0; i < NUM_TIMERS; i++) {
+		s5l8900_timer_channel_s *ch = &s->channel[i];
+		int64_t period;
+
+		if (!(ch->state & TIMER_STATE_START))
+			continue;
+
+		period = s5l8900_timer_period(ch);
+		if (ch->start + period > now)
+			continue;
+
+		if (ch->config & TIMER_CONFIG_ONESHOT) {
+			ch->state &= ~TIMER_STATE_START;
+			ch->count = 0;
+		} else {
+			// Skip the periods missed while the host was busy rather than
+			// firing once for each of them
+			ch->start += period * ((now - ch->start) / period);
+		}
+
+		s->irqstat |= 1 << i;
 		//fprintf(stderr, "%s: Raising irq\n", __func__);
-       	qemu_irq_raise(s->irq);
-
-        /* schedule next interrupt */
-        s5l8900_st_set_timer(s);
-    } else {
-        s->next_planned_tick = 0;
-        s->last_tick = 0;
-        qemu_del_timer(s->st_timer);
+		qemu_irq_raise(s->irq);
+	}
+
+	s5l8900_timer_rearm(s);
+}
+
+static int s5l8900_timer_post_load(void *opaque, int version_id)
+{
+	s5l8900_timer_rearm((s5l8900_timer_s *)opaque);
+	return 0;
+}
+
+static const VMStateDescription vmstate_s5l8900_timer_channel = {
+    .name = "s5l8900.timer.channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config, s5l8900_timer_channel_s),
+        VMSTATE_UINT32(state, s5l8900_timer_channel_s),
+        VMSTATE_UINT32(bcount1, s5l8900_timer_channel_s),
+        VMSTATE_UINT32(bcount2, s5l8900_timer_channel_s),
+        VMSTATE_UINT32(prescaler, s5l8900_timer_channel_s),
+        VMSTATE_UINT32(count, s5l8900_timer_channel_s),
+        VMSTATE_INT64(start, s5l8900_timer_channel_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_s5l8900_timer = {
+    .name = "s5l8900.timer",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = s5l8900_timer_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ticks.high, s5l8900_timer_s),
+        VMSTATE_UINT32(ticks.low, s5l8900_timer_s),
+        VMSTATE_UINT32(irqstat, s5l8900_timer_s),
+        VMSTATE_STRUCT_ARRAY(channel, s5l8900_timer_s, NUM_TIMERS, 1,
+                             vmstate_s5l8900_timer_channel, s5l8900_timer_channel_s),
+        VMSTATE_END_OF_LIST()
     }
+};
+
+/* Channel at a register offset, NULL for the block's own registers */
+static s5l8900_timer_channel_s *s5l8900_timer_channel(s5l8900_timer_s *s, target_phys_addr_t addr)
+{
+	if (addr < TIMER_TICKSHIGH)
+		return &s->channel[(addr - TIMER_0) >> 5];
+
+	if (addr >= TIMER_4 && addr < TIMER_IRQLATCH)
+		return &s->channel[4 + ((addr - TIMER_4) >> 5)];
+
+	return NULL;
 }
 
 static uint32_t s5l8900_timer1_read(void *opaque, target_phys_addr_t addr)
 {
     s5l8900_timer_s *s = (struct s5l8900_timer_s *) opaque;
-	uint64_t ticks;
+	s5l8900_timer_channel_s *ch;
+
+	// The timebase is read all the time, keep it ahead of the tracing
+	if (addr == TIMER_TICKSHIGH || addr == TIMER_TICKSLOW)
+		return s5l8900_ticks_read(&s->ticks, addr == TIMER_TICKSHIGH);
 
-    S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+    trace_s5l8900_timer_read(addr);
 
     switch (addr) {
-		case TIMER_TICKSHIGH:	 // needs to be fixed so that read from low first works as well
-			ticks = qemu_get_clock_ns(vm_clock);
-			s->ticks_high = (ticks >> 32);
-			s->ticks_low = (ticks & 0xFFFFFFFF);
-			return s->ticks_high;
-		case TIMER_TICKSLOW:
-			return s->ticks_low;
 		case TIMER_IRQSTAT:
 			return s->irqstat;
 		case TIMER_IRQLATCH:
 			return 0xffffffff;
-
-      default:
-        S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x\n", __FUNCTION__, (int)addr);
     }
+
+	ch = s5l8900_timer_channel(s, addr);
+	if (ch) {
+		switch (addr & 0x1f) {
+			case TIMER_CONFIG:
+				return ch->config;
+			case TIMER_STATE:
+				return ch->state;
+			case TIMER_COUNT_BUFFER:
+				return ch->bcount1;
+			case TIMER_COUNT_BUFFER2:
+				return ch->bcount2;
+			case TIMER_PRESCALER:
+				return ch->prescaler;
+			case TIMER_COUNT:
+				return s5l8900_timer_count(ch, qemu_get_clock_ns(vm_clock));
+		}
+	}
+
+    trace_s5l8900_timer_unmapped_read(addr);
     return 0;
 }
 
 static void s5l8900_timer1_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
 	s5l8900_timer_s *s = (struct s5l8900_timer_s *) opaque;
+	s5l8900_timer_channel_s *ch;
+	int64_t now;
 
-    S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: offset = 0x%02x value = 0x%08x\n", __FUNCTION__, (int)addr, value);
+    trace_s5l8900_timer_write(addr, value);
 	switch(addr){
 
         case TIMER_IRQSTAT:
@@ -140,33 +282,50 @@ static void s5l8900_timer1_write(void *opaque, target_phys_addr_t addr, uint32_t
 			return;
         case TIMER_IRQLATCH:
             //fprintf(stderr, "%s: lowering irq\n", __func__);
+			s->irqstat = 0;
 			qemu_irq_lower(s->irq);		
             return;
-		case TIMER_4 + TIMER_CONFIG:
-			s5l8900_st_update(s);
-			s->config = value;
+	}
+
+	ch = s5l8900_timer_channel(s, addr);
+	if (!ch)
+		return;
+
+	// Latch the count, this write may stop the channel
+	now = qemu_get_clock_ns(vm_clock);
+	if (ch->state & TIMER_STATE_START)
+		ch->count = s5l8900_timer_count(ch, now);
+
+	switch (addr & 0x1f) {
+		case TIMER_CONFIG:
+			ch->config = value;
 			break;
-		case TIMER_4 + TIMER_STATE:
-            if ((value & TIMER_STATE_START) > (s->status & TIMER_STATE_START)) {
-                s->base_time = qemu_get_clock_ns(vm_clock);
-				s5l8900_st_update(s);
-                s5l8900_st_set_timer(s);
-            } else if ((value & TIMER_STATE_START) < (s->status & TIMER_STATE_START)) {
-                qemu_del_timer(s->st_timer);
-            }
-			s->status = value;
+		case TIMER_STATE:
+			if ((value & TIMER_STATE_START) > (ch->state & TIMER_STATE_START)
+					|| (value & TIMER_STATE_MANUALUPDATE)) {
+				ch->start = now;
+				ch->count = ch->bcount1;
+			}
+			ch->state = value & TIMER_STATE_START;
 			break;
-		case TIMER_4 + TIMER_COUNT_BUFFER:
-			s->bcount1 = s->bcreload = value;
+		case TIMER_COUNT_BUFFER:
+			ch->bcount1 = value;
 			break;
-		case TIMER_4 + TIMER_COUNT_BUFFER2:
-			s->bcount2 = value;
+		case TIMER_COUNT_BUFFER2:
+			ch->bcount2 = value;
 			break;
-      default:
-		break;
+		case TIMER_PRESCALER:
+			ch->prescaler = value;
+			break;
+		default:
+			return;
 	}
 
-	return;
+	// A new rate or reload value applies from the count latched above
+	if ((ch->state & TIMER_STATE_START) && (addr & 0x1f) != TIMER_STATE)
+		s5l8900_timer_rebase(ch, now);
+
+	s5l8900_timer_rearm(s);
 }
 
 static CPUReadMemoryFunc *s5l8900_timer1_readfn[] = {
@@ -189,18 +348,35 @@ static void s5l8900_timer_init(target_phys_addr_t base, qemu_irq irq)
                                            s5l8900_timer1_writefn, timer1, DEVICE_LITTLE_ENDIAN);
 	timer1->irq = irq;
     cpu_register_physical_memory(base, 0xFF, iomemtype);
-
-    timer1->base_time = qemu_get_clock_ns(vm_clock);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.timer");
 
     timer1->st_timer = qemu_new_timer_ns(vm_clock, s5l8900_st_tick, timer1);
+    vmstate_register(NULL, base, &vmstate_s5l8900_timer, timer1);
 
 }
 
+static const VMStateDescription vmstate_s5l8900_clk1 = {
+    .name = "s5l8900.clk1",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(clk1_config0, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_config1, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_config2, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_pll1con, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_pll2con, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_pll3con, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_plllock, s5l8900_clk1_s),
+        VMSTATE_UINT32(clk1_pllmode, s5l8900_clk1_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static uint32_t s5l8900_clk1_read(void *opaque, target_phys_addr_t addr)
 {
     s5l8900_clk1_s *s = (struct s5l8900_clk1_s *) opaque;
 
-    S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+    trace_s5l8900_clk1_read(addr);
 
     switch (addr) {
     	case CLOCK1_CONFIG0:
@@ -215,7 +391,7 @@ static uint32_t s5l8900_clk1_read(void *opaque, target_phys_addr_t addr)
 			return s->clk1_pllmode;
 	
       default:
-        S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x\n", __FUNCTION__, (int)addr);
+        trace_s5l8900_clk1_unmapped_read(addr);
     }
     return 0;
 }
@@ -223,7 +399,7 @@ static uint32_t s5l8900_clk1_read(void *opaque, target_phys_addr_t addr)
 static void s5l8900_clk1_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
 
-	S5L8900_DEBUG(S5L8900_DEBUG_CLK, S5L8900_DLVL_ERR, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+	trace_s5l8900_clk1_write(addr, value);
 
 }
 
@@ -248,12 +424,14 @@ static void s5l8900_clk_init(target_phys_addr_t base)
     S5L8900_OPAQUE("clk1", clk1);
 
     cpu_register_physical_memory(base, 0xFF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.clk1");
+    vmstate_register(NULL, base, &vmstate_s5l8900_clk1, clk1);
 }
 
 static uint32_t s5l8900_chipid_read(void *opaque, target_phys_addr_t addr)
 {
 
-	S5L8900_DEBUG(S5L8900_DEBUG_CHIPID, S5L8900_DLVL_WARN, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+	trace_s5l8900_chipid_read(addr);
 
 	switch(addr) {
 			case 0x04:	
@@ -308,7 +486,7 @@ static uint32_t s5l8900_chipid_read(void *opaque, target_phys_addr_t addr)
                 }
 
 		default:
-			 S5L8900_DEBUG(S5L8900_DEBUG_CHIPID, S5L8900_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x\n", __FUNCTION__, (int)addr);
+			 trace_s5l8900_chipid_unmapped_read(addr);
 	}
 
 	return 0;
@@ -326,13 +504,102 @@ static CPUWriteMemoryFunc *s5l8900_chipid_writefn[] = {
     NULL,
 };
 
+static void s5l8900_gpio_irq_update(s5l8900_gpio_s *s, int g)
+{
+    qemu_set_irq(s->irq[g], (s->intstat[g] & s->inten[g]) != 0);
+}
+
+/* Level triggered pins stay pending while they are at their active level */
+static void s5l8900_gpio_level_update(s5l8900_gpio_s *s, int g)
+{
+    s->intstat[g] |= s->inttype[g] & ~(s->level[g] ^ s->intlevel[g]);
+    s5l8900_gpio_irq_update(s, g);
+}
+
+static int s5l8900_gpio_pin_level(s5l8900_gpio_s *s, int group, int pin)
+{
+    switch ((s->con[group] >> (pin * 4)) & 0xf) {
+        case S5L8900_GPIO_FUNC_OUTPUT:
+            return (s->dat[group] >> pin) & 1;
+        case S5L8900_GPIO_FUNC_LOW:
+            return 0;
+        case S5L8900_GPIO_FUNC_HIGH:
+            return 1;
+        default:
+            return (s->input[group] >> pin) & 1;
+    }
+}
+
+/* Recompute the levels of a group's pins and latch their interrupts */
+static void s5l8900_gpio_update(s5l8900_gpio_s *s, int group)
+{
+    int g = group * 8 / 32;
+    uint32_t old = s->level[g];
+    uint32_t edges;
+    int pin;
+
+    for (pin = 0; pin < 8; pin++) {
+        uint32_t bit = 1 << ((group * 8 + pin) % 32);
+
+        if (s5l8900_gpio_pin_level(s, group, pin))
+            s->level[g] |= bit;
+        else
+            s->level[g] &= ~bit;
+    }
+
+    // Edge triggered pins that just moved to their active level
+    edges = (old ^ s->level[g]) & ~(s->level[g] ^ s->intlevel[g]);
+    s->intstat[g] |= edges & ~s->inttype[g];
+    s5l8900_gpio_level_update(s, g);
+}
+
+void s5l8900_gpio_set_input(s5l8900_gpio_s *s, uint32_t port, int level)
+{
+    int group = (port >> 8) & 0x1f;
+    int pin = port & 0x7;
+
+    if (group >= S5L8900_GPIO_GROUPS)
+        return;
+
+    if (level)
+        s->input[group] |= 1 << pin;
+    else
+        s->input[group] &= ~(1 << pin);
+    s5l8900_gpio_update(s, group);
+}
+
 static void s5l8900_sysic_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
+    s5l8900_gpio_s *s = (s5l8900_gpio_s *)opaque;
+    int g = (addr & 0x1f) >> 2;
+
     //fprintf(stderr, "%s: offset 0x%08x value 0x%08x\n", __func__, addr, value);
+
+    if (addr < S5L8900_GPIO_INTLEVEL || addr >= S5L8900_GPIO_INTTYPE + 0x20 || g >= S5L8900_GPIO_INTGROUPS)
+        return;
+
+    switch (addr & ~0x1f) {
+        case S5L8900_GPIO_INTLEVEL:
+            s->intlevel[g] = value;
+            break;
+        case S5L8900_GPIO_INTSTAT:
+            s->intstat[g] &= ~value;
+            break;
+        case S5L8900_GPIO_INTEN:
+            s->inten[g] = value;
+            break;
+        case S5L8900_GPIO_INTTYPE:
+            s->inttype[g] = value;
+            break;
+    }
+    s5l8900_gpio_level_update(s, g);
 }
 
 static uint32_t s5l8900_sysic_read(void *opaque, target_phys_addr_t addr)
 {
+    s5l8900_gpio_s *s = (s5l8900_gpio_s *)opaque;
+    int g = (addr & 0x1f) >> 2;
+
     //fprintf(stderr, "%s: offset 0x%08x\n", __func__, addr);
 
     switch(addr) {
@@ -344,7 +611,19 @@ static uint32_t s5l8900_sysic_read(void *opaque, target_phys_addr_t addr)
             return 1;
     }
 
-    return 0;
+    if (addr < S5L8900_GPIO_INTLEVEL || addr >= S5L8900_GPIO_INTTYPE + 0x20 || g >= S5L8900_GPIO_INTGROUPS)
+        return 0;
+
+    switch (addr & ~0x1f) {
+        case S5L8900_GPIO_INTLEVEL:
+            return s->intlevel[g];
+        case S5L8900_GPIO_INTSTAT:
+            return s->intstat[g];
+        case S5L8900_GPIO_INTEN:
+            return s->inten[g];
+        default:
+            return s->inttype[g];
+    }
 }
 
 static CPUReadMemoryFunc *s5l8900_sysic_readfn[] = {
@@ -359,12 +638,13 @@ static CPUWriteMemoryFunc *s5l8900_sysic_writefn[] = {
     s5l8900_sysic_write,
 };
 
-static void s5l8900_sysic_init(target_phys_addr_t base)
+static void s5l8900_sysic_init(target_phys_addr_t base, s5l8900_gpio_s *gpio)
 {
 
     int iomemtype = cpu_register_io_memory(s5l8900_sysic_readfn,
-                                           s5l8900_sysic_writefn, NULL, DEVICE_LITTLE_ENDIAN);
+                                           s5l8900_sysic_writefn, gpio, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0x3FF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.sysic");
 }
 
 static void s5l8900_chipid_init(target_phys_addr_t base)
@@ -373,25 +653,108 @@ static void s5l8900_chipid_init(target_phys_addr_t base)
     int iomemtype = cpu_register_io_memory(s5l8900_chipid_readfn,
                                            s5l8900_chipid_writefn, NULL, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.chipid");
 
 }
 
+static const VMStateDescription vmstate_s5l8900_gpio = {
+    .name = "s5l8900.gpio",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(con, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(dat, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(pud, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(conslp, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(pudslp, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(input, s5l8900_gpio_s, S5L8900_GPIO_GROUPS),
+        VMSTATE_UINT32_ARRAY(level, s5l8900_gpio_s, S5L8900_GPIO_INTGROUPS),
+        VMSTATE_UINT32_ARRAY(intlevel, s5l8900_gpio_s, S5L8900_GPIO_INTGROUPS),
+        VMSTATE_UINT32_ARRAY(intstat, s5l8900_gpio_s, S5L8900_GPIO_INTGROUPS),
+        VMSTATE_UINT32_ARRAY(inten, s5l8900_gpio_s, S5L8900_GPIO_INTGROUPS),
+        VMSTATE_UINT32_ARRAY(inttype, s5l8900_gpio_s, S5L8900_GPIO_INTGROUPS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void s5l8900_gpio_write(void *opaque, target_phys_addr_t addr, uint32_t value) 
 {
-	fprintf(stderr, "%s: offset 0x%08x value 0x%08x\n", __func__, addr, value);
+    s5l8900_gpio_s *s = (s5l8900_gpio_s *)opaque;
+    int group = addr >> 5;
+    int pin;
+
+    trace_s5l8900_gpio_write(addr, value);
+
+    if (addr == S5L8900_GPIO_FSEL) {
+        group = (value >> 16) & 0x1f;
+        pin = (value >> 8) & 0x7;
+        if (group >= S5L8900_GPIO_GROUPS)
+            return;
+
+        s->con[group] &= ~(0xfu << (pin * 4));
+        s->con[group] |= (value & 0xfu) << (pin * 4);
+        s5l8900_gpio_update(s, group);
+        return;
+    }
+
+    if (group >= S5L8900_GPIO_GROUPS)
+        return;
+
+    switch (addr & 0x1f) {
+        case S5L8900_GPIO_CON:
+            s->con[group] = value;
+            break;
+        case S5L8900_GPIO_DAT:
+            s->dat[group] = value;
+            break;
+        case S5L8900_GPIO_PUD:
+            s->pud[group] = value;
+            return;
+        case S5L8900_GPIO_CONSLP:
+            s->conslp[group] = value;
+            return;
+        case S5L8900_GPIO_PUDSLP:
+            s->pudslp[group] = value;
+            return;
+        default:
+            return;
+    }
+    s5l8900_gpio_update(s, group);
 }
 
 static uint32_t s5l8900_gpio_read(void *opaque, target_phys_addr_t addr)
 {
-    fprintf(stderr, "%s: offset 0x%08x\n", __func__, addr);
+    s5l8900_gpio_s *s = (s5l8900_gpio_s *)opaque;
+    int group = addr >> 5;
+    uint32_t value;
+    int pin;
+
+    trace_s5l8900_gpio_read(addr);
 
 	switch(addr) {
 		case 0x7a:
 			return 1;
-		case 0x2c4:
-			return s5l8900_gpio_state[0].gpio_state;
 	}
 
+    if (group >= S5L8900_GPIO_GROUPS)
+        return 0;
+
+    switch (addr & 0x1f) {
+        case S5L8900_GPIO_CON:
+            return s->con[group];
+        case S5L8900_GPIO_DAT:
+            value = 0;
+            for (pin = 0; pin < 8; pin++)
+                value |= s5l8900_gpio_pin_level(s, group, pin) << pin;
+            return value;
+        case S5L8900_GPIO_PUD:
+            return s->pud[group];
+        case S5L8900_GPIO_CONSLP:
+            return s->conslp[group];
+        case S5L8900_GPIO_PUDSLP:
+            return s->pudslp[group];
+    }
+
     return 0;
 }
 
@@ -407,18 +770,27 @@ static CPUWriteMemoryFunc *s5l8900_gpio_writefn[] = {
     s5l8900_gpio_write,
 };
 
-static void s5l8900_gpio_init(target_phys_addr_t base)
+static s5l8900_gpio_s *s5l8900_gpio_init(target_phys_addr_t base, qemu_irq *irq)
 {
+    s5l8900_gpio_s *s = (s5l8900_gpio_s *)qemu_mallocz(sizeof(s5l8900_gpio_s));
+    int i;
 
     int iomemtype = cpu_register_io_memory(s5l8900_gpio_readfn,
-                                           s5l8900_gpio_writefn, NULL, DEVICE_LITTLE_ENDIAN);
+                                           s5l8900_gpio_writefn, s, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0x3FF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.gpio");
 
-	/* Vol gpios are inverted */
-    s5l8900_gpio_state[0].gpio_state |= (1 << (BUTTONS_VOLUP & 0xf));
-    s5l8900_gpio_state[0].gpio_state |= (1 << (BUTTONS_VOLDOWN & 0xf));
+    for (i = 0; i < S5L8900_GPIO_INTGROUPS; i++)
+        s->irq[i] = irq[i];
 
+	/* Vol gpios are inverted */
+    s->input[(BUTTONS_VOLUP >> 8) & 0x1f] |= 1 << (BUTTONS_VOLUP & 0x7);
+    s->input[(BUTTONS_VOLDOWN >> 8) & 0x1f] |= 1 << (BUTTONS_VOLDOWN & 0x7);
+    for (i = 0; i < S5L8900_GPIO_GROUPS; i++)
+        s5l8900_gpio_update(s, i);
 
+    vmstate_register(NULL, base, &vmstate_s5l8900_gpio, s);
+    return s;
 }
 
 static inline qemu_irq s5l8900_get_irq(struct s5l8900_state_s *s, int n)
@@ -446,7 +818,7 @@ static uint32_t s5l8900_usb_phy_read(void *opaque, target_phys_addr_t offset)
 
 	default:
 		//hw_error("%s: read invalid location 0x%08x.\n", __func__, offset);
-		fprintf(stderr, "%s: read invalid location 0x%08x\n", __func__, offset);
+		trace_s5l8900_usb_phy_unmapped_read(offset);
 		return 0;
 	}
 
@@ -477,7 +849,7 @@ static void s5l8900_usb_phy_write(void *opaque, target_phys_addr_t offset, uint3
 
 	default:
 		//hw_error("%s: write invalid location 0x%08x.\n", __func__, offset);
-		fprintf(stderr, "%s: write invalid location 0x%08x\n", __func__, offset);
+		trace_s5l8900_usb_phy_unmapped_write(offset, val);
 	}
 }
 
@@ -493,6 +865,19 @@ static CPUWriteMemoryFunc * const s5l8900_usb_phy_writefn[] = {
     s5l8900_usb_phy_write,
 };
 
+static const VMStateDescription vmstate_s5l8900_usb_phy = {
+    .name = "s5l8900.usb_phy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(usb_ophypwr, s5l8900_state),
+        VMSTATE_UINT32(usb_ophyclk, s5l8900_state),
+        VMSTATE_UINT32(usb_orstcon, s5l8900_state),
+        VMSTATE_UINT32(usb_ophytune, s5l8900_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void s5l8900_usb_phy_init(s5l8900_state *_state)
 {
 	_state->usb_ophypwr = 0;
@@ -504,6 +889,8 @@ static void s5l8900_usb_phy_init(s5l8900_state *_state)
                                            s5l8900_usb_phy_writefn,
 										   _state, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(S5L8900_USB_PHY_BASE, 0x40, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8900.usb_phy");
+    vmstate_register(NULL, -1, &vmstate_s5l8900_usb_phy, _state);
 }
 
 static uint32_t s5l8900_usb_hwcfg[] = {
@@ -520,6 +907,7 @@ s5l8900_state *s5l8900_init(void)
 	i2c_bus *i2c;
 
     qemu_irq *cpu_irq;
+    qemu_irq gpio_irq[S5L8900_GPIO_INTGROUPS];
     DeviceState *dev, *dev_prev;
 	int i,j;
 
@@ -557,16 +945,23 @@ s5l8900_state *s5l8900_init(void)
 	s5l8900_timer_init(TIMER1, s5l8900_get_irq(s, IRQ_TIMER0));
 
 	/* GPIO */
-	s5l8900_gpio_init(S5L8900_GPIO_BASE);
-
-	/* SYSIC */
-	s5l8900_sysic_init(S5L8900_SYSIC_BASE);
+	gpio_irq[0] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO0);
+	gpio_irq[1] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO1);
+	gpio_irq[2] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO2);
+	gpio_irq[3] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO3);
+	gpio_irq[4] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO4);
+	gpio_irq[5] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO5);
+	gpio_irq[6] = s5l8900_get_irq(s, S5L8900_IRQ_GPIO6);
+	s->gpio = s5l8900_gpio_init(S5L8900_GPIO_BASE, gpio_irq);
+
+	/* SYSIC, with the GPIO interrupt registers */
+	s5l8900_sysic_init(S5L8900_SYSIC_BASE, s->gpio);
 
 	/* Uart */
-    s5l8900_uart_init(S5L8900_UART0_BASE, 0, 256, s5l8900_get_irq(s, S5L8900_IRQ_UART0), serial_hds[0]);
+    s5l8900_uart_init(S5L8900_UART0_BASE, 0, 0, s5l8900_get_irq(s, S5L8900_IRQ_UART0), serial_hds[0]);
 
 	/* Uart + Radio */
-    s5l8900_uart_init(S5L8900_UART1_BASE, 0, 256, s5l8900_get_irq(s, S5L8900_IRQ_UART0 /* XXX: fix irq for radio */), NULL);
+    s5l8900_uart_init(S5L8900_UART1_BASE, 0, 0, s5l8900_get_irq(s, S5L8900_IRQ_UART0 /* XXX: fix irq for radio */), NULL);
 
     /* I2C 0 */
     dev = sysbus_create_simple("s5l8900.i2c", S5l8900_I2C0_BASE,
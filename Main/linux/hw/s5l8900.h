@@ -17,11 +17,22 @@
 #define S5L8900_IRQ_GPIO4              0x02
 #define S5L8900_IRQ_GPIO5              0x01
 #define S5L8900_IRQ_GPIO6              0x00
-#define S5L8900_GPIO_INTLEVEL          0x80
+#define S5L8900_GPIO_INTLEVEL          0x80	// interrupt registers are in SYSIC
 #define S5L8900_GPIO_INTSTAT           0xA0
 #define S5L8900_GPIO_INTEN             0xC0
 #define S5L8900_GPIO_INTTYPE           0xE0
 #define S5L8900_GPIO_FSEL              0x320
+#define S5L8900_GPIO_GROUPS            25		// 8 pins each, 0x20 apart
+#define S5L8900_GPIO_INTGROUPS         7		// 32 pins each
+#define S5L8900_GPIO_CON               0x0
+#define S5L8900_GPIO_DAT               0x4
+#define S5L8900_GPIO_PUD               0x8
+#define S5L8900_GPIO_CONSLP            0xC
+#define S5L8900_GPIO_PUDSLP            0x10
+#define S5L8900_GPIO_FUNC_INPUT        0x0
+#define S5L8900_GPIO_FUNC_OUTPUT       0x1
+#define S5L8900_GPIO_FUNC_LOW          0xE		// FSEL: output, driven low
+#define S5L8900_GPIO_FUNC_HIGH         0xF		// FSEL: output, driven high
 
 #define BUTTONS_HOLD 0x1605
 #define BUTTONS_HOME 0x1600
@@ -53,11 +64,19 @@
 #define TIMER_STATE_STOP 0
 #define TIMER_STATE_MANUALUPDATE 2
 #define NUM_TIMERS 7
-#define TIMER_4 0xA0
+#define TIMER_0 0x0		// channels 0-3 are 0x20 apart from here
+#define TIMER_4 0xA0	// and 4-6 from here, past the tick counter
 #define TIMER_CONFIG 0 
 #define TIMER_STATE 0x4
 #define TIMER_COUNT_BUFFER 0x8
 #define TIMER_COUNT_BUFFER2 0xC
+#define TIMER_PRESCALER 0x10
+#define TIMER_COUNT 0x14
+#define TIMER_CONFIG_ONESHOT (1 << 4)
+#define TIMER_CONFIG_DIVIDER_SHIFT 8
+#define TIMER_CONFIG_DIVIDER_MASK 0x7	// 0: /2, 1: /4, 2: /16, 3: /64, 4: /1
+#define TIMER_PRESCALER_MASK 0xFFFF
+#define S5L8900_TIMER_CLOCK 24000000
 
 // VIC
 #define S5l8900_I2C0_BASE 0x3C600000
@@ -127,35 +146,25 @@
 #define CLOCK1_CL3_GATES 0x4C
 
 
-// DEBUG
-
-#define S5L8900_DLVL_ERR   (1)
-#define S5L8900_DLVL_WARN  (2)
-#define S5L8900_DLVL_INFO  (3)
-#define S5L8900_DLVL_INFO2 (4)
-
-extern uint32_t g_debug;
-extern uint32_t g_dlevel;
-extern FILE *g_debug_fp;
-
 #define S5L8900_OPAQUE(name, opaque) fprintf(stderr, name " is at %p\n", opaque)
 
-#define S5L8900_DEBUG_CLK  		(0x00000001)
-#define S5L8900_DEBUG_MIU  		(0x00000002)
-#define S5L8900_DEBUG_CHIPID 	(0x00000003)
-
-#define S5L8900_DEBUG(module, level, msg ...)                              \
-    do {                                                                \
-    if ((module) & g_debug || (level) <= g_dlevel) {                \
-        fprintf(g_debug_fp, "%lld : ", qemu_get_clock_ms(vm_clock));    \
-            fprintf(g_debug_fp, msg);                                   \
-        }                                                               \
-    } while (0)
-
+/* Ports are (group << 8) | pin, as in the BUTTONS_ defines. Pin n of the
+   block (group * 8 + pin) is bit n % 32 of interrupt group n / 32. */
 typedef struct s5l8900_gpio_s
 {
-    uint32_t gpio_state;
-    uint32_t int_state;
+    uint32_t con[S5L8900_GPIO_GROUPS];		// function, a nibble per pin
+    uint32_t dat[S5L8900_GPIO_GROUPS];		// output latch
+    uint32_t pud[S5L8900_GPIO_GROUPS];
+    uint32_t conslp[S5L8900_GPIO_GROUPS];
+    uint32_t pudslp[S5L8900_GPIO_GROUPS];
+    uint32_t input[S5L8900_GPIO_GROUPS];	// levels driven from outside
+
+    uint32_t level[S5L8900_GPIO_INTGROUPS];	// pin levels as last seen
+    uint32_t intlevel[S5L8900_GPIO_INTGROUPS];	// active high / rising
+    uint32_t intstat[S5L8900_GPIO_INTGROUPS];
+    uint32_t inten[S5L8900_GPIO_INTGROUPS];
+    uint32_t inttype[S5L8900_GPIO_INTGROUPS];	// level, else edge
+    qemu_irq irq[S5L8900_GPIO_INTGROUPS];
 
 } s5l8900_gpio_s;
 
@@ -169,10 +178,15 @@ typedef struct s5l8900_state_s {
 	uint32_t usb_orstcon;
 	uint32_t usb_ophytune;
 
+	s5l8900_gpio_s *gpio;
+
 } s5l8900_state;
 
 s5l8900_state *s5l8900_init(void);
 
+/* Drive an input pin from outside, e.g. a button */
+void s5l8900_gpio_set_input(s5l8900_gpio_s *s, uint32_t port, int level);
+
 
 DeviceState *s5l8900_uart_init(target_phys_addr_t base, int instance,
                                int queue_size, qemu_irq irq,
@@ -180,4 +194,6 @@ DeviceState *s5l8900_uart_init(target_phys_addr_t base, int instance,
 DeviceState *pcf50633_init(i2c_bus *bus, int addr);
 void s5l8900_usb_otg_init(NICInfo *nd, target_phys_addr_t base, qemu_irq irq);
 void set_spi_base(uint32_t base);
+DeviceState *s5l8900_lcd_init(target_phys_addr_t base, uint32_t mmio_size,
+                              int width, int height, uint32_t fb_default);
 #endif
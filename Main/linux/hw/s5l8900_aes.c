@@ -0,0 +1,193 @@
+/*
+ * S5L89xx AES engine backend
+ *
+ * Key schedules are expanded once and kept in a small LRU cache keyed by
+ * (key bytes, key length, direction).  Whole blocks go through OpenSSL's EVP
+ * interface, which picks AES-NI (or another vectorised implementation) at
+ * runtime; the portable AES_cbc_encrypt() from QEMU's aes.c handles any
+ * trailing partial block and is used throughout if EVP is unavailable or
+ * disabled.
+ *
+ * This code is licenced under the GPL.
+ */
+
+#ifdef NEED_CPU_H
+#include "hw.h"
+#endif
+#include <string.h>
+#include <openssl/evp.h>
+#include "s5l8900_aes.h"
+
+#define AES_CACHE_SIZE 8
+
+typedef struct AESCacheEntry {
+    int valid;
+    int keybits;
+    int enc;
+    uint8_t key[32];
+    uint64_t stamp;
+    AES_KEY schedule;
+    EVP_CIPHER_CTX *ctx;
+} AESCacheEntry;
+
+static AESCacheEntry aes_cache[AES_CACHE_SIZE];
+static uint64_t aes_cache_clock;
+static int aes_portable;
+
+void s5l8900_aes_set_portable(int portable)
+{
+    aes_portable = portable;
+}
+
+static const EVP_CIPHER *s5l8900_aes_cipher(int keybits)
+{
+    switch (keybits) {
+    case 128:
+        return EVP_aes_128_cbc();
+    case 192:
+        return EVP_aes_192_cbc();
+    default:
+        return EVP_aes_256_cbc();
+    }
+}
+
+static AESCacheEntry *s5l8900_aes_lookup(const uint8_t *key, int keybits,
+                                         int enc)
+{
+    AESCacheEntry *e, *victim = &aes_cache[0];
+    int i;
+
+    for (i = 0; i < AES_CACHE_SIZE; i++) {
+        e = &aes_cache[i];
+        if (e->valid && e->keybits == keybits && e->enc == enc &&
+            !memcmp(e->key, key, keybits / 8)) {
+            e->stamp = ++aes_cache_clock;
+            return e;
+        }
+        if (!e->valid || e->stamp < victim->stamp) {
+            victim = e;
+        }
+    }
+
+    e = victim;
+    e->valid = 1;
+    e->keybits = keybits;
+    e->enc = enc;
+    memcpy(e->key, key, keybits / 8);
+    e->stamp = ++aes_cache_clock;
+
+    if (enc == AES_ENCRYPT) {
+        AES_set_encrypt_key(key, keybits, &e->schedule);
+    } else {
+        AES_set_decrypt_key(key, keybits, &e->schedule);
+    }
+
+    if (!e->ctx) {
+        e->ctx = EVP_CIPHER_CTX_new();
+    }
+    if (e->ctx) {
+        if (!EVP_CipherInit_ex(e->ctx, s5l8900_aes_cipher(keybits), NULL,
+                               key, NULL, enc == AES_ENCRYPT)) {
+            EVP_CIPHER_CTX_free(e->ctx);
+            e->ctx = NULL;
+        } else {
+            EVP_CIPHER_CTX_set_padding(e->ctx, 0);
+        }
+    }
+
+    return e;
+}
+
+/* Run the whole blocks through EVP.  Returns the number of bytes done. */
+static size_t s5l8900_aes_cbc_evp(AESCacheEntry *e, const uint8_t *in,
+                                  uint8_t *out, size_t len, uint8_t *ivec)
+{
+    uint8_t next_iv[AES_BLOCK_SIZE];
+    int outl;
+
+    len &= ~(size_t)(AES_BLOCK_SIZE - 1);
+    if (!len || len > 0x7fffffff) {
+        return 0;
+    }
+
+    /* Pick up the chaining value before an in-place decrypt overwrites it */
+    memcpy(next_iv, in + len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+
+    /* Reloading only the IV keeps the expanded key */
+    if (!EVP_CipherInit_ex(e->ctx, NULL, NULL, NULL, ivec, -1) ||
+        !EVP_CipherUpdate(e->ctx, out, &outl, in, len) ||
+        outl != (int)len) {
+        return 0;
+    }
+
+    if (e->enc == AES_ENCRYPT) {
+        memcpy(ivec, out + len - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+    } else {
+        memcpy(ivec, next_iv, AES_BLOCK_SIZE);
+    }
+    return len;
+}
+
+int s5l8900_aes_cbc(const uint8_t *key, int keybits, const uint8_t *in,
+                    uint8_t *out, size_t len, uint8_t *ivec, int enc)
+{
+    AESCacheEntry *e;
+    size_t done = 0;
+
+    if (keybits != 128 && keybits != 192 && keybits != 256) {
+        return -1;
+    }
+
+    e = s5l8900_aes_lookup(key, keybits, enc);
+
+    if (!aes_portable && e->ctx) {
+        done = s5l8900_aes_cbc_evp(e, in, out, len, ivec);
+    }
+    if (done < len) {
+        AES_cbc_encrypt(in + done, out + done, len - done, &e->schedule,
+                        ivec, enc);
+    }
+    return 0;
+}
+
+#ifdef NEED_CPU_H
+void s5l8900_aes_cbc_phys(const uint8_t *key, int keybits,
+                          target_phys_addr_t src, target_phys_addr_t dst,
+                          uint32_t len, uint8_t *ivec, int enc)
+{
+    uint8_t block[AES_BLOCK_SIZE];
+
+    while (len) {
+        target_phys_addr_t slen = len, dlen = len, n = 0;
+        uint8_t *s = cpu_physical_memory_map(src, &slen, 0);
+        uint8_t *d = s ? cpu_physical_memory_map(dst, &dlen, 1) : NULL;
+
+        if (d) {
+            /* Whole blocks only: a short tail would be written out as a
+               full block, past the end of the buffer */
+            n = MIN(slen, dlen) & ~(target_phys_addr_t)(AES_BLOCK_SIZE - 1);
+            if (n) {
+                s5l8900_aes_cbc(key, keybits, s, d, n, ivec, enc);
+            }
+            cpu_physical_memory_unmap(d, dlen, 1, n);
+        }
+        if (s) {
+            cpu_physical_memory_unmap(s, slen, 0, n);
+        }
+
+        if (!n) {
+            /* Short tail, a block straddling a mapping boundary, or a
+               range that is not RAM: bounce through a local block */
+            n = MIN(len, AES_BLOCK_SIZE);
+            memset(block, 0, sizeof(block));
+            cpu_physical_memory_read(src, block, n);
+            s5l8900_aes_cbc(key, keybits, block, block, n, ivec, enc);
+            cpu_physical_memory_write(dst, block, n);
+        }
+
+        src += n;
+        dst += n;
+        len -= n;
+    }
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef S5L8900_AES_H
+#define S5L8900_AES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "aes.h"
+
+#ifndef AES_ENCRYPT
+#define AES_ENCRYPT 1
+#define AES_DECRYPT 0
+#endif
+
+/* AES-CBC for the S5L89xx AES engines.  Expanded key schedules are cached,
+ * so callers pass raw key bytes on every operation.  ivec is updated the
+ * same way AES_cbc_encrypt() updates it.  Returns -1 if keybits is not
+ * 128, 192 or 256. */
+int s5l8900_aes_cbc(const uint8_t *key, int keybits, const uint8_t *in,
+                    uint8_t *out, size_t len, uint8_t *ivec, int enc);
+
+#ifdef NEED_CPU_H
+#include "hw.h"
+
+/* Same as s5l8900_aes_cbc() but between guest physical ranges, which are
+ * mapped and processed in place without bounce buffers. */
+void s5l8900_aes_cbc_phys(const uint8_t *key, int keybits,
+                          target_phys_addr_t src, target_phys_addr_t dst,
+                          uint32_t len, uint8_t *ivec, int enc);
+#endif
+
+/* Force the portable table-based implementation (benchmarking/debugging). */
+void s5l8900_aes_set_portable(int portable);
+
+#endif
@@ -0,0 +1,257 @@
+/*
+ * S5L89xx display controller
+ *
+ * Display shared by the S5L8900 and S5L8930 boards.  The controller's
+ * register map is not known, so only the scan-out is modelled: an RGB565
+ * framebuffer covering the whole panel.  Boards that know where the boot
+ * chain leaves the framebuffer pin it with "fb-default" and every guest
+ * write is ignored.  Otherwise the base follows the guest's writes to the
+ * window 2 framebuffer register (0x78), the only one iBoot is seen to
+ * program.  Register reads return 0.
+ *
+ * Only rows whose backing pages were written since the last refresh are
+ * converted, and each dirty run is pushed to the console as its own
+ * rectangle.
+ *
+ * This code is licenced under the GPL.
+ */
+
+#include "sysbus.h"
+#include "console.h"
+#include "pixel_ops.h"
+#include "framebuffer.h"
+#include "s5l8900.h"
+
+#define LCD_WND2_BUF        0x78    /* Window 2 framebuffer base */
+
+#define S5L8900_LCD_REG_MEM_SIZE 0x1000
+
+typedef struct S5L8900LCDState {
+    SysBusDevice busdev;
+    DisplayState *ds;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t fb_default;
+    uint32_t mmio_size;
+
+    uint32_t base;
+    int32_t invalidate;
+    int dest_bpp;
+} S5L8900LCDState;
+
+static void s5l8900_lcd_reset(DeviceState *d)
+{
+    S5L8900LCDState *s = container_of(d, S5L8900LCDState, busdev.qdev);
+
+    s->base = s->fb_default;
+    s->invalidate = 1;
+}
+
+static uint32_t s5l8900_lcd_read(void *opaque, target_phys_addr_t offset)
+{
+    return 0;
+}
+
+static void s5l8900_lcd_write(void *opaque, target_phys_addr_t offset,
+                              uint32_t value)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+
+    if (s->fb_default || offset != LCD_WND2_BUF)
+        return;
+
+    if (s->base != value)
+        s->invalidate = 1;
+    s->base = value;
+}
+
+static CPUReadMemoryFunc * const s5l8900_lcd_readfn[] = {
+    s5l8900_lcd_read,
+    s5l8900_lcd_read,
+    s5l8900_lcd_read,
+};
+
+static CPUWriteMemoryFunc * const s5l8900_lcd_writefn[] = {
+    s5l8900_lcd_write,
+    s5l8900_lcd_write,
+    s5l8900_lcd_write,
+};
+
+/* Convert one RGB565 source line to the host surface format */
+static void s5l8900_lcd_draw_line(void *opaque, uint8_t *d, const uint8_t *src,
+                                  int width, int deststep)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+    unsigned int r, g, b, p;
+
+    for (; width > 0; width--, src += 2) {
+        p = lduw_le_p(src);
+        r = (p >> 8) & 0xf8;
+        g = (p >> 3) & 0xfc;
+        b = (p << 3) & 0xf8;
+        switch (s->dest_bpp) {
+        case 8:
+            *d = rgb_to_pixel8(r, g, b);
+            d += 1;
+            break;
+        case 15:
+            *(uint16_t *)d = rgb_to_pixel15(r, g, b);
+            d += 2;
+            break;
+        case 16:
+            *(uint16_t *)d = rgb_to_pixel16(r, g, b);
+            d += 2;
+            break;
+        case 24:
+            {
+                unsigned int v = rgb_to_pixel24(r, g, b);
+                d[0] = v;
+                d[1] = v >> 8;
+                d[2] = v >> 16;
+                d += 3;
+            }
+            break;
+        case 32:
+            *(uint32_t *)d = rgb_to_pixel32(r, g, b);
+            d += 4;
+            break;
+        }
+    }
+}
+
+static void s5l8900_lcd_update_rows(void *opaque, int first, int last)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+
+    dpy_update(s->ds, 0, first, s->width, last - first + 1);
+}
+
+static void s5l8900_lcd_update_display(void *opaque)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+    int first = 0, last = 0;
+    int depth;
+
+    if (!s->ds || !s->base)
+        return;
+
+    depth = ds_get_bits_per_pixel(s->ds);
+    switch (depth) {
+    case 0:
+        return;
+    case 8:
+    case 15:
+    case 16:
+    case 24:
+    case 32:
+        break;
+    default:
+        fprintf(stderr, "%s: Bad color depth\n", __FUNCTION__);
+        exit(1);
+    }
+
+    /* Mode changes: panel geometry and host depth */
+    if (ds_get_width(s->ds) != s->width || ds_get_height(s->ds) != s->height) {
+        qemu_console_resize(s->ds, s->width, s->height);
+        s->invalidate = 1;
+    }
+    if (depth != s->dest_bpp) {
+        s->dest_bpp = depth;
+        s->invalidate = 1;
+    }
+
+    framebuffer_update_display_runs(s->ds, s->base,
+                                    s->width, s->height,
+                                    s->width * 2,
+                                    ds_get_linesize(s->ds),
+                                    ds_get_bytes_per_pixel(s->ds),
+                                    s->invalidate,
+                                    s5l8900_lcd_draw_line, s,
+                                    &first, &last,
+                                    s5l8900_lcd_update_rows, s);
+    s->invalidate = 0;
+}
+
+static void s5l8900_lcd_invalidate_display(void *opaque)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+    s->invalidate = 1;
+}
+
+static int s5l8900_lcd_post_load(void *opaque, int version_id)
+{
+    S5L8900LCDState *s = (S5L8900LCDState *)opaque;
+
+    s->invalidate = 1;
+    return 0;
+}
+
+static const VMStateDescription vmstate_s5l8900_lcd = {
+    .name = "s5l8900.lcd",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = s5l8900_lcd_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(base, S5L8900LCDState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+DeviceState *s5l8900_lcd_init(target_phys_addr_t base, uint32_t mmio_size,
+                              int width, int height, uint32_t fb_default)
+{
+    DeviceState *dev = qdev_create(NULL, "s5l8900.lcd");
+
+    qdev_prop_set_uint32(dev, "width", width);
+    qdev_prop_set_uint32(dev, "height", height);
+    qdev_prop_set_uint32(dev, "fb-default", fb_default);
+    qdev_prop_set_uint32(dev, "mmio-size", mmio_size);
+    qdev_init_nofail(dev);
+    sysbus_mmio_map(sysbus_from_qdev(dev), 0, base);
+
+    return dev;
+}
+
+static int s5l8900_lcd_init1(SysBusDevice *dev)
+{
+    S5L8900LCDState *s = FROM_SYSBUS(S5L8900LCDState, dev);
+    int iomemtype;
+
+    iomemtype = cpu_register_io_memory(s5l8900_lcd_readfn,
+                                       s5l8900_lcd_writefn, s,
+                                       DEVICE_LITTLE_ENDIAN);
+    sysbus_init_mmio(dev, s->mmio_size, iomemtype);
+
+    s->ds = graphic_console_init(s5l8900_lcd_update_display,
+                                 s5l8900_lcd_invalidate_display,
+                                 NULL, NULL, s);
+
+    s5l8900_lcd_reset(&dev->qdev);
+
+    return 0;
+}
+
+static SysBusDeviceInfo s5l8900_lcd_info = {
+    .init       = s5l8900_lcd_init1,
+    .qdev.name  = "s5l8900.lcd",
+    .qdev.size  = sizeof(S5L8900LCDState),
+    .qdev.vmsd  = &vmstate_s5l8900_lcd,
+    .qdev.reset = s5l8900_lcd_reset,
+    .qdev.no_user = 1,
+    .qdev.props = (Property[]) {
+        DEFINE_PROP_UINT32("width", S5L8900LCDState, width, 320),
+        DEFINE_PROP_UINT32("height", S5L8900LCDState, height, 480),
+        DEFINE_PROP_UINT32("fb-default", S5L8900LCDState, fb_default, 0),
+        DEFINE_PROP_UINT32("mmio-size", S5L8900LCDState, mmio_size,
+                           S5L8900_LCD_REG_MEM_SIZE),
+        DEFINE_PROP_END_OF_LIST(),
+    }
+};
+
+static void s5l8900_lcd_register_devices(void)
+{
+    sysbus_register_withprop(&s5l8900_lcd_info);
+}
+
+device_init(s5l8900_lcd_register_devices)
@@ -0,0 +1,320 @@
+/*
+ * S5L89xx SHA-1 engine backend
+ *
+ * The running contexts of the hash engines use the block functions below,
+ * whose state is fully visible: the engines read the chaining value back
+ * mid-message and migrate it field by field.  On x86 hosts with the SHA
+ * extensions the blocks are compressed with those, elsewhere by portable C;
+ * the choice is made on first use.  One-shot hashes of guest memory go
+ * through OpenSSL's EVP interface instead, which makes the same choice at
+ * runtime, and hash the range straight from its mapping instead of copying
+ * it out first.
+ *
+ * This code is licenced under the GPL.
+ */
+
+#ifdef NEED_CPU_H
+#include "hw.h"
+#endif
+#include <string.h>
+#include <openssl/evp.h>
+#include "s5l8900_sha1.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (__GNUC__ >= 5)
+#define S5L8900_SHA1_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void S5L8900SHA1BlocksFunc(uint32_t *h, const uint8_t *p, size_t n);
+
+static S5L8900SHA1BlocksFunc *s5l8900_sha1_blocks;
+
+static void s5l8900_sha1_blocks_c(uint32_t *h, const uint8_t *p, size_t n)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, t;
+    int i;
+
+    for (; n; n--, p += S5L8900_SHA1_BLOCK) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+                   (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+        }
+        for (; i < 80; i++) {
+            w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        e = h[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            t = ROL32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = ROL32(b, 30);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+#ifdef S5L8900_SHA1_SHANI
+/* Four rounds from group g on: fold the schedule word x into e, run the
+ * rounds and advance the message schedule by one group.  The schedule work
+ * of the last groups computes words nobody reads, which is harmless. */
+#define SHA1_ROUNDS4(g, e, enext, x, m1, m2, m3) \
+    do { \
+        e = _mm_sha1nexte_epu32(e, x); \
+        enext = abcd; \
+        m1 = _mm_sha1msg2_epu32(m1, x); \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5); \
+        m3 = _mm_sha1msg1_epu32(m3, x); \
+        m2 = _mm_xor_si128(m2, x); \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void s5l8900_sha1_blocks_shani(uint32_t *h, const uint8_t *p, size_t n)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+    e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; n; n--, p += S5L8900_SHA1_BLOCK) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+                              bswap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)),
+                              bswap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)),
+                              bswap);
+
+        /* Rounds 0-15: the first schedule words are the block itself */
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        SHA1_ROUNDS4(3, e1, e0, m3, m0, m1, m2);
+
+        /* Rounds 16-79 */
+        SHA1_ROUNDS4(4, e0, e1, m0, m1, m2, m3);
+        SHA1_ROUNDS4(5, e1, e0, m1, m2, m3, m0);
+        SHA1_ROUNDS4(6, e0, e1, m2, m3, m0, m1);
+        SHA1_ROUNDS4(7, e1, e0, m3, m0, m1, m2);
+        SHA1_ROUNDS4(8, e0, e1, m0, m1, m2, m3);
+        SHA1_ROUNDS4(9, e1, e0, m1, m2, m3, m0);
+        SHA1_ROUNDS4(10, e0, e1, m2, m3, m0, m1);
+        SHA1_ROUNDS4(11, e1, e0, m3, m0, m1, m2);
+        SHA1_ROUNDS4(12, e0, e1, m0, m1, m2, m3);
+        SHA1_ROUNDS4(13, e1, e0, m1, m2, m3, m0);
+        SHA1_ROUNDS4(14, e0, e1, m2, m3, m0, m1);
+        SHA1_ROUNDS4(15, e1, e0, m3, m0, m1, m2);
+        SHA1_ROUNDS4(16, e0, e1, m0, m1, m2, m3);
+        SHA1_ROUNDS4(17, e1, e0, m1, m2, m3, m0);
+        SHA1_ROUNDS4(18, e0, e1, m2, m3, m0, m1);
+        SHA1_ROUNDS4(19, e1, e0, m3, m0, m1, m2);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int s5l8900_sha1_have_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 29)) != 0;     /* SHA */
+}
+#endif
+
+static S5L8900SHA1BlocksFunc *s5l8900_sha1_select(void)
+{
+#ifdef S5L8900_SHA1_SHANI
+    if (s5l8900_sha1_have_shani()) {
+        return s5l8900_sha1_blocks_shani;
+    }
+#endif
+    return s5l8900_sha1_blocks_c;
+}
+
+void s5l8900_sha1_init(S5L8900SHA1Context *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+    ctx->num = 0;
+}
+
+void s5l8900_sha1_update(S5L8900SHA1Context *ctx, const void *data,
+                         size_t len)
+{
+    const uint8_t *p = data;
+    size_t n;
+
+    if (!s5l8900_sha1_blocks) {
+        s5l8900_sha1_blocks = s5l8900_sha1_select();
+    }
+
+    ctx->len += len;
+
+    if (ctx->num) {
+        n = S5L8900_SHA1_BLOCK - ctx->num;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->data + ctx->num, p, n);
+        ctx->num += n;
+        p += n;
+        len -= n;
+        if (ctx->num < S5L8900_SHA1_BLOCK) {
+            return;
+        }
+        s5l8900_sha1_blocks(ctx->h, ctx->data, 1);
+        ctx->num = 0;
+    }
+
+    n = len / S5L8900_SHA1_BLOCK;
+    if (n) {
+        s5l8900_sha1_blocks(ctx->h, p, n);
+        p += n * S5L8900_SHA1_BLOCK;
+        len -= n * S5L8900_SHA1_BLOCK;
+    }
+
+    memcpy(ctx->data, p, len);
+    ctx->num = len;
+}
+
+void s5l8900_sha1_final(S5L8900SHA1Context *ctx, uint8_t *out)
+{
+    uint64_t bits = ctx->len << 3;
+    uint8_t pad[S5L8900_SHA1_BLOCK * 2] = { 0x80 };
+    size_t n = (ctx->num < 56 ? 56 : 120) - ctx->num;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = bits >> (56 - i * 8);
+    }
+    s5l8900_sha1_update(ctx, pad, n + 8);
+    s5l8900_sha1_state(ctx, out);
+}
+
+void s5l8900_sha1_state(const S5L8900SHA1Context *ctx, uint8_t *out)
+{
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        out[i * 4] = ctx->h[i] >> 24;
+        out[i * 4 + 1] = ctx->h[i] >> 16;
+        out[i * 4 + 2] = ctx->h[i] >> 8;
+        out[i * 4 + 3] = ctx->h[i];
+    }
+}
+
+#ifdef NEED_CPU_H
+static EVP_MD_CTX *sha1_md;
+
+/* Feed EVP when it is up, the local block function otherwise */
+static void s5l8900_sha1_phys_update(S5L8900SHA1Context *ctx,
+                                     const uint8_t *p, size_t n)
+{
+    if (sha1_md) {
+        EVP_DigestUpdate(sha1_md, p, n);
+    } else {
+        s5l8900_sha1_update(ctx, p, n);
+    }
+}
+
+void s5l8900_sha1_phys(target_phys_addr_t addr, uint32_t len, uint8_t *out)
+{
+    uint8_t chunk[S5L8900_SHA1_BLOCK];
+    S5L8900SHA1Context ctx;
+
+    if (!sha1_md) {
+        sha1_md = EVP_MD_CTX_new();
+    }
+    if (sha1_md && !EVP_DigestInit_ex(sha1_md, EVP_sha1(), NULL)) {
+        EVP_MD_CTX_free(sha1_md);
+        sha1_md = NULL;
+    }
+    s5l8900_sha1_init(&ctx);
+
+    while (len) {
+        target_phys_addr_t n = len;
+        uint8_t *p = cpu_physical_memory_map(addr, &n, 0);
+
+        if (p) {
+            s5l8900_sha1_phys_update(&ctx, p, n);
+            cpu_physical_memory_unmap(p, n, 0, n);
+        } else {
+            /* Not RAM, go through the slow path a block at a time */
+            n = MIN(len, S5L8900_SHA1_BLOCK);
+            cpu_physical_memory_read(addr, chunk, n);
+            s5l8900_sha1_phys_update(&ctx, chunk, n);
+        }
+
+        addr += n;
+        len -= n;
+    }
+
+    if (sha1_md) {
+        EVP_DigestFinal_ex(sha1_md, out, NULL);
+    } else {
+        s5l8900_sha1_final(&ctx, out);
+    }
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef S5L8900_SHA1_H
+#define S5L8900_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define S5L8900_SHA1_BLOCK 64
+
+/* SHA-1 for the S5L89xx hash engines.  The engines keep a running context
+ * and feed it as input arrives.  All of its state is in plain fields, so it
+ * can be saved field by field and the chaining value read back at any
+ * point. */
+typedef struct S5L8900SHA1Context {
+    uint32_t h[5];
+    uint64_t len;       /* bytes absorbed, including those in data */
+    uint32_t num;       /* bytes of data still waiting for a full block */
+    uint8_t data[S5L8900_SHA1_BLOCK];
+} S5L8900SHA1Context;
+
+void s5l8900_sha1_init(S5L8900SHA1Context *ctx);
+void s5l8900_sha1_update(S5L8900SHA1Context *ctx, const void *data,
+                         size_t len);
+void s5l8900_sha1_final(S5L8900SHA1Context *ctx, uint8_t *out);
+
+/* The chaining value after the blocks absorbed so far, as 20 digest bytes.
+ * Once the guest has added its own padding this is the hash. */
+void s5l8900_sha1_state(const S5L8900SHA1Context *ctx, uint8_t *out);
+
+#ifdef NEED_CPU_H
+#include "hw.h"
+
+/* SHA-1 of a guest physical range, hashed in place where it is RAM. */
+void s5l8900_sha1_phys(target_phys_addr_t addr, uint32_t len, uint8_t *out);
+#endif
+
+#endif
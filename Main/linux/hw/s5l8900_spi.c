@@ -164,6 +164,26 @@ void set_spi_base(uint32_t base)
 	base_addr = base;
 }
 
+static const VMStateDescription vmstate_s5l8900_spi = {
+    .name = "s5l8900.spi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(cmd, S5L8900SPIState),
+        VMSTATE_UINT32(base, S5L8900SPIState),
+        VMSTATE_UINT32(ctrl, S5L8900SPIState),
+        VMSTATE_UINT32(setup, S5L8900SPIState),
+        VMSTATE_UINT32(status, S5L8900SPIState),
+        VMSTATE_UINT32(pin, S5L8900SPIState),
+        VMSTATE_UINT32(tx_data, S5L8900SPIState),
+        VMSTATE_UINT32(rx_data, S5L8900SPIState),
+        VMSTATE_UINT32(clkdiv, S5L8900SPIState),
+        VMSTATE_UINT32(cnt, S5L8900SPIState),
+        VMSTATE_UINT32(idd, S5L8900SPIState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static int s5l8900_spi_init(SysBusDevice *dev)
 {
     int iomemtype;
@@ -178,6 +198,7 @@ static int s5l8900_spi_init(SysBusDevice *dev)
     s5l8900_spi_reset(s);
 
     qemu_register_reset(s5l8900_spi_reset, s);
+    vmstate_register(&dev->qdev, -1, &vmstate_s5l8900_spi, s);
 
     return 0;
 }
@@ -0,0 +1,44 @@
+#ifndef S5L8900_TICKS_H
+#define S5L8900_TICKS_H
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+
+/* The free running 64-bit timebase of the S5L89xx timer blocks, read as two
+ * 32-bit halves.  Reading either half latches the whole count, and the
+ * next read of the other half comes straight from that latch, without
+ * looking at the clock, so a pair never tears whichever half the guest
+ * reads first.  Reading the same half again takes a new latch. */
+#define S5L8900_TICKS_FREQ	24000000
+
+typedef struct s5l8900_ticks_s
+{
+	uint32_t	high;
+	uint32_t	low;
+	int			pending;	// half still to come from the latch, 0 for none
+
+} s5l8900_ticks_s;
+
+static inline uint64_t s5l8900_ticks_now(void)
+{
+	return muldiv64(qemu_get_clock_ns(vm_clock), S5L8900_TICKS_FREQ, get_ticks_per_sec());
+}
+
+static inline uint32_t s5l8900_ticks_read(s5l8900_ticks_s *t, int high)
+{
+	int half = high ? 2 : 1;
+
+	if (t->pending == half) {
+		t->pending = 0;
+	} else {
+		uint64_t now = s5l8900_ticks_now();
+
+		t->high = now >> 32;
+		t->low = now;
+		t->pending = half ^ 3;
+	}
+
+	return high ? t->high : t->low;
+}
+
+#endif
@@ -8,10 +8,19 @@
 
 #include "sysbus.h"
 #include "qemu-char.h"
+#include "qemu-timer.h"
 #include "s5l8900.h"
+#include "s5l8900_uart.h"
 
+/* Default RX queue, the queue-size property overrides it */
+#define RX_QUEUE_SIZE   4096
 
-#define QUEUE_SIZE   257
+/* Transmitted bytes are passed to the chardev a line at a time, or once
+ * the buffer fills up or nothing more has come for TX_DELAY_MS. */
+#define TX_BUFFER_SIZE  1024
+#define TX_DELAY_MS     5
+
+#define MAX_UARTS       8
 
 #define INT_RXD     (1 << 0)
 #define INT_ERROR   (1 << 1)
@@ -31,15 +40,16 @@
 #define UFSTAT_TX_COUNT_SHIT        16
 #define UFSTAT_TX_COUNT             (0xFF << UFSTAT_TX_COUNT_SHIT)
 
-#define QI(x) ((x + 1) % QUEUE_SIZE)
-#define QD(x) ((x - 1 + QUEUE_SIZE) % QUEUE_SIZE)
+#define QI(q, x) (((x) + 1) % (q)->len)
 
 #define S5L8900_UART_REG_MEM_SIZE 0x3C
 
+/* Ring of len = size + 1 bytes holding up to size */
 typedef struct UartQueue {
-    uint8_t queue[QUEUE_SIZE];
+    uint8_t *queue;
     uint32_t s, t;
     uint32_t size;
+    uint32_t len;
 } UartQueue;
 
 typedef struct S5L8900UartState {
@@ -47,6 +57,16 @@ typedef struct S5L8900UartState {
 
     UartQueue rx;
 
+    uint8_t tx_buf[TX_BUFFER_SIZE];
+    int tx_len;
+    QEMUTimer *tx_timer;
+
+    /* Statistics for info uart */
+    uint64_t tx_bytes;
+    uint64_t tx_flushes;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;
+
 	uint32_t base;
     uint32_t ulcon;
     uint32_t ucon;
@@ -69,19 +89,21 @@ typedef struct S5L8900UartState {
     uint32_t instance;
 } S5L8900UartState;
 
+static S5L8900UartState *s5l8900_uarts[MAX_UARTS];
+
 
 static inline int queue_elem_count(const UartQueue *s)
 {
     if (s->t >= s->s) {
         return s->t - s->s;
     } else {
-        return QUEUE_SIZE - s->s + s->t;
+        return s->len - s->s + s->t;
     }
 }
 
 static inline int queue_empty_count(const UartQueue *s)
 {
-    return s->size - queue_elem_count(s) - 1;
+    return s->size - queue_elem_count(s);
 }
 
 static inline int queue_empty(const UartQueue *s)
@@ -92,7 +114,7 @@ static inline int queue_empty(const UartQueue *s)
 static inline void queue_push(UartQueue *s, uint8_t x)
 {
     s->queue[s->t] = x;
-    s->t = QI(s->t);
+    s->t = QI(s, s->t);
 }
 
 static inline uint8_t queue_get(UartQueue *s)
@@ -100,7 +122,7 @@ static inline uint8_t queue_get(UartQueue *s)
     uint8_t ret;
 
     ret = s->queue[s->s];
-    s->s = QI(s->s);
+    s->s = QI(s, s->s);
     return ret;
 }
 
@@ -151,8 +173,10 @@ static uint32_t s5l8900_uart_mm_read(void *opaque, target_phys_addr_t offset)
         s->uerstat = 0;
         return res;
     case 0x18:
-        s->ufstat = queue_elem_count(&s->rx) & 0xff;
-        if (queue_empty_count(&s->rx) == 0) {
+        /* The queue can hold more than the count field, it reads as a
+         * full FIFO then */
+        s->ufstat = MIN(queue_elem_count(&s->rx), 0xff);
+        if (queue_empty_count(&s->rx) == 0 || s->ufstat == 0xff) {
             s->ufstat |= UFSTAT_RX_FIFO_FULL;
         }
         return s->ufstat;
@@ -163,12 +187,19 @@ static uint32_t s5l8900_uart_mm_read(void *opaque, target_phys_addr_t offset)
     case 0x24:
         if (s->ufcon & 1) {
             if (! queue_empty(&s->rx)) {
+                int was_full = queue_empty_count(&s->rx) == 0;
+
                 res = queue_get(&s->rx);
                 if (queue_empty(&s->rx)) {
                     s->utrstat &= ~TRSTATUS_DATA_READY;
                 } else {
                     s->utrstat |= TRSTATUS_DATA_READY;
                 }
+                if (was_full) {
+                    /* can_receive stopped the chardev, there's room again.
+                       The backend may deliver right away, so only now. */
+                    qemu_chr_accept_input(s->chr);
+                }
             } else {
                 s->uintsp |= INT_ERROR;
                 s5l8900_uart_update(s);
@@ -195,6 +226,34 @@ static uint32_t s5l8900_uart_mm_read(void *opaque, target_phys_addr_t offset)
     }
 }
 
+static void s5l8900_uart_tx_flush(S5L8900UartState *s)
+{
+    if (s->tx_len == 0) {
+        return;
+    }
+    qemu_del_timer(s->tx_timer);
+    qemu_chr_write(s->chr, s->tx_buf, s->tx_len);
+    s->tx_len = 0;
+    s->tx_flushes++;
+}
+
+static void s5l8900_uart_tx_timeout(void *opaque)
+{
+    s5l8900_uart_tx_flush(opaque);
+}
+
+static void s5l8900_uart_tx(S5L8900UartState *s, uint8_t ch)
+{
+    s->tx_buf[s->tx_len++] = ch;
+    s->tx_bytes++;
+
+    if (ch == '\n' || s->tx_len == TX_BUFFER_SIZE) {
+        s5l8900_uart_tx_flush(s);
+    } else if (s->tx_len == 1) {
+        qemu_mod_timer(s->tx_timer, qemu_get_clock_ms(rt_clock) + TX_DELAY_MS);
+    }
+}
+
 static void s5l8900_uart_mm_write(void *opaque, target_phys_addr_t offset,
                                   uint32_t val)
 {
@@ -227,7 +286,7 @@ static void s5l8900_uart_mm_write(void *opaque, target_phys_addr_t offset,
         //if (s->chr && !(s->base & 0x4000)) {
             s->utrstat &= ~(TRSTATUS_TRANSMITTER_READY | TRSTATUS_BUFFER_EMPTY);
             ch = (uint8_t)val;
-            qemu_chr_write(s->chr, &ch, 1);
+            s5l8900_uart_tx(s, ch);
             s->utrstat |= TRSTATUS_TRANSMITTER_READY | TRSTATUS_BUFFER_EMPTY;
             s->uintsp |= INT_TXD;
         //} else if (s->base & 0x4000) {
@@ -288,13 +347,17 @@ static void s5l8900_uart_trigger_level(S5L8900UartState *s)
 
 static void s5l8900_uart_receive(void *opaque, const uint8_t *buf, int size)
 {
-    int i;
+    int i, n;
     S5L8900UartState *s = (S5L8900UartState *)opaque;
+
+    s->rx_bytes += size;
     if (s->ufcon & 1) {
         if (queue_empty_count(&s->rx) < size) {
-            for (i = 0; i < queue_empty_count(&s->rx); i++) {
+            n = queue_empty_count(&s->rx);
+            for (i = 0; i < n; i++) {
                 queue_push(&s->rx, buf[i]);
             }
+            s->rx_dropped += size - n;
             s->uintp |= INT_ERROR;
             s->utrstat |= TRSTATUS_DATA_READY;
         } else {
@@ -336,6 +399,7 @@ static void s5l8900_uart_reset(DeviceState *d)
     s->uintsp   = 0;
     s->uintm    = 0;
     queue_reset(&s->rx);
+    s5l8900_uart_tx_flush(s);
 }
 
 DeviceState *s5l8900_uart_init(target_phys_addr_t base, int instance,
@@ -353,7 +417,9 @@ DeviceState *s5l8900_uart_init(target_phys_addr_t base, int instance,
         chr = qemu_chr_open(str, "null", NULL);
     }
     qdev_prop_set_chr(dev, "chr", chr);
-    qdev_prop_set_uint32(dev, "queue-size", queue_size);
+    if (queue_size) {
+        qdev_prop_set_uint32(dev, "queue-size", queue_size);
+    }
     qdev_prop_set_uint32(dev, "instance", instance);
     qdev_init_nofail(dev);
     sysbus_mmio_map(sysbus_from_qdev(dev), 0, base);
@@ -365,6 +431,21 @@ static int s5l8900_uart_init1(SysBusDevice *dev)
 {
     int iomemtype;
     S5L8900UartState *s = FROM_SYSBUS(S5L8900UartState, dev);
+    int i;
+
+    if (s->rx.size == 0) {
+        s->rx.size = 1;
+    }
+    s->rx.len = s->rx.size + 1;
+    s->rx.queue = qemu_mallocz(s->rx.len);
+    s->tx_timer = qemu_new_timer_ms(rt_clock, s5l8900_uart_tx_timeout, s);
+
+    for (i = 0; i < MAX_UARTS; i++) {
+        if (!s5l8900_uarts[i]) {
+            s5l8900_uarts[i] = s;
+            break;
+        }
+    }
 
     s5l8900_uart_reset(&s->busdev.qdev);
 
@@ -380,19 +461,97 @@ static int s5l8900_uart_init1(SysBusDevice *dev)
     return 0;
 }
 
+static int s5l8900_uart_queue_post_load(void *opaque, int version_id)
+{
+    UartQueue *q = opaque;
+
+    if (q->s >= q->len || q->t >= q->len) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_s5l8900_uart_queue = {
+    .name = "s5l8900.uart.queue",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = s5l8900_uart_queue_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_EQUAL(len, UartQueue),
+        VMSTATE_VBUFFER_UINT32(queue, UartQueue, 0, NULL, 0, len),
+        VMSTATE_UINT32(s, UartQueue),
+        VMSTATE_UINT32(t, UartQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Buffered output goes out before the snapshot, it isn't part of it */
+static void s5l8900_uart_pre_save(void *opaque)
+{
+    s5l8900_uart_tx_flush(opaque);
+}
+
+static const VMStateDescription vmstate_s5l8900_uart = {
+    .name = "s5l8900.uart",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .pre_save = s5l8900_uart_pre_save,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(rx, S5L8900UartState, 2,
+                       vmstate_s5l8900_uart_queue, UartQueue),
+        VMSTATE_UINT32(ulcon, S5L8900UartState),
+        VMSTATE_UINT32(ucon, S5L8900UartState),
+        VMSTATE_UINT32(ufcon, S5L8900UartState),
+        VMSTATE_UINT32(umcon, S5L8900UartState),
+        VMSTATE_UINT32(utrstat, S5L8900UartState),
+        VMSTATE_UINT32(uerstat, S5L8900UartState),
+        VMSTATE_UINT32(ufstat, S5L8900UartState),
+        VMSTATE_UINT32(umstat, S5L8900UartState),
+        VMSTATE_UINT32(utxh, S5L8900UartState),
+        VMSTATE_UINT32(urxh, S5L8900UartState),
+        VMSTATE_UINT32(ubrdiv, S5L8900UartState),
+        VMSTATE_UINT32(udivslot, S5L8900UartState),
+        VMSTATE_UINT32(uintp, S5L8900UartState),
+        VMSTATE_UINT32(uintsp, S5L8900UartState),
+        VMSTATE_UINT32(uintm, S5L8900UartState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static SysBusDeviceInfo s5l8900_uart_info = {
     .init = s5l8900_uart_init1,
     .qdev.name  = "s5l8900.uart",
     .qdev.size  = sizeof(S5L8900UartState),
     .qdev.reset = s5l8900_uart_reset,
+    .qdev.vmsd  = &vmstate_s5l8900_uart,
     .qdev.props = (Property[]) {
         DEFINE_PROP_UINT32("instance",   S5L8900UartState, instance, 0),
-        DEFINE_PROP_UINT32("queue-size", S5L8900UartState, rx.size, 16),
+        DEFINE_PROP_UINT32("queue-size", S5L8900UartState, rx.size,
+                           RX_QUEUE_SIZE),
         DEFINE_PROP_CHR("chr", S5L8900UartState, chr),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
 
+void s5l8900_uart_print_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    S5L8900UartState *s;
+    int i;
+
+    for (i = 0; i < MAX_UARTS; i++) {
+        s = s5l8900_uarts[i];
+        if (!s) {
+            continue;
+        }
+        cpu_fprintf(f, "uart%d (%s): tx %" PRIu64 " bytes in %" PRIu64
+                    " writes, %d buffered\n", i, s->chr->label, s->tx_bytes,
+                    s->tx_flushes, s->tx_len);
+        cpu_fprintf(f, "  rx %" PRIu64 " bytes, %" PRIu64 " dropped, "
+                    "queue %d/%u\n", s->rx_bytes, s->rx_dropped,
+                    queue_elem_count(&s->rx), s->rx.size);
+    }
+}
+
 static void s5l8900_uart_register(void)
 {
     sysbus_register_withprop(&s5l8900_uart_info);
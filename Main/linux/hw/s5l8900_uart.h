@@ -0,0 +1,8 @@
+#ifndef S5L8900_UART_H
+#define S5L8900_UART_H
+
+#include "qemu-common.h"
+
+void s5l8900_uart_print_stats(FILE *f, fprintf_function cpu_fprintf);
+
+#endif
@@ -14,6 +14,7 @@
 #include "irq.h"
 #include "hw.h"
 #include "s5l8900.h"
+#include "trace.h"
 
 
 /* Interrupts */
@@ -154,10 +155,10 @@ static const uint8_t otg_setup_config[] = {
 static void s5l8900_usb_otg_update_irq(S5L8900UsbOtgState *s)
 {
     if (s->gint_sts & s->gint_msk) {
-    	fprintf(stderr,"%s: qemu_irq_raise()\n", __func__);
+        trace_s5l8900_usb_otg_irq(1);
         qemu_irq_raise(s->irq);
     } else {
-		fprintf(stderr,"%s: qemu_irq_lower()\n", __func__);
+        trace_s5l8900_usb_otg_irq(0);
         qemu_irq_lower(s->irq);
     }
 }
@@ -208,7 +209,7 @@ static uint32_t s5l8900_usb_otg_phy_mm_read(void *opaque,
 {
     S5L8900UsbOtgState *s = (S5L8900UsbOtgState *)opaque;
 
-    fprintf(stderr, "%s: offset 0x%08x\n", __func__, offset);
+    trace_s5l8900_usb_otg_phy_read(offset);
 
 
     switch (offset) {
@@ -229,7 +230,7 @@ static void s5l8900_usb_otg_phy_mm_write(void *opaque, target_phys_addr_t offset
 {
     S5L8900UsbOtgState *s = (S5L8900UsbOtgState *)opaque;
 
-    fprintf(stderr, "%s: offset 0x%08x val 0x%08x\n", __func__, offset, val);
+    trace_s5l8900_usb_otg_phy_write(offset, val);
 
     switch (offset) {
     case 0x00:
@@ -267,7 +268,7 @@ static CPUWriteMemoryFunc * const s5l8900_usb_otg_phy_mm_writefn[] = {
 static void s5l8900_usb_otg_ep_update_irq(S5L8900UsbOtgEndPoint *s)
 {
 
-    fprintf(stderr, "%s: \n", __func__);
+    trace_s5l8900_usb_otg_ep_irq(s->n, s->interrupt);
 
     if (s->interrupt) {
         if (s->dir == OTG_EP_DIR_IN) {
@@ -307,7 +308,7 @@ static void s5l8900_usb_otg_ep_update_irq(S5L8900UsbOtgEndPoint *s)
 
 static void s5l8900_usb_otg_act(S5L8900UsbOtgState *s)
 {
-    fprintf(stderr, "%s: \n", __func__);
+    trace_s5l8900_usb_otg_act(s->state);
 
     switch (s->state) {
         case OTG_STATE_START:
@@ -344,7 +345,7 @@ static void s5l8900_usb_otg_data_tx(S5L8900UsbOtgEndPoint *s)
     uint8_t buf[1600];
     uint32_t size = s->transfer_size & 0x7ffff;
 
-    fprintf(stderr, "%s: ", __func__);
+    trace_s5l8900_usb_otg_data_tx(s->n, size);
 
     cpu_physical_memory_read(s->dma_addr, buf, size);
     qemu_send_packet(&s->parent->nic->nc, buf, size);
@@ -356,7 +357,7 @@ static void s5l8900_usb_otg_data_rx(S5L8900UsbOtgEndPoint *s)
 {
     uint32_t size = s->parent->buf_size;
 
-    fprintf(stderr, "%s: \n", __func__);
+    trace_s5l8900_usb_otg_data_rx(s->n, size);
 
     if (s->parent->buf_size > (s->transfer_size & 0x7ffff)) {
         s->parent->buf_full = 0;
@@ -375,7 +376,7 @@ static void s5l8900_usb_otg_data_rx(S5L8900UsbOtgEndPoint *s)
 static uint32_t s5l8900_usb_otg_ep_read(S5L8900UsbOtgEndPoint *s,
                                         target_phys_addr_t addr)
 {
-    fprintf(stderr, "%s: \n", __func__);
+    trace_s5l8900_usb_otg_ep_read(s->n, addr);
 
     switch (addr) {
     case 0x00:
@@ -397,7 +398,7 @@ static uint32_t s5l8900_usb_otg_ep_read(S5L8900UsbOtgEndPoint *s,
 static uint32_t s5l8900_usb_otg_ep_write(S5L8900UsbOtgEndPoint *s,
                                          target_phys_addr_t addr, uint32_t val)
 {
-    fprintf(stderr, "%s: addr 0x%08x val 0x%08x\n", __func__, addr, val);
+    trace_s5l8900_usb_otg_ep_write(s->n, addr, val);
 
     switch (addr) {
     case 0x00:
@@ -460,7 +461,7 @@ static uint32_t s5l8900_usb_otg_read(void *opaque, target_phys_addr_t addr)
     }
 */
 
-    fprintf(stderr, "%s: offset 0x%08x\n", __func__, addr);
+    trace_s5l8900_usb_otg_read(addr);
 
     switch (addr) {
     case 0x00:
@@ -522,7 +523,7 @@ static void s5l8900_usb_otg_write(void *opaque, target_phys_addr_t addr,
     }
 	*/
 
-	fprintf(stderr, "%s: offset 0x%08x val 0x%08x\n", __func__, addr, val);
+	trace_s5l8900_usb_otg_write(addr, val);
 
     switch (addr) {
     case 0x00:
@@ -18,9 +18,14 @@
 #include "block.h"
 #include "boards.h"
 #include "s5l8930.h"
+#include "s5l8930_aes_capture.h"
+#include "s5l8900_aes.h"
+#include "s5l8900_sha1.h"
+#include "s5l8900_ticks.h"
 #include "usb_synopsys.h"
 #include "net.h"
 #include "i2c.h"
+#include "trace.h"
 
 static void s5l8930_cdma_aes_init(target_phys_addr_t base, void *opaque);
 
@@ -37,8 +42,7 @@ int buffer_zero(uint8_t *buf, uint32_t size)
 
 typedef struct s5l8930_timer_s
 {
-    uint32_t    ticks_high;
-    uint32_t    ticks_low;
+    s5l8900_ticks_s ticks;
     uint32_t    status;
     uint32_t    config;
 	uint32_t    timer;
@@ -114,20 +118,14 @@ static void s5l8930_st_tick2(void *opaque)
 static uint32_t s5l8930_timer1_read(void *opaque, target_phys_addr_t addr)
 {
     s5l8930_timer_s *s = (struct s5l8930_timer_s *) opaque;
-	uint64_t ticks;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_CLK, S5L8930_DLVL_ERR, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+	// The timebase is read all the time, keep it ahead of the tracing
+	if (addr == TIMER_TICKSHIGH || addr == TIMER_TICKSLOW)
+		return s5l8900_ticks_read(&s->ticks, addr == TIMER_TICKSHIGH);
+
+    trace_s5l8930_timer_read(addr);
 
     switch (addr) {
-		case TIMER_TICKSHIGH:	 // needs to be fixed so that read from low first works as well
-			ticks = (qemu_get_clock_ns(vm_clock) / 1000) * 24;
-			s->ticks_high = (ticks >> 32);
-			s->ticks_low = (ticks & 0xFFFFFFFF);
-			return s->ticks_high;
-		case TIMER_TICKSLOW:
-            ticks = (qemu_get_clock_ns(vm_clock) / 1000) * 24;
-            s->ticks_low = (ticks & 0xFFFFFFFF);
-			return s->ticks_low;
 		/* Timer is really sys reg which overlaps the MIU */
 		case POWER_ID:
 			return 0x2020001;
@@ -142,7 +140,7 @@ static uint32_t s5l8930_timer1_read(void *opaque, target_phys_addr_t addr)
 		case 0x3030:
 			return s->val3030;
       default:
-        S5L8930_DEBUG(S5L8930_DEBUG_CLK, S5L8930_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x\n", __FUNCTION__, (int)addr);
+        trace_s5l8930_timer_unmapped_read(addr);
 		break;
     }
     return 0;
@@ -150,8 +148,7 @@ static uint32_t s5l8930_timer1_read(void *opaque, target_phys_addr_t addr)
 
 static void s5l8930_timer1_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
-
-    S5L8930_DEBUG(S5L8930_DEBUG_CLK, S5L8930_DLVL_ERR, "%s: offset = 0x%02x  value 0x%08x\n", __FUNCTION__, (int)addr, value);
+    trace_s5l8930_timer_write(addr, value);
     s5l8930_timer_s *s = (struct s5l8930_timer_s *) opaque;
 
     switch(addr){
@@ -203,7 +200,7 @@ static void s5l8930_timer1_write(void *opaque, target_phys_addr_t addr, uint32_t
             break;
 
       default:
-		S5L8930_DEBUG(S5L8930_DEBUG_CLK, S5L8930_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x value = 0x%08x\n", __FUNCTION__, (int)addr, value);
+		trace_s5l8930_timer_unmapped_write(addr, value);
         break;
     }
 
@@ -222,6 +219,29 @@ static CPUWriteMemoryFunc *s5l8930_timer1_writefn[] = {
     s5l8930_timer1_write,
 };
 
+static const VMStateDescription vmstate_s5l8930_timer = {
+    .name = "s5l8930.timer",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ticks.high, s5l8930_timer_s),
+        VMSTATE_UINT32(ticks.low, s5l8930_timer_s),
+        VMSTATE_UINT32(status, s5l8930_timer_s),
+        VMSTATE_UINT32(config, s5l8930_timer_s),
+        VMSTATE_UINT32(timer, s5l8930_timer_s),
+        VMSTATE_UINT32(prescaler, s5l8930_timer_s),
+        VMSTATE_UINT32(irqstat, s5l8930_timer_s),
+        VMSTATE_TIMER(st_timer, s5l8930_timer_s),
+        VMSTATE_TIMER(st_timer2, s5l8930_timer_s),
+        VMSTATE_UINT64(tick_interval, s5l8930_timer_s),
+        VMSTATE_UINT64(tick_interval2, s5l8930_timer_s),
+        VMSTATE_UINT32(timer2, s5l8930_timer_s),
+        VMSTATE_UINT32(status2, s5l8930_timer_s),
+        VMSTATE_UINT32(val3030, s5l8930_timer_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void *s5l8930_timer_init(target_phys_addr_t base, qemu_irq irq)
 {
     struct s5l8930_timer_s *timer1 = (struct s5l8930_timer_s *) qemu_mallocz(sizeof(struct s5l8930_timer_s));
@@ -229,22 +249,24 @@ static void *s5l8930_timer_init(target_phys_addr_t base, qemu_irq irq)
     int iomemtype = cpu_register_io_memory(s5l8930_timer1_readfn,
                                            s5l8930_timer1_writefn, timer1, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xffff, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.timer");
     timer1->irq = irq;
     timer1->st_timer = qemu_new_timer_ns(vm_clock, s5l8930_st_tick, timer1);
 
 	timer1->st_timer2 = qemu_new_timer_ns(vm_clock, s5l8930_st_tick2, timer1);
+    vmstate_register(NULL, base, &vmstate_s5l8930_timer, timer1);
 
 	return timer1;
 }
 
 static void s5l8930_misc_sys_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
-	S5L8930_DEBUG(S5L8930_DEBUG_MISCSYS, S5L8930_DLVL_ERR, "%s: addr 0x%08x value 0x%08x\n", __FUNCTION__, addr, value);
+	trace_s5l8930_misc_sys_write(addr, value);
 }
 
 static uint32_t s5l8930_misc_sys_read(void *opaque, target_phys_addr_t addr)
 {
-	S5L8930_DEBUG(S5L8930_DEBUG_MISCSYS, S5L8930_DLVL_ERR, "%s: addr 0x%08x\n", __FUNCTION__, addr);
+	trace_s5l8930_misc_sys_read(addr);
 
 	switch(addr){
 		case 0x104:
@@ -274,6 +296,7 @@ static void s5l8930_misc_sys_init(target_phys_addr_t base)
     int iomemtype = cpu_register_io_memory(s5l8930_misc_sys_readfn,
                                            s5l8930_misc_sys_writefn, NULL, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xfff, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.misc_sys");
 }
 
 typedef struct s5l8930_pmgr_s
@@ -304,7 +327,7 @@ typedef struct s5l8930_pmgr_s
 
 static void s5l8930_pmgr_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
-    S5L8930_DEBUG(S5L8930_DEBUG_PMGR, S5L8930_DLVL_ERR, "%s: addr 0x%08x value 0x%08x\n", __FUNCTION__, addr, value);
+    trace_s5l8930_pmgr_write(addr, value);
 
     s5l8930_pmgr_s *s = (struct s5l8930_pmgr_s *) opaque;
 
@@ -381,7 +404,7 @@ static void s5l8930_pmgr_write(void *opaque, target_phys_addr_t addr, uint32_t v
 
 static uint32_t s5l8930_pmgr_read(void *opaque, target_phys_addr_t addr)
 {
-    S5L8930_DEBUG(S5L8930_DEBUG_PMGR, S5L8930_DLVL_ERR, "%s: addr 0x%08x\n", __FUNCTION__, addr);
+    trace_s5l8930_pmgr_read(addr);
     s5l8930_pmgr_s *s = (struct s5l8930_pmgr_s *) opaque;
 
     switch(addr){
@@ -559,6 +582,37 @@ void s5l8930_pmgr_reset(s5l8930_pmgr_s *pmgr)
 	pmgr->nc0_ref0 = 0xa0000003;
 }
 
+static const VMStateDescription vmstate_s5l8930_pmgr = {
+    .name = "s5l8930.pmgr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(armclk, s5l8930_pmgr_s),
+        VMSTATE_UINT32(base0, s5l8930_pmgr_s),
+        VMSTATE_UINT32(base1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(base2, s5l8930_pmgr_s),
+        VMSTATE_UINT32(nc0_ref0, s5l8930_pmgr_s),
+        VMSTATE_UINT32(medium0, s5l8930_pmgr_s),
+        VMSTATE_UINT32(medium1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(hperf0, s5l8930_pmgr_s),
+        VMSTATE_UINT32(hperf1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(hperf2clk, s5l8930_pmgr_s),
+        VMSTATE_UINT32(vid1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(audioclk, s5l8930_pmgr_s),
+        VMSTATE_UINT32(lperf1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(mipiclk, s5l8930_pmgr_s),
+        VMSTATE_UINT32(prediv0, s5l8930_pmgr_s),
+        VMSTATE_UINT32(prediv1, s5l8930_pmgr_s),
+        VMSTATE_UINT32(prediv2, s5l8930_pmgr_s),
+        VMSTATE_UINT32(prediv3, s5l8930_pmgr_s),
+        VMSTATE_UINT32(prediv4, s5l8930_pmgr_s),
+        VMSTATE_UINT32(sdioclk, s5l8930_pmgr_s),
+        VMSTATE_UINT32(cdma, s5l8930_pmgr_s),
+        VMSTATE_UINT32(d4clk, s5l8930_pmgr_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void s5l8930_pmgr_init(target_phys_addr_t base)
 {
 
@@ -567,11 +621,25 @@ static void s5l8930_pmgr_init(target_phys_addr_t base)
     int iomemtype = cpu_register_io_memory(s5l8930_pmgr_readfn,
                                            s5l8930_pmgr_writefn, pmgr, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xfff, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.pmgr");
 
 	s5l8930_pmgr_reset(pmgr);
+    vmstate_register(NULL, -1, &vmstate_s5l8930_pmgr, pmgr);
 }
 
 static uint32_t d_counter = 0;
+
+/* Latch the key for following operations.  Like AES_set_decrypt_key() did,
+ * an invalid key length leaves the previous key in place. */
+static void s5l8930_cdma_set_key(s5l8930_cdma_s *cdma, const uint8_t *key, uint32_t bits)
+{
+	if(bits != 128 && bits != 192 && bits != 256)
+		return;
+
+	memcpy(cdma->aesKey, key, bits / 8);
+	cdma->aesKeyBits = bits;
+}
+
 void do_aes_crypto(uint32_t *inBuf, uint32_t *outBuf, uint32_t size, uint32_t operation, void *opaque)
 {
 		s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
@@ -580,7 +648,7 @@ void do_aes_crypto(uint32_t *inBuf, uint32_t *outBuf, uint32_t size, uint32_t op
 
 		fprintf(stderr, "%s: AES_GO of size %x\n", __FUNCTION__, size);
 */
-		AES_set_decrypt_key((uint8_t *)cdma->custkey, cdma->keyLen, &cdma->decryptKey);
+		s5l8930_cdma_set_key(cdma, (uint8_t *)cdma->custkey, cdma->keyLen);
 /*
 	
 		sprintf(debugname, "/tmp/aes/inbuf-%d.img", d_counter);
@@ -588,7 +656,7 @@ void do_aes_crypto(uint32_t *inBuf, uint32_t *outBuf, uint32_t size, uint32_t op
         fwrite(inBuf, 1, size, fp);
         fclose(fp);
 */
-		AES_cbc_encrypt((uint8_t *)inBuf, (uint8_t *)outBuf, size, &cdma->decryptKey, (uint8_t *)cdma->ivec, operation);
+		s5l8900_aes_cbc(cdma->aesKey, cdma->aesKeyBits, (uint8_t *)inBuf, (uint8_t *)outBuf, size, cdma->ivec, operation);
 /*
 		sprintf(debugname, "/tmp/aes/outbuf-%d.img", d_counter);
         fp = fopen(debugname, "w");
@@ -603,11 +671,7 @@ static uint32_t s5l8930_cdma_read(void *opaque, target_phys_addr_t addr)
 	s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
 	uint32_t channel_reg = addr >> 12;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: addr 0x%08x\n", __FUNCTION__, addr);
-
-    if(channel_reg > 0x8) {
-        fprintf(stderr, "%s: addr 0x%08x\n", __FUNCTION__, addr);
-    }
+    trace_s5l8930_cdma_read(addr);
 
     switch (addr & 0xff) {		
 		case 0x0: /* status */
@@ -627,12 +691,160 @@ static uint32_t s5l8930_cdma_read(void *opaque, target_phys_addr_t addr)
     return 0;
 }
 
+void s5l8930_cdma_register_fifo(void *opaque, uint32_t addr,
+                                s5l8930_cdma_fifo_fn read,
+                                s5l8930_cdma_fifo_fn write, void *fifo_opaque)
+{
+    s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
+    s5l8930_cdma_fifo *fifo;
+
+    if(cdma->nfifo >= MAX_CDMA_FIFO) {
+        hw_error("s5l8930_cdma: too many peripheral FIFOs\n");
+    }
+
+    fifo = &cdma->fifo[cdma->nfifo++];
+    fifo->addr = addr;
+    fifo->read = read;
+    fifo->write = write;
+    fifo->opaque = fifo_opaque;
+}
+
+static s5l8930_cdma_fifo *s5l8930_cdma_find_fifo(s5l8930_cdma_s *cdma, uint32_t addr)
+{
+    int i;
+
+    for(i = 0; i < cdma->nfifo; i++) {
+        if(cdma->fifo[i].addr == addr)
+            return &cdma->fifo[i];
+    }
+    return NULL;
+}
+
+/* Copy a finished transfer into guest memory, mapping RAM directly where possible */
+static void s5l8930_cdma_scatter(target_phys_addr_t addr, const uint8_t *buf, uint32_t len)
+{
+    while(len) {
+        target_phys_addr_t plen = len;
+        uint8_t *ptr = cpu_physical_memory_map(addr, &plen, 1);
+
+        if(!ptr || !plen) {
+            cpu_physical_memory_write(addr, buf, len);
+            return;
+        }
+
+        memcpy(ptr, buf, plen);
+        cpu_physical_memory_unmap(ptr, plen, 1, plen);
+        addr += plen;
+        buf += plen;
+        len -= plen;
+    }
+}
+
+static void s5l8930_cdma_gather(target_phys_addr_t addr, uint8_t *buf, uint32_t len)
+{
+    while(len) {
+        target_phys_addr_t plen = len;
+        uint8_t *ptr = cpu_physical_memory_map(addr, &plen, 0);
+
+        if(!ptr || !plen) {
+            cpu_physical_memory_read(addr, buf, len);
+            return;
+        }
+
+        memcpy(buf, ptr, plen);
+        cpu_physical_memory_unmap(ptr, plen, 0, plen);
+        addr += plen;
+        buf += plen;
+        len -= plen;
+    }
+}
+
+static void s5l8930_cdma_complete(s5l8930_cdma_s *cdma, uint32_t channel_reg)
+{
+	cdma->size[channel_reg] = 0;
+	cdma->status[channel_reg] &= ~((1 << 19) | (1 << 18));
+	cdma->status[channel_reg] |= 0x80000;
+	cdma->mstatus |= 1 << channel_reg;
+	//cdma->cstatus[channel_reg] &= ~((1 << 16) | (1 << 17));
+	//cpu_physical_memory_write((target_phys_addr_t)0x5FF29590, &cdma->size[channel_reg], 4);
+
+	memset(cdma->ivec, 0, 0x10);
+	//fprintf(stderr, "%s: triggering IRQ for channel %d\n", __FUNCTION__, channel_reg);	
+	qemu_irq_raise(cdma->irqs[channel_reg]);
+}
+
+/* Move one guest segment to or from a peripheral FIFO without a bounce buffer */
+static uint32_t s5l8930_cdma_fifo_segment(s5l8930_cdma_fifo *fifo, target_phys_addr_t addr, uint32_t len, int write)
+{
+    uint32_t done = 0;
+    int got;
+
+    while(len) {
+        target_phys_addr_t plen = len;
+        uint8_t *ptr = cpu_physical_memory_map(addr, &plen, !write);
+
+        if(!ptr || !plen)
+            break;
+
+        got = write ? fifo->write(fifo->opaque, ptr, plen) : fifo->read(fifo->opaque, ptr, plen);
+        if(got < 0)
+            got = 0;
+        cpu_physical_memory_unmap(ptr, plen, !write, write ? plen : got);
+
+        done += got;
+        if(got < plen)
+            break;
+
+        addr += plen;
+        len -= plen;
+    }
+
+    return done;
+}
+
+/* Plain peripheral transfer on any channel that has a FIFO registered at its
+ * destination register: no AES, straight between the FIFO and guest memory. */
+static void s5l8930_cdma_fifo_transfer(s5l8930_cdma_s *cdma, uint32_t channel_reg, s5l8930_cdma_fifo *fifo)
+{
+	int write = cdma->config[channel_reg] & 0x2;
+	uint32_t nextSeg = cdma->dmaSegment[channel_reg]->address;
+	uint32_t len, done = 0;
+	segmentBuffer segBuf;
+
+	if(cdma->dmaSegment[channel_reg]->flags & 1)
+		nextSeg = cdma->segptr[channel_reg];
+
+	if((write && fifo->write) || (!write && fifo->read))
+	{
+		do
+		{
+			cpu_physical_memory_read((target_phys_addr_t)nextSeg, (uint8_t *)&segBuf, sizeof(segmentBuffer));
+
+			if(!(segBuf.flags & 2))
+				break;
+
+			len = MIN(segBuf.size, cdma->size[channel_reg] - done);
+			if(s5l8930_cdma_fifo_segment(fifo, segBuf.buffer, len, write) < len)
+				break;
+
+			done += len;
+			nextSeg = segBuf.address;
+
+		} while((segBuf.flags & 0x1) && done < cdma->size[channel_reg]);
+	}
+
+	if(done != cdma->size[channel_reg])
+		trace_s5l8930_cdma_short(channel_reg, done, cdma->size[channel_reg]);
+
+	s5l8930_cdma_complete(cdma, channel_reg);
+}
+
 static void s5l8930_cdma_write(void *opaque, target_phys_addr_t addr, uint32_t value)
 {
     s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
     uint32_t channel_reg = addr >> 12;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: addr 0x%08x value 0x%08x\n", __FUNCTION__, addr, value);
+    trace_s5l8930_cdma_write(addr, value);
 
 #if 0
 	if(!(addr >> 8))
@@ -641,9 +853,6 @@ static void s5l8930_cdma_write(void *opaque, target_phys_addr_t addr, uint32_t v
 		return;
 	}
 #endif
-	if(channel_reg > 0x8) {
-		fprintf(stderr, "%s: addr 0x%08x value 0x%08x\n", __FUNCTION__, addr, value);
-	}
     switch (addr & 0xff) {
 			case 0x0: /* Status */
 				//Clear IRQ
@@ -660,89 +869,57 @@ static void s5l8930_cdma_write(void *opaque, target_phys_addr_t addr, uint32_t v
 						case 1:
 							break;
 						case 2:
-							//S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: AES_GO type %d size %x keyLen %d\n", __FUNCTION__, cdma->aesOperation, cdma->dmaSegment[channel_reg]->size, cdma->keyLen);
-							fprintf(stderr, "%s: AES_GO type %d size %x keyLen %d keyType %d\n", __FUNCTION__, cdma->aesOperation, cdma->dmaSegment[channel_reg]->size, cdma->keyLen, cdma->keyType);
+							trace_s5l8930_cdma_aes_go(cdma->aesOperation, cdma->dmaSegment[channel_reg]->size, cdma->keyLen, cdma->keyType);
 							{
-								uint8_t *aesOutBuf = (uint8_t *)qemu_mallocz(cdma->dmaSegment[channel_reg]->size);
-								uint8_t *aesInBuf = (uint8_t *)qemu_mallocz(cdma->dmaSegment[channel_reg]->size);
-								char debugname[1024];
+								target_phys_addr_t aesIn = cdma->dmaSegment[1]->buffer;
+								target_phys_addr_t aesOut = cdma->dmaSegment[channel_reg]->buffer;
 								uint8_t iv[16] = {0};
 								
 								switch(cdma->keyType) {
                                     case AESUID:
-										S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: AESUID key in use \n", __FUNCTION__);
-                                        AES_set_decrypt_key(key_uid, sizeof(key_uid) * 8, &cdma->decryptKey);
+										trace_s5l8930_cdma_aes_uid();
+                                        s5l8930_cdma_set_key(cdma, key_uid, sizeof(key_uid) * 8);
                                         break;
 									case AESGID:
 										/* We cant do anything here as we dont know the GID key */
-										S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: AESGID requested!!! bad news mate\n", __FUNCTION__);
+										trace_s5l8930_cdma_aes_gid();
 										break;
 									case AESCustom:
 										/* test */
 										/*
 										if(cdma->dmaSegment[channel_reg]->size == 0x80)
 										{
-                                        	S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: AESCustom key in use \n", __FUNCTION__);
-											AES_set_decrypt_key(key_test, 128, &cdma->decryptKey);
+											s5l8930_cdma_set_key(cdma, key_test, 128);
 											memset(cdma->ivec, 0x0, 0x10);
 										} else {
 										*/
-										AES_set_decrypt_key((uint8_t *)cdma->custkey, cdma->keyLen, &cdma->decryptKey);
+										s5l8930_cdma_set_key(cdma, (uint8_t *)cdma->custkey, cdma->keyLen);
 										break;
 								}
 
-								cpu_physical_memory_read((target_phys_addr_t)cdma->dmaSegment[1]->buffer, (uint8_t *)aesInBuf, cdma->dmaSegment[channel_reg]->size);
-	
-                                    sprintf(debugname, "/tmp/aes/inbuf-%d.img", d_counter);
-                                    FILE *fp = fopen(debugname, "w");
-                                    fwrite(aesInBuf, 1, cdma->dmaSegment[channel_reg]->size, fp);
-                                    fclose(fp);
+								if(aes_capture_enabled)
+									aes_capture_record_phys(AES_CAPTURE_INBUF, d_counter, aesIn, cdma->dmaSegment[channel_reg]->size);
+
 								switch(cdma->dmaSegment[channel_reg]->size) {
 										case 0x5e42c0:
-												AES_set_decrypt_key((uint8_t *)kernKey435, cdma->keyLen, &cdma->decryptKey);
-												AES_cbc_encrypt(aesInBuf, aesOutBuf, cdma->dmaSegment[channel_reg]->size, &cdma->decryptKey, kernIV435, cdma->aesOperation);
+												memcpy(iv, kernIV435, sizeof(iv));
+												s5l8930_cdma_set_key(cdma, kernKey435, cdma->keyLen);
 												break;
 										case 0xe9a0:
-												AES_set_decrypt_key((uint8_t *)deviceKey435, cdma->keyLen, &cdma->decryptKey);
-												AES_cbc_encrypt(aesInBuf, aesOutBuf, cdma->dmaSegment[channel_reg]->size, &cdma->decryptKey, deviceIV435, cdma->aesOperation);
+												memcpy(iv, deviceIV435, sizeof(iv));
+												s5l8930_cdma_set_key(cdma, deviceKey435, cdma->keyLen);
 												break;
 									default:
-										memset(iv, 0, 0x10);
-										AES_cbc_encrypt(aesInBuf, aesOutBuf, cdma->dmaSegment[channel_reg]->size, &cdma->decryptKey, iv, cdma->aesOperation);
-										break;
-								}
-								/* 
-								switch(d_counter) {
-									case 0:
-										memcpy(aesOutBuf, Key835, 16);
-										break;
-									case 1:
-										memcpy(aesOutBuf, Key89B, 16);
 										break;
-								  default:
-									break;
 								}
-								*/
-								if(cdma->keyType == AESCustom)
-								{
-                                    sprintf(debugname, "/tmp/aes/key-%d.img", d_counter);
-                                    FILE *fp = fopen(debugname, "w");
-                                    fwrite(cdma->custkey, 1, 32, fp);
-                                    fclose(fp);
-
+								s5l8900_aes_cbc_phys(cdma->aesKey, cdma->aesKeyBits, aesIn, aesOut, cdma->dmaSegment[channel_reg]->size, iv, cdma->aesOperation);
+								if(aes_capture_enabled) {
+									if(cdma->keyType == AESCustom)
+										aes_capture_record(AES_CAPTURE_KEY, d_counter, cdma->custkey, 32);
+									aes_capture_record_phys(AES_CAPTURE_OUTBUF, d_counter, aesOut, cdma->dmaSegment[channel_reg]->size);
 								}
-								//if(cdma->dmaSegment[channel_reg]->size == 0x5e42c0) {
-									sprintf(debugname, "/tmp/aes/outbuf-%d.img", d_counter);
-									fp = fopen(debugname, "w");
-									fwrite(aesOutBuf, 1, cdma->dmaSegment[channel_reg]->size, fp);
-									fclose(fp);
-								//}
 								d_counter++;
 
-								cpu_physical_memory_write((target_phys_addr_t)cdma->dmaSegment[channel_reg]->buffer, aesOutBuf, cdma->dmaSegment[channel_reg]->size);
-
-								qemu_free(aesOutBuf);
-								qemu_free(aesInBuf);
 								memset(cdma->ivec, 0, 0x10);
 							}
 							cdma->keyLen = 0;
@@ -755,121 +932,145 @@ static void s5l8930_cdma_write(void *opaque, target_phys_addr_t addr, uint32_t v
                     case 0x8: /* H2FMI 1 META */
 						{
 							uint8_t direction = (cdma->config[channel_reg] & 0x2);
-							if(direction) {	
+							segmentBuffer segBuf;
+							s5l8930_cdma_fifo *fifo;
+							uint8_t *buf;
+							uint32_t i, soffset, got;
+							uint32_t nextSeg, firstSeg = cdma->dmaSegment[channel_reg]->address;
+							size_t size = 0;
+
+							/* If FLAG_DATA is set then no AES */
+							if(cdma->dmaSegment[channel_reg]->flags & 1)
+								firstSeg = cdma->segptr[channel_reg];
+							else {
+								memcpy(cdma->ivec, cdma->dmaSegment[channel_reg]->iv, 0x10);
+								/*
+								fprintf(stderr, "%s: printing iv: {", __FUNCTION__);
+								for(i=0;i < 0x10;i++) {
+									fprintf(stderr, "0x%02x,", (uint8_t)cdma->ivec[i]);
+								}
+								fprintf(stderr, "\n");
+								*/
+							}
+
+							if(cdma->dmaBufSize < cdma->size[channel_reg] + 4) {
+								cdma->dmaBufSize = cdma->size[channel_reg] + 4;
+								cdma->dmaBuf = qemu_realloc(cdma->dmaBuf, cdma->dmaBufSize);
+							}
+							buf = cdma->dmaBuf;
+							fifo = s5l8930_cdma_find_fifo(cdma, cdma->creg[channel_reg]);
+
+							if(direction) {
 								// its a write
-								fprintf(stderr, "%s: got write\n", __FUNCTION__);
-							} else {
-								// its a read
-								segmentBuffer segBuf;
-								uint8_t *outBuf, *inBuf;
-								uint32_t i, soffset;
-                                uint32_t nextSeg, firstSeg = cdma->dmaSegment[channel_reg]->address;
-								size_t size = 0;
-
-								/* If FLAG_DATA is set then no AES */
-								if(cdma->dmaSegment[channel_reg]->flags & 1)
-									firstSeg = cdma->segptr[channel_reg];
-								else {
-                                    memcpy(cdma->ivec, cdma->dmaSegment[channel_reg]->iv, 0x10);
-									/*
-									fprintf(stderr, "%s: printing iv: {", __FUNCTION__);
-									for(i=0;i < 0x10;i++) {
-										fprintf(stderr, "0x%02x,", (uint8_t)cdma->ivec[i]);
+								nextSeg = firstSeg;
+								soffset = 0;
+
+								/* Gather the guest segments, then push them into the FIFO in one transfer */
+								do
+								{
+									cpu_physical_memory_read((target_phys_addr_t)nextSeg, (uint8_t *)&segBuf, sizeof(segmentBuffer));
+
+									if(!(segBuf.flags & 2))
+										break;
+
+									if(soffset + segBuf.size > cdma->size[channel_reg])
+									{
+										trace_s5l8930_cdma_overrun(channel_reg, cdma->size[channel_reg]);
+										break;
 									}
-                                	fprintf(stderr, "\n");
-									*/
-								}
 
+									s5l8930_cdma_gather(segBuf.buffer, buf+soffset, segBuf.size);
+									soffset += segBuf.size;
+									nextSeg = segBuf.address;
+
+								} while(segBuf.flags & 0x1);
+
+								size = soffset;
+								if(size != cdma->size[channel_reg])
+									trace_s5l8930_cdma_size_mismatch(channel_reg, cdma->size[channel_reg], size);
+
+								/* Encrypt in place */
+								if(!(cdma->dmaSegment[channel_reg]->flags & 0x1) && size)
+									do_aes_crypto((uint32_t *)buf, (uint32_t *)buf, size, AES_ENCRYPT, cdma);
+
+								if(fifo && fifo->write)
+									fifo->write(fifo->opaque, buf, size);
+								else {
+									for(i = 0; i < size; i++)
+										cpu_physical_memory_write((target_phys_addr_t)cdma->creg[channel_reg], buf+i, 1);
+								}
+							} else {
+								// its a read
 								nextSeg = firstSeg;
-                                inBuf = (uint8_t *)qemu_mallocz(cdma->size[channel_reg] + 4);
-                                outBuf = (uint8_t *)qemu_mallocz(cdma->size[channel_reg] + 4);
 								soffset = 0;
 
+								/* Size up the chain first so the FIFO can be drained in one transfer */
 								do 
 								{
-									// read segments
-									fprintf(stderr, "%s: reading seg 0x%08x\n", __func__, nextSeg);
 									cpu_physical_memory_read((target_phys_addr_t)nextSeg, (uint8_t *)&segBuf, sizeof(segmentBuffer));
 
-									fprintf(stderr, "%s: got seg 0x%08x, addr 0x%08x, size 0x%08x\n", __func__, segBuf.flags,
-											segBuf.address, segBuf.size);
-
 									if(segBuf.flags & 3)
 									{
-
-										fprintf(stderr, "%s: reading segment size %d\n", __FUNCTION__, segBuf.size);
 										if(size + segBuf.size > cdma->size[channel_reg])
 										{
-											fprintf(stderr, "%s: used too much buffer!\n", __func__);
+											trace_s5l8930_cdma_overrun(channel_reg, cdma->size[channel_reg]);
 											break;
 										}
-
-									    //for(i=0; i < segBuf.size; i += 4)
-									    //	cpu_physical_memory_read((target_phys_addr_t)cdma->creg[channel_reg], inBuf+i, 4);
-										//cpu_physical_memory_read((target_phys_addr_t)cdma->creg[channel_reg], inBuf, segBuf.size);
-										for(i = 0; i < segBuf.size; i++)
-											cpu_physical_memory_read((target_phys_addr_t)cdma->creg[channel_reg], inBuf+size+i, 1);
 										size += segBuf.size;
 									}
 									
 									nextSeg = segBuf.address;
-									fprintf(stderr, "%s: next seg 0x%08x\n", __func__, nextSeg);
 
 								} while(nextSeg && size < cdma->size[channel_reg]);
 
 								if(size != cdma->size[channel_reg])
-									fprintf(stderr, "%s: size incorrect! Expected %d, got %d.\n", __func__, cdma->size[channel_reg], size);
+									trace_s5l8930_cdma_size_mismatch(channel_reg, cdma->size[channel_reg], size);
 
-                                if((cdma->dmaSegment[channel_reg]->flags & 0x1) || buffer_zero(inBuf, cdma->size[channel_reg]))
-                              		memcpy(outBuf, inBuf, size);
-								else { 
-									//fprintf(stderr, "%s: doing crypto on %x bytes\n", __FUNCTION__, size);
-                                	do_aes_crypto((uint32_t *)inBuf, (uint32_t *)outBuf, cdma->size[channel_reg], AES_DECRYPT, cdma);
+								if(fifo && fifo->read)
+									got = fifo->read(fifo->opaque, buf, size);
+								else {
+									for(i = 0; i < size; i++)
+										cpu_physical_memory_read((target_phys_addr_t)cdma->creg[channel_reg], buf+i, 1);
+									got = size;
 								}
+								memset(buf + got, 0, cdma->size[channel_reg] + 4 - got);
+
+								/* Decrypt in place */
+                                if(!(cdma->dmaSegment[channel_reg]->flags & 0x1) && !buffer_zero(buf, cdma->size[channel_reg]))
+                                	do_aes_crypto((uint32_t *)buf, (uint32_t *)buf, cdma->size[channel_reg], AES_DECRYPT, cdma);
 
 								nextSeg = firstSeg;
 								soffset = 0;
 
 								do
 								{
-									// read segments
-									fprintf(stderr, "%s: reading seg 0x%08x\n", __func__, nextSeg);
 									cpu_physical_memory_read((target_phys_addr_t)nextSeg, (uint8_t *)&segBuf, sizeof(segmentBuffer));
 
 									if(!(segBuf.flags & 2))
 										break;
 
-									fprintf(stderr, "%s: writing out segment size %d to location 0x%08x segptr 0x%08x\n", __FUNCTION__, segBuf.size, segBuf.buffer, nextSeg);
-
-									if(!(channel_reg & 1))
-									{
-										fprintf(stderr, "meta: ");
-										int b;
-										for(b = 0; b < segBuf.size; b++)
-											fprintf(stderr, "%02x ", outBuf[b]);
-										fprintf(stderr, "\n");
-									}
+									if(soffset + segBuf.size > cdma->size[channel_reg])
+										break;
 
-                                    cpu_physical_memory_write((target_phys_addr_t)segBuf.buffer, (uint8_t *)outBuf+soffset, segBuf.size);
+									s5l8930_cdma_scatter(segBuf.buffer, buf+soffset, segBuf.size);
 									soffset += segBuf.size;
                                     nextSeg = segBuf.address;
 
 								} while(segBuf.flags & 0x1);
+							}
 
-					            cdma->size[channel_reg] = 0;
-								cdma->status[channel_reg] &= ~((1 << 19) | (1 << 18));
-								cdma->status[channel_reg] |= 0x80000;
-								cdma->mstatus |= 1 << channel_reg;
-								//cdma->cstatus[channel_reg] &= ~((1 << 16) | (1 << 17));
-								//cpu_physical_memory_write((target_phys_addr_t)0x5FF29590, &cdma->size[channel_reg], 4);
+							s5l8930_cdma_complete(cdma, channel_reg);
+							return;
+						}
+						break;
 
-                                qemu_free(inBuf);
-                                qemu_free(outBuf);
-								memset(cdma->ivec, 0, 0x10);
-								//fprintf(stderr, "%s: triggering IRQ for channel %d\n", __FUNCTION__, channel_reg);	
-								qemu_irq_raise(cdma->irqs[channel_reg]);
+					default:
+						{
+							s5l8930_cdma_fifo *fifo = s5l8930_cdma_find_fifo(cdma, cdma->creg[channel_reg]);
+							if(fifo && cdma->dmaSegment[channel_reg]) {
+								s5l8930_cdma_fifo_transfer(cdma, channel_reg, fifo);
+								return;
 							}
-							return;
 						}
 						break;
 					}
@@ -904,7 +1105,6 @@ static void s5l8930_cdma_write(void *opaque, target_phys_addr_t addr, uint32_t v
 				   }
 				   cdma->dmaSegment[channel_reg] = (segmentBuffer *)qemu_mallocz(sizeof(segmentBuffer));
 				   cpu_physical_memory_read(value, (uint8_t *)cdma->dmaSegment[channel_reg], sizeof(segmentBuffer));
-				   //S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: dmaAes got buffer 0x%08x - size %x\n", __FUNCTION__, cdma->dmaAes[channel_reg]->buffer, cdma->dmaAes[channel_reg]->size);
 				}
 				cdma->segptr[channel_reg] = value;	
 				break;
@@ -932,6 +1132,82 @@ void replaceCDMAIRQHandlers(void *opaque, qemu_irq dma5, qemu_irq dma6, qemu_irq
     cdma->irqs[8] = dma8;
 }
 
+/* A channel's segment descriptor is latched from guest memory when the
+ * segment pointer is written, so migrate the latched copy rather than
+ * re-reading memory the guest may since have reused. */
+static void put_cdma_segment(QEMUFile *f, void *pv, size_t size)
+{
+    segmentBuffer *seg = *(segmentBuffer **)pv;
+    int i;
+
+    qemu_put_byte(f, seg != NULL);
+    if (!seg)
+        return;
+
+    qemu_put_be32(f, seg->address);
+    qemu_put_be32(f, seg->flags);
+    qemu_put_be32(f, seg->buffer);
+    qemu_put_be32(f, seg->size);
+    for (i = 0; i < 4; i++)
+        qemu_put_be32(f, seg->iv[i]);
+}
+
+static int get_cdma_segment(QEMUFile *f, void *pv, size_t size)
+{
+    segmentBuffer **segp = pv;
+    segmentBuffer *seg;
+    int i;
+
+    if (!qemu_get_byte(f)) {
+        qemu_free(*segp);
+        *segp = NULL;
+        return 0;
+    }
+
+    if (!*segp)
+        *segp = (segmentBuffer *)qemu_mallocz(sizeof(segmentBuffer));
+    seg = *segp;
+
+    seg->address = qemu_get_be32(f);
+    seg->flags = qemu_get_be32(f);
+    seg->buffer = qemu_get_be32(f);
+    seg->size = qemu_get_be32(f);
+    for (i = 0; i < 4; i++)
+        seg->iv[i] = qemu_get_be32(f);
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_cdma_segment = {
+    .name = "cdma segment",
+    .get  = get_cdma_segment,
+    .put  = put_cdma_segment,
+};
+
+static const VMStateDescription vmstate_s5l8930_cdma = {
+    .name = "s5l8930.cdma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(size, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32_ARRAY(segptr, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32_ARRAY(status, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32_ARRAY(dmaAesSetup, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32_ARRAY(config, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32_ARRAY(creg, s5l8930_cdma_s, MAX_CDMA_CHAN),
+        VMSTATE_UINT32(mstatus, s5l8930_cdma_s),
+        VMSTATE_UINT8(aesOperation, s5l8930_cdma_s),
+        VMSTATE_ARRAY(dmaSegment, s5l8930_cdma_s, MAX_CDMA_CHAN, 0,
+                      vmstate_info_cdma_segment, segmentBuffer *),
+        VMSTATE_BUFFER(aesKey, s5l8930_cdma_s),
+        VMSTATE_UINT32(aesKeyBits, s5l8930_cdma_s),
+        VMSTATE_BUFFER(ivec, s5l8930_cdma_s),
+        VMSTATE_UINT32_ARRAY(custkey, s5l8930_cdma_s, 8),
+        VMSTATE_UINT32(keyLen, s5l8930_cdma_s),
+        VMSTATE_UINT8(keyType, s5l8930_cdma_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void * s5l8930_cdma_init(target_phys_addr_t base, qemu_irq dma5, qemu_irq dma6, qemu_irq dma7, qemu_irq dma8)
 {
     s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) qemu_mallocz(sizeof(s5l8930_cdma_s));
@@ -939,6 +1215,7 @@ static void * s5l8930_cdma_init(target_phys_addr_t base, qemu_irq dma5, qemu_irq
     int iomemtype = cpu_register_io_memory(s5l8930_cdma_readfn,
                                            s5l8930_cdma_writefn, cdma, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xffff, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.cdma");
 
 	cdma->irqs[5] = dma5;
 	cdma->irqs[6] = dma6;
@@ -946,6 +1223,7 @@ static void * s5l8930_cdma_init(target_phys_addr_t base, qemu_irq dma5, qemu_irq
 	cdma->irqs[8] = dma8;
 
 	s5l8930_cdma_aes_init(S5L8930_CDMA_AES_BASE, cdma);
+    vmstate_register(NULL, -1, &vmstate_s5l8930_cdma, cdma);
 	
 	return (void *)cdma;
 }
@@ -955,7 +1233,7 @@ static uint32_t s5l8930_cdma_aes_read(void *opaque, target_phys_addr_t addr)
     s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
     uint32_t channel_reg = addr >> 12;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: addr 0x%08x\n", __FUNCTION__, addr);
+    trace_s5l8930_cdma_aes_read(addr);
 
     switch (addr & 0xff) {
 		case 0x0: // Setup
@@ -980,7 +1258,7 @@ static void s5l8930_cdma_aes_write(void *opaque, target_phys_addr_t addr, uint32
     s5l8930_cdma_s *cdma = (s5l8930_cdma_s *) opaque;
     uint32_t channel_reg = addr >> 12;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_CDMA, S5L8930_DLVL_ERR, "%s: addr 0x%08x value 0x%08x\n", __FUNCTION__, addr, value);
+    trace_s5l8930_cdma_aes_write(addr, value);
 	
     switch (addr & 0xff) {
         case 0x0: // Setup
@@ -1046,12 +1324,13 @@ static void s5l8930_cdma_aes_init(target_phys_addr_t base, void *opaque)
     int iomemtype = cpu_register_io_memory(s5l8930_cdma_aes_readfn,
                                            s5l8930_cdma_aes_writefn, opaque, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xffff, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.cdma_aes");
 }
 
 static uint32_t s5l8930_chipid_read(void *opaque, target_phys_addr_t addr)
 {
 
-	S5L8930_DEBUG(S5L8930_DEBUG_CHIPID, S5L8930_DLVL_WARN, "%s: offset = 0x%02x\n", __FUNCTION__, (int)addr);
+	trace_s5l8930_chipid_read(addr);
 
 	switch(addr) {
 			case 0x0:	
@@ -1062,7 +1341,7 @@ static uint32_t s5l8930_chipid_read(void *opaque, target_phys_addr_t addr)
 				return 0x47002735;
 
 		default:
-			 S5L8930_DEBUG(S5L8930_DEBUG_CHIPID, S5L8930_DLVL_ERR, "%s: UNMAPPED offset = 0x%02x\n", __FUNCTION__, (int)addr);
+			 trace_s5l8930_chipid_unmapped_read(addr);
 	}
 
 	return 0;
@@ -1086,16 +1365,22 @@ static void s5l8930_chipid_init(target_phys_addr_t base)
     int iomemtype = cpu_register_io_memory(s5l8930_chipid_readfn,
                                            s5l8930_chipid_writefn, NULL, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.chipid");
 
 }
 
+/*
+ * The input registers take the (already padded) message a word at a time,
+ * and each 64-byte block is absorbed into a running context as it fills,
+ * so the result registers always hold the chaining value so far.
+ */
 typedef struct sha1_status {
     uint32_t status;
     uint32_t reset;
     uint32_t hresult;
     uint32_t inWordCnt;
     uint32_t unkstat;
-	uint32_t *hashIn;
+    S5L8900SHA1Context ctx;
     uint8_t hashout[0x14];
 } sha1_status_s;
 
@@ -1103,13 +1388,10 @@ static void sha1_reset(void *opaque)
 {
     sha1_status_s *s = (sha1_status_s *)opaque;
 
-	/* Wow huge buffer lets ditch for now */
-	if(s->hashIn)
-		qemu_free(s->hashIn);
-
     memset(s, 0, sizeof(sha1_status_s));
+    s5l8900_sha1_init(&s->ctx);
 
-    S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "Resetting SHA1\n");
+    trace_s5l8930_sha1_reset();
 }
 
 static uint32_t sha1_read(void *opaque, target_phys_addr_t offset)
@@ -1117,35 +1399,15 @@ static uint32_t sha1_read(void *opaque, target_phys_addr_t offset)
     sha1_status_s *s = (sha1_status_s *)opaque;
     uint32_t retVal;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "%s: offset 0x%08x\n", __FUNCTION__, offset);
+    trace_s5l8930_sha1_read(offset);
     switch(offset) {
         // Hash result ouput
         case 0x20 ... 0x30:
 			if(offset == 0x20) 
-			{ /* It's hashing time baby */
-				/*
-                SHA_CTX context;
-                SHA1_Init(&context);
-                SHA1_Update(&context, (uint8_t*)s->hashIn, (s->inWordCnt * 4) - 0x40);
-                SHA1_Final(s->hashout, &context);
-				*/
+				s5l8900_sha1_state(&s->ctx, s->hashout);
 
-#if 0
-				{
-                	uint32_t ctr;
-					for( ctr = 0; ctr < 20; ctr++ )
-					{
-							fprintf(stderr, "%x ", s->hashout[ctr] );
-					}
-					fprintf(stderr, "\n");
-					FILE *fp = fopen("/tmp/sha1.img", "w");
-					fwrite(s->hashIn, 1, (s->inWordCnt * 4) - 0x40, fp);
-					fclose(fp);
-				}
-#endif
-				}
-				retVal = *(uint32_t *)&s->hashout[offset - 0x20];
-            S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "Hash out %08x\n",  *(uint32_t *)&s->hashout[offset - 0x20]);
+			retVal = *(uint32_t *)&s->hashout[offset - 0x20];
+            trace_s5l8930_sha1_hash_out(retVal);
 			if(offset == 0x30) 
 				sha1_reset(s);
             return retVal;
@@ -1157,20 +1419,16 @@ static void sha1_write(void *opaque, target_phys_addr_t offset,
                        uint32_t value)
 {
     sha1_status_s *s = (sha1_status_s *)opaque;
+    uint32_t word;
 
-    S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, offset, value);
+    trace_s5l8930_sha1_write(offset, value);
 
     switch(offset) {
 		case 0x40 ... 0x7c: /* In buffer regs */
-			if(!s->inWordCnt) 
-				s->hashIn = (uint32_t *)qemu_mallocz(0x40000);
-			if(s->inWordCnt >= 0x10000) 
-			{
-				S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "%s: error out of sha1 buffer\n", __FUNCTION__);
-				break;
-			}	
-			S5L8930_DEBUG(S5L8930_DEBUG_SHA1, S5L8930_DLVL_ERR, "%s: adding value to hash 0x%08x inWordCnt %x\n", __FUNCTION__, value, s->inWordCnt);
-			s->hashIn[s->inWordCnt++] = value;
+			trace_s5l8930_sha1_input(value, s->inWordCnt);
+			word = cpu_to_le32(value);
+			s5l8900_sha1_update(&s->ctx, &word, sizeof(word));
+			s->inWordCnt++;
 			break;
     }
 
@@ -1188,6 +1446,37 @@ static CPUWriteMemoryFunc * const s5l8930_sha1_writefn[] = {
     sha1_write,
 };
 
+static int sha1_post_load(void *opaque, int version_id)
+{
+    sha1_status_s *s = (sha1_status_s *)opaque;
+
+    if (s->ctx.num >= S5L8900_SHA1_BLOCK
+        || s->ctx.num != s->ctx.len % S5L8900_SHA1_BLOCK)
+        return -EINVAL;
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_s5l8930_sha1 = {
+    .name = "s5l8930.sha1",
+    .version_id = 3,
+    .minimum_version_id = 3,
+    .post_load = sha1_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(status, sha1_status_s),
+        VMSTATE_UINT32(reset, sha1_status_s),
+        VMSTATE_UINT32(hresult, sha1_status_s),
+        VMSTATE_UINT32(inWordCnt, sha1_status_s),
+        VMSTATE_UINT32(unkstat, sha1_status_s),
+        VMSTATE_UINT32_ARRAY(ctx.h, sha1_status_s, 5),
+        VMSTATE_UINT64(ctx.len, sha1_status_s),
+        VMSTATE_UINT32(ctx.num, sha1_status_s),
+        VMSTATE_BUFFER(ctx.data, sha1_status_s),
+        VMSTATE_BUFFER(hashout, sha1_status_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void s5l8930_sha1_init(target_phys_addr_t base)
 {
     sha1_status_s *s = (sha1_status_s *) qemu_mallocz(sizeof(sha1_status_s));
@@ -1195,23 +1484,159 @@ static void s5l8930_sha1_init(target_phys_addr_t base)
                                            s5l8930_sha1_writefn,
                                            s, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0xFF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.sha1");
+    s5l8900_sha1_init(&s->ctx);
+    vmstate_register(NULL, -1, &vmstate_s5l8930_sha1, s);
+}
+
+/*
+ * One config word per pin: the level in bit 0, which for an output is the
+ * value driven, the mode in bits 1-3 and the interrupt group in bits
+ * 16-18. Pending interrupts are latched in per-group status words,
+ * cleared by writing 1s.
+ */
+#define S5L8930_GPIO_STATS (S5L8930_GPIO_IRQGROUPS * S5L8930_GPIO_PINS / 32)
+#define S5L8930_GPIO_STAT(g, i) ((g) * (S5L8930_GPIO_PINS / 32) + (i))
+
+typedef struct s5l8930_gpio_s {
+    uint32_t config[S5L8930_GPIO_PINS];
+    uint32_t input[S5L8930_GPIO_PINS / 32];		// levels driven from outside
+    uint32_t level[S5L8930_GPIO_PINS / 32];		// pin levels as last seen
+    uint32_t stat[S5L8930_GPIO_STATS];		// S5L8930_GPIO_STAT(group, word)
+    qemu_irq irq;
+} s5l8930_gpio_s;
+
+static int s5l8930_gpio_pin_level(s5l8930_gpio_s *s, int pin)
+{
+    if (S5L8930_GPIO_MODE(s->config[pin]) == S5L8930_GPIO_MODE_OUT)
+        return s->config[pin] & S5L8930_GPIO_DATA;
+
+    return (s->input[pin / 32] >> (pin % 32)) & 1;
+}
+
+static void s5l8930_gpio_irq_update(s5l8930_gpio_s *s)
+{
+    int i;
+
+    for (i = 0; i < S5L8930_GPIO_STATS; i++) {
+        if (s->stat[i]) {
+            qemu_irq_raise(s->irq);
+            return;
+        }
+    }
+    qemu_irq_lower(s->irq);
+}
+
+/* Latch a pin's interrupt for its current level, old is its last level */
+static void s5l8930_gpio_latch(s5l8930_gpio_s *s, int pin, int old)
+{
+    int level = (s->level[pin / 32] >> (pin % 32)) & 1;
+    int group = S5L8930_GPIO_GROUP(s->config[pin]);
+    int pending;
+
+    switch (S5L8930_GPIO_MODE(s->config[pin])) {
+        case S5L8930_GPIO_MODE_IRQ_HI:
+            pending = level;
+            break;
+        case S5L8930_GPIO_MODE_IRQ_LO:
+            pending = !level;
+            break;
+        case S5L8930_GPIO_MODE_IRQ_UP:
+            pending = !old && level;
+            break;
+        case S5L8930_GPIO_MODE_IRQ_DN:
+            pending = old && !level;
+            break;
+        case S5L8930_GPIO_MODE_IRQ_ANY:
+            pending = old != level;
+            break;
+        default:
+            return;
+    }
+
+    if (pending && group < S5L8930_GPIO_IRQGROUPS)
+        s->stat[S5L8930_GPIO_STAT(group, pin / 32)] |= 1u << (pin % 32);
+}
+
+static void s5l8930_gpio_update(s5l8930_gpio_s *s, int pin)
+{
+    uint32_t bit = 1u << (pin % 32);
+    int old = (s->level[pin / 32] & bit) != 0;
+
+    if (s5l8930_gpio_pin_level(s, pin))
+        s->level[pin / 32] |= bit;
+    else
+        s->level[pin / 32] &= ~bit;
+
+    s5l8930_gpio_latch(s, pin, old);
+    s5l8930_gpio_irq_update(s);
+}
+
+void s5l8930_gpio_set_input(void *opaque, int pin, int level)
+{
+    s5l8930_gpio_s *s = (s5l8930_gpio_s *)opaque;
+
+    if (pin < 0 || pin >= S5L8930_GPIO_PINS)
+        return;
+
+    if (level)
+        s->input[pin / 32] |= 1u << (pin % 32);
+    else
+        s->input[pin / 32] &= ~(1u << (pin % 32));
+    s5l8930_gpio_update(s, pin);
 }
 
 static void s5l8930_gpio_write(void *opaque, target_phys_addr_t addr, uint32_t value) 
 {
-	 S5L8930_DEBUG(S5L8930_DEBUG_GPIO, S5L8930_DLVL_ERR, "%s: offset 0x%08x value 0x%08x\n", __func__, addr, value);
+    s5l8930_gpio_s *s = (s5l8930_gpio_s *)opaque;
+    int g, i, pin;
+
+	 trace_s5l8930_gpio_write(addr, value);
+
+    if (addr < S5L8930_GPIO_PINS * 4) {
+        pin = addr >> 2;
+        s->config[pin] = value;
+        s5l8930_gpio_update(s, pin);
+        return;
+    }
+
+    if (addr >= S5L8930_GPIO_INTSTAT &&
+        addr < S5L8930_GPIO_INTSTAT + S5L8930_GPIO_IRQGROUPS * 0x40) {
+        g = (addr - S5L8930_GPIO_INTSTAT) / 0x40;
+        i = ((addr - S5L8930_GPIO_INTSTAT) % 0x40) >> 2;
+        if (i >= S5L8930_GPIO_PINS / 32)
+            return;
+
+        s->stat[S5L8930_GPIO_STAT(g, i)] &= ~value;
+        // Level interrupts still asserted come straight back
+        for (pin = i * 32; pin < i * 32 + 32; pin++) {
+            if (S5L8930_GPIO_GROUP(s->config[pin]) == g)
+                s5l8930_gpio_latch(s, pin, (s->level[i] >> (pin % 32)) & 1);
+        }
+        s5l8930_gpio_irq_update(s);
+    }
 }
 
 static uint32_t s5l8930_gpio_read(void *opaque, target_phys_addr_t addr)
 {
-     S5L8930_DEBUG(S5L8930_DEBUG_GPIO, S5L8930_DLVL_ERR, "%s: offset 0x%08x\n", __func__, addr);
+    s5l8930_gpio_s *s = (s5l8930_gpio_s *)opaque;
+    int g, i, pin;
 
-	switch(addr) {
-		case 0xa0:
-			return 1; /* board id? */
-		case 0x9c:
-			return 1; /* board id? */
-	}
+     trace_s5l8930_gpio_read(addr);
+
+    if (addr < S5L8930_GPIO_PINS * 4) {
+        pin = addr >> 2;
+        return (s->config[pin] & ~S5L8930_GPIO_DATA) |
+               ((s->level[pin / 32] >> (pin % 32)) & 1);
+    }
+
+    if (addr >= S5L8930_GPIO_INTSTAT &&
+        addr < S5L8930_GPIO_INTSTAT + S5L8930_GPIO_IRQGROUPS * 0x40) {
+        g = (addr - S5L8930_GPIO_INTSTAT) / 0x40;
+        i = ((addr - S5L8930_GPIO_INTSTAT) % 0x40) >> 2;
+        if (i < S5L8930_GPIO_PINS / 32)
+            return s->stat[S5L8930_GPIO_STAT(g, i)];
+    }
 
     return 0;
 }
@@ -1227,12 +1652,34 @@ static CPUWriteMemoryFunc *s5l8930_gpio_writefn[] = {
     s5l8930_gpio_write,
 };
 
-static void s5l8930_gpio_init(target_phys_addr_t base)
-{
+static const VMStateDescription vmstate_s5l8930_gpio = {
+    .name = "s5l8930.gpio",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(config, s5l8930_gpio_s, S5L8930_GPIO_PINS),
+        VMSTATE_UINT32_ARRAY(input, s5l8930_gpio_s, S5L8930_GPIO_PINS / 32),
+        VMSTATE_UINT32_ARRAY(level, s5l8930_gpio_s, S5L8930_GPIO_PINS / 32),
+        VMSTATE_UINT32_ARRAY(stat, s5l8930_gpio_s, S5L8930_GPIO_STATS),
+        VMSTATE_END_OF_LIST()
+    }
+};
 
+static void *s5l8930_gpio_init(target_phys_addr_t base, qemu_irq irq)
+{
+    s5l8930_gpio_s *s = (s5l8930_gpio_s *)qemu_mallocz(sizeof(s5l8930_gpio_s));
     int iomemtype = cpu_register_io_memory(s5l8930_gpio_readfn,
-                                           s5l8930_gpio_writefn, NULL, DEVICE_LITTLE_ENDIAN);
-    cpu_register_physical_memory(base, 0x3FF, iomemtype);
+                                           s5l8930_gpio_writefn, s, DEVICE_LITTLE_ENDIAN);
+    cpu_register_physical_memory(base, 0xFFF, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.gpio");
+    s->irq = irq;
+
+    /* Board id straps */
+    s5l8930_gpio_set_input(s, 0x9c / 4, 1);
+    s5l8930_gpio_set_input(s, 0xa0 / 4, 1);
+
+    vmstate_register(NULL, base, &vmstate_s5l8930_gpio, s);
+    return s;
 }
 
 static inline qemu_irq s5l8930_get_irq(struct s5l8930_state_s *s, int n)
@@ -1259,7 +1706,7 @@ static uint32_t s5l8930_usb_phy_read(void *opaque, target_phys_addr_t offset)
 		return s->usb_ophytune;
 
 	default:
-		S5L8930_DEBUG(S5L8930_DEBUG_USBPHY, S5L8930_DLVL_ERR, "%s: read invalid location 0x%08x.\n", __func__, offset);
+		trace_s5l8930_usb_phy_unmapped_read(offset);
 		return 0;
 	}
 
@@ -1289,7 +1736,7 @@ static void s5l8930_usb_phy_write(void *opaque, target_phys_addr_t offset, uint3
 		return;
 
 	default:
-		S5L8930_DEBUG(S5L8930_DEBUG_USBPHY, S5L8930_DLVL_ERR, "%s: write invalid location 0x%08x.\n", __func__, offset);
+		trace_s5l8930_usb_phy_unmapped_write(offset, val);
 	}
 }
 
@@ -1305,6 +1752,19 @@ static CPUWriteMemoryFunc * const s5l8930_usb_phy_writefn[] = {
     s5l8930_usb_phy_write,
 };
 
+static const VMStateDescription vmstate_s5l8930_usb_phy = {
+    .name = "s5l8930.usb_phy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(usb_ophypwr, s5l8930_state),
+        VMSTATE_UINT32(usb_ophyclk, s5l8930_state),
+        VMSTATE_UINT32(usb_orstcon, s5l8930_state),
+        VMSTATE_UINT32(usb_ophytune, s5l8930_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void s5l8930_usb_phy_init(s5l8930_state *_state)
 {
 	_state->usb_ophypwr = 0;
@@ -1316,6 +1776,8 @@ static void s5l8930_usb_phy_init(s5l8930_state *_state)
                                            s5l8930_usb_phy_writefn,
 										   _state, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(S5L8930_USB_PHY_BASE, 0x40, iomemtype);
+    cpu_io_memory_set_name(iomemtype, "s5l8930.usb_phy");
+    vmstate_register(NULL, -1, &vmstate_s5l8930_usb_phy, _state);
 }
 
 static void unmapped_write(void *opaque, target_phys_addr_t offset,
@@ -1323,7 +1785,7 @@ static void unmapped_write(void *opaque, target_phys_addr_t offset,
 {
     char *name = (char *)opaque;
 
-    fprintf(stderr, "%s:%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, name, offset, value);
+    trace_s5l8930_unmapped_write(name, offset, value);
 }
 
 static void *s5l8930;
@@ -1337,7 +1799,7 @@ static uint32_t unmapped_read(void *opaque, target_phys_addr_t offset)
 {
     char *name = (char *)opaque;
 
-    fprintf(stderr, "%s:%s: offset 0x%08x\n", __FUNCTION__, name, offset);
+    trace_s5l8930_unmapped_read(name, offset);
 	if(offset == 0x110) {
 		triggerSDIO();
 	}
@@ -1363,6 +1825,7 @@ static void s5l8930_unmapped_hw_init(target_phys_addr_t base, int size, const ch
     int io;
     io = cpu_register_io_memory(unmapped_readfn, unmapped_writefn, (void *)name, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, size, io);
+    cpu_io_memory_set_name(io, name);
 }
 
 s5l8930_state *s5l8930_init(void)
@@ -1421,10 +1884,10 @@ s5l8930_state *s5l8930_init(void)
 	s5l8930_pmgr_init(S5L8930_PMGR_BASE);
 
 	/* GPIO */
-	s5l8930_gpio_init(S5L8930_GPIO_BASE);
+	s->gpio = s5l8930_gpio_init(S5L8930_GPIO_BASE, s5l8930_get_irq(s, S5L8930_GPIO_IRQ));
 
 	/* Uart */
-    s5l8900_uart_init(S5L8930_UART0_BASE, 0, 256, s5l8930_get_irq(s, S5L8930_UART0_IRQ), serial_hds[0]);
+    s5l8900_uart_init(S5L8930_UART0_BASE, 0, 0, s5l8930_get_irq(s, S5L8930_UART0_IRQ), serial_hds[0]);
 
     /* I2C 0 */
     dev = sysbus_create_simple("s5l8930.i2c", S5L8930_I2C0_BASE,
@@ -1457,9 +1920,10 @@ s5l8930_state *s5l8930_init(void)
 	s5l8930_misc_sys_init(S5L8900_MISCSYS_BASEADDR);
 
     /* SPI */
-    sysbus_create_simple("s5l8930.spi",
+    dev = sysbus_create_simple("s5l8930.spi",
                          S5L8930_SPI0_BASE,
                          s5l8930_get_irq(s, S5L8930_SPI0_IRQ));
+    s5l8930_spi_attach_cdma(dev, S5L8930_SPI0_BASE, s->cdma);
     s5l8930_set_spi_base(1);
     sysbus_create_simple("s5l8930.spi",
                          S5L8930_SPI1_BASE,
@@ -1481,8 +1945,8 @@ s5l8930_state *s5l8930_init(void)
 
 	/* H2FMI */
 
-	s5l8930_h2fmi0_register(S5L8930_H2FMI_BASE0, getH2FMI_IRQ_0());//s5l8930_get_irq(s, S5L8930_H2FMI_IRQ0));
-	s5l8930_h2fmi1_register(S5L8930_H2FMI_BASE1, getH2FMI_IRQ_1());//s5l8930_get_irq(s, S5L8930_H2FMI_IRQ1));
+	s5l8930_h2fmi0_register(S5L8930_H2FMI_BASE0, getH2FMI_IRQ_0(), s->cdma);//s5l8930_get_irq(s, S5L8930_H2FMI_IRQ0));
+	s5l8930_h2fmi1_register(S5L8930_H2FMI_BASE1, getH2FMI_IRQ_1(), s->cdma);//s5l8930_get_irq(s, S5L8930_H2FMI_IRQ1));
 
     /* USB-OTG */
     register_synopsys_usb(S5L8930_USB_OTG_BASE,
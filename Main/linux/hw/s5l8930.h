@@ -2,8 +2,6 @@
 #define S5L8900_H
 
 #include "qemu-timer.h"
-#include <openssl/sha.h>
-#include <openssl/aes.h>
 
 // These iPad values need to be removed in cleanup
 #define RAM_BASE_ADDR 0x40000000
@@ -44,6 +42,18 @@
 // GPIO
 #define S5L8930_GPIO_BASE 0xBFA00000
 #define S5L8930_GPIO_IRQ  0x74
+#define S5L8930_GPIO_PINS 256		// config words, 4 apart
+#define S5L8930_GPIO_IRQGROUPS 7	// all on S5L8930_GPIO_IRQ
+#define S5L8930_GPIO_INTSTAT 0x800	// + 0x40 * group + 4 * (pin / 32)
+#define S5L8930_GPIO_DATA (1 << 0)
+#define S5L8930_GPIO_MODE(x) (((x) >> 1) & 0x7)
+#define S5L8930_GPIO_MODE_OUT 1
+#define S5L8930_GPIO_MODE_IRQ_HI 2
+#define S5L8930_GPIO_MODE_IRQ_LO 3
+#define S5L8930_GPIO_MODE_IRQ_UP 4
+#define S5L8930_GPIO_MODE_IRQ_DN 5
+#define S5L8930_GPIO_MODE_IRQ_ANY 6
+#define S5L8930_GPIO_GROUP(x) (((x) >> 16) & 0x7)
 
 // USB
 #define S5L8930_USB_PHY_BASE 0x86000000
@@ -133,35 +143,11 @@ typedef enum AESKeyType {
 #define S5L8930_H2FMI_IRQ1  0x23
 
 
-// Debug stuff
-#define S5L8930_DLVL_ERR   (1)
-#define S5L8930_DLVL_WARN  (2)
-#define S5L8930_DLVL_INFO  (3)
-#define S5L8930_DLVL_INFO2 (4)
-
-extern uint32_t g_debug;
-extern uint32_t g_dlevel;
-extern FILE *g_debug_fp;
-
 #define S5L8930_OPAQUE(name, opaque) fprintf(stderr, name " is at %p\n", opaque)
 
-#define S5L8930_DEBUG_CLK  		(0x00000001)
-#define S5L8930_DEBUG_MIU  		(0x00000002)
-#define S5L8930_DEBUG_CHIPID 	(0x00000004)
-#define S5L8930_DEBUG_MISCSYS   (0x00000008)
-#define S5L8930_DEBUG_PMGR		(0x00000010)
-#define S5L8930_DEBUG_CDMA		(0x00000020)
-#define S5L8930_DEBUG_SHA1		(0x00000040)
-#define S5L8930_DEBUG_GPIO		(0x00000080)
-#define S5L8930_DEBUG_USBPHY	(0x00000100)
-
-#define S5L8930_DEBUG(module, level, msg ...)                              \
-    do {                                                                \
-    if ((module) & g_debug || (level) <= g_dlevel) {                \
-        fprintf(g_debug_fp, "%lld : ", qemu_get_clock_ms(vm_clock));    \
-            fprintf(g_debug_fp, msg);                                   \
-        }                                                               \
-    } while (0)
+/* Peripheral FIFO callback: moves up to len bytes between the FIFO and buf
+ * in one call and returns the number of bytes transferred. */
+typedef int (*s5l8930_cdma_fifo_fn)(void *opaque, uint8_t *buf, uint32_t len);
 
 typedef struct s5l8930_state_s {
     CPUState *env;
@@ -172,6 +158,8 @@ typedef struct s5l8930_state_s {
 	void *cdma;
 	/* Timer */
 	void *timer;
+	/* GPIO */
+	void *gpio;
 
 	/* PHY USB */
     uint32_t usb_ophypwr;
@@ -187,6 +175,7 @@ typedef struct s5l8930iop_state_s {
 } s5l8930iop_state_s;
 
 s5l8930_state *s5l8930_init(void);
+void s5l8930_gpio_set_input(void *opaque, int pin, int level);
 DeviceState *pcf50633_init(i2c_bus *bus, int addr);
 DeviceState *ipadchg_init(i2c_bus *bus, int addr);
 void s5l8930_iop_init(void *opaque);
@@ -194,10 +183,16 @@ void setTimerIRQ2(void *opaque, qemu_irq irq);
 DeviceState *s5l8900_uart_init(target_phys_addr_t base, int instance,
                                int queue_size, qemu_irq irq,
                                CharDriverState *chr);
+DeviceState *s5l8900_lcd_init(target_phys_addr_t base, uint32_t mmio_size,
+                              int width, int height, uint32_t fb_default);
 void do_aes_crypto(uint32_t *inBuf, uint32_t *outBuf, uint32_t size, uint32_t operation, void *opaque);
 void replaceCDMAIRQHandlers(void *opaque, qemu_irq dma5, qemu_irq dma6, qemu_irq dma7, qemu_irq dma8);
-DeviceState *s5l8930_h2fmi0_register(target_phys_addr_t base, qemu_irq irq);
-DeviceState *s5l8930_h2fmi1_register(target_phys_addr_t base, qemu_irq irq);
+void s5l8930_cdma_register_fifo(void *opaque, uint32_t addr,
+                                s5l8930_cdma_fifo_fn read,
+                                s5l8930_cdma_fifo_fn write, void *fifo_opaque);
+void s5l8930_spi_attach_cdma(DeviceState *dev, target_phys_addr_t base, void *cdma);
+DeviceState *s5l8930_h2fmi0_register(target_phys_addr_t base, qemu_irq irq, void *cdma);
+DeviceState *s5l8930_h2fmi1_register(target_phys_addr_t base, qemu_irq irq, void *cdma);
 
 void enableIOPH2fmi(void);
 
@@ -234,6 +229,14 @@ typedef struct segmentBuffer {
 } segmentBuffer;
 
 #define MAX_CDMA_CHAN 37
+#define MAX_CDMA_FIFO 8
+
+typedef struct s5l8930_cdma_fifo {
+    uint32_t addr;
+    s5l8930_cdma_fifo_fn read;
+    s5l8930_cdma_fifo_fn write;
+    void *opaque;
+} s5l8930_cdma_fifo;
 
 typedef struct s5l8930_cdma {
     uint32_t size[MAX_CDMA_CHAN];
@@ -245,12 +248,17 @@ typedef struct s5l8930_cdma {
 	uint32_t mstatus;
     uint8_t aesOperation;
     segmentBuffer *dmaSegment[MAX_CDMA_CHAN];
-    AES_KEY decryptKey;
+    uint8_t aesKey[32];
+    uint32_t aesKeyBits;
     uint8_t ivec[16];
     uint32_t custkey[8];
     uint32_t keyLen;
     uint8_t keyType;
 	qemu_irq irqs[MAX_CDMA_CHAN];
+    s5l8930_cdma_fifo fifo[MAX_CDMA_FIFO];
+    int nfifo;
+    uint8_t *dmaBuf;
+    uint32_t dmaBufSize;
 } s5l8930_cdma_s;
 
 #endif
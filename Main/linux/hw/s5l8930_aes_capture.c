@@ -0,0 +1,225 @@
+/*
+ * S5L8930 AES capture
+ *
+ * Buffers handed to the CDMA AES engine are copied into a ring buffer and
+ * written out as <dir>/{inbuf,key,outbuf}-<n>.img by a background thread, so
+ * the vCPU never waits on file I/O.  Records that do not fit in the ring are
+ * dropped rather than stalling the guest.
+ */
+
+#include <sys/stat.h>
+#include "hw.h"
+#include "qemu-thread.h"
+#include "s5l8930_aes_capture.h"
+
+#define AES_CAPTURE_RING_SIZE   (32 << 20)
+#define AES_CAPTURE_DEFAULT_DIR "/tmp/aes"
+
+typedef struct AESCaptureRecord {
+    uint32_t kind;
+    uint32_t seq;
+    uint32_t len;
+} AESCaptureRecord;
+
+static const char *aes_capture_names[] = {
+    [AES_CAPTURE_INBUF]  = "inbuf",
+    [AES_CAPTURE_KEY]    = "key",
+    [AES_CAPTURE_OUTBUF] = "outbuf",
+};
+
+int aes_capture_enabled;
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    int started;
+
+    uint8_t *ring;
+    /* Free-running byte counters, ring offset is (counter % size) */
+    uint64_t head;
+    uint64_t tail;
+
+    char dir[1024];
+
+    uint64_t records;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t errors;
+} cap;
+
+static void aes_capture_ring_put(uint64_t pos, const void *data, size_t len)
+{
+    size_t off = pos % AES_CAPTURE_RING_SIZE;
+    size_t first = MIN(len, AES_CAPTURE_RING_SIZE - off);
+
+    memcpy(cap.ring + off, data, first);
+    memcpy(cap.ring, (const uint8_t *)data + first, len - first);
+}
+
+static void aes_capture_ring_get(uint64_t pos, void *data, size_t len)
+{
+    size_t off = pos % AES_CAPTURE_RING_SIZE;
+    size_t first = MIN(len, AES_CAPTURE_RING_SIZE - off);
+
+    memcpy(data, cap.ring + off, first);
+    memcpy((uint8_t *)data + first, cap.ring, len - first);
+}
+
+static int aes_capture_write_file(const char *path, uint64_t pos, size_t len)
+{
+    size_t off = pos % AES_CAPTURE_RING_SIZE;
+    size_t first = MIN(len, AES_CAPTURE_RING_SIZE - off);
+    FILE *fp = fopen(path, "w");
+    int ret = 0;
+
+    if (!fp) {
+        return -1;
+    }
+    if (fwrite(cap.ring + off, 1, first, fp) != first ||
+        fwrite(cap.ring, 1, len - first, fp) != len - first) {
+        ret = -1;
+    }
+    if (fclose(fp)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void *aes_capture_thread(void *opaque)
+{
+    AESCaptureRecord rec;
+    char path[1100];
+    uint64_t pos;
+
+    qemu_mutex_lock(&cap.lock);
+    for (;;) {
+        while (cap.head == cap.tail) {
+            qemu_cond_wait(&cap.cond, &cap.lock);
+        }
+
+        aes_capture_ring_get(cap.tail, &rec, sizeof(rec));
+        snprintf(path, sizeof(path), "%s/%s-%u.img", cap.dir,
+                 aes_capture_names[rec.kind], rec.seq);
+        pos = cap.tail + sizeof(rec);
+
+        /* The producer only fills [head, tail + size), so the record stays
+         * put while we write it out unlocked. */
+        qemu_mutex_unlock(&cap.lock);
+        if (aes_capture_write_file(path, pos, rec.len)) {
+            fprintf(stderr, "aes_capture: failed to write %s\n", path);
+            qemu_mutex_lock(&cap.lock);
+            cap.errors++;
+        } else {
+            qemu_mutex_lock(&cap.lock);
+            cap.written++;
+        }
+        cap.tail += sizeof(rec) + rec.len;
+    }
+
+    return NULL;
+}
+
+/* Reserve room for a record and fill in its header.  Returns with the lock
+ * held and the payload position in *pos, or -1 (unlocked) if it is full. */
+static int aes_capture_reserve(int kind, uint32_t seq, uint32_t len,
+                               uint64_t *pos)
+{
+    AESCaptureRecord rec;
+
+    qemu_mutex_lock(&cap.lock);
+    if (sizeof(rec) + len > AES_CAPTURE_RING_SIZE - (cap.head - cap.tail)) {
+        cap.dropped++;
+        qemu_mutex_unlock(&cap.lock);
+        return -1;
+    }
+
+    rec.kind = kind;
+    rec.seq = seq;
+    rec.len = len;
+    aes_capture_ring_put(cap.head, &rec, sizeof(rec));
+    *pos = cap.head + sizeof(rec);
+    return 0;
+}
+
+static void aes_capture_commit(uint64_t pos, uint32_t len)
+{
+    cap.head = pos + len;
+    cap.records++;
+
+    qemu_cond_signal(&cap.cond);
+    qemu_mutex_unlock(&cap.lock);
+}
+
+void aes_capture_record(int kind, uint32_t seq, const void *data, uint32_t len)
+{
+    uint64_t pos;
+
+    if (!aes_capture_enabled || aes_capture_reserve(kind, seq, len, &pos)) {
+        return;
+    }
+
+    aes_capture_ring_put(pos, data, len);
+    aes_capture_commit(pos, len);
+}
+
+/* Copy straight from guest memory, for devices that work in place */
+void aes_capture_record_phys(int kind, uint32_t seq, target_phys_addr_t addr,
+                             uint32_t len)
+{
+    uint64_t pos;
+    size_t off, first;
+
+    if (!aes_capture_enabled || aes_capture_reserve(kind, seq, len, &pos)) {
+        return;
+    }
+
+    off = pos % AES_CAPTURE_RING_SIZE;
+    first = MIN(len, AES_CAPTURE_RING_SIZE - off);
+    cpu_physical_memory_read(addr, cap.ring + off, first);
+    cpu_physical_memory_read(addr + first, cap.ring, len - first);
+    aes_capture_commit(pos, len);
+}
+
+void aes_capture_set_enabled(bool enable, const char *dir)
+{
+    if (!cap.started) {
+        if (!enable) {
+            return;
+        }
+        qemu_mutex_init(&cap.lock);
+        qemu_cond_init(&cap.cond);
+        cap.ring = qemu_malloc(AES_CAPTURE_RING_SIZE);
+        pstrcpy(cap.dir, sizeof(cap.dir), AES_CAPTURE_DEFAULT_DIR);
+        qemu_thread_create(&cap.thread, aes_capture_thread, NULL);
+        cap.started = 1;
+    }
+
+    qemu_mutex_lock(&cap.lock);
+    if (dir) {
+        pstrcpy(cap.dir, sizeof(cap.dir), dir);
+    }
+    if (enable) {
+        mkdir(cap.dir, 0755);
+    }
+    aes_capture_enabled = enable;
+    qemu_mutex_unlock(&cap.lock);
+}
+
+void aes_capture_print_status(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!cap.started) {
+        cpu_fprintf(f, "AES capture off.\n");
+        return;
+    }
+
+    qemu_mutex_lock(&cap.lock);
+    cpu_fprintf(f, "AES capture %s, directory \"%s\".\n",
+                aes_capture_enabled ? "on" : "off", cap.dir);
+    cpu_fprintf(f, "  records %" PRIu64 " written %" PRIu64
+                " dropped %" PRIu64 " errors %" PRIu64 "\n",
+                cap.records, cap.written, cap.dropped, cap.errors);
+    cpu_fprintf(f, "  queued %" PRIu64 " of %d bytes\n",
+                cap.head - cap.tail, AES_CAPTURE_RING_SIZE);
+    qemu_mutex_unlock(&cap.lock);
+}
@@ -0,0 +1,21 @@
+#ifndef S5L8930_AES_CAPTURE_H
+#define S5L8930_AES_CAPTURE_H
+
+#include "hw.h"
+
+enum {
+    AES_CAPTURE_INBUF,
+    AES_CAPTURE_KEY,
+    AES_CAPTURE_OUTBUF,
+};
+
+/* Checked by the AES path before doing any capture work */
+extern int aes_capture_enabled;
+
+void aes_capture_record(int kind, uint32_t seq, const void *data, uint32_t len);
+void aes_capture_record_phys(int kind, uint32_t seq, target_phys_addr_t addr,
+                             uint32_t len);
+void aes_capture_set_enabled(bool enable, const char *dir);
+void aes_capture_print_status(FILE *f, fprintf_function cpu_fprintf);
+
+#endif
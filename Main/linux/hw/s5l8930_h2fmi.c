@@ -10,7 +10,16 @@
 #include "s5l8930.h"
 #include "block.h"
 #include "block_int.h"
+#include "trace.h"
+#include "sysemu.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "s5l8930_h2fmi.h"
 #include <strings.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 
 #define DNAND(x) x
 
@@ -115,7 +124,7 @@ static int h2fmi_buffer_read(struct h2fmi_buffer *_buf, void *_ptr, size_t _sz)
 		amt = _sz;
 
 	memcpy(_ptr, _buf->ptr + _buf->read, amt);
-	_buf->read += _sz;
+	_buf->read += amt;
 	return amt;
 }
 
@@ -173,11 +182,80 @@ static void *h2fmi_buffer_map(struct h2fmi_buffer *_buf, size_t _sz)
 	return ptr;
 }
 
+/* Raw page records (marker, data, meta) kept per CE, least recently used
+ * entry is replaced on a miss. */
+struct h2fmi_cache_entry
+{
+	uint32_t addr;
+	int valid;
+	uint64_t stamp;
+	uint8_t *rec;
+};
+
+struct h2fmi_page_cache
+{
+	struct h2fmi_cache_entry *entries;
+	uint64_t clock;
+	uint64_t hits, misses;
+};
+
+/* A chip backed by a mapped sparse image instead of a BlockDriverState */
+struct h2fmi_image
+{
+	int fd;
+	uint8_t *map;
+	size_t size;
+	int writable;
+	h2fmi_image_header hdr;
+	uint8_t *bitmap;
+	uint8_t *meta;
+	uint8_t *data;
+};
+
+/* Page programs and erases on packed images are queued and applied by a
+ * worker thread through a private descriptor, so the vCPU never waits on
+ * the host disk.  Reads look at the queue first. */
+#define H2FMI_WB_DEPTH 256
+
+enum
+{
+	H2FMI_WB_PROGRAM,
+	H2FMI_WB_ERASE,
+};
+
+struct h2fmi_wb_op
+{
+	int type;
+	int ce;
+	uint32_t addr;
+	uint32_t count;
+	uint8_t *rec;
+	QTAILQ_ENTRY(h2fmi_wb_op) next;
+};
+
+struct h2fmi_writeback
+{
+	QemuThread thread;
+	QemuMutex lock;
+	QemuCond cond;
+	int started;
+
+	QTAILQ_HEAD(h2fmi_wb_queue, h2fmi_wb_op) queue;
+	int depth;
+	int fd[H2FMI_MAX_CHIPS];
+	uint32_t dirty;
+
+	uint64_t programs, erases;
+};
+
 typedef struct
 {
     SysBusDevice busdev;
     qemu_irq irq;
 	BlockDriverState ce[H2FMI_MAX_CHIPS];
+	struct h2fmi_image *image[H2FMI_MAX_CHIPS];
+	struct h2fmi_writeback wb;
+	Notifier exit_notifier;
 	int bitmap;
 
 	char *ce_paths;
@@ -192,6 +270,7 @@ typedef struct
 
     uint32_t nsts, csts, ests;
 	uint32_t nstatus;
+	uint32_t erase_pending;		// 60h seen, waiting for D0h
 
 	uint16_t ncmd;
 	uint8_t ccmd;
@@ -201,8 +280,21 @@ typedef struct
 	struct h2fmi_buffer buf0;
 	struct h2fmi_buffer buf1;
 	struct h2fmi_buffer eccbuf;
+
+	uint32_t cache_pages;
+	uint32_t block_pages;
+	struct h2fmi_page_cache cache[H2FMI_MAX_CHIPS];
+	uint8_t *page_rec;
+	uint64_t reads;
+	uint64_t bytes_read;
+
+	uint32_t iop_enabled;
 } h2fmi_state_t;
 
+#define H2FMI_MAX_DEVICES 2
+
+static h2fmi_state_t *h2fmi_devices[H2FMI_MAX_DEVICES];
+
 static inline uint8_t h2fmi_active_chip(h2fmi_state_t *_state)
 {
 	//fprintf(stderr, "%s: active chip ptr %p fmt %d\n", __FUNCTION__, _state, _state->fmtn);
@@ -226,13 +318,164 @@ static inline int64_t h2fmi_page_offset(h2fmi_state_t *_state, int _addr)
 	return H2FMI_CHIPID_LENGTH + _addr*(1ull + _state->page_size + _state->meta_size);
 }
 
+/* Marker byte, page data and the meta bytes the controller returns */
+static inline size_t h2fmi_record_size(h2fmi_state_t *_state)
+{
+	return 1 + _state->page_size + _state->meta_size - 2;
+}
+
+static void h2fmi_cache_flush(h2fmi_state_t *_h2fmi, int _ce)
+{
+	struct h2fmi_page_cache *cache = &_h2fmi->cache[_ce];
+	uint32_t i;
+
+	if(!cache->entries)
+		return;
+
+	for(i = 0; i < _h2fmi->cache_pages; i++)
+		cache->entries[i].valid = 0;
+}
+
+static void h2fmi_cache_invalidate(h2fmi_state_t *_h2fmi, int _ce, uint32_t _addr, uint32_t _count)
+{
+	struct h2fmi_page_cache *cache = &_h2fmi->cache[_ce];
+	uint32_t i;
+
+	if(!cache->entries)
+		return;
+
+	for(i = 0; i < _h2fmi->cache_pages; i++)
+	{
+		if(cache->entries[i].addr - _addr < _count)
+			cache->entries[i].valid = 0;
+	}
+}
+
+/* Newest queued state of a page: copies the record and returns 1 if a
+ * program is pending, returns 0 for a pending erase, -1 if nothing is
+ * queued.  Anything no longer queued has already reached the file. */
+static int h2fmi_wb_lookup(h2fmi_state_t *_h2fmi, int _ce, uint32_t _addr, uint8_t *_rec)
+{
+	struct h2fmi_writeback *wb = &_h2fmi->wb;
+	struct h2fmi_wb_op *op;
+	int ret = -1;
+
+	if(!wb->started || wb->fd[_ce] < 0)
+		return -1;
+
+	qemu_mutex_lock(&wb->lock);
+	QTAILQ_FOREACH_REVERSE(op, &wb->queue, h2fmi_wb_queue, next)
+	{
+		if(op->ce != _ce || _addr - op->addr >= op->count)
+			continue;
+
+		if(op->type == H2FMI_WB_PROGRAM)
+		{
+			memcpy(_rec, op->rec, h2fmi_record_size(_h2fmi));
+			ret = 1;
+		}
+		else
+			ret = 0;
+		break;
+	}
+	qemu_mutex_unlock(&wb->lock);
+
+	return ret;
+}
+
+/* Fetch the raw record for a page with a single image read, through the
+ * per-CE cache.  Returns NULL if the image could not be read. */
+static uint8_t *h2fmi_read_record(h2fmi_state_t *_h2fmi, int _ce, uint32_t _addr, int *_ret)
+{
+	struct h2fmi_page_cache *cache = &_h2fmi->cache[_ce];
+	struct h2fmi_cache_entry *e, *victim = NULL;
+	size_t len = h2fmi_record_size(_h2fmi);
+	uint8_t *rec;
+	uint32_t i;
+	int ret;
+
+	_h2fmi->reads++;
+
+	if(_h2fmi->cache_pages)
+	{
+		if(!cache->entries)
+			cache->entries = qemu_mallocz(_h2fmi->cache_pages * sizeof(*cache->entries));
+
+		for(i = 0; i < _h2fmi->cache_pages; i++)
+		{
+			e = &cache->entries[i];
+			if(e->valid && e->addr == _addr)
+			{
+				e->stamp = ++cache->clock;
+				cache->hits++;
+				trace_h2fmi_read_page(_h2fmi->fmtn, _ce, _addr, 1);
+				*_ret = len;
+				return e->rec;
+			}
+
+			if(!victim || !e->valid || (victim->valid && e->stamp < victim->stamp))
+				victim = e;
+		}
+
+		if(!victim->rec)
+			victim->rec = qemu_malloc(len);
+		victim->valid = 0;
+		rec = victim->rec;
+	}
+	else
+	{
+		if(!_h2fmi->page_rec)
+			_h2fmi->page_rec = qemu_malloc(len);
+		rec = _h2fmi->page_rec;
+	}
+
+	cache->misses++;
+	trace_h2fmi_read_page(_h2fmi->fmtn, _ce, _addr, 0);
+
+	switch(h2fmi_wb_lookup(_h2fmi, _ce, _addr, rec))
+	{
+	case 0:
+		memset(rec, 0, len);
+		/* fall through */
+	case 1:
+		ret = len;
+		break;
+
+	default:
+		ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _addr), rec, len);
+		if(ret <= 0)
+		{
+			*_ret = ret;
+			return NULL;
+		}
+
+		_h2fmi->bytes_read += ret;
+		if(ret < len)
+			memset(rec + ret, 0, len - ret);
+		break;
+	}
+	*_ret = ret;
+
+	if(victim)
+	{
+		victim->addr = _addr;
+		victim->stamp = ++cache->clock;
+		victim->valid = 1;
+	}
+
+	return rec;
+}
+
 /* Flash CMDS */
 #define NAND_CMD_READID		0x90
 #define NAND_CMD_READ0		0x00
 #define NAND_CMD_READSTART	0x30
 #define NAND_CMD_ERASE		0x60
+#define NAND_CMD_ERASE2		0xD0
+#define NAND_CMD_SEQIN		0x80
 #define NAND_CMD_WRITE0		0x10
 #define NAND_CMD_WRITE1		0x11
+#define NAND_CMD_PAGEPROG	NAND_CMD_WRITE0
 
 /* Base h2fmi */
 #define H2FMI_CBASE			(0x0)
@@ -269,10 +512,244 @@ static inline int64_t h2fmi_page_offset(h2fmi_state_t *_state, int _addr)
 #define H2FMI_ECCSTS		(0x10)
 #define H2FMI_ECCINT		(0x14)
 
+static inline int h2fmi_image_programmed(struct h2fmi_image *_img, uint32_t _addr)
+{
+	return _addr < _img->hdr.page_count && (_img->bitmap[_addr >> 3] & (1 << (_addr & 7)));
+}
+
+static void h2fmi_image_close(struct h2fmi_image *_img)
+{
+	munmap(_img->map, _img->size);
+	close(_img->fd);
+	qemu_free(_img);
+}
+
+/* Map _file if it is a sparse image.  Returns 0 once mapped, 1 if the file
+ * is in some other format, or a negative errno. */
+static int h2fmi_image_open(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
+{
+	struct h2fmi_image *img;
+	h2fmi_image_header hdr;
+	struct stat st;
+	uint64_t size;
+	void *map;
+	int fd, writable = 1;
+
+	fd = open(_file, O_RDWR | O_BINARY);
+	if(fd < 0)
+	{
+		writable = 0;
+		fd = open(_file, O_RDONLY | O_BINARY);
+		if(fd < 0)
+			return 1;
+	}
+
+	if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+			|| memcmp(hdr.magic, H2FMI_IMAGE_MAGIC, sizeof(hdr.magic)))
+	{
+		close(fd);
+		return 1;
+	}
+
+	le32_to_cpus(&hdr.version);
+	le32_to_cpus(&hdr.page_size);
+	le32_to_cpus(&hdr.meta_size);
+	le32_to_cpus(&hdr.page_count);
+	le64_to_cpus(&hdr.bitmap_offset);
+	le64_to_cpus(&hdr.meta_offset);
+	le64_to_cpus(&hdr.data_offset);
+
+	if(fstat(fd, &st) < 0)
+		goto invalid;
+	size = st.st_size;
+
+	if(hdr.version != H2FMI_IMAGE_VERSION
+			|| hdr.page_size != _h2fmi->page_size || hdr.meta_size != _h2fmi->meta_size
+			|| hdr.bitmap_offset + (hdr.page_count + 7) / 8 > size
+			|| hdr.meta_offset + (uint64_t)hdr.page_count * hdr.meta_size > size
+			|| hdr.data_offset + (uint64_t)hdr.page_count * hdr.page_size > size)
+	{
+		fprintf(stderr, "%s: %s: bad image header or geometry\n", __FUNCTION__, _file);
+		goto invalid;
+	}
+
+	map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s: mmap failed: %s\n", __FUNCTION__, _file, strerror(errno));
+		goto invalid;
+	}
+
+	img = qemu_mallocz(sizeof(*img));
+	img->fd = fd;
+	img->map = map;
+	img->size = size;
+	img->writable = writable;
+	img->hdr = hdr;
+	img->bitmap = img->map + hdr.bitmap_offset;
+	img->meta = img->map + hdr.meta_offset;
+	img->data = img->map + hdr.data_offset;
+	_h2fmi->image[_ce] = img;
+	return 0;
+
+invalid:
+	close(fd);
+	return -EINVAL;
+}
+
+static void h2fmi_wb_apply(h2fmi_state_t *_h2fmi, struct h2fmi_wb_op *_op)
+{
+	int fd = _h2fmi->wb.fd[_op->ce];
+	uint8_t empty = 0;
+	uint32_t i;
+
+	switch(_op->type)
+	{
+	case H2FMI_WB_PROGRAM:
+		if(pwrite(fd, _op->rec, h2fmi_record_size(_h2fmi), h2fmi_page_offset(_h2fmi, _op->addr)) < 0)
+			fprintf(stderr, "%s: ce %d page %d: %s\n", __FUNCTION__, _op->ce, _op->addr, strerror(errno));
+		break;
+
+	case H2FMI_WB_ERASE:
+		for(i = 0; i < _op->count; i++)
+		{
+			if(pwrite(fd, &empty, 1, h2fmi_page_offset(_h2fmi, _op->addr + i)) < 0)
+			{
+				fprintf(stderr, "%s: ce %d page %d: %s\n", __FUNCTION__, _op->ce, _op->addr + i, strerror(errno));
+				break;
+			}
+		}
+		break;
+	}
+}
+
+static void *h2fmi_wb_thread(void *_opaque)
+{
+	h2fmi_state_t *h2fmi = _opaque;
+	struct h2fmi_writeback *wb = &h2fmi->wb;
+	struct h2fmi_wb_op *op;
+	uint32_t dirty;
+	int ce;
+
+	qemu_mutex_lock(&wb->lock);
+	for(;;)
+	{
+		if(QTAILQ_EMPTY(&wb->queue))
+		{
+			/* Sync once the queue has drained, off the vCPU thread */
+			dirty = wb->dirty;
+			wb->dirty = 0;
+			qemu_mutex_unlock(&wb->lock);
+			for(ce = 0; ce < H2FMI_MAX_CHIPS; ce++)
+			{
+				if((dirty & (1 << ce)) && wb->fd[ce] >= 0)
+					qemu_fdatasync(wb->fd[ce]);
+			}
+			qemu_mutex_lock(&wb->lock);
+
+			while(QTAILQ_EMPTY(&wb->queue))
+				qemu_cond_wait(&wb->cond, &wb->lock);
+		}
+
+		op = QTAILQ_FIRST(&wb->queue);
+		qemu_mutex_unlock(&wb->lock);
+
+		h2fmi_wb_apply(h2fmi, op);
+
+		qemu_mutex_lock(&wb->lock);
+		QTAILQ_REMOVE(&wb->queue, op, next);
+		wb->depth--;
+		wb->dirty |= 1 << op->ce;
+		qemu_cond_broadcast(&wb->cond);
+		qemu_free(op->rec);
+		qemu_free(op);
+	}
+
+	return NULL;
+}
+
+static void h2fmi_wb_submit(h2fmi_state_t *_h2fmi, struct h2fmi_wb_op *_op)
+{
+	struct h2fmi_writeback *wb = &_h2fmi->wb;
+
+	qemu_mutex_lock(&wb->lock);
+	while(wb->depth >= H2FMI_WB_DEPTH)
+		qemu_cond_wait(&wb->cond, &wb->lock);
+
+	QTAILQ_INSERT_TAIL(&wb->queue, _op, next);
+	wb->depth++;
+	qemu_cond_broadcast(&wb->cond);
+	qemu_mutex_unlock(&wb->lock);
+}
+
+static void h2fmi_wb_drain(h2fmi_state_t *_h2fmi)
+{
+	struct h2fmi_writeback *wb = &_h2fmi->wb;
+
+	if(!wb->started)
+		return;
+
+	qemu_mutex_lock(&wb->lock);
+	while(wb->depth)
+		qemu_cond_wait(&wb->cond, &wb->lock);
+	qemu_mutex_unlock(&wb->lock);
+}
+
+static void h2fmi_exit_notify(Notifier *_notifier)
+{
+	h2fmi_state_t *h2fmi = container_of(_notifier, h2fmi_state_t, exit_notifier);
+	int ce;
+
+	h2fmi_wb_drain(h2fmi);
+
+	for(ce = 0; ce < H2FMI_MAX_CHIPS; ce++)
+	{
+		if(h2fmi->wb.fd[ce] >= 0)
+			qemu_fdatasync(h2fmi->wb.fd[ce]);
+		if(h2fmi->image[ce])
+			msync(h2fmi->image[ce]->map, h2fmi->image[ce]->size, MS_SYNC);
+	}
+}
+
+/* Give a packed raw image its own descriptor for the write-back worker */
+static void h2fmi_wb_attach(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
+{
+	struct h2fmi_writeback *wb = &_h2fmi->wb;
+	BlockDriverState *bs = &_h2fmi->ce[_ce];
+
+	if(!bs->drv || strcmp(bs->drv->format_name, "raw") || bdrv_is_read_only(bs))
+		return;
+
+	wb->fd[_ce] = open(_file, O_RDWR | O_BINARY);
+	if(wb->fd[_ce] < 0)
+		return;
+
+	if(!wb->started)
+	{
+		qemu_mutex_init(&wb->lock);
+		qemu_cond_init(&wb->cond);
+		qemu_thread_create(&wb->thread, h2fmi_wb_thread, _h2fmi);
+		wb->started = 1;
+	}
+}
+
+static void h2fmi_wb_detach(h2fmi_state_t *_h2fmi, int _ce)
+{
+	struct h2fmi_writeback *wb = &_h2fmi->wb;
+
+	if(wb->fd[_ce] < 0)
+		return;
+
+	h2fmi_wb_drain(_h2fmi);
+	qemu_fdatasync(wb->fd[_ce]);
+	close(wb->fd[_ce]);
+	wb->fd[_ce] = -1;
+}
+
 static int h2fmi_add_chip(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
 {
 	int ret;
-	if(_ce > H2FMI_MAX_CHIPS)
+	if(_ce >= H2FMI_MAX_CHIPS)
 	{
 		//fprintf(stderr, "invalid CE %d.\n", _ce);
 		return -EINVAL;
@@ -280,15 +757,35 @@ static int h2fmi_add_chip(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
 
 	if(_h2fmi->bitmap & (1 << _ce))
 	{
-		bdrv_close(&_h2fmi->ce[_ce]);
+		if(_h2fmi->image[_ce])
+		{
+			h2fmi_image_close(_h2fmi->image[_ce]);
+			_h2fmi->image[_ce] = NULL;
+		}
+		else
+		{
+			h2fmi_wb_detach(_h2fmi, _ce);
+			bdrv_close(&_h2fmi->ce[_ce]);
+		}
 		_h2fmi->bitmap &=~ (1 << _ce);
+		h2fmi_cache_flush(_h2fmi, _ce);
+	}
+
+	ret = h2fmi_image_open(_h2fmi, _ce, _file);
+	if(ret <= 0)
+	{
+		if(!ret)
+			_h2fmi->bitmap |= (1 << _ce);
+		return ret;
 	}
 
 	//fprintf(stderr, "FILE: %s\n", _file);
-	ret = bdrv_open(&_h2fmi->ce[_ce], _file, BDRV_O_RDWR, NULL);
+	ret = bdrv_open(&_h2fmi->ce[_ce], _file, BDRV_O_RDWR | BDRV_O_CACHE_WB, NULL);
 	if(ret)
 		return ret;
 
+	h2fmi_wb_attach(_h2fmi, _ce, _file);
+
 	//fprintf(stderr, "added h2fmi ce%d, %s.\n", _ce, _file);
 	_h2fmi->bitmap |= (1 << _ce);
 	return 0;
@@ -353,7 +850,15 @@ void enableIOPH2fmi(void) {
 static int h2fmi_do_readid(h2fmi_state_t *_h2fmi, int _ce)
 {
 	void *data = h2fmi_buffer_map(&_h2fmi->buf0, H2FMI_CHIPID_LENGTH);
-	int ret = bdrv_pread(&_h2fmi->ce[_ce], 0, // h2fmi_id_offset(_h2fmi, _h2fmi->addr),
+	int ret;
+
+	if(_h2fmi->image[_ce])
+	{
+		memcpy(data, _h2fmi->image[_ce]->hdr.chip_id, H2FMI_CHIPID_LENGTH);
+		return H2FMI_CHIPID_LENGTH;
+	}
+
+	ret = bdrv_pread(&_h2fmi->ce[_ce], 0, // h2fmi_id_offset(_h2fmi, _h2fmi->addr),
 			data, H2FMI_CHIPID_LENGTH);
 	//fprintf(stderr, "%s: data 0x%08x ret: %d ptr %p fmt %d offset 0x%08x\n", __FUNCTION__, *(uint32_t *)data, ret, _h2fmi, _h2fmi->fmtn,  h2fmi_id_offset(_h2fmi, _h2fmi->addr));
 	if(ret <= 0)
@@ -363,14 +868,148 @@ static int h2fmi_do_readid(h2fmi_state_t *_h2fmi, int _ce)
 
 static int h2fmi_do_erase(h2fmi_state_t *_h2fmi, int _ce)
 {
+	struct h2fmi_image *img = _h2fmi->image[_ce];
+	uint32_t first = _h2fmi->addr - (_h2fmi->addr % _h2fmi->block_pages);
+	uint32_t count = _h2fmi->block_pages;
+	struct h2fmi_wb_op *op;
+	uint8_t empty = 0;
+	uint32_t i;
+	int ret = 0;
+
+	trace_h2fmi_erase(_h2fmi->fmtn, _ce, first, count);
+	_h2fmi->wb.erases++;
+
+	if(img)
+	{
+		if(!img->writable)
+			return -EROFS;
+
+		for(i = first; i < first + count && i < img->hdr.page_count; i++)
+			img->bitmap[i >> 3] &= ~(1 << (i & 7));
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+		/* Hand the erased data back to the host filesystem */
+		if(first < img->hdr.page_count)
+		{
+			count = MIN(count, img->hdr.page_count - first);
+			fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					img->hdr.data_offset + (uint64_t)first * _h2fmi->page_size,
+					(uint64_t)count * _h2fmi->page_size);
+		}
+#endif
+	}
+	else
+	{
+		h2fmi_cache_invalidate(_h2fmi, _ce, first, count);
+
+		if(_h2fmi->wb.fd[_ce] >= 0)
+		{
+			op = qemu_mallocz(sizeof(*op));
+			op->type = H2FMI_WB_ERASE;
+			op->ce = _ce;
+			op->addr = first;
+			op->count = count;
+			h2fmi_wb_submit(_h2fmi, op);
+		}
+		else
+		{
+			for(i = first; i < first + count && ret >= 0; i++)
+				ret = bdrv_pwrite(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, i), &empty, 1);
+		}
+	}
 
-    //int bdrv_pwrite(BlockDriverState *bs, int64_t offset, const void *buf, int count1)
-	int buf = '1';
-	int ret = 1;
-	//int ret = bdrv_pwrite(&_h2fmi->ce[_ce], offset, 1);
-	fprintf(stderr, "%s: returned %d for address 0x%08x on ce %d\n", __FUNCTION__, ret, _h2fmi->addr, _ce);
 	if(ret < 0)
+	{
+		fprintf(stderr, "%s: returned %d for address 0x%08x on ce %d\n", __FUNCTION__, ret, _h2fmi->addr, _ce);
 		return ret;
+	}
+	_h2fmi->nstatus = 0x80;
+
+	return 0;
+}
+
+/* Program the page at addr from what the guest pushed into the data and
+ * meta FIFOs. */
+static int h2fmi_do_program(h2fmi_state_t *_h2fmi, int _ce)
+{
+	struct h2fmi_image *img = _h2fmi->image[_ce];
+	size_t meta_len = _h2fmi->meta_size - 2;
+	size_t len = h2fmi_record_size(_h2fmi);
+	uint32_t addr = _h2fmi->addr;
+	struct h2fmi_wb_op *op;
+	uint32_t words[3];
+	uint8_t *rec;
+	size_t n;
+	int i, ret = 0;
+
+	trace_h2fmi_program(_h2fmi->fmtn, _ce, addr);
+	_h2fmi->wb.programs++;
+
+	/* Marker, data and meta laid out as in the packed image; anything the
+	 * guest did not supply reads back as erased. */
+	rec = qemu_malloc(len);
+	rec[0] = '1';
+	memset(rec + 1, 0xff, len - 1);
+
+	n = MIN(_h2fmi->buf0.written, _h2fmi->page_size);
+	if(_h2fmi->buf0.ptr)
+		memcpy(rec + 1, _h2fmi->buf0.ptr, n);
+	n = MIN(_h2fmi->buf1.written, meta_len);
+	if(_h2fmi->buf1.ptr)
+		memcpy(rec + 1 + _h2fmi->page_size, _h2fmi->buf1.ptr, n);
+
+	/* Whitening is its own inverse */
+	n = MIN(sizeof(words), meta_len);
+	memset(words, 0, sizeof(words));
+	memcpy(words, rec + 1 + _h2fmi->page_size, n);
+	for(i = 0; i < 3; i++)
+		words[i] ^= h2fmi_hash_table[(i + addr) % ARRAY_SIZE(h2fmi_hash_table)];
+	memcpy(rec + 1 + _h2fmi->page_size, words, n);
+
+	h2fmi_buffer_clear(&_h2fmi->buf0);
+	h2fmi_buffer_clear(&_h2fmi->buf1);
+
+	if(img)
+	{
+		if(!img->writable || addr >= img->hdr.page_count)
+		{
+			ret = -EINVAL;
+		}
+		else
+		{
+			memcpy(img->data + (uint64_t)addr * _h2fmi->page_size, rec + 1, _h2fmi->page_size);
+			memset(img->meta + (uint64_t)addr * _h2fmi->meta_size, 0, _h2fmi->meta_size);
+			memcpy(img->meta + (uint64_t)addr * _h2fmi->meta_size, rec + 1 + _h2fmi->page_size, meta_len);
+			img->bitmap[addr >> 3] |= 1 << (addr & 7);
+		}
+		qemu_free(rec);
+	}
+	else
+	{
+		h2fmi_cache_invalidate(_h2fmi, _ce, addr, 1);
+
+		if(_h2fmi->wb.fd[_ce] >= 0)
+		{
+			op = qemu_mallocz(sizeof(*op));
+			op->type = H2FMI_WB_PROGRAM;
+			op->ce = _ce;
+			op->addr = addr;
+			op->count = 1;
+			op->rec = rec;
+			h2fmi_wb_submit(_h2fmi, op);
+		}
+		else
+		{
+			ret = bdrv_pwrite(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, addr), rec, len);
+			qemu_free(rec);
+		}
+	}
+
+	if(ret < 0)
+	{
+		fprintf(stderr, "%s: returned %d for address 0x%08x on ce %d\n", __FUNCTION__, ret, addr, _ce);
+		return ret;
+	}
 	_h2fmi->nstatus = 0x80;
 
 	return 0;
@@ -379,25 +1018,48 @@ static int h2fmi_do_erase(h2fmi_state_t *_h2fmi, int _ce)
 static int h2fmi_do_read(h2fmi_state_t *_h2fmi, int _ce)
 {
 	uint32_t err = 4; // 0xFE is empty
-	int i;
-	uint8_t marker;
+	int i, ret;
+	struct h2fmi_image *img = _h2fmi->image[_ce];
+	uint8_t *rec, *src_data, *src_meta;
 	void *data, *meta;
-	int ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr),
-			&marker, 1);
+	uint32_t words[3];
+	size_t len;
 
-	fprintf(stderr, "%s: returned %d for address 0x%08x and page offset %llx on ce %d fmt %d\n", __FUNCTION__, ret, _h2fmi->addr, h2fmi_page_offset(_h2fmi, _h2fmi->addr), _ce, _h2fmi->fmtn);
-	if(ret <= 0)
+	if(img)
 	{
-		fprintf(stderr, "%s: failed to read page marker for %d.\n",__FUNCTION__, _h2fmi->addr);
-		goto done;
-	}
+		/* Mapped image, nothing to read */
+		_h2fmi->reads++;
+		trace_h2fmi_read_page(_h2fmi->fmtn, _ce, _h2fmi->addr, 1);
+		ret = 1;
+
+		if(!h2fmi_image_programmed(img, _h2fmi->addr))
+		{
+			err = 0xa;
+			goto done;
+		}
 
-	if(!marker || marker == '0')
+		src_data = img->data + (uint64_t)_h2fmi->addr * _h2fmi->page_size;
+		src_meta = img->meta + (uint64_t)_h2fmi->addr * _h2fmi->meta_size;
+	}
+	else
 	{
-		// empty
-		//err = 0x2;
-		err = 0xa;
-		goto done;
+		rec = h2fmi_read_record(_h2fmi, _ce, _h2fmi->addr, &ret);
+		if(!rec)
+		{
+			fprintf(stderr, "%s: failed to read page %d on ce %d, ret %d.\n", __FUNCTION__, _h2fmi->addr, _ce, ret);
+			goto done;
+		}
+
+		if(!rec[0] || rec[0] == '0')
+		{
+			// empty
+			//err = 0x2;
+			err = 0xa;
+			goto done;
+		}
+
+		src_data = rec + 1;
+		src_meta = rec + 1 + _h2fmi->page_size;
 	}
 
 	data = h2fmi_buffer_map(&_h2fmi->buf0, _h2fmi->page_size);
@@ -408,31 +1070,18 @@ static int h2fmi_do_read(h2fmi_state_t *_h2fmi, int _ce)
 		goto done;
 	}
 
-	ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr) + 1,
-			data, _h2fmi->page_size);
-	if(ret <= 0)
-	{
-		fprintf(stderr, "%s: failed to read page ret %d.\n", __FUNCTION__, ret);
-		goto done;
-	}
-
-	ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr)
-			+ 1 + _h2fmi->page_size, meta, _h2fmi->meta_size-2);
-	if(ret <= 0)
-	{
-		fprintf(stderr, "%s: failed to read meta. ret: %d\n", __FUNCTION__, ret);
-		goto done;
-	}
-
-    fprintf(stderr, "%02x %02x %02x %02x  %02x %02x %02x %02x  %02x %02x %02x %02x.\n", ((uint8_t*)meta)[0], ((uint8_t*)meta)[1], ((uint8_t*)meta)[2], ((uint8_t*)meta)[3],
-        ((uint8_t*)meta)[4], ((uint8_t*)meta)[5], ((uint8_t*)meta)[6], ((uint8_t*)meta)[7], ((uint8_t*)meta)[8], ((uint8_t*)meta)[9], ((uint8_t*)meta)[10], ((uint8_t*)meta)[11]);
+	memcpy(data, src_data, _h2fmi->page_size);
+	memcpy(meta, src_meta, _h2fmi->meta_size-2);
 
+	/* Only the first three words of the meta are whitened */
+	len = MIN(sizeof(words), _h2fmi->meta_size-2);
+	memset(words, 0, sizeof(words));
+	memcpy(words, meta, len);
    	for(i = 0; i < 3; i++)
-   		((uint32_t*)meta)[i] ^= h2fmi_hash_table[(i + _h2fmi->addr) % ARRAY_SIZE(h2fmi_hash_table)];
-
-    fprintf(stderr, "%02x %02x %02x %02x  %02x %02x %02x %02x  %02x %02x %02x %02x.\n", ((uint8_t*)meta)[0], ((uint8_t*)meta)[1], ((uint8_t*)meta)[2], ((uint8_t*)meta)[3],
-        ((uint8_t*)meta)[4], ((uint8_t*)meta)[5], ((uint8_t*)meta)[6], ((uint8_t*)meta)[7], ((uint8_t*)meta)[8], ((uint8_t*)meta)[9], ((uint8_t*)meta)[10], ((uint8_t*)meta)[11]);
+   		words[i] ^= h2fmi_hash_table[(i + _h2fmi->addr) % ARRAY_SIZE(h2fmi_hash_table)];
+	memcpy(meta, words, len);
 
+	trace_h2fmi_read_meta(_h2fmi->addr, words[0], words[1], words[2]);
 
 	err = 0;
 done:
@@ -446,17 +1095,15 @@ static void h2fmi_do_single_ncmd(h2fmi_state_t *_h2fmi, uint8_t _cmd)
 {
 	int ce = h2fmi_active_chip(_h2fmi);
 
-	fprintf(stderr, "got active chip %d\n", ce);
 	if(ce < 0 || ce >= H2FMI_MAX_CHIPS || !(_h2fmi->bitmap & (1 << ce))) {
 		fprintf(stderr, "error with chip id %d\n", ce);
 		return;
 	}
 
-	fprintf(stderr, "%s: ce 0x%08x - _h2fmi->bitmap 0x%08x fmt %d cmd %d\n", __FUNCTION__, ce, _h2fmi->bitmap, _h2fmi->fmtn, _cmd);
+	trace_h2fmi_ncmd(_h2fmi->fmtn, ce, _cmd);
 	if(!_cmd) // DEPLETE or READ0, we don't care.
 		return;
 
-	fprintf(stderr, "%s: cmd 0x%08x\n", __FUNCTION__, _cmd);
 	switch(_cmd)
 	{
 	case NAND_CMD_READID:
@@ -468,11 +1115,32 @@ static void h2fmi_do_single_ncmd(h2fmi_state_t *_h2fmi, uint8_t _cmd)
 		break;
 
 	case NAND_CMD_ERASE:
+		/* The row address may still be written after 60h, so the block is
+		   only picked and erased on D0h */
+		_h2fmi->erase_pending = 1;
+		break;
+
+	case NAND_CMD_ERASE2:
+		if(!_h2fmi->erase_pending)
+			break;
+		_h2fmi->erase_pending = 0;
 		h2fmi_do_erase(_h2fmi, ce);
 		_h2fmi->nstatus |= 0x80;
 	    if(iopEnabled)
 			qemu_irq_raise(_h2fmi->irq);
 		break;
+
+	case NAND_CMD_PAGEPROG:
+		h2fmi_do_program(_h2fmi, ce);
+		_h2fmi->nstatus |= 0x80;
+	    if(iopEnabled)
+			qemu_irq_raise(_h2fmi->irq);
+		break;
+
+	case NAND_CMD_SEQIN:
+		/* Address and data are latched separately, nothing to do */
+		_h2fmi->erase_pending = 0;
+		break;
 	}
 }
 
@@ -492,7 +1160,7 @@ static uint32_t h2fmi_creadl(void *_op, target_phys_addr_t _addr)
 	h2fmi_state_t *h2fmi = _op;
 
 	if(_addr != H2FMI_DATA0 && _addr != H2FMI_DATA1)
-    	fprintf(stderr, "%s: offset 0x%08x fmt %d\n", __FUNCTION__, _addr, h2fmi->fmtn);
+		trace_h2fmi_creadl(h2fmi->fmtn, _addr);
 
 	switch(_addr)
 	{
@@ -574,8 +1242,7 @@ static void h2fmi_cwritel(void *_op, target_phys_addr_t _addr, uint32_t _v)
 {
 	h2fmi_state_t *h2fmi = _op;
 
-    //if(_addr != 0x14)
-    	fprintf(stderr, "%s: offset 0x%08x value 0x%08x fmt %d\n", __FUNCTION__, _addr, _v, h2fmi->fmtn);
+	trace_h2fmi_cwritel(h2fmi->fmtn, _addr, _v);
 
 	switch(_addr)
 	{
@@ -618,7 +1285,7 @@ static uint32_t h2fmi_nreadl(void *_op, target_phys_addr_t _addr)
 	uint32_t ret = 0;
 	h2fmi_state_t *h2fmi = _op;
 
-    fprintf(stderr, "%s: offset 0x%08x fmt %d\n", __FUNCTION__, _addr, h2fmi->fmtn);
+	trace_h2fmi_nreadl(h2fmi->fmtn, _addr);
 
 	switch(_addr)
 	{
@@ -648,7 +1315,7 @@ static void h2fmi_nwritel(void *_op, target_phys_addr_t _addr, uint32_t _v)
 {
 	h2fmi_state_t *h2fmi = _op;
 
-	fprintf(stderr, "%s: offset 0x%08x value 0x%08x h2fmi ptr %p fmt %d\n", __FUNCTION__, _addr, _v, h2fmi, h2fmi->fmtn);
+	trace_h2fmi_nwritel(h2fmi->fmtn, _addr, _v);
 	switch(_addr)
 	{
 	case H2FMI_CHIP_MASK:
@@ -680,12 +1347,12 @@ static void h2fmi_nwritel(void *_op, target_phys_addr_t _addr, uint32_t _v)
 
 	case H2FMI_ADDR0:
 		h2fmi->addr = (h2fmi->addr &~ 0xFFFF) | (_v >> 16);
-        fprintf(stderr, "%s: 0x18 got addr %x.\n", __func__, h2fmi->addr);
+        trace_h2fmi_addr(h2fmi->fmtn, h2fmi->addr);
 		break;
 
 	case H2FMI_ADDR1:
 		h2fmi->addr = (h2fmi->addr & 0xFFFF) | (_v << 16);
-		fprintf(stderr, "%s: 0x1c got addr %x.\n", __func__, h2fmi->addr);
+		trace_h2fmi_addr(h2fmi->fmtn, h2fmi->addr);
 		break;
 
 	case H2FMI_TIMING:
@@ -797,22 +1464,172 @@ static int s5l8930_h2fmi_init(SysBusDevice *dev)
 
 	initNandHash();
 
+	if(!h2fmi_state->block_pages)
+		h2fmi_state->block_pages = 1;
+	QTAILQ_INIT(&h2fmi_state->wb.queue);
+	memset(h2fmi_state->wb.fd, -1, sizeof(h2fmi_state->wb.fd));
+	h2fmi_state->exit_notifier.notify = h2fmi_exit_notify;
+	qemu_add_exit_notifier(&h2fmi_state->exit_notifier);
+
 	if(h2fmi_state->ce_paths)
 		h2fmi_setup_chips(h2fmi_state, h2fmi_state->ce_paths);
 
+	if(h2fmi_state->fmtn < H2FMI_MAX_DEVICES)
+		h2fmi_devices[h2fmi_state->fmtn] = h2fmi_state;
+
     return 0;
 }
 
+void h2fmi_print_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+	h2fmi_state_t *h2fmi;
+	struct h2fmi_page_cache *cache;
+	int i, ce;
+
+	for(i = 0; i < H2FMI_MAX_DEVICES; i++)
+	{
+		h2fmi = h2fmi_devices[i];
+		if(!h2fmi)
+			continue;
+
+		cpu_fprintf(f, "h2fmi%d: %" PRIu64 " page reads, %" PRIu64 " bytes read from image, cache %u pages/ce\n",
+				i, h2fmi->reads, h2fmi->bytes_read, h2fmi->cache_pages);
+		cpu_fprintf(f, "  %" PRIu64 " programs, %" PRIu64 " erases, %d writes queued\n",
+				h2fmi->wb.programs, h2fmi->wb.erases, h2fmi->wb.depth);
+
+		for(ce = 0; ce < H2FMI_MAX_CHIPS; ce++)
+		{
+			if(!(h2fmi->bitmap & (1 << ce)))
+				continue;
+
+			if(h2fmi->image[ce])
+			{
+				cpu_fprintf(f, "  ce%d: mapped image, %u pages\n",
+						ce, h2fmi->image[ce]->hdr.page_count);
+				continue;
+			}
+
+			cache = &h2fmi->cache[ce];
+			cpu_fprintf(f, "  ce%d: %" PRIu64 " hits, %" PRIu64 " misses\n",
+					ce, cache->hits, cache->misses);
+		}
+	}
+}
+
+// Buffer contents are migrated up to the write pointer, the allocation
+// is recreated at its old size so later maps don't have to grow it.
+
+static void put_h2fmi_buffer(QEMUFile *f, void *pv, size_t size)
+{
+	struct h2fmi_buffer *buf = pv;
+
+	if(!buf->ptr)
+	{
+		qemu_put_be32(f, 0);
+		return;
+	}
+
+	qemu_put_be32(f, buf->size);
+	qemu_put_be32(f, buf->read);
+	qemu_put_be32(f, buf->written);
+	qemu_put_buffer(f, buf->ptr, buf->written);
+}
+
+static int get_h2fmi_buffer(QEMUFile *f, void *pv, size_t size)
+{
+	struct h2fmi_buffer *buf = pv;
+	uint32_t sz, rd, wr;
+
+	h2fmi_buffer_free(buf);
+	h2fmi_buffer_init(buf);
+
+	sz = qemu_get_be32(f);
+	if(!sz)
+		return 0;
+
+	rd = qemu_get_be32(f);
+	wr = qemu_get_be32(f);
+	if(wr > sz || rd > wr)
+		return -EINVAL;
+
+	if(h2fmi_buffer_alloc(buf, sz))
+		return -ENOMEM;
+
+	qemu_get_buffer(f, buf->ptr, wr);
+	buf->read = rd;
+	buf->written = wr;
+	return 0;
+}
+
+static const VMStateInfo vmstate_info_h2fmi_buffer = {
+	.name = "h2fmi buffer",
+	.get  = get_h2fmi_buffer,
+	.put  = put_h2fmi_buffer,
+};
+
+static void h2fmi_pre_save(void *_opaque)
+{
+	h2fmi_state_t *h2fmi = _opaque;
+
+	// Everything the guest programmed has to be in the images before
+	// they are copied alongside the snapshot.
+	h2fmi_wb_drain(h2fmi);
+	h2fmi->iop_enabled = iopEnabled;
+}
+
+static int h2fmi_post_load(void *_opaque, int _version_id)
+{
+	h2fmi_state_t *h2fmi = _opaque;
+	int ce;
+
+	for(ce = 0; ce < H2FMI_MAX_CHIPS; ce++)
+		h2fmi_cache_flush(h2fmi, ce);
+
+	if(h2fmi->iop_enabled)
+		iopEnabled = 1;
+	return 0;
+}
+
+static const VMStateDescription vmstate_h2fmi = {
+	.name = "s5l8930_h2fmi",
+	.version_id = 2,
+	.minimum_version_id = 1,
+	.pre_save = h2fmi_pre_save,
+	.post_load = h2fmi_post_load,
+	.fields = (VMStateField[]) {
+		VMSTATE_UINT32(eccfmt, h2fmi_state_t),
+		VMSTATE_UINT32(pagefmt, h2fmi_state_t),
+		VMSTATE_UINT32(timing, h2fmi_state_t),
+		VMSTATE_UINT32(addr, h2fmi_state_t),
+		VMSTATE_UINT32(chip, h2fmi_state_t),
+		VMSTATE_UINT32(nsts, h2fmi_state_t),
+		VMSTATE_UINT32(csts, h2fmi_state_t),
+		VMSTATE_UINT32(ests, h2fmi_state_t),
+		VMSTATE_UINT32(nstatus, h2fmi_state_t),
+		VMSTATE_UINT32_V(erase_pending, h2fmi_state_t, 2),
+		VMSTATE_UINT16(ncmd, h2fmi_state_t),
+		VMSTATE_UINT8(ccmd, h2fmi_state_t),
+		VMSTATE_SINGLE(buf0, h2fmi_state_t, 0, vmstate_info_h2fmi_buffer, struct h2fmi_buffer),
+		VMSTATE_SINGLE(buf1, h2fmi_state_t, 0, vmstate_info_h2fmi_buffer, struct h2fmi_buffer),
+		VMSTATE_SINGLE(eccbuf, h2fmi_state_t, 0, vmstate_info_h2fmi_buffer, struct h2fmi_buffer),
+		VMSTATE_UINT32(iop_enabled, h2fmi_state_t),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
 static SysBusDeviceInfo s5l8930_h2fmi_info0 = {
     .init = s5l8930_h2fmi_init,
     .qdev.name = "s5l8930_h2fmi0",
     .qdev.size = sizeof(h2fmi_state_t),
+    .qdev.vmsd = &vmstate_h2fmi,
     .qdev.props = (Property[]) {
 		DEFINE_PROP_STRING("file", h2fmi_state_t, ce_paths),
 		DEFINE_PROP_UINT32("page_size", h2fmi_state_t, page_size, 4096),
 		DEFINE_PROP_UINT32("fmtn", h2fmi_state_t, fmtn, 0),
 		DEFINE_PROP_UINT32("meta_size", h2fmi_state_t, meta_size, 12),
 		DEFINE_PROP_UINT32("ecc_shift", h2fmi_state_t, ecc_shift, 10),
+		DEFINE_PROP_UINT32("cache_pages", h2fmi_state_t, cache_pages, 64),
+		DEFINE_PROP_UINT32("block_pages", h2fmi_state_t, block_pages, 128),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
@@ -821,12 +1638,15 @@ static SysBusDeviceInfo s5l8930_h2fmi_info1 = {
     .init = s5l8930_h2fmi_init,
     .qdev.name = "s5l8930_h2fmi1",
     .qdev.size = sizeof(h2fmi_state_t),
+    .qdev.vmsd = &vmstate_h2fmi,
     .qdev.props = (Property[]) {
         DEFINE_PROP_STRING("file", h2fmi_state_t, ce_paths),
         DEFINE_PROP_UINT32("page_size", h2fmi_state_t, page_size, 4096),
 		DEFINE_PROP_UINT32("fmtn", h2fmi_state_t, fmtn, 1),
         DEFINE_PROP_UINT32("meta_size", h2fmi_state_t, meta_size, 12),
         DEFINE_PROP_UINT32("ecc_shift", h2fmi_state_t, ecc_shift, 10),
+        DEFINE_PROP_UINT32("cache_pages", h2fmi_state_t, cache_pages, 64),
+        DEFINE_PROP_UINT32("block_pages", h2fmi_state_t, block_pages, 128),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
@@ -839,7 +1659,31 @@ static void s5l8930_h2fmi_register_devices(void)
 
 device_init(s5l8930_h2fmi_register_devices);
 
-DeviceState *s5l8930_h2fmi0_register(target_phys_addr_t base, qemu_irq irq)
+// CDMA FIFO interface
+static int h2fmi_fifo_read(void *_op, uint8_t *_buf, uint32_t _len)
+{
+	return h2fmi_buffer_read(_op, _buf, _len);
+}
+
+static int h2fmi_fifo_write(void *_op, uint8_t *_buf, uint32_t _len)
+{
+	return h2fmi_buffer_write(_op, _buf, _len);
+}
+
+static void h2fmi_attach_cdma(DeviceState *dev, target_phys_addr_t base, void *cdma)
+{
+	h2fmi_state_t *h2fmi = FROM_SYSBUS(h2fmi_state_t, sysbus_from_qdev(dev));
+
+	if(!cdma)
+		return;
+
+	s5l8930_cdma_register_fifo(cdma, base + H2FMI_CBASE + H2FMI_DATA0,
+			h2fmi_fifo_read, h2fmi_fifo_write, &h2fmi->buf0);
+	s5l8930_cdma_register_fifo(cdma, base + H2FMI_CBASE + H2FMI_DATA1,
+			h2fmi_fifo_read, h2fmi_fifo_write, &h2fmi->buf1);
+}
+
+DeviceState *s5l8930_h2fmi0_register(target_phys_addr_t base, qemu_irq irq, void *cdma)
 {
     DeviceState *dev = qdev_create(NULL, "s5l8930_h2fmi0");
     qdev_init_nofail(dev);
@@ -848,11 +1692,12 @@ DeviceState *s5l8930_h2fmi0_register(target_phys_addr_t base, qemu_irq irq)
     sysbus_mmio_map(sysbus_from_qdev(dev), 1, base + H2FMI_NBASE);
     sysbus_mmio_map(sysbus_from_qdev(dev), 2, base + H2FMI_EBASE);
     sysbus_connect_irq(sysbus_from_qdev(dev), 0, irq);
+	h2fmi_attach_cdma(dev, base, cdma);
 
     return dev;
 }
 
-DeviceState *s5l8930_h2fmi1_register(target_phys_addr_t base, qemu_irq irq)
+DeviceState *s5l8930_h2fmi1_register(target_phys_addr_t base, qemu_irq irq, void *cdma)
 {
     DeviceState *dev = qdev_create(NULL, "s5l8930_h2fmi1");
     qdev_init_nofail(dev);
@@ -861,7 +1706,7 @@ DeviceState *s5l8930_h2fmi1_register(target_phys_addr_t base, qemu_irq irq)
     sysbus_mmio_map(sysbus_from_qdev(dev), 1, base + H2FMI_NBASE);
     sysbus_mmio_map(sysbus_from_qdev(dev), 2, base + H2FMI_EBASE);
     sysbus_connect_irq(sysbus_from_qdev(dev), 0, irq);
+	h2fmi_attach_cdma(dev, base, cdma);
 
     return dev;
 }
-
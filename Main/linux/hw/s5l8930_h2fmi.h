@@ -0,0 +1,37 @@
+#ifndef S5L8930_H2FMI_H
+#define S5L8930_H2FMI_H
+
+#include "qemu-common.h"
+
+/*
+ * Sparse NAND image, one file per chip enable
+ *
+ *   0                 header
+ *   bitmap_offset     one bit per page, set once the page is programmed
+ *   meta_offset       meta_size bytes per page
+ *   data_offset       page_size bytes per page
+ *
+ * Each plane starts on a 4 KiB boundary and the file is created sparse, so
+ * erased pages take no disk space and the whole image can be mmap()ed.
+ * All fields are little endian.  scripts/h2fmi_convert.py converts the old
+ * packed marker/data/meta layout.
+ */
+#define H2FMI_IMAGE_MAGIC   "FMINAND1"
+#define H2FMI_IMAGE_VERSION 1
+#define H2FMI_IMAGE_ALIGN   4096
+
+typedef struct h2fmi_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t meta_size;
+    uint32_t page_count;
+    uint8_t chip_id[8];
+    uint64_t bitmap_offset;
+    uint64_t meta_offset;
+    uint64_t data_offset;
+} h2fmi_image_header;
+
+void h2fmi_print_stats(FILE *f, fprintf_function cpu_fprintf);
+
+#endif
@@ -7,6 +7,7 @@
 #include "i2c.h"
 #include "sysbus.h"
 #include "qemu-common.h"
+#include "trace.h"
 
 
 #define I2CADD        0x00      /* I2C Slave Address register */
@@ -78,7 +79,7 @@ static void s5l8930_i2c_update(S5L8930I2CState *s)
     //qemu_set_irq(s->irq, !!level);
 	*/
 	s->status = 0x1;
-	fprintf(stderr, "s5l8930_i2c_update: irq triggered i2cnum %d", s->i2cnum);
+	trace_s5l8930_i2c_irq(s->i2cnum);
 
 	// for now always raise irq but we should fix irqen
 	qemu_irq_raise(s->irq);
@@ -113,7 +114,7 @@ static uint32_t s5l8930_i2c_read(void *opaque, target_phys_addr_t offset)
 {
     S5L8930I2CState *s = (S5L8930I2CState *)opaque;
 
-    fprintf(stderr, "s5l8930_i2c_read(): offset = 0x%08x\n", offset);
+    trace_s5l8930_i2c_read(offset);
 
 	// We shouldnt lower every time but for now this works :XXX fix me
     qemu_irq_lower(s->irq);
@@ -146,7 +147,7 @@ static void s5l8930_i2c_write(void *opaque, target_phys_addr_t offset,
     S5L8930I2CState *s = (S5L8930I2CState *)opaque;
     int mode;
 
-    fprintf(stderr, "s5l8930_i2c_write: offset = 0x%08x, val = 0x%08x\n", offset, value);
+    trace_s5l8930_i2c_write(offset, value);
 
     switch (offset) {
     case I2CCON:
@@ -8,6 +8,7 @@
 #include "smbus.h"
 #include "s5l8930.h"
 #include "qemu-timer.h"
+#include "trace.h"
 
 
 typedef struct ipadchgState {
@@ -24,7 +25,7 @@ static void ipadchg_reset(void *opaque)
 static void ipadchg_write_data(SMBusDevice *dev, uint8_t cmd,
                                 uint8_t *buf, int len)
 {
-    fprintf(stderr, "%s: cmd 0x%08x len 0x%08x\n", __func__, cmd, len);
+    trace_ipadchg_write_data(cmd, len);
 
     switch (cmd) {
     default:
@@ -36,7 +37,7 @@ static void ipadchg_write_data(SMBusDevice *dev, uint8_t cmd,
 
 static uint8_t ipadchg_read_data(SMBusDevice *dev, uint8_t cmd, int n)
 {
-	fprintf(stderr, "%s: cmd 0x%08x n 0x%08x\n", __func__, cmd, n);
+	trace_ipadchg_read_data(cmd, n);
     switch (cmd) {
     default:
         //hw_error("ipadchg: bad read offset 0x%x\n", cmd);
@@ -48,14 +49,14 @@ static uint8_t ipadchg_read_data(SMBusDevice *dev, uint8_t cmd, int n)
 
 static void ipadchg_quick_cmd(SMBusDevice *dev, uint8_t read)
 {
-    fprintf(stderr, "%s: addr=0x%02x read=%d\n", __func__, dev->i2c.address, read);
+    trace_ipadchg_quick_cmd(dev->i2c.address, read);
 }
 
 static void ipadchg_send_byte(SMBusDevice *dev, uint8_t val)
 {
 	ipadchgState *s = (ipadchgState *)dev;
 
-    fprintf(stderr, "%s: addr=%02x val=%02x\n",__func__, dev->i2c.address, val);
+    trace_ipadchg_send_byte(dev->i2c.address, val);
 
 	s->cmd=val;
 	
@@ -65,7 +66,7 @@ static uint8_t ipadchg_receive_byte(SMBusDevice *dev)
 {
 	ipadchgState *s = (ipadchgState *)dev;
 
-    fprintf(stderr, "%s: addr=0x%02x cmd=0x%02x\n",__func__, dev->i2c.address, s->cmd);
+    trace_ipadchg_receive_byte(dev->i2c.address, s->cmd);
 
 	return 0xff;
 
@@ -94,9 +95,21 @@ static int ipadchg_init1(SMBusDevice *dev)
     return 0;
 }
 
+static const VMStateDescription vmstate_ipadchg = {
+    .name = "ipadchg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(smbusdev.i2c, ipadchgState),
+        VMSTATE_UINT32(cmd, ipadchgState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static SMBusDeviceInfo ipadchg_info = {
     .i2c.qdev.name = "ipadchg",
     .i2c.qdev.size = sizeof(ipadchgState),
+    .i2c.qdev.vmsd = &vmstate_ipadchg,
     .init = ipadchg_init1,
     .quick_cmd = ipadchg_quick_cmd,
 	.send_byte = ipadchg_send_byte,
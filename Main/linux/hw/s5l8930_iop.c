@@ -11,6 +11,7 @@
 #include "cpu.h"
 #include "exec-all.h"
 #include "s5l8930.h"
+#include "trace.h"
 
 #define ARM_MODE_IOP 6
 #define ARM_MODE_NORM 7
@@ -63,7 +64,7 @@ static void do_iop_run(void *opaque)
 
 	replaceCDMAIRQHandlers(s->cdma, s5l8930_iop_get_irq(s, S5L8930_CDMA_CHANNEL5_IRQ), s5l8930_iop_get_irq(s, S5L8930_CDMA_CHANNEL6_IRQ), s5l8930_iop_get_irq(s, S5L8930_CDMA_CHANNEL7_IRQ), s5l8930_iop_get_irq(s, S5L8930_CDMA_CHANNEL8_IRQ));
 
-	fprintf(stderr, "start running on iop proc\n");
+	trace_s5l8930_iop_run(s->name, s->startaddr);
 	s->iopenv->regs[15] = s->startaddr;
 	cpu_interrupt(s->iopenv, CPU_INTERRUPT_EXITTB);
 	cpu_interrupt(s->s5l8930env, CPU_INTERRUPT_EXITTB);
@@ -74,7 +75,7 @@ static void s5l8930_iop_write(void *opaque, target_phys_addr_t offset,
 {
     s5l8930_iop_s *s = (s5l8930_iop_s *)opaque;
 
-    //fprintf(stderr, "%s:%s: offset 0x%08x value 0x%08x isARM7_CPU 0x%p\n", __FUNCTION__, s->name, offset, value, get_current_cpu());
+    trace_s5l8930_iop_write(s->name, offset, value);
 	//cpu_synchronize_all_states();
 
     switch(offset) {
@@ -89,7 +90,7 @@ static void s5l8930_iop_write(void *opaque, target_phys_addr_t offset,
                     break;
                 }
 				if(value & 0x1) {
-					fprintf(stderr, "switching cpu state to start IOP processing @ address 0x%08x\n", s->startaddr);
+					trace_s5l8930_iop_start(s->name, s->startaddr);
 					cpu_interrupt(s->s5l8930env, CPU_INTERRUPT_HALT);
 					//pause_all_vcpus();
 					//switch_iop_mode(s->env, ARM_MODE_IOP);
@@ -103,7 +104,7 @@ static void s5l8930_iop_write(void *opaque, target_phys_addr_t offset,
 				s->startaddr = value;
 				break;
         default:
-	    	fprintf(stderr, "%s:%s: UNKNOWN offset 0x%08x value 0x%08x isARM7_CPU 0x%p\n", __FUNCTION__, s->name, offset, value, get_current_cpu());
+	    	trace_s5l8930_iop_unknown_write(s->name, offset, value);
             break;
     }
 }
@@ -113,7 +114,7 @@ static uint32_t s5l8930_iop_read(void *opaque, target_phys_addr_t offset)
 
     s5l8930_iop_s *s = (s5l8930_iop_s *)opaque;
 
-    fprintf(stderr, "%s:%s: offset 0x%08x isARM7_CPU 0x%p\n", __FUNCTION__, s->name, offset, get_current_cpu());
+    trace_s5l8930_iop_read(s->name, offset);
 
     switch(offset) {
         case 0x18:
@@ -125,7 +126,7 @@ static uint32_t s5l8930_iop_read(void *opaque, target_phys_addr_t offset)
 		case 0x110:
 			return s->startaddr;
 		default:
-			fprintf(stderr, "%s:%s: UNKNOWN offset 0x%08x isARM7_CPU 0x%p\n", __FUNCTION__, s->name, offset, get_current_cpu());
+			trace_s5l8930_iop_unknown_read(s->name, offset);
         break;
     }
 
@@ -152,14 +153,14 @@ static void unmapped_write(void *opaque, target_phys_addr_t offset,
 {
     char *name = (char *)opaque;
 
-    fprintf(stderr, "%s:%s: offset 0x%08x value 0x%08x\n", __FUNCTION__, name, offset, value);
+    trace_s5l8930_iop_unmapped_write(name, offset, value);
 }
 
 static uint32_t unmapped_read(void *opaque, target_phys_addr_t offset)
 {
     char *name = (char *)opaque;
 
-    fprintf(stderr, "%s:%s: offset 0x%08x\n", __FUNCTION__, name, offset);
+    trace_s5l8930_iop_unmapped_read(name, offset);
     return 0;
 }
 
@@ -182,6 +183,7 @@ static void iop_unmapped_hw_init(target_phys_addr_t base, int size, const char *
     int io;
     io = cpu_register_io_memory(unmapped_readfn, unmapped_writefn, (void *)name, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, size, io);
+    cpu_io_memory_set_name(io, name);
 }
 
 static CPUState *IOPCpuState;
@@ -214,6 +216,17 @@ void iopTriggerIRQ(void)
 	s5l8930_iop_s *s = (s5l8930_iop_s *) getIOPState();
     //qemu_irq_raise(s5l8930_iop_get_irq(s, S5L8930_IOP_IRQ));
 }
+static const VMStateDescription vmstate_s5l8930_iop = {
+    .name = "s5l8930.iop",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(status, s5l8930_iop_s),
+        VMSTATE_UINT32(startaddr, s5l8930_iop_s),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 void s5l8930_iop_init(void *opaque)
 {
     int io;
@@ -261,6 +274,8 @@ void s5l8930_iop_init(void *opaque)
 	s->iopirq = s5l8930_get_irq(s5l8930, S5L8930_IOP_IRQ);
     io = cpu_register_io_memory(s5l8930_iop_readfn, s5l8930_iop_writefn, s, DEVICE_LITTLE_ENDIAN);
     cpu_register_physical_memory(base, 0x1000, io);
+    cpu_io_memory_set_name(io, s->name);
+    vmstate_register(NULL, -1, &vmstate_s5l8930_iop, s);
 
 	setTimerIRQ2(s->timer, s5l8930_iop_get_irq(s, S5L8930_TIMER0_IRQ));
 	IOPCpuState = s->iopenv;
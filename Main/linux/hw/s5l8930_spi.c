@@ -11,6 +11,7 @@
 #include "qemu-timer.h"
 
 #include "s5l8930.h"
+#include "trace.h"
 
 #define S5L8930_WDT_REG_MEM_SIZE 0x38
 
@@ -24,6 +25,16 @@
 #define SPI_CNT 0x34
 #define SPI_IDD 0x38
 
+/* SETUP word size, 8/16/32 bits per FIFO entry */
+#define SPI_SETUP_WORDSIZE(x) (((x) >> 15) & 0x3)
+
+#define SPI_STATUS_RXLVL_SHIFT 11
+#define SPI_STATUS_RXLVL_MASK (0x1f << SPI_STATUS_RXLVL_SHIFT)
+
+/* Entries per FIFO burst, and the clock the divider is applied to */
+#define SPI_FIFO_DEPTH 0x1f
+#define SPI_CLOCK_HZ 54000000
+
 
 typedef struct S5L8930SPIState {
     SysBusDevice busdev;
@@ -43,31 +54,125 @@ typedef struct S5L8930SPIState {
 	
 	// needs to be cleaner :(
 	uint32_t txBuffer;
-	uint32_t rxBuffer;
-	uint32_t rxFifoCnt;
+	uint8_t rxFifo[SPI_FIFO_DEPTH * 4];
+	uint32_t rxHead;
+	uint32_t rxLen;
     QEMUTimer *timer;
 	void *pflash;
 
 } S5L8930SPIState;
 
 
+static inline uint32_t spi_word_bytes(S5L8930SPIState *s)
+{
+	switch(SPI_SETUP_WORDSIZE(s->setup)) {
+		case 1:
+			return 2;
+		case 2:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+static void spi_update_level(S5L8930SPIState *s)
+{
+	uint32_t level = s->rxLen / spi_word_bytes(s);
+
+	s->status &= ~SPI_STATUS_RXLVL_MASK;
+	s->status |= MIN(level, 0x1f) << SPI_STATUS_RXLVL_SHIFT;
+}
+
+/* Pull a whole FIFO's worth from the NOR at once */
+static void spi_rx_refill(S5L8930SPIState *s)
+{
+	if(s->rxLen || !s->pflash)
+		return;
+
+	s->rxHead = 0;
+	s->rxLen = pflash_spi_read(s->pflash, s->rxFifo, SPI_FIFO_DEPTH * spi_word_bytes(s));
+	spi_update_level(s);
+}
+
+/* Time taken to clock the next burst in at the programmed divider */
+static int64_t spi_burst_ns(S5L8930SPIState *s, uint32_t bytes)
+{
+	uint64_t bits = (uint64_t)MIN(bytes, SPI_FIFO_DEPTH * spi_word_bytes(s)) * 8;
+
+	return muldiv64(bits * MAX(s->clkdiv, 1), get_ticks_per_sec(), SPI_CLOCK_HZ);
+}
+
 static void spi_timer (void *opaque)
 {
     S5L8930SPIState *s = (S5L8930SPIState *)opaque;
 
-	if(s->rxFifoCnt == 0x1e)
+	spi_rx_refill(s);
+	if(s->rxLen)
 	{
-		s->rxFifoCnt = 0;
 		s->status |= 1;
-		//fprintf(stderr, "%s: base 0x%08x fifo queue empty.. triggering irq\n", __FUNCTION__, s->base);
+		//fprintf(stderr, "%s: base 0x%08x fifo refilled.. triggering irq\n", __FUNCTION__, s->base);
 		qemu_irq_lower(s->irq);
 		qemu_irq_raise(s->irq);
 	}
 
 }
 
-#define RX_BUFFER_LEFT(x) (((x) >> 11) & 0x1f)
-#define TX_BUFFER_LEFT(x) (((x) >> 6) & 0x1f)
+static uint32_t spi_rx_pop(S5L8930SPIState *s)
+{
+	uint32_t i, val = 0, width = spi_word_bytes(s);
+	uint32_t remaining;
+
+	if(!s->pflash)
+		return 0;
+
+	/* Reading ahead of the IRQ just pulls the next burst in early */
+	if(!s->rxLen)
+		spi_rx_refill(s);
+
+	for(i = 0; i < width && s->rxLen; i++, s->rxLen--)
+		val |= (uint32_t)s->rxFifo[s->rxHead++] << (8 * i);
+
+	spi_update_level(s);
+
+	/* Queue fifo refill irq */
+	remaining = pflash_spi_remaining(s->pflash);
+	if(!s->rxLen && remaining) {
+		qemu_irq_lower(s->irq);
+		qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock) + spi_burst_ns(s, remaining));
+	}
+
+	return val;
+}
+
+/* CDMA side of the RX FIFO: whatever is buffered, then straight from the NOR */
+static int s5l8930_spi_dma_read(void *opaque, uint8_t *buf, uint32_t len)
+{
+    S5L8930SPIState *s = (S5L8930SPIState *)opaque;
+	uint32_t n = MIN(len, s->rxLen);
+
+	if(!s->pflash)
+		return 0;
+
+	memcpy(buf, s->rxFifo + s->rxHead, n);
+	s->rxHead += n;
+	s->rxLen -= n;
+	n += pflash_spi_read(s->pflash, buf + n, len - n);
+
+	qemu_del_timer(s->timer);
+	spi_update_level(s);
+	return n;
+}
+
+static int s5l8930_spi_dma_write(void *opaque, uint8_t *buf, uint32_t len)
+{
+    S5L8930SPIState *s = (S5L8930SPIState *)opaque;
+	uint32_t i;
+
+	for(i = 0; i < len && s->txBuffer < ARRAY_SIZE(s->tx_data); i++)
+		s->tx_data[s->txBuffer++] = buf[i];
+
+	return i;
+}
 
 static uint32_t s5l8930_spi_mm_read(void *opaque, target_phys_addr_t offset)
 {
@@ -89,16 +194,8 @@ static uint32_t s5l8930_spi_mm_read(void *opaque, target_phys_addr_t offset)
     case SPI_TXDATA:
         return s->tx_data[0];
     case SPI_RXDATA:
-		s->rx_data = pflash_cmd_parse(s->pflash);
-        s->status |= pflash_cmd_len(s->pflash) << 11;
+		s->rx_data = spi_rx_pop(s);
 		//fprintf(stderr, "%s: rxBuf 0x%08x\n", __func__, s->rx_data);
-
-		/* Queue fifo empty irq */
-		if(s->rxFifoCnt == 0x1e) {
-			qemu_irq_lower(s->irq);
-			qemu_mod_timer(s->timer, qemu_get_clock_ns(vm_clock) + (get_ticks_per_sec() / 1000));
-		} else 
-			s->rxFifoCnt++;
 		return s->rx_data;
     case SPI_CLKDIV:
         return s->clkdiv;
@@ -121,7 +218,7 @@ static void s5l8930_spi_mm_write(void *opaque, target_phys_addr_t offset,
 {
     S5L8930SPIState *s = (S5L8930SPIState *)opaque;
 
-    fprintf(stderr, "%s: base 0x%08x offset 0x%08x value 0x%08x\n", __func__, s->base, offset, val);
+    trace_s5l8930_spi_write(s->base, offset, val);
 
     switch (offset) {
     case SPI_CONTROL:
@@ -130,13 +227,14 @@ static void s5l8930_spi_mm_write(void *opaque, target_phys_addr_t offset,
 					// tx
 					s->status = 0x400002;
                 	s->cmd = s->tx_data[0];
-					pflash_cmd_set(s->pflash, s->tx_data);
+					s->rxLen = 0;
+					if(s->pflash)
+						pflash_cmd_set(s->pflash, s->tx_data);
 					//fprintf(stderr, "%s: base: %d txCmd: %d\n", __FUNCTION__, s->base, s->cmd);
 				} else {
                     // rx
-					s->rxFifoCnt = 0;
                     s->status |= 1;
-					s->status |= pflash_cmd_len(s->pflash) << 11;
+					spi_rx_refill(s);
                 	//fprintf(stderr, "%s: base: %d rxBuf: %d\n", __FUNCTION__, s->base, RX_BUFFER_LEFT(s->status));
 				}
 	    		qemu_irq_raise(s->irq);
@@ -164,7 +262,8 @@ static void s5l8930_spi_mm_write(void *opaque, target_phys_addr_t offset,
         s->clkdiv = val;
         break;
     case SPI_CNT:
-		pflash_set_rxlen(s->pflash, val);
+		if(s->pflash)
+			pflash_set_rxlen(s->pflash, val * spi_word_bytes(s));
         s->cnt = val;
         break;
     case SPI_IDD:
@@ -251,6 +350,17 @@ DeviceState *s5l8930_spi_init(target_phys_addr_t base, qemu_irq irq)
     return dev;
 }
 
+void s5l8930_spi_attach_cdma(DeviceState *dev, target_phys_addr_t base, void *cdma)
+{
+    S5L8930SPIState *s = FROM_SYSBUS(S5L8930SPIState, sysbus_from_qdev(dev));
+
+	if(!cdma || !s->pflash)
+		return;
+
+	s5l8930_cdma_register_fifo(cdma, base + SPI_RXDATA, s5l8930_spi_dma_read, NULL, s);
+	s5l8930_cdma_register_fifo(cdma, base + SPI_TXDATA, NULL, s5l8930_spi_dma_write, s);
+}
+
 static int intnum = 0;
 static int s5l8930_spi_init1(SysBusDevice *dev)
 {
@@ -282,10 +392,54 @@ static int s5l8930_spi_init1(SysBusDevice *dev)
     return 0;
 }
 
+/* Only the controller wired to the NOR has a transfer timer */
+static bool s5l8930_spi_has_timer(void *opaque, int version_id)
+{
+    S5L8930SPIState *s = opaque;
+
+    return s->timer != NULL;
+}
+
+static int s5l8930_spi_post_load(void *opaque, int version_id)
+{
+    S5L8930SPIState *s = opaque;
+
+    if (s->rxHead > sizeof(s->rxFifo) || s->rxLen > sizeof(s->rxFifo) - s->rxHead)
+        return -EINVAL;
+    return 0;
+}
+
+static const VMStateDescription vmstate_s5l8930_spi = {
+    .name = "s5l8930.spi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = s5l8930_spi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(cmd, S5L8930SPIState),
+        VMSTATE_UINT32(base, S5L8930SPIState),
+        VMSTATE_UINT32(ctrl, S5L8930SPIState),
+        VMSTATE_UINT32(setup, S5L8930SPIState),
+        VMSTATE_UINT32(status, S5L8930SPIState),
+        VMSTATE_UINT32(pin, S5L8930SPIState),
+        VMSTATE_UINT32_ARRAY(tx_data, S5L8930SPIState, 10),
+        VMSTATE_UINT32(rx_data, S5L8930SPIState),
+        VMSTATE_UINT32(clkdiv, S5L8930SPIState),
+        VMSTATE_UINT32(cnt, S5L8930SPIState),
+        VMSTATE_UINT32(idd, S5L8930SPIState),
+        VMSTATE_UINT32(txBuffer, S5L8930SPIState),
+        VMSTATE_BUFFER(rxFifo, S5L8930SPIState),
+        VMSTATE_UINT32(rxHead, S5L8930SPIState),
+        VMSTATE_UINT32(rxLen, S5L8930SPIState),
+        VMSTATE_TIMER_TEST(timer, S5L8930SPIState, s5l8930_spi_has_timer),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static SysBusDeviceInfo s5l8930_spi_info = {
     .init = s5l8930_spi_init1,
     .qdev.name  = "s5l8930.spi",
-    .qdev.size  = sizeof(S5L8930SPIState)
+    .qdev.size  = sizeof(S5L8930SPIState),
+    .qdev.vmsd  = &vmstate_s5l8930_spi,
 };
 
 static void s5l8930_spi_register(void)
@@ -94,6 +94,7 @@ void sysbus_init_mmio(SysBusDevice *dev, target_phys_addr_t size,
     dev->mmio[n].addr = -1;
     dev->mmio[n].size = size;
     dev->mmio[n].iofunc = iofunc;
+    cpu_io_memory_set_name(iofunc, dev->qdev.info->name);
 }
 
 void sysbus_init_mmio_cb(SysBusDevice *dev, target_phys_addr_t size,
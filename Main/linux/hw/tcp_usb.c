@@ -19,6 +19,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
@@ -31,7 +33,20 @@
 #include "usb.h"
 #include "tcp_usb.h"
 
-#define DEBUG_TCP_USB
+//#define DEBUG_TCP_USB
+
+// send_queue entry for a cancel of the request with that tag
+#define TCP_USB_CANCEL_ENTRY	0x80
+
+#if defined(CONFIG_EVENTFD) && defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#ifdef SYS_memfd_create
+#define TCP_USB_SHM
+#endif
+#endif
+
+#define TCP_USB_SHM_SIZE	(2 * sizeof(tcp_usb_ring_t))
 
 void tcp_usb_init(tcp_usb_state_t *_state, tcp_usb_callback_t _cb, tcp_usb_closed_t _closed, void *_arg)
 {
@@ -41,19 +56,94 @@ void tcp_usb_init(tcp_usb_state_t *_state, tcp_usb_callback_t _cb, tcp_usb_close
 
 	_state->socket = -1;
 	_state->closed = 1;
+	_state->max_batch = TCP_USB_MAX_BATCH;
+
+	_state->host = 0;
+
+	_state->shm = NULL;
+	_state->rx_ring = NULL;
+	_state->tx_ring = NULL;
+	_state->doorbell = -1;
+	_state->peer_doorbell = -1;
 
 	_state->state = tcp_usb_idle;
-	_state->amount_done = 0;
+	_state->rx.stage = 0;
+	_state->rx.amount_done = 0;
+	_state->writing = 0;
+	_state->send_head = 0;
+	_state->send_count = 0;
+	_state->next_tag = 0;
+	_state->dispatching = 0;
+	memset(_state->requests, 0, sizeof(_state->requests));
+
+	_state->buffer = NULL;
+	_state->buffer_size = 0;
 }
 
 void tcp_usb_cleanup(tcp_usb_state_t *_state)
 {
+	int i;
+
+	for(i = 0; i < TCP_USB_MAX_TAGS; i++)
+	{
+		tcp_usb_request_t *req = &_state->requests[i];
+
+		if(req->bounce)
+		{
+			free(req->bounce);
+			req->bounce = NULL;
+		}
+
+		// The client's slots own their buffers
+		if(!_state->host && req->buffer)
+		{
+			free(req->buffer);
+			req->buffer = NULL;
+			req->size = 0;
+		}
+
+		req->state = tcp_usb_req_free;
+		req->header = NULL;
+	}
+
+	_state->send_count = 0;
+	_state->writing = 0;
+	_state->dispatching = 0;
+
 	if(_state->socket >= 0)
 	{
 		close(_state->socket);
 		qemu_set_fd_handler(_state->socket, NULL, NULL, NULL);
 		_state->socket = -1;
 	}
+
+	if(_state->doorbell >= 0)
+	{
+		qemu_set_fd_handler(_state->doorbell, NULL, NULL, NULL);
+		close(_state->doorbell);
+		_state->doorbell = -1;
+	}
+
+	if(_state->peer_doorbell >= 0)
+	{
+		close(_state->peer_doorbell);
+		_state->peer_doorbell = -1;
+	}
+
+	if(_state->shm)
+	{
+		munmap(_state->shm, TCP_USB_SHM_SIZE);
+		_state->shm = NULL;
+		_state->rx_ring = NULL;
+		_state->tx_ring = NULL;
+	}
+
+	if(_state->buffer)
+	{
+		free(_state->buffer);
+		_state->buffer = NULL;
+		_state->buffer_size = 0;
+	}
 }
 
 int tcp_usb_closed(tcp_usb_state_t *_state)
@@ -69,6 +159,8 @@ static void tcp_usb_do_closed(tcp_usb_state_t *_state)
 	_state->closed = 1;
 
 	qemu_set_fd_handler(_state->socket, NULL, NULL, NULL);
+	if(_state->doorbell >= 0)
+		qemu_set_fd_handler(_state->doorbell, NULL, NULL, NULL);
 
 	if(_state->closed_callback)
 		_state->closed_callback(_state, _state->callback_arg);
@@ -100,395 +192,1202 @@ static void hexdump(const void *_data, size_t _amt)
 #	define debug_printf(a...)
 #endif // DEBUG_TCP_USB
 
-static void tcp_usb_callback(tcp_usb_state_t *state, int _can_read, int _can_write)
+static void tcp_usb_read_callback(void *_arg);
+static void tcp_usb_write_callback(void *_arg);
+static void tcp_usb_doorbell_callback(void *_arg);
+static void tcp_usb_hangup_callback(void *_arg);
+
+// Only poll for writability while we have something to send.
+static void tcp_usb_update_handlers(tcp_usb_state_t *_state)
 {
-	if(state->closed)
+	if(_state->closed || _state->socket < 0)
 		return;
 
-	int ret;
-	switch(state->state)
+	// The peer rings the doorbell for data and for space alike
+	if(_state->shm)
 	{
-	case tcp_usb_idle:
-		if(!_can_read)
-			return;
+		qemu_set_fd_handler(_state->socket, tcp_usb_hangup_callback, NULL, _state);
+		qemu_set_fd_handler(_state->doorbell, tcp_usb_doorbell_callback, NULL, _state);
+		return;
+	}
 
-		debug_printf("%s: tcp_usb_idle.\n", __func__);
+	qemu_set_fd_handler(_state->socket, tcp_usb_read_callback,
+			_state->writing ? tcp_usb_write_callback : NULL, _state);
+}
 
-		// Receiving new request
-		state->header = malloc(sizeof(*state->header));
-		state->amount_done = 0;
-		state->state = tcp_usb_read_request;
+static void tcp_usb_iov_reset(tcp_usb_io_t *_io)
+{
+	_io->iovcnt = 0;
+	_io->amount_done = 0;
+}
 
-		// Fall through
-	case tcp_usb_read_request:
-//		debug_printf("%s: tcp_usb_read_request\n", __func__);
+static int tcp_usb_iov_add(tcp_usb_io_t *_io, void *_base, size_t _len)
+{
+	if(_len == 0)
+		return -1;
 
-		if(state->amount_done < sizeof(*state->header))
-		{
-			ret = read(state->socket,
-					((char*)state->header) + state->amount_done,
-					sizeof(*state->header) - state->amount_done);
-			if(ret == 0 && _can_read)
-			{
-				free(state->header);
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d reading request header!\n", ret);
-				return;
-			}
+	_io->iov[_io->iovcnt].iov_base = _base;
+	_io->iov[_io->iovcnt].iov_len = _len;
+	return _io->iovcnt++;
+}
 
-			_can_read = 0;
-			state->amount_done += ret;
+static void tcp_usb_ring_copy(tcp_usb_ring_t *_ring, uint32_t _pos, char *_buf, size_t _len, int _write)
+{
+	size_t off = _pos % TCP_USB_RING_SIZE;
+	size_t first = MIN(_len, TCP_USB_RING_SIZE - off);
 
-			if(state->amount_done < sizeof(*state->header))
-				return;
+	if(_write)
+	{
+		memcpy(&_ring->data[off], _buf, first);
+		memcpy(_ring->data, _buf + first, _len - first);
+	}
+	else
+	{
+		memcpy(_buf, &_ring->data[off], first);
+		memcpy(_buf + first, _ring->data, _len - first);
+	}
+}
 
-			debug_hexdump("tcp_usb: Got Header: ", state->header, sizeof(*state->header));
+/*
+ * readv/writev for the shared memory transport: move what fits through
+ * the ring and ring the peer's doorbell. Fails with EAGAIN if the ring is
+ * full (or empty).
+ */
+static ssize_t tcp_usb_ring_transfer(tcp_usb_state_t *_state, struct iovec *_iov, int _cnt, int _write)
+{
+	tcp_usb_ring_t *ring = _write ? _state->tx_ring : _state->rx_ring;
+	uint32_t head = ring->head, tail = ring->tail;
+	uint32_t pos = _write ? head : tail;
+	size_t avail, amt, done = 0;
+	uint64_t one = 1;
+	int i;
 
-			if(state->header->length > 0)
-				state->buffer = malloc(state->header->length);
-			else
-				state->buffer = NULL;
-		}
+	// The peer's data (or the space it freed) before our copy
+	__sync_synchronize();
 
-		if((state->header->ep & USB_DIR_IN) == 0 && state->header->length > 0) // OUT
+	avail = _write ? TCP_USB_RING_SIZE - (head - tail) : head - tail;
+	for(i = 0; i < _cnt && done < avail; i++)
+	{
+		amt = MIN(_iov[i].iov_len, avail - done);
+		tcp_usb_ring_copy(ring, pos + done, _iov[i].iov_base, amt, _write);
+		done += amt;
+	}
+
+	if(done == 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// Our copy before the peer can see it
+	__sync_synchronize();
+
+	if(_write)
+		ring->head = head + done;
+	else
+		ring->tail = tail + done;
+
+	if(write(_state->peer_doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+
+	return done;
+}
+
+/*
+ * Move an iovec across the socket, resuming at amount_done.
+ * Returns 1 once all of it has gone, 0 if the socket would block and
+ * -1 if the connection went away.
+ */
+static int tcp_usb_iov_transfer(tcp_usb_state_t *_state, tcp_usb_io_t *_io, int _write)
+{
+	struct iovec iov[TCP_USB_MAX_BATCH + 2];
+	size_t skip;
+	ssize_t ret;
+	int i, n;
+
+	for(;;)
+	{
+		skip = _io->amount_done;
+		n = 0;
+		for(i = 0; i < _io->iovcnt; i++)
 		{
-			ret = read(state->socket,
-					((char*)state->buffer) + (state->amount_done - sizeof(*state->header)),
-					state->header->length - (state->amount_done - sizeof(*state->header)));
-			if(ret == 0 && _can_read)
+			if(skip >= _io->iov[i].iov_len)
 			{
-				free(state->header);
-				if(state->buffer)
-					free(state->buffer);
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d reading request data!\n", ret);
-				return;
+				skip -= _io->iov[i].iov_len;
+				continue;
 			}
 
-			_can_read = 0;
-			state->amount_done += ret;
+			iov[n].iov_base = (char*)_io->iov[i].iov_base + skip;
+			iov[n].iov_len = _io->iov[i].iov_len - skip;
+			skip = 0;
+			n++;
+		}
 
-			if(state->amount_done < sizeof(*state->header) + state->header->length)
-				return;
+		if(n == 0)
+			return 1;
 
-			debug_hexdump("tcp_usb: Read: ", state->buffer, state->header->length);
-		}
+		if(_state->shm)
+			ret = tcp_usb_ring_transfer(_state, iov, n, _write);
+		else if(_write)
+			ret = writev(_state->socket, iov, n);
+		else
+			ret = readv(_state->socket, iov, n);
 
-		// Transfer complete! Call callback!
-		if(state->data_callback)
+		if(ret < 0)
 		{
-			state->state = tcp_usb_write_response;
-			state->amount_done = 0;
-
-			debug_printf("tcp_usb: Calling callback.\n");
-			ret = state->data_callback(state, state->callback_arg, state->header, state->buffer);
-			state->header->length = ret;
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			fprintf(stderr, "tcp_usb: Error %d %s socket.\n", errno, _write ? "writing to" : "reading from");
+			tcp_usb_do_closed(_state);
+			return -1;
 		}
-		else
+		else if(ret == 0)
 		{
-			fprintf(stderr, "tcp_usb: Packet received but no callback!\n");
-			state->state = tcp_usb_idle;
-			return;
+			tcp_usb_do_closed(_state);
+			return -1;
 		}
 
-		// Fall through
-	case tcp_usb_write_response:
-		debug_printf("%s: tcp_usb_write_response\n", __func__);
+		_io->amount_done += ret;
+	}
+}
 
-		if(state->amount_done < sizeof(*state->header))
-		{
-			ret = write(state->socket,
-					((char*)state->header) + state->amount_done,
-					sizeof(*state->header) - state->amount_done);
-			if(ret == 0 && _can_write)
-			{
-				free(state->header);
-				if(state->buffer)
-					free(state->buffer);
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d writing response header.\n", ret);
-				return;
-			}
+static void tcp_usb_protocol_error(tcp_usb_state_t *_state, const char *_what)
+{
+	fprintf(stderr, "tcp_usb: Protocol error: %s.\n", _what);
+	tcp_usb_do_closed(_state);
+}
 
-			_can_write = 0;
-			state->amount_done += ret;
+static int tcp_usb_reserve_buffer(tcp_usb_state_t *_state, size_t _need)
+{
+	char *ptr;
 
-			if(state->amount_done < sizeof(*state->header))
-				return;
-			
-			debug_hexdump("tcp_usb: Sent Header: ", state->header, sizeof(*state->header));
-		}
+	if(_need <= _state->buffer_size)
+		return 0;
 
-		if((state->header->ep & USB_DIR_IN) != 0 && state->header->length > 0) // IN
-		{
-			ret = write(state->socket,
-					((char*)state->buffer) + (state->amount_done - sizeof(*state->header)),
-					state->header->length - (state->amount_done - sizeof(*state->header)));
-			if(ret == 0 && _can_write)
-			{
-				free(state->header);
-				if(state->buffer)
-					free(state->buffer);
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d writing response data.\n", ret);
-				return;
-			}
+	ptr = realloc(_state->buffer, _need);
+	if(!ptr)
+		return -1;
 
-			_can_write = 0;
-			state->amount_done += ret;
-		
-			if(state->amount_done < sizeof(*state->header) + state->header->length)
-				return;
+	_state->buffer = ptr;
+	_state->buffer_size = _need;
+	return 0;
+}
 
-			debug_hexdump("tcp_usb: Wrote: ", state->buffer, state->header->length);
-		}
+static void tcp_usb_write_frame(tcp_usb_state_t *_state);
 
-		free(state->header);
-		if(state->buffer)
-			free(state->buffer);
-		state->state = tcp_usb_idle;
-		break;
+static void tcp_usb_free_tag(tcp_usb_state_t *_state, int _tag)
+{
+	tcp_usb_request_t *req = &_state->requests[_tag];
 
-	case tcp_usb_write_request:
-		debug_printf("%s: tcp_usb_write_request\n", __func__);
+	req->state = tcp_usb_req_free;
+	req->header = NULL;
+	if(_state->host)
+		req->buffer = NULL;
+}
 
-		if(state->amount_done < sizeof(*state->header))
-		{
-			ret = write(state->socket,
-					((char*)state->header) + state->amount_done,
-					sizeof(*state->header) - state->amount_done);
-			if(ret == 0 && _can_write)
-			{
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d writing request header!\n", ret);
-				return;
-			}
+static void tcp_usb_enqueue(tcp_usb_state_t *_state, int _entry)
+{
+	_state->send_queue[(_state->send_head + _state->send_count) % TCP_USB_QUEUE_SIZE] = _entry;
+	_state->send_count++;
+}
 
-			_can_write = 0;
-			state->amount_done += ret;
+// Drop an entry that hasn't gone out yet, returns 0 if it wasn't queued.
+static int tcp_usb_dequeue(tcp_usb_state_t *_state, int _entry)
+{
+	int i, n;
 
-			if(state->amount_done < sizeof(*state->header))
-				return;
+	for(i = 0; i < _state->send_count; i++)
+	{
+		if(_state->send_queue[(_state->send_head + i) % TCP_USB_QUEUE_SIZE] == _entry)
+			break;
+	}
 
-			debug_hexdump("tcp_usb: Sent Header: ", state->header, sizeof(*state->header));
-		}
+	if(i == _state->send_count)
+		return 0;
+
+	for(n = i; n < _state->send_count - 1; n++)
+	{
+		_state->send_queue[(_state->send_head + n) % TCP_USB_QUEUE_SIZE] =
+			_state->send_queue[(_state->send_head + n + 1) % TCP_USB_QUEUE_SIZE];
+	}
+
+	_state->send_count--;
+	return 1;
+}
+
+/*
+ * Start writing the next frame if the link is free. The host sends
+ * requests with their OUT data and cancels, the client sends responses
+ * with their IN data.
+ */
+static void tcp_usb_kick(tcp_usb_state_t *_state)
+{
+	tcp_usb_io_t *io = &_state->tx;
+	uint32_t total = 0;
+	int i, count;
+
+	if(_state->closed || _state->writing || _state->dispatching
+			|| _state->send_count == 0)
+		return;
+
+	count = MIN(_state->send_count, _state->max_batch);
+
+	tcp_usb_iov_reset(io);
+	tcp_usb_iov_add(io, &io->frame, sizeof(io->frame));
+	tcp_usb_iov_add(io, io->headers, count * sizeof(tcp_usb_header_t));
+
+	for(i = 0; i < count; i++)
+	{
+		int entry = _state->send_queue[(_state->send_head + i) % TCP_USB_QUEUE_SIZE];
+		tcp_usb_request_t *req = &_state->requests[entry & ~TCP_USB_CANCEL_ENTRY];
+		tcp_usb_header_t *hdr = &io->headers[i];
 
-		if((state->header->ep & USB_DIR_IN) == 0 && state->header->length > 0) // OUT
+		if(entry & TCP_USB_CANCEL_ENTRY)
 		{
-			ret = write(state->socket,
-					((char*)state->buffer) + (state->amount_done - sizeof(*state->header)),
-					state->header->length - (state->amount_done - sizeof(*state->header)));
-			if(ret == 0 && _can_write)
-			{
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d writing request data!\n", ret);
-				return;
-			}
+			*hdr = req->hdr;
+			continue;
+		}
 
-			_can_write = 0;
-			state->amount_done += ret;
+		*hdr = *req->header;
+		req->state = tcp_usb_req_writing;
+		req->iov = -1;
 
-			if(state->amount_done < sizeof(*state->header) + state->header->length)
-				return;
-			
-			debug_hexdump("tcp_usb: Wrote: ", state->buffer, state->header->length);
+		// OUT data goes with the request, IN data with the response
+		if(((hdr->ep & USB_DIR_IN) == 0) == (_state->host != 0) && hdr->length > 0)
+		{
+			req->iov = tcp_usb_iov_add(io, req->buffer, hdr->length);
+			total += hdr->length;
 		}
+	}
 
-		state->state = tcp_usb_read_response;
-		state->amount_done = 0;
+	_state->send_head = (_state->send_head + count) % TCP_USB_QUEUE_SIZE;
+	_state->send_count -= count;
 
-		// Fall through
-	case tcp_usb_read_response:
-//		debug_printf("%s: tcp_usb_read_response\n", __func__);
+	io->frame.count = count;
+	io->frame.reserved = 0;
+	io->frame.length = total;
 
-		if(state->amount_done < sizeof(*state->header))
-		{
-			ret = read(state->socket,
-					((char*)state->header) + state->amount_done,
-					sizeof(*state->header) - state->amount_done);
-			if(ret == 0 && _can_read)
-			{
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d reading response header.\n", ret);
-				return;
-			}
+	debug_printf("%s: sending %d packets, %u bytes.\n", __func__, io->frame.count, total);
 
-			_can_read = 0;
-			state->amount_done += ret;
+	_state->writing = 1;
+	tcp_usb_update_handlers(_state);
+	tcp_usb_write_frame(_state);
+}
 
-			if(state->amount_done < sizeof(*state->header))
-				return;
+// Push the frame out, then start on the next one.
+static void tcp_usb_write_frame(tcp_usb_state_t *_state)
+{
+	tcp_usb_io_t *io = &_state->tx;
+	int i;
 
-			debug_hexdump("tcp_usb: Got Header: ", state->header, sizeof(*state->header));
-		}
-		
-		if((state->header->ep & USB_DIR_IN) != 0 && state->header->length > 0) // IN
-		{
-			ret = read(state->socket,
-					((char*)state->buffer) + (state->amount_done - sizeof(*state->header)),
-					state->header->length - (state->amount_done - sizeof(*state->header)));
-			if(ret == 0 && _can_read)
-			{
-				tcp_usb_do_closed(state);
-				return;
-			}
-			else if(ret == EWOULDBLOCK || ret == 0 || ret == -1)
-				return;
-			else if(ret < 0)
-			{
-				fprintf(stderr, "tcp_usb: Error %d reading response data.\n", ret);
-				return;
-			}
+	if(tcp_usb_iov_transfer(_state, io, 1) <= 0)
+		return;
 
-			_can_read = 0;
-			state->amount_done += ret;
-		
-			if(state->amount_done < sizeof(*state->header) + state->header->length)
-				return;
-			
-			debug_hexdump("tcp_usb: Read: ", state->buffer, state->header->length);
-		}
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req = &_state->requests[hdr->tag];
 
-		state->state = tcp_usb_idle;
+		if(hdr->flags & tcp_usb_abort)
+			continue;
 
-		// Transfer complete! Call callback!
-		if(state->data_callback)
+		if(!_state->host)
 		{
-			debug_printf("tcp_usb: calling callback!\n");
-			state->data_callback(state, state->callback_arg, state->header, state->buffer);
-			return;
+			// The host may reuse the tag once it has the response
+			tcp_usb_free_tag(_state, hdr->tag);
+			continue;
 		}
-		else
+
+		if(req->state == tcp_usb_req_writing)
+			req->state = tcp_usb_req_sent;
+
+		if(req->bounce)
 		{
-			fprintf(stderr, "tcp_usb: Request sent but no callback!\n");
-			state->state = tcp_usb_idle;
-			return;
+			free(req->bounce);
+			req->bounce = NULL;
 		}
-		break;
 	}
-}
 
-static void tcp_usb_read_callback(void *_arg)
-{
-	tcp_usb_state_t *state = _arg;
-	tcp_usb_callback(state, 1, 0);
+	_state->writing = 0;
+	tcp_usb_kick(_state);
+	tcp_usb_update_handlers(_state);
 }
 
-static void tcp_usb_write_callback(void *_arg)
+// Client: give each new request a slot with its own buffer and point an
+// iovec at each OUT payload.
+static int tcp_usb_setup_request(tcp_usb_state_t *_state)
 {
-	tcp_usb_state_t *state = _arg;
-	tcp_usb_callback(state, 0, 1);
-}
+	tcp_usb_io_t *io = &_state->rx;
+	size_t out = 0;
+	int i;
 
-int tcp_usb_connect(tcp_usb_state_t *_state, char *_host, uint32_t _port)
-{
-	_state->socket = socket(AF_INET, SOCK_STREAM, 0);
-	
-	struct hostent *hostname = gethostbyname(_host);
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		if(hdr->length < 0 || hdr->length > TCP_USB_MAX_PAYLOAD
+				|| hdr->tag >= TCP_USB_MAX_TAGS)
+			return -1;
 
-	struct sockaddr_in server_addr;
-	memset(&server_addr, 0, sizeof(server_addr));
+		if(hdr->flags & tcp_usb_abort)
+		{
+			if(hdr->length != 0)
+				return -1;
 
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(_port);
-	memcpy(&server_addr.sin_addr.s_addr,
-			hostname->h_addr, hostname->h_length);
+			continue;
+		}
 
-	int ret = connect(_state->socket, &server_addr, sizeof(server_addr));
-	if(ret < 0)
-		return -EIO;
+		if(_state->requests[hdr->tag].state != tcp_usb_req_free)
+			return -1;
 
-	_state->closed = 0;
-	int flags = fcntl(_state->socket, F_GETFL, 0);
-	fcntl(_state->socket, F_SETFL, flags | O_NONBLOCK);
-	qemu_set_fd_handler(_state->socket, tcp_usb_read_callback, tcp_usb_write_callback, _state);
-	return 0;
-}
+		if((hdr->ep & USB_DIR_IN) == 0)
+			out += hdr->length;
+	}
 
-int tcp_usb_request(tcp_usb_state_t *_state, tcp_usb_header_t *_header, const char *_data)
-{
-	debug_printf("%s.\n", __func__);
+	if(out != io->frame.length)
+		return -1;
 
-	if(_state->state != tcp_usb_idle)
-		return -EBUSY;
+	tcp_usb_iov_reset(io);
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req = &_state->requests[hdr->tag];
 
-	debug_printf("%s starting request.\n", __func__);
-	
-	_state->state = tcp_usb_write_request;
-	_state->amount_done = 0;
-	_state->buffer = (char*)_data;
-	_state->header = _header;
+		if(hdr->flags & tcp_usb_abort)
+			continue;
 
-	tcp_usb_callback(_state, 0, 1);
-	return 0;
-}
+		if(hdr->length > req->size)
+		{
+			char *ptr = realloc(req->buffer, hdr->length);
+			if(!ptr)
+				return -1;
 
-void tcp_usb_host_init(tcp_usb_host_state_t *_state)
-{
-	_state->socket = -1;
-}
+			req->buffer = ptr;
+			req->size = hdr->length;
+		}
 
-void tcp_usb_host_cleanup(tcp_usb_host_state_t *_state)
-{
-	if(_state->socket >= 0)
-	{
-		close(_state->socket);
-		_state->socket = -1;
+		req->hdr = *hdr;
+		req->header = &req->hdr;
+		req->max = hdr->length;
+		req->state = tcp_usb_req_parked;
+
+		if((hdr->ep & USB_DIR_IN) == 0)
+			tcp_usb_iov_add(io, req->buffer, hdr->length);
 	}
-}
 
-int tcp_usb_host_okay(tcp_usb_host_state_t *_state)
-{
 	return 0;
 }
 
-int tcp_usb_host(tcp_usb_host_state_t *_state, uint32_t _port)
+// Client: run each request through the callback. Those it doesn't park
+// are answered in the next response frame.
+static void tcp_usb_dispatch_request(tcp_usb_state_t *_state)
 {
-	_state->socket = socket(AF_INET, SOCK_STREAM, 0);
-	if(_state->socket < 0)
-		return -EIO;
+	tcp_usb_io_t *io = &_state->rx;
+	int i;
+
+	_state->dispatching = 1;
+
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req = &_state->requests[hdr->tag];
+		int ret;
+
+		if(hdr->flags & tcp_usb_abort)
+		{
+			// Only a parked request can still be cancelled
+			if(req->state != tcp_usb_req_parked || req->hdr.ep != hdr->ep)
+				continue;
+
+			req->hdr.flags |= tcp_usb_abort;
+			_state->data_callback(_state, _state->callback_arg, &req->hdr, req->buffer);
+			req->hdr.flags &= ~tcp_usb_abort;
+			tcp_usb_complete(_state, &req->hdr, USB_RET_NAK);
+			continue;
+		}
+
+		debug_printf("tcp_usb: Calling callback.\n");
+		ret = _state->data_callback(_state, _state->callback_arg, &req->hdr, req->buffer);
+		if(ret != USB_RET_ASYNC)
+			tcp_usb_complete(_state, &req->hdr, ret);
+
+		if(_state->closed)
+			return;
+	}
+
+	_state->dispatching = 0;
+	tcp_usb_kick(_state);
+}
+
+// Host: match the reply headers to their requests by tag and aim the IN
+// payloads at the callers' buffers, or at our own for cancelled requests.
+static int tcp_usb_setup_response(tcp_usb_state_t *_state)
+{
+	tcp_usb_io_t *io = &_state->rx;
+	uint32_t total = 0;
+	size_t scratch = 0;
+	int i;
+
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req;
+
+		if(hdr->tag >= TCP_USB_MAX_TAGS)
+			return -1;
+
+		req = &_state->requests[hdr->tag];
+		if(req->state != tcp_usb_req_sent && req->state != tcp_usb_req_cancelled)
+			return -1;
+
+		if((hdr->ep & USB_DIR_IN) != 0 && hdr->length > 0) // IN
+		{
+			if(hdr->length > req->max)
+				return -1;
+
+			scratch = MAX(scratch, hdr->length);
+			total += hdr->length;
+		}
+	}
+
+	if(total != io->frame.length)
+		return -1;
+
+	// Room to drop the data of any request cancelled while we read
+	if(tcp_usb_reserve_buffer(_state, scratch) < 0)
+		return -1;
+
+	tcp_usb_iov_reset(io);
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req = &_state->requests[hdr->tag];
+		char *dest = _state->buffer;
+
+		if(req->state == tcp_usb_req_sent)
+		{
+			req->state = tcp_usb_req_reading;
+			dest = req->buffer;
+		}
+
+		req->iov = -1;
+		if((hdr->ep & USB_DIR_IN) != 0 && hdr->length > 0)
+			req->iov = tcp_usb_iov_add(io, dest, hdr->length);
+	}
+
+	return 0;
+}
+
+// Host: complete the requests of a response frame.
+static void tcp_usb_dispatch_response(tcp_usb_state_t *_state)
+{
+	tcp_usb_io_t *io = &_state->rx;
+	int i;
+
+	_state->state = tcp_usb_idle;
+	_state->dispatching = 1;
+
+	for(i = 0; i < io->frame.count; i++)
+	{
+		tcp_usb_header_t *hdr = &io->headers[i];
+		tcp_usb_request_t *req = &_state->requests[hdr->tag];
+		tcp_usb_header_t *header = req->header;
+		char *buffer = req->buffer;
+
+		if(req->state != tcp_usb_req_reading)
+		{
+			// Answered before our cancel went out, don't send it now
+			// that the tag can be reused
+			tcp_usb_dequeue(_state, hdr->tag | TCP_USB_CANCEL_ENTRY);
+			tcp_usb_free_tag(_state, hdr->tag);
+			continue;
+		}
+
+		// The tag is free again before the callback can ask for one
+		tcp_usb_free_tag(_state, hdr->tag);
+		*header = *hdr;
+
+		debug_printf("tcp_usb: calling callback!\n");
+		_state->data_callback(_state, _state->callback_arg, header, buffer);
+
+		if(_state->closed)
+			return;
+	}
+
+	_state->dispatching = 0;
+	tcp_usb_kick(_state);
+	tcp_usb_update_handlers(_state);
+}
+
+// Read frames whenever they come: responses on the host, requests on
+// the client.
+static void tcp_usb_read_frame(tcp_usb_state_t *state)
+{
+	tcp_usb_io_t *io = &state->rx;
+	int ret;
+
+	if(state->state == tcp_usb_idle)
+	{
+		state->state = state->host ? tcp_usb_read_response : tcp_usb_read_request;
+		io->stage = 0;
+		tcp_usb_iov_reset(io);
+		tcp_usb_iov_add(io, &io->frame, sizeof(io->frame));
+	}
+
+	if(io->stage == 0)
+	{
+		ret = tcp_usb_iov_transfer(state, io, 0);
+		if(ret <= 0)
+			return;
+
+		if(io->frame.count == 0 || io->frame.count > state->max_batch)
+		{
+			tcp_usb_protocol_error(state, "bad frame count");
+			return;
+		}
+
+		io->stage = 1;
+		tcp_usb_iov_reset(io);
+		tcp_usb_iov_add(io, io->headers, io->frame.count * sizeof(tcp_usb_header_t));
+	}
+
+	if(io->stage == 1)
+	{
+		ret = tcp_usb_iov_transfer(state, io, 0);
+		if(ret <= 0)
+			return;
+
+		debug_hexdump("tcp_usb: Got Headers: ", io->headers, io->frame.count * sizeof(tcp_usb_header_t));
+
+		ret = state->host ? tcp_usb_setup_response(state) : tcp_usb_setup_request(state);
+		if(ret < 0)
+		{
+			tcp_usb_protocol_error(state, state->host ? "bad response" : "bad request");
+			return;
+		}
+
+		io->stage = 2;
+	}
+
+	ret = tcp_usb_iov_transfer(state, io, 0);
+	if(ret <= 0)
+		return;
+
+	// Transfer complete! Call callback!
+	state->state = tcp_usb_idle;
+	if(!state->data_callback)
+	{
+		fprintf(stderr, "tcp_usb: Frame received but no callback!\n");
+		return;
+	}
+
+	if(state->host)
+		tcp_usb_dispatch_response(state);
+	else
+		tcp_usb_dispatch_request(state);
+}
+
+static void tcp_usb_callback(tcp_usb_state_t *state, int _can_read, int _can_write)
+{
+	if(state->closed)
+		return;
+
+	if(_can_write && state->writing)
+		tcp_usb_write_frame(state);
+
+	if(_can_read && !state->closed)
+		tcp_usb_read_frame(state);
+}
+
+static void tcp_usb_read_callback(void *_arg)
+{
+	tcp_usb_state_t *state = _arg;
+	tcp_usb_callback(state, 1, 0);
+}
+
+static void tcp_usb_write_callback(void *_arg)
+{
+	tcp_usb_state_t *state = _arg;
+	tcp_usb_callback(state, 0, 1);
+}
+
+static void tcp_usb_doorbell_callback(void *_arg)
+{
+	tcp_usb_state_t *state = _arg;
+	uint64_t count;
+	uint32_t tail;
+
+	// Non-blocking, and there may be nothing left to clear
+	if(read(state->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	{
+		fprintf(stderr, "tcp_usb: Error %d reading doorbell.\n", errno);
+		tcp_usb_do_closed(state);
+		return;
+	}
+
+	// The doorbell only rings once for whatever is in the ring
+	do
+	{
+		tail = state->rx_ring->tail;
+		tcp_usb_callback(state, 1, 1);
+	}
+	while(!state->closed && state->rx_ring->tail != tail);
+}
+
+// With shared memory nothing more comes over the socket, until it closes.
+static void tcp_usb_hangup_callback(void *_arg)
+{
+	tcp_usb_state_t *state = _arg;
+	char c;
+	ssize_t ret;
+
+	ret = recv(state->socket, &c, 1, MSG_DONTWAIT);
+	if(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if(ret > 0)
+		tcp_usb_protocol_error(state, "data on shared memory link");
+	else
+		tcp_usb_do_closed(state);
+}
+
+static int tcp_usb_full_io(int _socket, void *_buf, size_t _len, int _write)
+{
+	char *ptr = _buf;
+	ssize_t ret;
+
+	while(_len > 0)
+	{
+		if(_write)
+			ret = write(_socket, ptr, _len);
+		else
+			ret = read(_socket, ptr, _len);
+
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return -EIO;
+
+		ptr += ret;
+		_len -= ret;
+	}
+
+	return 0;
+}
+
+#ifdef TCP_USB_SHM
+static int tcp_usb_shm_map(tcp_usb_state_t *_state, int _memfd)
+{
+	tcp_usb_ring_t *rings;
+
+	rings = mmap(NULL, TCP_USB_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _memfd, 0);
+	if(rings == MAP_FAILED)
+		return -errno;
+
+	// The first ring carries what the connecting end sends
+	_state->shm = rings;
+	_state->tx_ring = &rings[_state->host ? 1 : 0];
+	_state->rx_ring = &rings[_state->host ? 0 : 1];
+	return 0;
+}
+
+// Connecting end: set up the rings and doorbells, and the fds to pass on.
+static int tcp_usb_shm_create(tcp_usb_state_t *_state, int _fds[3])
+{
+	int memfd, ret;
+
+	memfd = syscall(SYS_memfd_create, "tcp_usb", 0);
+	if(memfd < 0)
+		return -errno;
+
+	if(ftruncate(memfd, TCP_USB_SHM_SIZE) < 0)
+	{
+		ret = -errno;
+		close(memfd);
+		return ret;
+	}
+
+	ret = tcp_usb_shm_map(_state, memfd);
+	if(ret < 0)
+	{
+		close(memfd);
+		return ret;
+	}
+
+	_state->peer_doorbell = eventfd(0, 0);
+	_state->doorbell = eventfd(0, 0);
+	if(_state->peer_doorbell < 0 || _state->doorbell < 0)
+	{
+		if(_state->peer_doorbell >= 0)
+			close(_state->peer_doorbell);
+		if(_state->doorbell >= 0)
+			close(_state->doorbell);
+		_state->peer_doorbell = -1;
+		_state->doorbell = -1;
+
+		munmap(_state->shm, TCP_USB_SHM_SIZE);
+		_state->shm = NULL;
+		_state->rx_ring = NULL;
+		_state->tx_ring = NULL;
+		close(memfd);
+		return -EIO;
+	}
+
+	fcntl(_state->peer_doorbell, F_SETFL, O_NONBLOCK);
+	fcntl(_state->doorbell, F_SETFL, O_NONBLOCK);
+
+	_fds[0] = memfd;
+	_fds[1] = _state->peer_doorbell;
+	_fds[2] = _state->doorbell;
+	return 0;
+}
+
+// Accepting end: take over the fds that came with the hello.
+static int tcp_usb_shm_attach(tcp_usb_state_t *_state, int _fds[3])
+{
+	struct stat st;
+	int ret;
+
+	if(fstat(_fds[0], &st) < 0 || st.st_size < TCP_USB_SHM_SIZE)
+		return -EINVAL;
+
+	ret = tcp_usb_shm_map(_state, _fds[0]);
+	if(ret < 0)
+		return ret;
+
+	close(_fds[0]);
+	_state->doorbell = _fds[1];
+	_state->peer_doorbell = _fds[2];
+	return 0;
+}
+#else
+static int tcp_usb_shm_create(tcp_usb_state_t *_state, int _fds[3])
+{
+	return -ENOSYS;
+}
+
+static int tcp_usb_shm_attach(tcp_usb_state_t *_state, int _fds[3])
+{
+	return -ENOSYS;
+}
+#endif
+
+// Send a hello, with file descriptors attached to its first byte.
+static int tcp_usb_send_hello(int _socket, tcp_usb_hello_t *_hello, int *_fds, int _nfds)
+{
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	if(_nfds == 0)
+		return tcp_usb_full_io(_socket, _hello, sizeof(*_hello), 1);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = _hello;
+	iov.iov_len = sizeof(*_hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(_nfds * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(_nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), _fds, _nfds * sizeof(int));
+
+	do
+	{
+		ret = sendmsg(_socket, &msg, 0);
+	}
+	while(ret < 0 && errno == EINTR);
+
+	if(ret <= 0)
+		return -EIO;
+
+	return tcp_usb_full_io(_socket, (char*)_hello + ret, sizeof(*_hello) - ret, 1);
+}
+
+// Read a hello and up to three file descriptors that came with it.
+static int tcp_usb_recv_hello(int _socket, tcp_usb_hello_t *_hello, int _fds[3], int *_nfds)
+{
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+	int i, n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = _hello;
+	iov.iov_len = sizeof(*_hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	do
+	{
+		ret = recvmsg(_socket, &msg, 0);
+	}
+	while(ret < 0 && errno == EINTR);
+
+	if(ret <= 0)
+		return -EIO;
+
+	*_nfds = 0;
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		int *fds = (int*)CMSG_DATA(cmsg);
+
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(i = 0; i < n; i++)
+		{
+			if(*_nfds < 3)
+				_fds[(*_nfds)++] = fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+
+	return tcp_usb_full_io(_socket, (char*)_hello + ret, sizeof(*_hello) - ret, 0);
+}
+
+/*
+ * Swap hellos on a fresh, still blocking, socket. The connecting end asks
+ * for _transport, the accepting end grants it if it can.
+ */
+static int tcp_usb_handshake(tcp_usb_state_t *_state, int _transport)
+{
+	tcp_usb_hello_t hello, peer;
+	int fds[3] = { -1, -1, -1 }, nfds = 0, i, ret;
+
+	hello.magic = TCP_USB_MAGIC;
+	hello.version = TCP_USB_VERSION;
+	hello.max_batch = TCP_USB_MAX_BATCH;
+	hello.transport = _transport;
+
+	if(!_state->host)
+	{
+		if(_transport == tcp_usb_transport_shm)
+		{
+			ret = tcp_usb_shm_create(_state, fds);
+			if(ret < 0)
+				return ret;
+
+			nfds = 3;
+		}
+
+		ret = tcp_usb_send_hello(_state->socket, &hello, fds, nfds);
+
+		// Mapped already, and the doorbells are ours to keep
+		if(nfds)
+			close(fds[0]);
+
+		nfds = 0;
+		if(ret < 0)
+			return ret;
+	}
+
+	ret = tcp_usb_recv_hello(_state->socket, &peer, fds, &nfds);
+	if(ret < 0 || peer.magic != TCP_USB_MAGIC || peer.version != TCP_USB_VERSION)
+	{
+		for(i = 0; i < nfds; i++)
+			close(fds[i]);
+
+		if(ret < 0)
+			return -EIO;
+
+		fprintf(stderr, "tcp_usb: Peer speaks protocol version %d, we need %d.\n",
+				peer.magic == TCP_USB_MAGIC ? peer.version : 1, TCP_USB_VERSION);
+		return -EPROTO;
+	}
+
+	if(_state->host)
+	{
+		hello.transport = tcp_usb_transport_socket;
+		if(peer.transport == tcp_usb_transport_shm && nfds == 3
+				&& tcp_usb_shm_attach(_state, fds) == 0)
+		{
+			hello.transport = tcp_usb_transport_shm;
+			nfds = 0;
+		}
+
+		for(i = 0; i < nfds; i++)
+			close(fds[i]);
+
+		if(tcp_usb_send_hello(_state->socket, &hello, NULL, 0) < 0)
+			return -EIO;
+	}
+	else
+	{
+		for(i = 0; i < nfds; i++)
+			close(fds[i]);
+
+		if(peer.transport != _transport)
+		{
+			fprintf(stderr, "tcp_usb: Peer refused transport %d.\n", _transport);
+			return -EPROTO;
+		}
+	}
+
+	_state->max_batch = MIN(MAX(peer.max_batch, 1), TCP_USB_MAX_BATCH);
+	return 0;
+}
+
+static void tcp_usb_start(tcp_usb_state_t *_state)
+{
+	int flags = fcntl(_state->socket, F_GETFL, 0);
+	fcntl(_state->socket, F_SETFL, flags | O_NONBLOCK);
+
+	_state->closed = 0;
+	_state->state = tcp_usb_idle;
+	tcp_usb_update_handlers(_state);
+}
+
+int tcp_usb_connect(tcp_usb_state_t *_state, char *_host, uint32_t _port)
+{
+	int ret;
+
+	struct hostent *hostname = gethostbyname(_host);
+	if(hostname == NULL)
+		return -ENOENT;
+
+	_state->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if(_state->socket < 0)
+		return -EIO;
+
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(server_addr));
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(_port);
+	memcpy(&server_addr.sin_addr.s_addr,
+			hostname->h_addr, hostname->h_length);
+
+	ret = connect(_state->socket, (struct sockaddr*)&server_addr, sizeof(server_addr));
+	if(ret < 0)
+	{
+		close(_state->socket);
+		_state->socket = -1;
+		return -EIO;
+	}
+
+	ret = tcp_usb_handshake(_state, tcp_usb_transport_socket);
+	if(ret < 0)
+	{
+		tcp_usb_cleanup(_state);
+		return ret;
+	}
+
+	tcp_usb_start(_state);
+	return 0;
+}
+
+int tcp_usb_connect_unix(tcp_usb_state_t *_state, const char *_path, int _transport)
+{
+	struct sockaddr_un server_addr;
+	int ret;
+
+	if(strlen(_path) >= sizeof(server_addr.sun_path))
+		return -ENAMETOOLONG;
+
+	_state->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(_state->socket < 0)
+		return -EIO;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sun_family = AF_UNIX;
+	pstrcpy(server_addr.sun_path, sizeof(server_addr.sun_path), _path);
+
+	ret = connect(_state->socket, (struct sockaddr*)&server_addr, sizeof(server_addr));
+	if(ret < 0)
+	{
+		close(_state->socket);
+		_state->socket = -1;
+		return -EIO;
+	}
+
+	ret = tcp_usb_handshake(_state, _transport);
+	if(ret < 0)
+	{
+		tcp_usb_cleanup(_state);
+		return ret;
+	}
+
+	tcp_usb_start(_state);
+	return 0;
+}
+
+int tcp_usb_request(tcp_usb_state_t *_state, tcp_usb_header_t *_header, const char *_data)
+{
+	tcp_usb_request_t *req;
+	int i, tag;
+
+	debug_printf("%s.\n", __func__);
+
+	if(_state->closed)
+		return -EIO;
+
+	for(i = 0; i < TCP_USB_MAX_TAGS; i++)
+	{
+		tag = (_state->next_tag + i) % TCP_USB_MAX_TAGS;
+		if(_state->requests[tag].state == tcp_usb_req_free)
+			break;
+	}
+
+	if(i == TCP_USB_MAX_TAGS)
+		return -EBUSY;
+
+	debug_printf("%s queueing request %d.\n", __func__, tag);
+
+	_state->next_tag = (tag + 1) % TCP_USB_MAX_TAGS;
+	_header->tag = tag;
+
+	req = &_state->requests[tag];
+	req->header = _header;
+	req->buffer = (char*)_data;
+	req->max = _header->length;
+	req->state = tcp_usb_req_queued;
+
+	tcp_usb_enqueue(_state, tag);
+	tcp_usb_kick(_state);
+	return tag;
+}
+
+/*
+ * Client: answer a request the callback returned USB_RET_ASYNC for.
+ * _length is what the callback would have returned, and IN data must
+ * already be in the request's buffer.
+ */
+void tcp_usb_complete(tcp_usb_state_t *_state, tcp_usb_header_t *_hdr, int _length)
+{
+	tcp_usb_request_t *req = &_state->requests[_hdr->tag];
+
+	if(_state->host || req->state != tcp_usb_req_parked || _hdr != &req->hdr)
+	{
+		fprintf(stderr, "%s: request %d isn't waiting for an answer.\n", __func__, _hdr->tag);
+		return;
+	}
+
+	if((_hdr->ep & USB_DIR_IN) != 0 && _length > req->max)
+		_length = req->max;
+
+	_hdr->length = _length;
+	req->state = tcp_usb_req_queued;
+
+	tcp_usb_enqueue(_state, _hdr->tag);
+	tcp_usb_kick(_state);
+}
+
+/*
+ * Forget a request whose caller has gone away. It is dropped from the
+ * queue if it hasn't been sent, otherwise the device is told to give up
+ * on it and its response is read into our own buffer and discarded.
+ * Nothing touches the caller's header or buffer afterwards.
+ */
+void tcp_usb_cancel(tcp_usb_state_t *_state, int _tag)
+{
+	tcp_usb_request_t *req;
+
+	if(_tag < 0 || _tag >= TCP_USB_MAX_TAGS || !_state->host)
+		return;
+
+	req = &_state->requests[_tag];
+	switch(req->state)
+	{
+	case tcp_usb_req_queued:
+		tcp_usb_dequeue(_state, _tag);
+		tcp_usb_free_tag(_state, _tag);
+		return;
+
+	case tcp_usb_req_writing:
+		// The rest of its OUT data still has to go out
+		if(req->iov >= 0)
+		{
+			struct iovec *iov = &_state->tx.iov[req->iov];
+
+			req->bounce = malloc(iov->iov_len);
+			if(!req->bounce)
+			{
+				tcp_usb_protocol_error(_state, "out of memory");
+				return;
+			}
+
+			memcpy(req->bounce, iov->iov_base, iov->iov_len);
+			iov->iov_base = req->bounce;
+		}
+
+		// Fall through
+	case tcp_usb_req_sent:
+		// The device may be holding on to it until its endpoint is ready
+		req->hdr.addr = req->header->addr;
+		req->hdr.ep = req->header->ep;
+		req->hdr.flags = tcp_usb_abort;
+		req->hdr.tag = _tag;
+		req->hdr.length = 0;
+
+		tcp_usb_enqueue(_state, _tag | TCP_USB_CANCEL_ENTRY);
+		tcp_usb_kick(_state);
+		break;
+
+	case tcp_usb_req_reading:
+		if(req->iov >= 0)
+			_state->rx.iov[req->iov].iov_base = _state->buffer;
+		break;
+
+	default:
+		break;
+	}
+
+	if(req->state != tcp_usb_req_free)
+	{
+		req->state = tcp_usb_req_cancelled;
+		req->header = NULL;
+		req->buffer = NULL;
+	}
+}
+
+void tcp_usb_host_init(tcp_usb_host_state_t *_state)
+{
+	_state->socket = -1;
+}
+
+void tcp_usb_host_cleanup(tcp_usb_host_state_t *_state)
+{
+	if(_state->socket >= 0)
+	{
+		close(_state->socket);
+		_state->socket = -1;
+	}
+}
+
+int tcp_usb_host_okay(tcp_usb_host_state_t *_state)
+{
+	return 0;
+}
+
+int tcp_usb_host(tcp_usb_host_state_t *_state, uint32_t _port)
+{
+	_state->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if(_state->socket < 0)
+		return -EIO;
 	
 	struct linger linger;
 	linger.l_onoff = 0;
@@ -507,24 +1406,55 @@ int tcp_usb_host(tcp_usb_host_state_t *_state, uint32_t _port)
 	return 0;
 }
 
+int tcp_usb_host_unix(tcp_usb_host_state_t *_state, const char *_path)
+{
+	struct sockaddr_un server_addr;
+
+	if(strlen(_path) >= sizeof(server_addr.sun_path))
+		return -ENAMETOOLONG;
+
+	_state->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(_state->socket < 0)
+		return -EIO;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sun_family = AF_UNIX;
+	pstrcpy(server_addr.sun_path, sizeof(server_addr.sun_path), _path);
+
+	// A server that went away leaves its socket behind
+	unlink(_path);
+
+	if(bind(_state->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0)
+		return -EIO;
+
+	listen(_state->socket, 5);
+	return 0;
+}
+
 int tcp_usb_accept(tcp_usb_host_state_t *_host, tcp_usb_state_t *_client)
 {
-	struct sockaddr_in addr;
-	size_t addr_sz = sizeof(addr);
+	struct sockaddr_storage addr;
+	socklen_t addr_sz = sizeof(addr);
 
 	debug_printf("%s: waiting on accept...\n", __func__);
 
-	_client->socket = accept(_host->socket, &addr, &addr_sz);
+	_client->socket = accept(_host->socket, (struct sockaddr*)&addr, &addr_sz);
 	if(_client->socket < 0)
 	{
 		fprintf(stderr, "%s: accept error %d.\n", __func__, errno);
 		return -EIO;
 	}
 
-	_client->closed = 0;
-	int flags = fcntl(_client->socket, F_GETFL, 0);
-	fcntl(_client->socket, F_SETFL, flags | O_NONBLOCK);
-	qemu_set_fd_handler(_client->socket, tcp_usb_read_callback, tcp_usb_write_callback, _client);
+	// The accepting end drives the link
+	_client->host = 1;
+
+	if(tcp_usb_handshake(_client, tcp_usb_transport_socket) < 0)
+	{
+		fprintf(stderr, "%s: handshake failed.\n", __func__);
+		return -EPROTO;
+	}
+
+	tcp_usb_start(_client);
 	debug_printf("%s: USB device accepted!\n", __func__);
 	return 0;
 }
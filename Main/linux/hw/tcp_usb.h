@@ -27,28 +27,100 @@ enum
 	tcp_usb_setup = 1 << 0,
 	tcp_usb_reset = 1 << 1,
 	tcp_usb_enumdone = 1 << 2,
+	tcp_usb_abort = 1 << 3,
 };
 
 typedef enum _tcp_usb_state_enum
 {
 	tcp_usb_idle,
 
-	// Client
+	// Client, responses are written independently
 	tcp_usb_read_request,
-	tcp_usb_write_response,
 
-	// Host
-	tcp_usb_write_request,
+	// Host, requests are written independently
 	tcp_usb_read_response,
 
 } tcp_usb_state_enum_t;
 
+// How frames travel once the hello has been swapped
+enum
+{
+	tcp_usb_transport_socket = 0,	// the TCP or AF_UNIX stream itself
+	tcp_usb_transport_shm = 1,		// rings in a memfd, eventfd doorbells
+};
+
+/*
+ * Wire protocol, version 5.
+ *
+ * The connecting end sends a tcp_usb_hello_t as soon as the connection is
+ * up, and the accepting end answers with its own. Either drops the link if
+ * the magic or version differ. `transport` in the first hello asks for a
+ * transport, the answer holds the one granted. For tcp_usb_transport_shm,
+ * which needs an AF_UNIX socket, the first hello carries three file
+ * descriptors: a memfd holding two tcp_usb_ring_t (connecting to accepting
+ * end, then the other way) and the eventfds the accepting and the
+ * connecting end wait on. The socket then only tells either end when the
+ * other has gone. After that, requests
+ * and responses travel in frames: a tcp_usb_frame_t, then `count`
+ * tcp_usb_header_t, then the payloads of those packets back to back
+ * (OUT data in a request, IN data in a response). `length` in the frame
+ * is the total payload size. Fields are in host byte order.
+ *
+ * Every request carries a tag, which its response echoes. The host keeps
+ * sending request frames while earlier ones are outstanding, up to
+ * TCP_USB_MAX_TAGS requests, and the device may answer them in any order
+ * and in frames of any size. The device may sit on a request until the
+ * guest has set up the endpoint for it.
+ *
+ * A header with tcp_usb_abort in its flags and no payload asks the device
+ * to give up on an outstanding request with that tag. It still gets a
+ * response, USB_RET_NAK if nothing had been transferred yet, and nothing
+ * is sent back for the cancel itself.
+ */
+#define TCP_USB_MAGIC		0x42535554 // "TUSB"
+#define TCP_USB_VERSION		5
+#define TCP_USB_MAX_BATCH	32
+#define TCP_USB_MAX_TAGS	64
+#define TCP_USB_QUEUE_SIZE	(2 * TCP_USB_MAX_TAGS)
+#define TCP_USB_MAX_PAYLOAD	(16 << 20)
+#define TCP_USB_RING_SIZE	(1 << 20)
+
+typedef struct _tcp_usb_hello
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t max_batch;
+	uint32_t transport;
+
+} __attribute__((packed)) tcp_usb_hello_t;
+
+// One direction of the shared memory transport, a byte stream standing in
+// for the socket. head and tail run freely, each written by one side only.
+typedef struct _tcp_usb_ring
+{
+	volatile uint32_t head;		// bytes produced
+	uint8_t pad0[60];
+	volatile uint32_t tail;		// bytes consumed
+	uint8_t pad1[60];
+	uint8_t data[TCP_USB_RING_SIZE];
+
+} tcp_usb_ring_t;
+
+typedef struct _tcp_usb_frame
+{
+	uint16_t count;
+	uint16_t reserved;
+	uint32_t length;
+
+} __attribute__((packed)) tcp_usb_frame_t;
+
 typedef struct _tcp_usb_header
 {
 	uint8_t addr;
 	uint8_t ep;
 	uint8_t flags;
-	int16_t length;
+	uint8_t tag;
+	int32_t length;
 
 } __attribute__((packed)) tcp_usb_header_t;
 
@@ -56,15 +128,86 @@ struct _tcp_usb_state;
 typedef int (*tcp_usb_callback_t)(struct _tcp_usb_state *_status, void *_arg, tcp_usb_header_t *_hdr, char *_buffer);
 typedef void (*tcp_usb_closed_t)(struct _tcp_usb_state *_state, void *_arg);
 
+typedef enum _tcp_usb_request_state
+{
+	tcp_usb_req_free,
+	tcp_usb_req_queued,		// waiting for a frame to go out in
+	tcp_usb_req_writing,	// in the frame being written
+	tcp_usb_req_sent,		// host: waiting for its response
+	tcp_usb_req_cancelled,	// host: on the wire, response will be dropped
+	tcp_usb_req_reading,	// host: in the response frame being read
+	tcp_usb_req_parked,		// client: with the device, not answered yet
+
+} tcp_usb_request_state_t;
+
+typedef struct _tcp_usb_request
+{
+	tcp_usb_header_t *header;
+	char *buffer;
+	tcp_usb_request_state_t state;
+	int iov;				// payload's slot in the frame's iovec
+	int32_t max;			// length asked for
+
+	// Client: the request itself. Host: its cancel.
+	tcp_usb_header_t hdr;
+
+	// Host: OUT data kept for a cancelled request
+	char *bounce;
+
+	// Client: size of buffer, kept across requests on this tag
+	size_t size;
+
+} tcp_usb_request_t;
+
+// A frame on its way across the socket.
+typedef struct _tcp_usb_io
+{
+	int stage;
+	size_t amount_done;
+
+	tcp_usb_frame_t frame;
+	tcp_usb_header_t headers[TCP_USB_MAX_BATCH];
+	struct iovec iov[TCP_USB_MAX_BATCH + 2];
+	int iovcnt;
+
+} tcp_usb_io_t;
+
 typedef struct _tcp_usb_state
 {
 	int socket;
 	int closed;
+	int host;
+	int max_batch;
+
+	// Shared memory transport, shm is NULL on a plain socket
+	void *shm;
+	tcp_usb_ring_t *rx_ring;
+	tcp_usb_ring_t *tx_ring;
+	int doorbell;			// rung by the peer
+	int peer_doorbell;
 
+	// Client: request frames. Host: response frames.
 	tcp_usb_state_enum_t state;
-	tcp_usb_header_t *header;
+	tcp_usb_io_t rx;
+
+	// The other way, written while we read
+	int writing;
+	tcp_usb_io_t tx;
+
+	// Indexed by tag
+	tcp_usb_request_t requests[TCP_USB_MAX_TAGS];
+
+	// Tags (and host cancels) waiting for a frame, in order
+	uint8_t send_queue[TCP_USB_QUEUE_SIZE];
+	int send_head;
+	int send_count;
+	int next_tag;
+	int dispatching;
+
+	// Host: where cancelled IN data is dropped, kept for the life of the
+	// connection.
 	char *buffer;
-	size_t amount_done;
+	size_t buffer_size;
 	
 	tcp_usb_closed_t closed_callback;
 	tcp_usb_callback_t data_callback;
@@ -78,7 +221,19 @@ int tcp_usb_closed(tcp_usb_state_t *_state);
 
 int tcp_usb_connect(tcp_usb_state_t *_state, char *_host, uint32_t _port);
 
+// Connect to an AF_UNIX socket, passing frames over it or, with _transport
+// tcp_usb_transport_shm, through shared memory.
+int tcp_usb_connect_unix(tcp_usb_state_t *_state, const char *_path, int _transport);
+
+// Host: queue a request, returns its tag. The header and buffer must stay
+// valid until the callback has run for it or it has been cancelled.
 int tcp_usb_request(tcp_usb_state_t *_state, tcp_usb_header_t *_header, const char *_data);
+void tcp_usb_cancel(tcp_usb_state_t *_state, int _tag);
+
+// Client: answer a request parked by returning USB_RET_ASYNC from the
+// callback. The callback sees it again with tcp_usb_abort set if the host
+// gives up first, and mustn't complete it after that.
+void tcp_usb_complete(tcp_usb_state_t *_state, tcp_usb_header_t *_hdr, int _length);
 
 typedef struct _tcp_usb_host_state
 {
@@ -92,6 +247,7 @@ void tcp_usb_host_cleanup(tcp_usb_host_state_t *_state);
 int tcp_usb_host_okay(tcp_usb_host_state_t *_state);
 
 int tcp_usb_host(tcp_usb_host_state_t *_state, uint32_t _port);
+int tcp_usb_host_unix(tcp_usb_host_state_t *_state, const char *_path);
 int tcp_usb_accept(tcp_usb_host_state_t *_host, tcp_usb_state_t *_client);
 
 #endif //HW_TCP_USB
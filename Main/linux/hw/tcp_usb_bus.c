@@ -38,6 +38,7 @@ typedef struct _tcp_bus_state
 	SysBusDevice busdev;
 	
 	uint32_t port;
+	char *path;
 
 	int closed;
 	QemuThread thread;
@@ -45,6 +46,20 @@ typedef struct _tcp_bus_state
 
 } tcp_bus_state_t;
 
+// Requests each endpoint may have outstanding on the link
+#define TCP_USB_BUS_EP_DEPTH	8
+
+typedef struct _tcp_passthrough_req
+{
+	tcp_usb_header_t header;
+	USBPacket *packet;
+	struct _tcp_passthrough_state *dev;
+	int tag;
+	int queue;
+
+	QTAILQ_ENTRY(_tcp_passthrough_req) next;
+} tcp_passthrough_req_t;
+
 typedef struct _tcp_passthrough_state
 {
 	USBDevice dev;
@@ -52,43 +67,78 @@ typedef struct _tcp_passthrough_state
 	tcp_bus_state_t *parent;
 	tcp_usb_state_t *tcp;
 
-	tcp_usb_header_t header;
-	USBPacket *packet;
-	int cancelled;
+	// In flight, per endpoint and direction (ep | 0x10 for IN)
+	tcp_passthrough_req_t reqs[TCP_USB_MAX_TAGS];
+	QTAILQ_HEAD(, _tcp_passthrough_req) free_reqs;
+	QTAILQ_HEAD(, _tcp_passthrough_req) queues[32];
+	int depth[32];
 } tcp_passthrough_state_t;
 
+static tcp_passthrough_req_t *passthrough_req_new(tcp_passthrough_state_t *state, int _queue)
+{
+	tcp_passthrough_req_t *req = QTAILQ_FIRST(&state->free_reqs);
+	if(req == NULL || state->depth[_queue] >= TCP_USB_BUS_EP_DEPTH)
+		return NULL;
+
+	QTAILQ_REMOVE(&state->free_reqs, req, next);
+	QTAILQ_INSERT_TAIL(&state->queues[_queue], req, next);
+	state->depth[_queue]++;
+
+	req->queue = _queue;
+	req->packet = NULL;
+	req->tag = -1;
+	return req;
+}
+
+static void passthrough_req_free(tcp_passthrough_req_t *req)
+{
+	tcp_passthrough_state_t *state = req->dev;
+
+	QTAILQ_REMOVE(&state->queues[req->queue], req, next);
+	state->depth[req->queue]--;
+	QTAILQ_INSERT_TAIL(&state->free_reqs, req, next);
+	req->packet = NULL;
+	req->tag = -1;
+}
+
 static int passthrough_tcp(tcp_usb_state_t *_state, void *_arg, tcp_usb_header_t *_hdr, char *_buffer)
 {
 	tcp_passthrough_state_t *state = _arg;
 	if(!state)
 		return -EINVAL;
 
+	tcp_passthrough_req_t *req = container_of(_hdr, tcp_passthrough_req_t, header);
+	USBPacket *packet = req->packet;
+
+	passthrough_req_free(req);
+
 	if(_hdr->flags & tcp_usb_reset)
 	{
 		debug_printf("%s: reset.\n", __func__);
 		return 0;
 	}
 
-	if(state->packet == NULL)
+	if(packet == NULL)
 	{
 		debug_printf("%s: no packet.\n", __func__);
 		return 0;
 	}
 
 	debug_printf("%s: completing packet len = %d!\n", __func__, _hdr->length);
-	state->packet->len = _hdr->length;
-	usb_packet_complete(state->packet);
-	state->packet = NULL;
-
+	packet->len = _hdr->length;
 	state->dev.addr = _hdr->addr;
+	usb_packet_complete(packet);
 	return 0;
 }
 
 static void passthrough_cancel(USBPacket *_packet, void *_arg)
 {
-	tcp_passthrough_state_t *state = _arg;
-	state->cancelled = 1;
-	state->packet = NULL;
+	tcp_passthrough_req_t *req = _arg;
+
+	if(req->dev->tcp)
+		tcp_usb_cancel(req->dev->tcp, req->tag);
+
+	passthrough_req_free(req);
 
 	debug_printf("%s.\n", __func__);
 }
@@ -113,7 +163,22 @@ static void passthrough_closed(tcp_usb_state_t *_state, void *_arg)
 static int passthrough_init(USBDevice *dev)
 {
 	tcp_passthrough_state_t *state = DO_UPCAST(tcp_passthrough_state_t, dev, dev);
-	state->packet = NULL;
+	int i;
+
+	QTAILQ_INIT(&state->free_reqs);
+	for(i = 0; i < ARRAY_SIZE(state->queues); i++)
+	{
+		QTAILQ_INIT(&state->queues[i]);
+		state->depth[i] = 0;
+	}
+
+	for(i = 0; i < TCP_USB_MAX_TAGS; i++)
+	{
+		state->reqs[i].dev = state;
+		state->reqs[i].tag = -1;
+		QTAILQ_INSERT_TAIL(&state->free_reqs, &state->reqs[i], next);
+	}
+
 	return 0;
 }
 
@@ -126,16 +191,53 @@ static void passthrough_reset(USBDevice *dev)
 	if(tcp_usb_closed(state->tcp))
 		return;
 
-	state->packet = NULL;
-
 	debug_printf("%s: reset!\n", __func__);
 
-	tcp_usb_header_t *header = &state->header;
+	tcp_passthrough_req_t *req = passthrough_req_new(state, 0);
+	if(req == NULL)
+	{
+		debug_printf("%s: no request for reset.\n", __func__);
+		return;
+	}
+
+	tcp_usb_header_t *header = &req->header;
 	header->addr = 0;
 	header->ep = 0;
 	header->flags = tcp_usb_reset;
 	header->length = 0;
-	tcp_usb_request(state->tcp, header, NULL);
+
+	req->tag = tcp_usb_request(state->tcp, header, NULL);
+	if(req->tag < 0)
+		passthrough_req_free(req);
+}
+
+// Send a token on its endpoint's queue, NAK if the queue is full.
+static int passthrough_submit(tcp_passthrough_state_t *s, USBPacket *p,
+		uint8_t ep, uint8_t flags, int32_t length)
+{
+	int queue = (ep & 0xf) | ((ep & USB_DIR_IN) ? 0x10 : 0);
+	tcp_passthrough_req_t *req = passthrough_req_new(s, queue);
+	int ret;
+
+	if(req == NULL)
+		return USB_RET_NAK;
+
+	req->packet = p;
+	req->header.addr = s->dev.addr;
+	req->header.ep = ep;
+	req->header.flags = flags;
+	req->header.length = length;
+
+	ret = tcp_usb_request(s->tcp, &req->header, (char*)p->data);
+	if(ret < 0)
+	{
+		passthrough_req_free(req);
+		return ret == -EBUSY ? USB_RET_NAK : USB_RET_STALL;
+	}
+
+	req->tag = ret;
+	usb_defer_packet(p, passthrough_cancel, req);
+	return USB_RET_ASYNC;
 }
 
 static int do_token_setup(tcp_passthrough_state_t *s, USBPacket *p)
@@ -143,6 +245,7 @@ static int do_token_setup(tcp_passthrough_state_t *s, USBPacket *p)
 	debug_printf("%s.\n", __func__);
 
     int request, value, index;
+	uint8_t flags = tcp_usb_setup;
 
     if (p->len != 8)
         return USB_RET_STALL;
@@ -154,61 +257,26 @@ static int do_token_setup(tcp_passthrough_state_t *s, USBPacket *p)
     request = (s->dev.setup_buf[0] << 8) | s->dev.setup_buf[1];
     value   = (s->dev.setup_buf[3] << 8) | s->dev.setup_buf[2];
     index   = (s->dev.setup_buf[5] << 8) | s->dev.setup_buf[4];
-	
-	s->header.addr = s->dev.addr;
-	s->header.ep = 0;
-	s->header.flags = tcp_usb_setup;
-	s->header.length = 8;
 
 	if(request == USB_REQ_SET_ADDRESS)
-		s->header.flags |= tcp_usb_enumdone;
-
-	usb_defer_packet(p, passthrough_cancel, s);
-	if(tcp_usb_request(s->tcp, &s->header, (char*)p->data) < 0)
-	{
-		debug_printf("tcp_usb: SETUP fail'd!\n");
-		return USB_RET_STALL;
-	}
+		flags |= tcp_usb_enumdone;
 
-	return USB_RET_ASYNC;
+	return passthrough_submit(s, p, 0, flags, 8);
 }
 
 static int do_token_in(tcp_passthrough_state_t *s, USBPacket *p)
 {
 	debug_printf("%s.\n", __func__);
 
-	s->header.ep = p->devep | USB_DIR_IN;
-	s->header.length = s->dev.setup_len;
-	s->header.addr = s->dev.addr;
-	s->header.flags = 0;
-
-	usb_defer_packet(p, passthrough_cancel, s);
-	if(tcp_usb_request(s->tcp, &s->header, (char*)p->data) < 0)
-	{
-		debug_printf("tcp_usb: IN 0 fail'd.\n");
-		return USB_RET_STALL;
-	}
-
-	return USB_RET_ASYNC;
+	// Never more than the packet's buffer holds
+	return passthrough_submit(s, p, p->devep | USB_DIR_IN, 0, p->len);
 }
 
 static int do_token_out(tcp_passthrough_state_t *s, USBPacket *p)
 {
 	debug_printf("%s.\n", __func__);
 
-	s->header.ep = p->devep & 0x7f;
-	s->header.length = p->len;
-	s->header.addr = s->dev.addr;
-	s->header.flags = 0;
-
-	usb_defer_packet(p, passthrough_cancel, s);
-	if(tcp_usb_request(s->tcp, &s->header, (char*)p->data) < 0)
-	{
-		debug_printf("tcp_usb: OUT 0 fail'd.\n");
-		return USB_RET_STALL;
-	}
-
-	return USB_RET_ASYNC;
+	return passthrough_submit(s, p, p->devep & 0x7f, 0, p->len);
 }
 
 static int passthrough_packet(USBDevice *s, USBPacket *p)
@@ -243,11 +311,6 @@ static int passthrough_packet(USBDevice *s, USBPacket *p)
 	if(state->tcp == NULL)
 		return USB_RET_STALL;
 
-	if(state->packet)
-		return USB_RET_NAK;
-
-	state->packet = p;
-
     switch (p->pid) {
     case USB_TOKEN_SETUP:
         return do_token_setup(state, p);
@@ -269,37 +332,15 @@ static int passthrough_data(USBDevice *dev, USBPacket *p)
 	if(state->tcp == NULL)
 		return USB_RET_STALL;
 
-	int ret = USB_RET_STALL;
-	tcp_usb_header_t *header = &state->header;
 	switch(p->pid)
 	{
 	case USB_TOKEN_OUT:
-		header->ep = p->devep & 0x7f;
-		header->flags = 0;
-		header->addr = dev->addr;
-		header->length = p->len;
-		
-		usb_defer_packet(p, passthrough_cancel, state);
-		ret = tcp_usb_request(state->tcp, header, (char*)p->data);
-		if(ret < 0)
-			return USB_RET_NAK;
-
-		debug_printf("Host USB: OUT token on %02x -> 0x%08x.\n", p->devep, ret);
-		return USB_RET_ASYNC;
+		debug_printf("Host USB: OUT token on %02x.\n", p->devep);
+		return do_token_out(state, p);
 
 	case USB_TOKEN_IN:
-		header->ep = p->devep | USB_DIR_IN;
-		header->flags = 0;
-		header->addr = dev->addr;
-		header->length = p->len;
-
-		usb_defer_packet(p, passthrough_cancel, state);
-		ret = tcp_usb_request(state->tcp, header, (char*)p->data);
-		if(ret < 0)
-			return USB_RET_NAK;
-
-		debug_printf("Host USB: IN token on %02x -> 0x%08x.\n", p->devep, ret);
-		return USB_RET_ASYNC;
+		debug_printf("Host USB: IN token on %02x.\n", p->devep);
+		return do_token_in(state, p);
 	}
 
 	return USB_RET_STALL;
@@ -375,10 +416,20 @@ static int tcp_bus_init(SysBusDevice *dev)
 	state->closed = 0;
 	tcp_usb_host_init(&state->tcp_usb_state);
 
-	if(tcp_usb_host(&state->tcp_usb_state, state->port) < 0)
-		hw_error("Failed to bind USB server socket.\n");
+	if(state->path)
+	{
+		if(tcp_usb_host_unix(&state->tcp_usb_state, state->path) < 0)
+			hw_error("Failed to bind USB server socket %s.\n", state->path);
+
+		printf("TCP USB server started on %s!\n", state->path);
+	}
+	else
+	{
+		if(tcp_usb_host(&state->tcp_usb_state, state->port) < 0)
+			hw_error("Failed to bind USB server socket.\n");
 
-	printf("TCP USB server started on port %d!\n", state->port);
+		printf("TCP USB server started on port %d!\n", state->port);
+	}
 	qemu_thread_create(&state->thread, tcp_bus_thread, state);
 	return 0;
 }
@@ -390,6 +441,7 @@ static SysBusDeviceInfo tcp_bus_info = {
     .qdev.reset = tcp_bus_reset,
     .qdev.props = (Property[]) {
 		DEFINE_PROP_UINT32("port", tcp_bus_state_t, port, 7642),
+		DEFINE_PROP_STRING("path", tcp_bus_state_t, path),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
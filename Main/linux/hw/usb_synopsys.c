@@ -26,6 +26,7 @@
 #include "hw.h"
 #include "usb_synopsys.h"
 #include "tcp_usb.h"
+#include "trace.h"
 
 #define DEVICE_NAME		"usb_synopsys"
 
@@ -223,6 +224,16 @@
 
 #define USB_CONTROLEP 0
 
+// A request from the USB server waiting for the guest to enable its endpoint.
+typedef struct _synopsys_usb_parked
+{
+	tcp_usb_header_t *hdr;
+	char *buffer;
+
+	QTAILQ_ENTRY(_synopsys_usb_parked) next;
+
+} synopsys_usb_parked_t;
+
 typedef struct _synopsys_usb_ep_state
 {
 	uint32_t control;
@@ -233,6 +244,8 @@ typedef struct _synopsys_usb_ep_state
 	target_phys_addr_t dma_address;
 	target_phys_addr_t dma_buffer;
 
+	QTAILQ_HEAD(, _synopsys_usb_parked) parked;
+
 } synopsys_usb_ep_state;
 
 typedef struct _synopsys_usb_state
@@ -242,6 +255,8 @@ typedef struct _synopsys_usb_state
 
 	char *server_host;
 	uint32_t server_port;
+	char *server_path;
+	char *transport;
 	tcp_usb_state_t tcp_state;
 
 	uint32_t pcgcctl;
@@ -348,165 +363,243 @@ static void synopsys_usb_update_ep(synopsys_usb_state *_state, synopsys_usb_ep_s
 	}
 }
 
-static void synopsys_usb_update_in_ep(synopsys_usb_state *_state, uint8_t _ep)
+// Guest memory is read straight into the reply when the endpoint has a
+// DMA address, only PIO transfers go through the FIFO.
+static int synopsys_usb_in_transfer(synopsys_usb_state *_state, uint8_t _ep, tcp_usb_header_t *_hdr, char *_buffer)
 {
 	synopsys_usb_ep_state *eps = &_state->in_eps[_ep];
-	synopsys_usb_update_ep(_state, eps);
 
-	if(eps->control & USB_EPCON_ENABLE)
-		;//printf("USB: IN transfer queued on %d.\n", _ep);
+	if(eps->control & USB_EPCON_STALL)
+	{
+		eps->control &=~ USB_EPCON_STALL; // Should this be EP0 only
+		//printf("USB: Stall.\n");
+		return USB_RET_STALL;
+	}
+
+	if(!(eps->control & USB_EPCON_ENABLE))
+		return USB_RET_NAK;
+
+	// Do IN transfer!
+	eps->control &=~ USB_EPCON_ENABLE;
+
+	size_t sz = eps->tx_size & DEPTSIZ_XFERSIZ_MASK;
+	size_t amtDone = sz;
+	if(amtDone > _hdr->length)
+		amtDone = _hdr->length;
+
+	if(eps->fifo >= USB_NUM_FIFOS)
+		hw_error("usb_synopsys: USB transfer on non-existant FIFO %d!\n", eps->fifo);
+
+	size_t txfz = synopsys_usb_tx_fifo_size(_state, eps->fifo);
+	if(amtDone > txfz)
+		amtDone = txfz;
+
+	size_t txfs = synopsys_usb_tx_fifo_start(_state, eps->fifo);
+	if(txfs + txfz > sizeof(_state->fifos))
+		hw_error("usb_synopsys: USB transfer would overflow FIFO buffer!\n");
+
+	//printf("USB: Starting IN transfer on EP %d (%d)...\n", _ep, amtDone);
+
+	if(amtDone > 0)
+	{
+		if(eps->dma_address)
+		{
+			cpu_physical_memory_read(eps->dma_address, (uint8_t*)_buffer, amtDone);
+			eps->dma_address += amtDone;
+		}
+		else
+			memcpy(_buffer, (char*)&_state->fifos[txfs], amtDone);
+	}
+
+	//printf("USB: IN transfer complete!\n");
+
+	eps->tx_size = (eps->tx_size &~ DEPTSIZ_XFERSIZ_MASK)
+					| ((sz-amtDone) & DEPTSIZ_XFERSIZ_MASK);
+	eps->interrupt_status |= USB_EPINT_XferCompl;
+
+	return amtDone;
 }
 
-static void synopsys_usb_update_out_ep(synopsys_usb_state *_state, uint8_t _ep)
+static int synopsys_usb_out_transfer(synopsys_usb_state *_state, uint8_t _ep, tcp_usb_header_t *_hdr, char *_buffer)
 {
 	synopsys_usb_ep_state *eps = &_state->out_eps[_ep];
-	synopsys_usb_update_ep(_state, eps);
 
-	if(eps->control & USB_EPCON_ENABLE)
-		;//printf("USB: OUT transfer queued on %d.\n", _ep);
-}
+	if(eps->control & USB_EPCON_STALL)
+	{
+		eps->control &=~ USB_EPCON_STALL; // Should this be EP0 only
+		//printf("USB: Stall.\n");
+		return USB_RET_STALL;
+	}
 
-static int synopsys_usb_tcp_callback(tcp_usb_state_t *_state, void *_arg, tcp_usb_header_t *_hdr, char *_buffer)
-{
-	synopsys_usb_state *state = _arg;
+	if(!(eps->control & USB_EPCON_ENABLE))
+		return USB_RET_NAK;
 
-	_hdr->addr = (state->dcfg & DCFG_DEVICEADDRMSK) >> DCFG_DEVICEADDR_SHIFT;
+	// Do OUT transfer!
+	eps->control &=~ USB_EPCON_ENABLE;
 
-	if(_hdr->flags & tcp_usb_reset)
+	size_t sz = eps->tx_size & DEPTSIZ_XFERSIZ_MASK;
+	size_t amtDone = sz;
+	if(amtDone > _hdr->length)
+		amtDone = _hdr->length;
+
+	size_t rxfz = _state->grxfsiz;
+	if(amtDone > rxfz)
+		amtDone = rxfz;
+
+	if(rxfz > sizeof(_state->fifos))
+		hw_error("usb_synopsys: USB transfer would overflow FIFO buffer!\n");
+
+	//printf("USB: Starting OUT transfer on EP %d (%d)...\n", _ep, amtDone);
+
+	if(amtDone > 0)
 	{
-		state->gintsts |= GINTMSK_RESET;
-		synopsys_usb_update_irq(state);
-		return 0;
+		if(eps->dma_address)
+		{
+			cpu_physical_memory_write(eps->dma_address, (uint8_t*)_buffer, amtDone);
+			eps->dma_address += amtDone;
+		}
+		else
+			memcpy((char*)_state->fifos, _buffer, amtDone);
 	}
 
-	if(_hdr->flags & tcp_usb_enumdone)
+	//printf("USB: OUT transfer complete!\n");
+
+	if(_hdr->flags & tcp_usb_setup)
 	{
-		state->gintsts |= GINTMSK_ENUMDONE;
+		uint8_t *setup = (uint8_t*)_buffer;
+		trace_usb_synopsys_setup(setup[0], setup[1],
+				setup[2] | (setup[3] << 8), setup[4] | (setup[5] << 8),
+				setup[6] | (setup[7] << 8));
+		eps->interrupt_status |= USB_EPINT_SetUp;
 	}
+	else
+		eps->interrupt_status |= USB_EPINT_XferCompl;
 
-	int ret;
+	eps->tx_size = (eps->tx_size &~ DEPTSIZ_XFERSIZ_MASK)
+					| ((sz-amtDone) & DEPTSIZ_XFERSIZ_MASK);
+
+	return amtDone;
+}
+
+static int synopsys_usb_transfer(synopsys_usb_state *_state, tcp_usb_header_t *_hdr, char *_buffer)
+{
 	uint8_t ep = _hdr->ep & 0x7f;
+
 	if(_hdr->ep & USB_DIR_IN)
-	{
-		synopsys_usb_ep_state *eps = &state->in_eps[ep];
+		return synopsys_usb_in_transfer(_state, ep, _hdr, _buffer);
+	else
+		return synopsys_usb_out_transfer(_state, ep, _hdr, _buffer);
+}
 
-		if(eps->control & USB_EPCON_STALL)
-		{
-			eps->control &=~ USB_EPCON_STALL; // Should this be EP0 only
-			//printf("USB: Stall.\n");
-			ret = USB_RET_STALL;
-		}
-		else if(eps->control & USB_EPCON_ENABLE)
-		{
-			// Do IN transfer!
-			eps->control &=~ USB_EPCON_ENABLE;
+static void synopsys_usb_free_parked(synopsys_usb_ep_state *_ep)
+{
+	synopsys_usb_parked_t *park;
 
-			size_t sz = eps->tx_size & DEPTSIZ_XFERSIZ_MASK;
-			size_t amtDone = sz;
-			if(amtDone > _hdr->length)
-				amtDone = _hdr->length;
+	while((park = QTAILQ_FIRST(&_ep->parked)) != NULL)
+	{
+		QTAILQ_REMOVE(&_ep->parked, park, next);
+		qemu_free(park);
+	}
+}
 
-			if(eps->fifo >= USB_NUM_FIFOS)
-				hw_error("usb_synopsys: USB transfer on non-existant FIFO %d!\n", eps->fifo);
+// Answer the requests that were waiting for the guest to arm this endpoint.
+static void synopsys_usb_complete_parked(synopsys_usb_state *_state, synopsys_usb_ep_state *_ep)
+{
+	synopsys_usb_parked_t *park;
+	int ret, done = 0;
 
-			size_t txfz = synopsys_usb_tx_fifo_size(state, eps->fifo);
-			if(amtDone > txfz)
-				amtDone = txfz;
+	while((park = QTAILQ_FIRST(&_ep->parked)) != NULL)
+	{
+		ret = synopsys_usb_transfer(_state, park->hdr, park->buffer);
+		if(ret == USB_RET_NAK)
+			break;
+
+		QTAILQ_REMOVE(&_ep->parked, park, next);
+		tcp_usb_complete(&_state->tcp_state, park->hdr, ret);
+		qemu_free(park);
+		done = 1;
+	}
 
-			size_t txfs = synopsys_usb_tx_fifo_start(state, eps->fifo);
-			if(txfs + txfz > sizeof(state->fifos))
-				hw_error("usb_synopsys: USB transfer would overflow FIFO buffer!\n");
+	if(done)
+		synopsys_usb_update_irq(_state);
+}
 
-			printf("USB: Starting IN transfer on EP %d (%d)...\n", ep, amtDone);
+static void synopsys_usb_update_in_ep(synopsys_usb_state *_state, uint8_t _ep)
+{
+	synopsys_usb_ep_state *eps = &_state->in_eps[_ep];
+	synopsys_usb_update_ep(_state, eps);
 
-			if(amtDone > 0)
-			{
-				if(eps->dma_address)
-				{
-					cpu_physical_memory_read(eps->dma_address, &state->fifos[txfs], amtDone);
-					eps->dma_address += amtDone;
-				}
+	if(eps->control & (USB_EPCON_ENABLE | USB_EPCON_STALL))
+		synopsys_usb_complete_parked(_state, eps);
+}
 
-				memcpy(_buffer, (char*)&state->fifos[txfs], amtDone);
-			}
+static void synopsys_usb_update_out_ep(synopsys_usb_state *_state, uint8_t _ep)
+{
+	synopsys_usb_ep_state *eps = &_state->out_eps[_ep];
+	synopsys_usb_update_ep(_state, eps);
 
-			//printf("USB: IN transfer complete!\n");
+	if(eps->control & (USB_EPCON_ENABLE | USB_EPCON_STALL))
+		synopsys_usb_complete_parked(_state, eps);
+}
 
-			eps->tx_size = (eps->tx_size &~ DEPTSIZ_XFERSIZ_MASK)
-							| ((sz-amtDone) & DEPTSIZ_XFERSIZ_MASK);
-			eps->interrupt_status |= USB_EPINT_XferCompl;
+static int synopsys_usb_tcp_callback(tcp_usb_state_t *_state, void *_arg, tcp_usb_header_t *_hdr, char *_buffer)
+{
+	synopsys_usb_state *state = _arg;
+	synopsys_usb_ep_state *eps;
+	synopsys_usb_parked_t *park;
+	uint8_t ep = _hdr->ep & 0x7f;
+	int ret;
 
-			ret = amtDone;
-		}
-		else
-			ret = USB_RET_NAK;
-	}
-	else // OUT
-	{	
-		synopsys_usb_ep_state *eps = &state->out_eps[ep];
-		
-		if(eps->control & USB_EPCON_STALL)
+	if(_hdr->flags & tcp_usb_abort)
+	{
+		// The host gave up on a request we were holding
+		eps = (_hdr->ep & USB_DIR_IN) ? &state->in_eps[ep] : &state->out_eps[ep];
+		QTAILQ_FOREACH(park, &eps->parked, next)
 		{
-			eps->control &=~ USB_EPCON_STALL; // Should this be EP0 only
-			//printf("USB: Stall.\n");
-			ret = USB_RET_STALL;
+			if(park->hdr == _hdr)
+			{
+				QTAILQ_REMOVE(&eps->parked, park, next);
+				qemu_free(park);
+				break;
+			}
 		}
-		else if(eps->control & USB_EPCON_ENABLE)
-		{
-			// Do OUT transfer!
-			eps->control &=~ USB_EPCON_ENABLE;
-
-			size_t sz = eps->tx_size & DEPTSIZ_XFERSIZ_MASK;
-			size_t amtDone = sz;
-			if(amtDone > _hdr->length)
-				amtDone = _hdr->length;
 
-			size_t rxfz = state->grxfsiz;
-			if(amtDone > rxfz)
-				amtDone = rxfz;
+		return 0;
+	}
 
-			if(rxfz > sizeof(state->fifos))
-				hw_error("usb_synopsys: USB transfer would overflow FIFO buffer!\n");
+	_hdr->addr = (state->dcfg & DCFG_DEVICEADDRMSK) >> DCFG_DEVICEADDR_SHIFT;
 
-			//printf("USB: Starting OUT transfer on EP %d (%d)...\n", ep, amtDone);
+	if(_hdr->flags & tcp_usb_reset)
+	{
+		state->gintsts |= GINTMSK_RESET;
+		synopsys_usb_update_irq(state);
+		return 0;
+	}
 
-			if(amtDone > 0)
-			{
-				memcpy((char*)state->fifos, _buffer, amtDone);
-
-				if(eps->dma_address)
-				{
-					printf("USB: DMA copying to 0x%08x.\n", eps->dma_address);
-					cpu_physical_memory_write(eps->dma_address, state->fifos, amtDone);
-					eps->dma_address += amtDone;
-				}
-			}
+	if(_hdr->flags & tcp_usb_enumdone)
+	{
+		state->gintsts |= GINTMSK_ENUMDONE;
+	}
 
-			printf("USB: OUT transfer complete!\n");
+	if(ep >= USB_NUM_ENDPOINTS)
+		return USB_RET_STALL;
 
-			if(_hdr->flags & tcp_usb_setup)
-			{
-				printf("USB: Setup %02x %02x %02x %02x %02x %02x %02x %02x\n",
-						state->fifos[0],
-						state->fifos[1],
-						state->fifos[2],
-						state->fifos[3],
-						state->fifos[4],
-						state->fifos[5],
-						state->fifos[6],
-						state->fifos[7]);
-				eps->interrupt_status |= USB_EPINT_SetUp;
-			}
-			else
-				eps->interrupt_status |= USB_EPINT_XferCompl;
+	eps = (_hdr->ep & USB_DIR_IN) ? &state->in_eps[ep] : &state->out_eps[ep];
 
-			eps->tx_size = (eps->tx_size &~ DEPTSIZ_XFERSIZ_MASK)
-							| ((sz-amtDone) & DEPTSIZ_XFERSIZ_MASK);
+	// Instead of NAKing and having the host retry, hold on to the request
+	// until the guest enables the endpoint. Requests behind it wait too.
+	if(QTAILQ_EMPTY(&eps->parked))
+		ret = synopsys_usb_transfer(state, _hdr, _buffer);
+	else
+		ret = USB_RET_NAK;
 
-			ret = amtDone;
-		}
-		else
-			ret = USB_RET_NAK;
+	if(ret == USB_RET_NAK)
+	{
+		park = qemu_mallocz(sizeof(*park));
+		park->hdr = _hdr;
+		park->buffer = _buffer;
+		QTAILQ_INSERT_TAIL(&eps->parked, park, next);
+		ret = USB_RET_ASYNC;
 	}
 
 	synopsys_usb_update_irq(state);
@@ -579,6 +672,50 @@ static uint32_t synopsys_usb_out_ep_read(synopsys_usb_state *_state, int _ep, ta
 	return 0;
 }
 
+static void synopsys_usb_connect(synopsys_usb_state *state)
+{
+	int ret, i;
+
+	// Whatever the old connection had asked for is gone with it
+	for(i = 0; i < USB_NUM_ENDPOINTS; i++)
+	{
+		synopsys_usb_free_parked(&state->in_eps[i]);
+		synopsys_usb_free_parked(&state->out_eps[i]);
+	}
+
+	tcp_usb_cleanup(&state->tcp_state);
+	tcp_usb_init(&state->tcp_state, synopsys_usb_tcp_callback, NULL, state);
+
+	// A local server can be reached over its socket, or share memory with us
+	if(state->server_path)
+	{
+		int transport = tcp_usb_transport_socket;
+		if(state->transport && !strcmp(state->transport, "shm"))
+			transport = tcp_usb_transport_shm;
+		else if(state->transport && strcmp(state->transport, "unix"))
+			hw_error("usb_synopsys: Unknown transport %s.\n", state->transport);
+
+		trace_usb_synopsys_connect_unix(state->server_path,
+				transport == tcp_usb_transport_shm ? "shm" : "unix");
+
+		ret = tcp_usb_connect_unix(&state->tcp_state, state->server_path, transport);
+	}
+	else
+	{
+		if(state->transport && strcmp(state->transport, "tcp"))
+			hw_error("usb_synopsys: Transport %s needs a path.\n", state->transport);
+
+		trace_usb_synopsys_connect_tcp(state->server_host, state->server_port);
+
+		ret = tcp_usb_connect(&state->tcp_state, state->server_host, state->server_port);
+	}
+
+	if(ret < 0)
+		hw_error("Failed to connect to USB server (%d).\n", ret);
+
+	trace_usb_synopsys_connected();
+}
+
 static uint32_t synopsys_usb_read(void *_arg, target_phys_addr_t _addr)
 {
 	synopsys_usb_state *state = _arg;
@@ -761,7 +898,7 @@ static void synopsys_usb_write(void *_arg, target_phys_addr_t _addr, uint32_t _v
 {
 	synopsys_usb_state *state = _arg;
 	
-	printf("USB: Write 0x%08x to 0x%08x.\n", _val, _addr);
+	trace_usb_synopsys_write(_addr, _val);
 
 	switch(_addr)
 	{
@@ -785,20 +922,8 @@ static void synopsys_usb_write(void *_arg, target_phys_addr_t _addr, uint32_t _v
 			state->grstctl = GRSTCTL_CORESOFTRESET;
 
 			// Do reset stuff
-			if(state->server_host)
-			{
-				tcp_usb_cleanup(&state->tcp_state);
-				tcp_usb_init(&state->tcp_state, synopsys_usb_tcp_callback, NULL, state);
-
-				printf("Connecting to USB server at %s:%d...\n",
-						state->server_host, state->server_port);
-
-				int ret = tcp_usb_connect(&state->tcp_state, state->server_host, state->server_port);
-				if(ret < 0)
-					hw_error("Failed to connect to USB server (%d).\n", ret);
-
-				printf("Connected to USB server.\n");
-			}
+			if(state->server_host || state->server_path)
+				synopsys_usb_connect(state);
 
 			state->grstctl &= ~GRSTCTL_CORESOFTRESET;
 			state->grstctl |= GRSTCTL_AHBIDLE;
@@ -868,7 +993,7 @@ static void synopsys_usb_write(void *_arg, target_phys_addr_t _addr, uint32_t _v
 		return;
 
 	case DCFG:
-		printf("USB: dcfg = 0x%08x.\n", _val);
+		trace_usb_synopsys_dcfg(_val);
 		state->dcfg = _val;
 		return;
 
@@ -923,11 +1048,8 @@ static void synopsys_usb_initial_reset(DeviceState *dev)
 	synopsys_usb_state *state =
 		FROM_SYSBUS(synopsys_usb_state, sysbus_from_qdev(dev));
 
-	printf("USB: cfg = 0x%08x, 0x%08x, 0x%08x, 0x%08x.\n",
-			state->ghwcfg1,
-			state->ghwcfg2,
-			state->ghwcfg3,
-			state->ghwcfg4);
+	trace_usb_synopsys_reset(state->ghwcfg1, state->ghwcfg2,
+			state->ghwcfg3, state->ghwcfg4);
 
 	state->pcgcctl = 3;
 
@@ -986,6 +1108,13 @@ static int synopsys_usb_init(SysBusDevice *dev)
 
 	tcp_usb_init(&state->tcp_state, NULL, NULL, NULL);
 
+	int i;
+	for(i = 0; i < USB_NUM_ENDPOINTS; i++)
+	{
+		QTAILQ_INIT(&state->in_eps[i].parked);
+		QTAILQ_INIT(&state->out_eps[i].parked);
+	}
+
     int iomemtype = cpu_register_io_memory(synopsys_usb_readfn,
                                synopsys_usb_writefn, state, DEVICE_LITTLE_ENDIAN);
 
@@ -996,14 +1125,79 @@ static int synopsys_usb_init(SysBusDevice *dev)
 	return 0;
 }
 
+// The connection to the USB server is not part of the snapshot, a core the
+// guest already brought out of reset dials it again after loading.
+static int synopsys_usb_post_load(void *opaque, int version_id)
+{
+	synopsys_usb_state *state = opaque;
+
+	if((state->server_host || state->server_path) && (state->grstctl & GRSTCTL_AHBIDLE)
+			&& tcp_usb_closed(&state->tcp_state))
+		synopsys_usb_connect(state);
+
+	synopsys_usb_update_irq(state);
+	return 0;
+}
+
+static const VMStateDescription vmstate_synopsys_usb_ep = {
+	.name = DEVICE_NAME ".ep",
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (VMStateField[]) {
+		VMSTATE_UINT32(control, synopsys_usb_ep_state),
+		VMSTATE_UINT32(tx_size, synopsys_usb_ep_state),
+		VMSTATE_UINT32(fifo, synopsys_usb_ep_state),
+		VMSTATE_UINT32(interrupt_status, synopsys_usb_ep_state),
+		VMSTATE_UINT32(dma_address, synopsys_usb_ep_state),
+		VMSTATE_UINT32(dma_buffer, synopsys_usb_ep_state),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
+static const VMStateDescription vmstate_synopsys_usb = {
+	.name = DEVICE_NAME,
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.post_load = synopsys_usb_post_load,
+	.fields = (VMStateField[]) {
+		VMSTATE_UINT32(pcgcctl, synopsys_usb_state),
+		VMSTATE_UINT32(gahbcfg, synopsys_usb_state),
+		VMSTATE_UINT32(gusbcfg, synopsys_usb_state),
+		VMSTATE_UINT32(grxfsiz, synopsys_usb_state),
+		VMSTATE_UINT32(gnptxfsiz, synopsys_usb_state),
+		VMSTATE_UINT32(gotgctl, synopsys_usb_state),
+		VMSTATE_UINT32(gotgint, synopsys_usb_state),
+		VMSTATE_UINT32(grstctl, synopsys_usb_state),
+		VMSTATE_UINT32(gintmsk, synopsys_usb_state),
+		VMSTATE_UINT32(gintsts, synopsys_usb_state),
+		VMSTATE_UINT32_ARRAY(dptxfsiz, synopsys_usb_state, USB_NUM_FIFOS),
+		VMSTATE_UINT32(dctl, synopsys_usb_state),
+		VMSTATE_UINT32(dcfg, synopsys_usb_state),
+		VMSTATE_UINT32(dsts, synopsys_usb_state),
+		VMSTATE_UINT32(daintmsk, synopsys_usb_state),
+		VMSTATE_UINT32(daintsts, synopsys_usb_state),
+		VMSTATE_UINT32(diepmsk, synopsys_usb_state),
+		VMSTATE_UINT32(doepmsk, synopsys_usb_state),
+		VMSTATE_STRUCT_ARRAY(in_eps, synopsys_usb_state, USB_NUM_ENDPOINTS, 1,
+				vmstate_synopsys_usb_ep, synopsys_usb_ep_state),
+		VMSTATE_STRUCT_ARRAY(out_eps, synopsys_usb_state, USB_NUM_ENDPOINTS, 1,
+				vmstate_synopsys_usb_ep, synopsys_usb_ep_state),
+		VMSTATE_BUFFER(fifos, synopsys_usb_state),
+		VMSTATE_END_OF_LIST()
+	}
+};
+
 static SysBusDeviceInfo synopsys_usb_info = {
     .init = synopsys_usb_init,
     .qdev.name  = DEVICE_NAME,
     .qdev.size  = sizeof(synopsys_usb_state),
     .qdev.reset = synopsys_usb_initial_reset,
+    .qdev.vmsd  = &vmstate_synopsys_usb,
     .qdev.props = (Property[]) {
 		DEFINE_PROP_STRING("host", synopsys_usb_state, server_host),
 		DEFINE_PROP_UINT32("port", synopsys_usb_state, server_port, 7642),
+		DEFINE_PROP_STRING("path", synopsys_usb_state, server_path),
+		DEFINE_PROP_STRING("transport", synopsys_usb_state, transport),
 		DEFINE_PROP_HEX32("hwcfg1", synopsys_usb_state, ghwcfg1, 0),
 		DEFINE_PROP_HEX32("hwcfg2", synopsys_usb_state, ghwcfg2, 0),
 		DEFINE_PROP_HEX32("hwcfg3", synopsys_usb_state, ghwcfg3, 0),
@@ -180,6 +180,57 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+/* When set, RAM goes to this page-aligned image file instead of the
+ * migration stream, which only records the image's id. */
+static char *ram_image;
+
+const char *migrate_ram_image(void)
+{
+    return ram_image;
+}
+
+int do_migrate_set_ram_image(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data)
+{
+    const char *path = qdict_get_try_str(qdict, "path");
+
+    qemu_free(ram_image);
+    ram_image = (path && *path) ? qemu_strdup(path) : NULL;
+
+    return 0;
+}
+
+/* Worker threads that zlib-compress RAM pages, 0 sends them raw */
+static int compress_threads;
+static int compress_level = 1;
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int migrate_compress_level(void)
+{
+    return compress_level;
+}
+
+int do_migrate_set_compress(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int threads = qdict_get_int(qdict, "threads");
+    int level = qdict_get_try_int(qdict, "level", compress_level);
+
+    if (threads < 0 || threads > 64 || level < 1 || level > 9) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "threads",
+                      "0 to 64 threads, compression level 1 to 9");
+        return -1;
+    }
+    compress_threads = threads;
+    compress_level = level;
+
+    return 0;
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -63,6 +63,18 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 uint64_t migrate_max_downtime(void);
 
+const char *migrate_ram_image(void);
+
+int do_migrate_set_ram_image(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data);
+
+int migrate_compress_threads(void);
+
+int migrate_compress_level(void);
+
+int do_migrate_set_compress(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
@@ -61,6 +61,11 @@
 #include "trace.h"
 #endif
 #include "ui/qemu-spice.h"
+#if defined(TARGET_ARM)
+#include "hw/s5l8930_aes_capture.h"
+#include "hw/s5l8930_h2fmi.h"
+#include "hw/s5l8900_uart.h"
+#endif
 
 //#define DEBUG
 //#define DEBUG_COMPLETION
@@ -628,6 +633,43 @@ static void do_trace_file(Monitor *mon, const QDict *qdict)
 }
 #endif
 
+static void do_mmio_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_str(qdict, "op");
+
+    if (!strcmp(op, "on")) {
+        mmio_profile_set_enabled(true, false);
+    } else if (!strcmp(op, "time")) {
+        mmio_profile_set_enabled(true, true);
+    } else if (!strcmp(op, "off")) {
+        mmio_profile_set_enabled(false, false);
+    } else if (!strcmp(op, "reset")) {
+        mmio_profile_reset();
+    } else {
+        monitor_printf(mon, "unexpected argument \"%s\"\n", op);
+        help_cmd(mon, "mmio-profile");
+    }
+}
+
+#if defined(TARGET_ARM)
+static void do_aes_capture(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_try_str(qdict, "op");
+    const char *arg = qdict_get_try_str(qdict, "arg");
+
+    if (!op) {
+        aes_capture_print_status((FILE *)mon, &monitor_fprintf);
+    } else if (!strcmp(op, "on")) {
+        aes_capture_set_enabled(true, arg);
+    } else if (!strcmp(op, "off")) {
+        aes_capture_set_enabled(false, arg);
+    } else {
+        monitor_printf(mon, "unexpected argument \"%s\"\n", op);
+        help_cmd(mon, "aes-capture");
+    }
+}
+#endif
+
 static void user_monitor_complete(void *opaque, QObject *ret_data)
 {
     MonitorCompletionData *data = (MonitorCompletionData *)opaque; 
@@ -968,6 +1010,23 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_mmio_profile(Monitor *mon)
+{
+    mmio_profile_print((FILE *)mon, monitor_fprintf);
+}
+
+#if defined(TARGET_ARM)
+static void do_info_h2fmi(Monitor *mon)
+{
+    h2fmi_print_stats((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_uart(Monitor *mon)
+{
+    s5l8900_uart_print_stats((FILE *)mon, monitor_fprintf);
+}
+#endif
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2934,6 +2993,13 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "mmio-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most accessed MMIO devices and registers",
+        .mhandler.info = do_info_mmio_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -3097,6 +3163,22 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show roms",
         .mhandler.info = do_info_roms,
     },
+#if defined(TARGET_ARM)
+    {
+        .name       = "h2fmi",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show H2FMI NAND read and page cache statistics",
+        .mhandler.info = do_info_h2fmi,
+    },
+    {
+        .name       = "uart",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show S5L8900 UART transfer statistics",
+        .mhandler.info = do_info_uart,
+    },
+#endif
 #if defined(CONFIG_SIMPLE_TRACE)
     {
         .name       = "trace",
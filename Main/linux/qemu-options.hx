@@ -335,6 +335,18 @@ STEXI
 Allocate guest RAM from a temporarily created file in @var{path}.
 ETEXI
 
+DEF("ram-image", HAS_ARG, QEMU_OPTION_ram_image,
+    "-ram-image FILE map guest RAM copy-on-write from a saved RAM image\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -ram-image @var{file}
+Map guest RAM blocks privately from @var{file}, a RAM image written by
+migrating with @code{migrate_set_ram_image} in effect.  Instances started
+from the same image share its pages until they write to them.  Use it
+together with @option{-incoming} and the device state saved alongside
+the image.
+ETEXI
+
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
     "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
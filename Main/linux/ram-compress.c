@@ -0,0 +1,324 @@
+/*
+ * Parallel zlib compression of guest RAM for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "qemu-thread.h"
+#include "ram-compress.h"
+
+enum {
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_BUSY,
+    JOB_DONE,
+};
+
+typedef struct RAMCompressWorker {
+    RAMCompressPool *pool;
+    QemuThread thread;
+    z_stream stream;
+} RAMCompressWorker;
+
+struct RAMCompressPool {
+    int nthreads;
+    int level;
+    RAMCompressWorker *workers;
+
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    int running;
+    int quit;
+
+    /* head: oldest queued job, work: next job for a worker,
+     * tail: next free slot.  Free-running, indexed modulo size, which is
+     * a power of two so they can wrap. */
+    RAMCompressJob *ring;
+    int *state;
+    unsigned int size;
+    unsigned int head, work, tail;
+};
+
+static int ram_compress_run(RAMCompressWorker *w, RAMCompressJob *job)
+{
+    z_stream *s = &w->stream;
+    int ret;
+
+    if (job->op == RAM_COMPRESS_DEFLATE) {
+        if (deflateReset(s) != Z_OK) {
+            return -1;
+        }
+        s->next_in = job->host;
+        s->avail_in = job->len;
+        s->next_out = job->buf;
+        s->avail_out = job->buf_size;
+        ret = deflate(s, Z_FINISH);
+        job->buf_len = job->buf_size - s->avail_out;
+        return ret == Z_STREAM_END ? 0 : -1;
+    }
+
+    if (inflateReset(s) != Z_OK) {
+        return -1;
+    }
+    s->next_in = job->buf;
+    s->avail_in = job->buf_len;
+    s->next_out = job->host;
+    s->avail_out = job->len;
+    ret = inflate(s, Z_FINISH);
+    return (ret == Z_STREAM_END && s->avail_out == 0) ? 0 : -1;
+}
+
+static void *ram_compress_thread(void *opaque)
+{
+    RAMCompressWorker *w = opaque;
+    RAMCompressPool *pool = w->pool;
+    RAMCompressJob *job;
+    unsigned int i;
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        /* Pass-through jobs are already done */
+        while (pool->work != pool->tail &&
+               pool->state[pool->work % pool->size] == JOB_DONE) {
+            pool->work++;
+        }
+        if (pool->work != pool->tail) {
+            i = pool->work++ % pool->size;
+            job = &pool->ring[i];
+            pool->state[i] = JOB_BUSY;
+            qemu_mutex_unlock(&pool->lock);
+
+            ret = ram_compress_run(w, job);
+
+            qemu_mutex_lock(&pool->lock);
+            job->ret = ret;
+            pool->state[i] = JOB_DONE;
+            qemu_cond_broadcast(&pool->done_cond);
+            continue;
+        }
+        if (pool->quit) {
+            break;
+        }
+        qemu_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    pool->running--;
+    qemu_cond_broadcast(&pool->done_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static int ram_compress_host_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > 0) {
+        return n > 64 ? 64 : n;
+    }
+#endif
+    return 1;
+}
+
+RAMCompressPool *ram_compress_pool_new(int threads, int level)
+{
+    RAMCompressPool *pool;
+    size_t buf_size = compressBound(RAM_COMPRESS_MAX_LEN);
+    unsigned int i;
+
+    if (threads <= 0) {
+        threads = ram_compress_host_cpus();
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->nthreads = threads;
+    pool->level = level;
+    /* Two jobs per worker keeps them busy while the caller writes out or
+     * reads in the next one */
+    pool->size = 1;
+    while (pool->size < threads * 2) {
+        pool->size <<= 1;
+    }
+    pool->ring = calloc(pool->size, sizeof(*pool->ring));
+    pool->state = calloc(pool->size, sizeof(*pool->state));
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+    if (!pool->ring || !pool->state || !pool->workers) {
+        goto fail;
+    }
+    for (i = 0; i < pool->size; i++) {
+        pool->ring[i].buf_size = buf_size;
+        pool->ring[i].buf = malloc(buf_size);
+        if (!pool->ring[i].buf) {
+            goto fail;
+        }
+    }
+
+    /* A saving pool only deflates, a loading one only inflates */
+    for (i = 0; i < threads; i++) {
+        RAMCompressWorker *w = &pool->workers[i];
+
+        w->pool = pool;
+        if (level >= 0) {
+            if (deflateInit(&w->stream, level) != Z_OK) {
+                goto fail;
+            }
+        } else if (inflateInit(&w->stream) != Z_OK) {
+            goto fail;
+        }
+    }
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    pool->running = threads;
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(&pool->workers[i].thread, ram_compress_thread,
+                           &pool->workers[i]);
+    }
+    return pool;
+
+fail:
+    /* No thread has been started yet */
+    if (pool->workers) {
+        for (i = 0; i < threads; i++) {
+            if (level >= 0) {
+                deflateEnd(&pool->workers[i].stream);
+            } else {
+                inflateEnd(&pool->workers[i].stream);
+            }
+        }
+    }
+    for (i = 0; pool->ring && i < pool->size; i++) {
+        free(pool->ring[i].buf);
+    }
+    free(pool->workers);
+    free(pool->state);
+    free(pool->ring);
+    free(pool);
+    return NULL;
+}
+
+void ram_compress_pool_free(RAMCompressPool *pool)
+{
+    unsigned int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    qemu_cond_broadcast(&pool->work_cond);
+    while (pool->running) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++) {
+#ifndef _WIN32
+        /* Win32 threads are created detached */
+        qemu_thread_join(&pool->workers[i].thread);
+#endif
+        if (pool->level >= 0) {
+            deflateEnd(&pool->workers[i].stream);
+        } else {
+            inflateEnd(&pool->workers[i].stream);
+        }
+    }
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    for (i = 0; i < pool->size; i++) {
+        free(pool->ring[i].buf);
+    }
+    free(pool->workers);
+    free(pool->state);
+    free(pool->ring);
+    free(pool);
+}
+
+RAMCompressJob *ram_compress_next(RAMCompressPool *pool)
+{
+    if (pool->tail - pool->head == pool->size) {
+        return NULL;
+    }
+    return &pool->ring[pool->tail % pool->size];
+}
+
+void ram_compress_submit(RAMCompressPool *pool, RAMCompressJob *job)
+{
+    unsigned int i = pool->tail % pool->size;
+
+    qemu_mutex_lock(&pool->lock);
+    job->ret = 0;
+    if (job->op == RAM_COMPRESS_NONE) {
+        pool->state[i] = JOB_DONE;
+    } else {
+        pool->state[i] = JOB_QUEUED;
+        qemu_cond_signal(&pool->work_cond);
+    }
+    pool->tail++;
+    qemu_mutex_unlock(&pool->lock);
+}
+
+RAMCompressJob *ram_compress_wait(RAMCompressPool *pool)
+{
+    unsigned int i = pool->head % pool->size;
+
+    if (pool->head == pool->tail) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->state[i] != JOB_DONE) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return &pool->ring[i];
+}
+
+void ram_compress_retire(RAMCompressPool *pool)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->state[pool->head % pool->size] = JOB_FREE;
+    pool->head++;
+    /* Workers may not have stepped over pass-through jobs yet */
+    if ((int)(pool->work - pool->head) < 0) {
+        pool->work = pool->head;
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
+int ram_compress_pending(RAMCompressPool *pool, const uint8_t *host,
+                         size_t len)
+{
+    RAMCompressJob *job;
+    unsigned int n;
+    int ret = 0;
+
+    qemu_mutex_lock(&pool->lock);
+    for (n = pool->head; n != pool->tail; n++) {
+        job = &pool->ring[n % pool->size];
+        if (pool->state[n % pool->size] != JOB_DONE &&
+            job->op == RAM_COMPRESS_INFLATE &&
+            job->host < host + len && host < job->host + job->len) {
+            ret = 1;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return ret;
+}
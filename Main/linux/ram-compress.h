@@ -0,0 +1,62 @@
+/*
+ * Parallel zlib compression of guest RAM for migration
+ *
+ * A pool of worker threads deflates (on save) or inflates (on load) runs of
+ * guest pages.  Jobs live in a ring and are handed back in submission
+ * order, so the migration stream keeps its order while several runs are
+ * being compressed at once.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RAM_COMPRESS_H
+#define QEMU_RAM_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest run of guest memory in one job */
+#define RAM_COMPRESS_MAX_LEN    0x10000
+
+enum {
+    RAM_COMPRESS_NONE,      /* passed through in order, no work */
+    RAM_COMPRESS_DEFLATE,   /* host[0..len) -> buf[0..buf_len) */
+    RAM_COMPRESS_INFLATE,   /* buf[0..buf_len) -> host[0..len) */
+};
+
+typedef struct RAMCompressJob {
+    int op;
+    uint8_t *host;
+    size_t len;
+    uint8_t *buf;           /* buf_size bytes, owned by the pool */
+    size_t buf_size;
+    size_t buf_len;
+    int ret;                /* 0, or -1 if the data did not (de)compress */
+    /* For the caller, untouched by the pool */
+    void *opaque;
+    uint64_t offset;
+    uint8_t ch;
+} RAMCompressJob;
+
+typedef struct RAMCompressPool RAMCompressPool;
+
+/* threads <= 0 uses one per host CPU.  level is a zlib level for saving,
+ * or -1 for a pool that only inflates. */
+RAMCompressPool *ram_compress_pool_new(int threads, int level);
+void ram_compress_pool_free(RAMCompressPool *pool);
+
+/* Next free job, NULL while the ring is full */
+RAMCompressJob *ram_compress_next(RAMCompressPool *pool);
+void ram_compress_submit(RAMCompressPool *pool, RAMCompressJob *job);
+
+/* Oldest submitted job once it has finished, NULL if none are queued.
+ * It stays queued until ram_compress_retire(). */
+RAMCompressJob *ram_compress_wait(RAMCompressPool *pool);
+void ram_compress_retire(RAMCompressPool *pool);
+
+/* Whether a queued job still writes to host[0..len) */
+int ram_compress_pending(RAMCompressPool *pool, const uint8_t *host,
+                         size_t len);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * Page-aligned guest RAM images
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qemu-timer.h"
+#include "qemu-error.h"
+#include "ram-image.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+
+#define RAM_IMAGE_MAX_BLOCKS 1024
+
+typedef struct RAMImage {
+    int fd;
+    RAMImageHeader hdr;
+    RAMImageEntry *entries;
+} RAMImage;
+
+/* Image that guest RAM was mapped from at startup (-ram-image) */
+static RAMImage *mapped_image;
+static int mapped_image_failed;
+
+static uint64_t ram_image_align(uint64_t v)
+{
+    return (v + RAM_IMAGE_ALIGN - 1) & ~(uint64_t)(RAM_IMAGE_ALIGN - 1);
+}
+
+static int ram_image_pwrite(int fd, const uint8_t *buf, size_t len,
+                            off_t offset)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int ram_image_pread(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pread(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            return -EIO;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void ram_image_close(RAMImage *img)
+{
+    if (!img) {
+        return;
+    }
+    close(img->fd);
+    qemu_free(img->entries);
+    qemu_free(img);
+}
+
+static RAMImage *ram_image_open(const char *path)
+{
+    RAMImage *img;
+    size_t len;
+
+    img = qemu_mallocz(sizeof(*img));
+    img->fd = qemu_open(path, O_RDONLY);
+    if (img->fd < 0) {
+        error_report("ram image %s: %s", path, strerror(errno));
+        qemu_free(img);
+        return NULL;
+    }
+
+    if (ram_image_pread(img->fd, (uint8_t *)&img->hdr, sizeof(img->hdr), 0) ||
+        memcmp(img->hdr.magic, RAM_IMAGE_MAGIC, sizeof(img->hdr.magic)) ||
+        img->hdr.version != RAM_IMAGE_VERSION ||
+        img->hdr.nb_blocks == 0 ||
+        img->hdr.nb_blocks > RAM_IMAGE_MAX_BLOCKS) {
+        error_report("ram image %s: bad header", path);
+        ram_image_close(img);
+        return NULL;
+    }
+
+    len = img->hdr.nb_blocks * sizeof(RAMImageEntry);
+    img->entries = qemu_malloc(len);
+    if (ram_image_pread(img->fd, (uint8_t *)img->entries, len,
+                        sizeof(img->hdr))) {
+        error_report("ram image %s: truncated block table", path);
+        ram_image_close(img);
+        return NULL;
+    }
+    return img;
+}
+
+static RAMImageEntry *ram_image_find(RAMImage *img, const char *idstr,
+                                     ram_addr_t length)
+{
+    uint32_t i;
+
+    for (i = 0; i < img->hdr.nb_blocks; i++) {
+        RAMImageEntry *e = &img->entries[i];
+
+        if (!strncmp(e->idstr, idstr, sizeof(e->idstr)) &&
+            e->length == length) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void *ram_image_alloc(RAMBlock *block, ram_addr_t size)
+{
+    RAMImageEntry *e;
+    void *area;
+
+    if (!mapped_image) {
+        if (mapped_image_failed) {
+            return NULL;
+        }
+        mapped_image = ram_image_open(ram_image_path);
+        if (!mapped_image) {
+            mapped_image_failed = 1;
+            return NULL;
+        }
+    }
+
+    e = ram_image_find(mapped_image, block->idstr, size);
+    if (!e) {
+        return NULL;
+    }
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                mapped_image->fd, e->offset);
+    if (area == MAP_FAILED) {
+        perror("ram_image_alloc: can't mmap RAM pages");
+        return NULL;
+    }
+    block->flags |= RAM_IMAGE_MASK;
+    return area;
+}
+
+static int ram_image_page_is_zero(const uint8_t *p)
+{
+    const unsigned long *w = (const unsigned long *)p;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(*w); i++) {
+        if (w[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Zero pages are left as holes, so the image stays sparse and restored
+ * instances map them from the shared zero page. */
+static int ram_image_write_block(int fd, RAMBlock *block, uint64_t offset)
+{
+    ram_addr_t addr = 0, end;
+    int ret;
+
+    while (addr < block->length) {
+        end = addr;
+        while (end < block->length &&
+               !ram_image_page_is_zero(block->host + end)) {
+            end += TARGET_PAGE_SIZE;
+        }
+        if (end == addr) {
+            addr += TARGET_PAGE_SIZE;
+            continue;
+        }
+        ret = ram_image_pwrite(fd, block->host + addr, end - addr,
+                               offset + addr);
+        if (ret < 0) {
+            return ret;
+        }
+        addr = end;
+    }
+    return 0;
+}
+
+int ram_image_save(const char *path, uint64_t *id)
+{
+    RAMImageHeader hdr;
+    RAMImageEntry *entries;
+    RAMBlock *block;
+    uint64_t offset;
+    char *tmp;
+    int fd, i, n = 0, ret;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    if (n == 0 || n > RAM_IMAGE_MAX_BLOCKS) {
+        return -EINVAL;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RAM_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = RAM_IMAGE_VERSION;
+    hdr.nb_blocks = n;
+    hdr.id = get_clock_realtime() ^ ((uint64_t)getpid() << 32);
+
+    entries = qemu_mallocz(n * sizeof(*entries));
+    offset = ram_image_align(sizeof(hdr) + n * sizeof(*entries));
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        pstrcpy(entries[i].idstr, sizeof(entries[i].idstr), block->idstr);
+        entries[i].offset = offset;
+        entries[i].length = block->length;
+        offset = ram_image_align(offset + block->length);
+        i++;
+    }
+
+    /* Write a new file and rename it over the old one, instances that
+     * still map the old image keep their inode. */
+    tmp = qemu_malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    fd = qemu_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (ftruncate(fd, offset) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    ret = ram_image_pwrite(fd, (uint8_t *)&hdr, sizeof(hdr), 0);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = ram_image_pwrite(fd, (uint8_t *)entries, n * sizeof(*entries),
+                           sizeof(hdr));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ret = ram_image_write_block(fd, block, entries[i++].offset);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (qemu_fdatasync(fd) < 0 || close(fd) < 0) {
+        ret = -errno;
+        unlink(tmp);
+        goto out;
+    }
+    if (rename(tmp, path) < 0) {
+        ret = -errno;
+        unlink(tmp);
+        goto out;
+    }
+
+    *id = hdr.id;
+    ret = 0;
+    goto out;
+
+fail:
+    close(fd);
+    unlink(tmp);
+out:
+    qemu_free(tmp);
+    qemu_free(entries);
+    return ret;
+}
+
+int ram_image_load(const char *path, uint64_t id)
+{
+    RAMImage *img = NULL;
+    RAMImageEntry *e;
+    RAMBlock *block;
+    void *area;
+    int ret = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if ((block->flags & RAM_IMAGE_MASK) && mapped_image->hdr.id == id) {
+            /* Map the block again to drop pages written before the load,
+             * like ROMs copied in at reset. */
+            e = ram_image_find(mapped_image, block->idstr, block->length);
+            area = mmap(block->host, block->length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, mapped_image->fd, e->offset);
+            if (area == MAP_FAILED) {
+                ret = -errno;
+                break;
+            }
+            continue;
+        }
+
+        /* Not mapped from this image, copy it in instead */
+        if (!img) {
+            img = ram_image_open(path);
+            if (!img) {
+                ret = -EINVAL;
+                break;
+            }
+            if (img->hdr.id != id) {
+                error_report("ram image %s does not belong to this snapshot",
+                             path);
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        e = ram_image_find(img, block->idstr, block->length);
+        if (!e) {
+            error_report("ram image %s has no block \"%s\"", path,
+                         block->idstr);
+            ret = -EINVAL;
+            break;
+        }
+        ret = ram_image_pread(img->fd, block->host, block->length, e->offset);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    ram_image_close(img);
+    return ret;
+}
+
+#else
+
+void *ram_image_alloc(RAMBlock *block, ram_addr_t size)
+{
+    return NULL;
+}
+
+int ram_image_save(const char *path, uint64_t *id)
+{
+    return -ENOSYS;
+}
+
+int ram_image_load(const char *path, uint64_t id)
+{
+    return -ENOSYS;
+}
+
+#endif
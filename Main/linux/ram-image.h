@@ -0,0 +1,48 @@
+/*
+ * Page-aligned guest RAM images
+ *
+ * A RAM image holds every RAM block of a stopped machine at a page-aligned
+ * file offset, so a restored instance can map it MAP_PRIVATE as guest RAM.
+ * Instances started from the same image share its unmodified pages through
+ * the page cache and only pay for the pages they dirty.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RAM_IMAGE_H
+#define QEMU_RAM_IMAGE_H
+
+#include "cpu-common.h"
+
+#define RAM_IMAGE_MAGIC     "QEMURAMI"
+#define RAM_IMAGE_VERSION   1
+
+/* Block data is aligned well past any host page size we run on */
+#define RAM_IMAGE_ALIGN     0x10000
+
+typedef struct RAMImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_blocks;
+    uint64_t id;
+} RAMImageHeader;
+
+typedef struct RAMImageEntry {
+    char idstr[256];
+    uint64_t offset;
+    uint64_t length;
+} RAMImageEntry;
+
+struct RAMBlock;
+
+/* Map a block from the -ram-image file, NULL if the image lacks it */
+void *ram_image_alloc(struct RAMBlock *block, ram_addr_t size);
+
+/* Write all RAM blocks to path, returns the new image id in *id */
+int ram_image_save(const char *path, uint64_t *id);
+
+/* Restore RAM from the image with the given id */
+int ram_image_load(const char *path, uint64_t id);
+
+#endif
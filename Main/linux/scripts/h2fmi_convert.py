@@ -0,0 +1,87 @@
+#!/usr/bin/env python
+#
+# Convert a packed H2FMI NAND dump into the sparse image format
+#
+# The packed layout is an 8 byte chip ID followed by one record per page:
+# a marker byte (0 or '0' when the page is erased), the page data and the
+# meta bytes.  The sparse layout is described in hw/s5l8930_h2fmi.h.
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+
+import os
+import struct
+import sys
+from optparse import OptionParser
+
+IMAGE_MAGIC   = b'FMINAND1'
+IMAGE_VERSION = 1
+IMAGE_ALIGN   = 4096
+CHIPID_LENGTH = 8
+
+# magic, version, page_size, meta_size, page_count, chip_id,
+# bitmap_offset, meta_offset, data_offset
+header_fmt = '<8sIIII8sQQQ'
+
+def align(n):
+    return (n + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1)
+
+def convert(src, dst, page_size, meta_size):
+    record = 1 + page_size + meta_size
+    pages = (os.path.getsize(src) - CHIPID_LENGTH) // record
+    if pages < 0:
+        raise ValueError('%s is too small to be a NAND dump' % src)
+
+    bitmap_offset = align(struct.calcsize(header_fmt))
+    meta_offset = align(bitmap_offset + (pages + 7) // 8)
+    data_offset = align(meta_offset + pages * meta_size)
+    size = data_offset + pages * page_size
+
+    bitmap = bytearray((pages + 7) // 8)
+    programmed = 0
+
+    inp = open(src, 'rb')
+    out = open(dst, 'wb')
+    chip_id = inp.read(CHIPID_LENGTH)
+
+    # Only programmed pages are written, everything else stays a hole
+    out.truncate(size)
+    for page in range(pages):
+        rec = inp.read(record)
+        marker = rec[0:1]
+        if marker in (b'\x00', b'0'):
+            continue
+
+        bitmap[page >> 3] |= 1 << (page & 7)
+        programmed += 1
+        out.seek(meta_offset + page * meta_size)
+        out.write(rec[1 + page_size:])
+        out.seek(data_offset + page * page_size)
+        out.write(rec[1:1 + page_size])
+
+    out.seek(bitmap_offset)
+    out.write(bytes(bitmap))
+    out.seek(0)
+    out.write(struct.pack(header_fmt, IMAGE_MAGIC, IMAGE_VERSION, page_size,
+                          meta_size, pages, chip_id, bitmap_offset,
+                          meta_offset, data_offset))
+    out.close()
+    inp.close()
+    return pages, programmed
+
+def main():
+    parser = OptionParser(usage='%prog [options] packed.img sparse.img')
+    parser.add_option('-p', '--page-size', type='int', default=4096,
+                      help='page data size in bytes (default 4096)')
+    parser.add_option('-m', '--meta-size', type='int', default=12,
+                      help='meta size in bytes per page (default 12)')
+    opts, args = parser.parse_args()
+    if len(args) != 2:
+        parser.error('expected a source and a destination image')
+
+    pages, programmed = convert(args[0], args[1], opts.page_size,
+                                opts.meta_size)
+    sys.stdout.write('%d pages, %d programmed\n' % (pages, programmed))
+
+if __name__ == '__main__':
+    main()
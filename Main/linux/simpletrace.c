@@ -312,9 +312,23 @@ void st_print_trace_events(FILE *stream, int (*stream_printf)(FILE *stream, cons
     }
 }
 
+/* A trailing '*' matches every event starting with the rest of name, so
+ * that all events of one device can be switched at once. */
 bool st_change_trace_event_state(const char *name, bool enabled)
 {
     unsigned int i;
+    size_t len = strlen(name);
+    bool found = false;
+
+    if (len && name[len - 1] == '*') {
+        for (i = 0; i < NR_TRACE_EVENTS; i++) {
+            if (!strncmp(trace_list[i].tp_name, name, len - 1)) {
+                trace_list[i].state = enabled;
+                found = true;
+            }
+        }
+        return found;
+    }
 
     for (i = 0; i < NR_TRACE_EVENTS; i++) {
         if (!strcmp(trace_list[i].tp_name, name)) {
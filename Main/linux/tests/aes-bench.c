@@ -0,0 +1,110 @@
+/*
+ * Microbenchmark for the S5L89xx AES backend (hw/s5l8900_aes.c).
+ *
+ * Compares the old per-operation AES_set_decrypt_key() + AES_cbc_encrypt()
+ * sequence with the cached backend in its portable and EVP (AES-NI when the
+ * host has it) modes, for NAND page sized and kernelcache sized buffers.
+ * The backend's output is checked against plain AES_cbc_encrypt().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "s5l8900_aes.h"
+
+static uint8_t key[32];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run_uncached(const uint8_t *in, uint8_t *out, size_t len)
+{
+    AES_KEY schedule;
+    uint8_t iv[16] = { 0 };
+
+    AES_set_decrypt_key(key, 256, &schedule);
+    AES_cbc_encrypt(in, out, len, &schedule, iv, AES_DECRYPT);
+}
+
+static void run_backend(const uint8_t *in, uint8_t *out, size_t len)
+{
+    uint8_t iv[16] = { 0 };
+
+    s5l8900_aes_cbc(key, 256, in, out, len, iv, AES_DECRYPT);
+}
+
+static void bench(const char *name, void (*fn)(const uint8_t *, uint8_t *, size_t),
+                  const uint8_t *in, uint8_t *out, size_t len, size_t total)
+{
+    size_t done;
+    double t;
+
+    t = now();
+    for (done = 0; done < total; done += len) {
+        fn(in, out, len);
+    }
+    t = now() - t;
+
+    printf("  %-22s %9.1f MB/s  %9.2f us/op\n", name,
+           total / t / (1024 * 1024), t * 1e6 / (total / len));
+}
+
+static int check(const uint8_t *in, uint8_t *out, uint8_t *ref, size_t len)
+{
+    AES_KEY schedule;
+    uint8_t iv_ref[16] = { 1 }, iv[16] = { 1 };
+
+    AES_set_decrypt_key(key, 256, &schedule);
+    AES_cbc_encrypt(in, ref, len, &schedule, iv_ref, AES_DECRYPT);
+    s5l8900_aes_cbc(key, 256, in, out, len, iv, AES_DECRYPT);
+
+    return memcmp(ref, out, len) || memcmp(iv_ref, iv, sizeof(iv));
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 0x1000, 0x5e42c0 };
+    size_t total = 256 << 20;
+    uint8_t *in, *out, *ref;
+    unsigned i;
+
+    if (argc > 1) {
+        total = strtoul(argv[1], NULL, 0) << 20;
+    }
+
+    in = malloc(sizes[1]);
+    out = malloc(sizes[1]);
+    ref = malloc(sizes[1]);
+    srand(0x8930);
+    for (i = 0; i < sizeof(key); i++) {
+        key[i] = rand();
+    }
+    for (i = 0; i < sizes[1]; i++) {
+        in[i] = rand();
+    }
+
+    for (i = 0; i < 2; i++) {
+        s5l8900_aes_set_portable(i);
+        if (check(in, out, ref, sizes[1]) || check(in, out, ref, 0x1234)) {
+            printf("%s backend output mismatch\n", i ? "portable" : "EVP");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf("AES-256-CBC decrypt, %#zx byte operations:\n", sizes[i]);
+        bench("uncached schedule", run_uncached, in, out, sizes[i], total);
+        s5l8900_aes_set_portable(1);
+        bench("cached, portable", run_backend, in, out, sizes[i], total);
+        s5l8900_aes_set_portable(0);
+        bench("cached, EVP", run_backend, in, out, sizes[i], total);
+    }
+
+    return 0;
+}
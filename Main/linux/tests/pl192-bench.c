@@ -0,0 +1,190 @@
+/*
+ * Microbenchmark for the PL192 VIC priority logic (hw/pl192.h).
+ *
+ * Runs IRQ raise/ack/fin/lower cycles on a chain of four VICs, as on the
+ * S5L8930, the way hw/pl192.c sees them: every step updates the VIC whose
+ * line moved and the change travels down the daisy chain.  The old model
+ * sorted all 32 sources of every VIC on the way down on each update; the
+ * new one looks up the per-level bitmaps and stops as soon as a VIC's
+ * winner does not change.  Both are run in lockstep first and must agree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "pl192.h"
+
+#define NUM_VICS    4
+#define CYCLES      2000000
+
+typedef struct vic {
+    uint32_t status;
+    uint32_t vect_priority[PL192_INT_SOURCES];
+    uint32_t sw_priority_mask;
+    int daisy_input;
+    uint32_t daisy_priority;
+    uint32_t winner;
+    pl192_prio_t prio;
+} vic;
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* pl192_priority_sorter() as it was */
+static uint32_t old_sorter(const vic *s)
+{
+    int i;
+    uint32_t prio_irq[PL192_PRIO_LEVELS];
+
+    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
+        prio_irq[i] = PL192_NO_IRQ;
+    }
+    if (s->daisy_input) {
+        prio_irq[s->daisy_priority] = PL192_DAISY_IRQ;
+    }
+    for (i = PL192_INT_SOURCES - 1; i >= 0; i--) {
+        if (s->status & (1u << i)) {
+            prio_irq[s->vect_priority[i]] = i;
+        }
+    }
+    for (i = 0; i < PL192_PRIO_LEVELS; i++) {
+        if ((s->sw_priority_mask & (1u << i)) &&
+            prio_irq[i] <= PL192_DAISY_IRQ) {
+            return prio_irq[i];
+        }
+    }
+    return PL192_NO_IRQ;
+}
+
+static void old_update(vic *c, int k)
+{
+    for (; k < NUM_VICS; k++) {
+        c[k].winner = old_sorter(&c[k]);
+        if (k + 1 < NUM_VICS) {
+            c[k + 1].daisy_input = c[k].winner != PL192_NO_IRQ;
+        }
+    }
+}
+
+static void new_update(vic *c, int k)
+{
+    for (; k < NUM_VICS; k++) {
+        uint32_t w = pl192_prio_highest(&c[k].prio, c[k].status,
+                                        c[k].sw_priority_mask,
+                                        c[k].daisy_input,
+                                        c[k].daisy_priority);
+        if (w == c[k].winner) {
+            break;
+        }
+        c[k].winner = w;
+        if (k + 1 < NUM_VICS) {
+            c[k + 1].daisy_input = w != PL192_NO_IRQ;
+        }
+    }
+}
+
+static void set_line(vic *c, int k, int source, int level, int fast)
+{
+    uint32_t old = c[k].status;
+
+    if (level) {
+        c[k].status |= 1u << source;
+    } else {
+        c[k].status &= ~(1u << source);
+    }
+    if (fast) {
+        pl192_prio_status(&c[k].prio, c[k].vect_priority, old, c[k].status);
+        new_update(c, k);
+    } else {
+        old_update(c, k);
+    }
+}
+
+static void setup(vic *c)
+{
+    int k, i;
+
+    srand(1);
+    memset(c, 0, sizeof(vic) * NUM_VICS);
+    for (k = 0; k < NUM_VICS; k++) {
+        for (i = 0; i < PL192_INT_SOURCES; i++) {
+            c[k].vect_priority[i] = rand() % PL192_PRIO_LEVELS;
+        }
+        c[k].sw_priority_mask = 0xffff;
+        c[k].daisy_priority = 0xf;
+        c[k].winner = PL192_NO_IRQ;
+        /* A couple of lines that stay up, like a level triggered UART */
+        c[k].status = (1u << (rand() % 32)) | (1u << (rand() % 32));
+        pl192_prio_rebuild(&c[k].prio, c[k].vect_priority, c[k].status);
+    }
+    old_update(c, 0);
+}
+
+/* One interrupt: raise, ack and fin (both re-evaluate the VIC), lower */
+static void cycle(vic *c, int k, int source, int fast)
+{
+    set_line(c, k, source, 1, fast);
+    set_line(c, k, source, 1, fast);
+    set_line(c, k, source, 1, fast);
+    set_line(c, k, source, 0, fast);
+}
+
+static int check(void)
+{
+    vic a[NUM_VICS], b[NUM_VICS];
+    int n, k;
+
+    setup(a);
+    setup(b);
+    for (n = 0; n < 100000; n++) {
+        int v = rand() % NUM_VICS, source = rand() % PL192_INT_SOURCES;
+        int level = rand() & 1;
+
+        set_line(a, v, source, level, 0);
+        set_line(b, v, source, level, 1);
+        for (k = 0; k < NUM_VICS; k++) {
+            if (a[k].winner != b[k].winner) {
+                fprintf(stderr, "mismatch at step %d vic %d: %u != %u\n",
+                        n, k, a[k].winner, b[k].winner);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static double run(int fast)
+{
+    vic c[NUM_VICS];
+    double t;
+    int n;
+
+    setup(c);
+    t = now();
+    for (n = 0; n < CYCLES; n++) {
+        cycle(c, n & (NUM_VICS - 1), (n * 7) & (PL192_INT_SOURCES - 1), fast);
+    }
+    return now() - t;
+}
+
+int main(void)
+{
+    double before, after;
+
+    if (check()) {
+        return 1;
+    }
+
+    before = run(0);
+    after = run(1);
+    printf("%d VICs, raise/ack/fin/lower cycles per second:\n", NUM_VICS);
+    printf("  sorter:  %10.0f\n", CYCLES / before);
+    printf("  bitmaps: %10.0f  (%.1fx)\n", CYCLES / after, before / after);
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Benchmark for parallel RAM page compression (ram-compress.c).
+ *
+ * Saves a synthetic guest RAM image the way ram_save_live() does with
+ * migrate_set_compress (duplicate pages as one byte, other runs of up to
+ * RAM_COMPRESS_MAX_LEN deflated by the pool), restores it with an
+ * inflating pool like ram_load(), checks the result and reports save and
+ * restore throughput in guest bytes per second.  Raw pages copied into
+ * the stream are the baseline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ram-compress.h"
+
+#define PAGE_SIZE 1024  /* TARGET_PAGE_SIZE on ARM */
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int is_dup_page(const uint8_t *p)
+{
+    int i;
+
+    for (i = 1; i < PAGE_SIZE; i++) {
+        if (p[i] != p[0]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Roughly what a booted guest looks like: a third of the pages empty,
+ * the rest code and data with repeated words, some incompressible. */
+static void fill_ram(uint8_t *ram, size_t len)
+{
+    static const char *words[] = {
+        "\x00\x00\xa0\xe3", "\x1e\xff\x2f\xe1", "\x04\xe0\x2d\xe5",
+        "kernel", "IOService", "\xff\xff\xff\xff", "\x00\x00\x00\x00",
+    };
+    size_t off, i;
+
+    for (off = 0; off < len; off += PAGE_SIZE) {
+        uint8_t *p = ram + off;
+        int kind = rand() % 10;
+
+        if (kind < 3) {
+            memset(p, 0, PAGE_SIZE);
+        } else if (kind < 9) {
+            for (i = 0; i < PAGE_SIZE; ) {
+                const char *w = words[rand() % 7];
+                size_t n = (rand() % 3) ? strlen(w) : 4;
+
+                if (n > PAGE_SIZE - i) {
+                    n = PAGE_SIZE - i;
+                }
+                memcpy(p + i, w, n);
+                i += n;
+            }
+        } else {
+            for (i = 0; i < PAGE_SIZE; i++) {
+                p[i] = rand();
+            }
+        }
+    }
+}
+
+static void put32(uint8_t **s, uint32_t v)
+{
+    memcpy(*s, &v, 4);
+    *s += 4;
+}
+
+static uint32_t get32(const uint8_t **s)
+{
+    uint32_t v;
+
+    memcpy(&v, *s, 4);
+    *s += 4;
+    return v;
+}
+
+/* Stream records: offset, len, zlen, data.  zlen 0 is a duplicate page
+ * with its byte as data.  Without a pool the data is raw. */
+static void put_job(uint8_t **s, RAMCompressJob *job)
+{
+    put32(s, job->offset);
+    put32(s, job->len);
+    if (job->op == RAM_COMPRESS_NONE) {
+        put32(s, 0);
+        *(*s)++ = job->ch;
+    } else {
+        put32(s, job->buf_len);
+        memcpy(*s, job->buf, job->buf_len);
+        *s += job->buf_len;
+    }
+}
+
+static size_t save_raw(uint8_t *ram, size_t len, uint8_t *stream)
+{
+    uint8_t *s = stream;
+    size_t off;
+
+    for (off = 0; off < len; off += PAGE_SIZE) {
+        put32(&s, off);
+        put32(&s, PAGE_SIZE);
+        if (is_dup_page(ram + off)) {
+            put32(&s, 0);
+            *s++ = ram[off];
+        } else {
+            put32(&s, PAGE_SIZE);
+            memcpy(s, ram + off, PAGE_SIZE);
+            s += PAGE_SIZE;
+        }
+    }
+    return s - stream;
+}
+
+static size_t save_compressed(RAMCompressPool *pool, uint8_t *ram,
+                              size_t len, uint8_t *stream)
+{
+    RAMCompressJob *job;
+    uint8_t *s = stream;
+    size_t off, run;
+
+    for (off = 0; off < len; off += run) {
+        while ((job = ram_compress_next(pool)) == NULL) {
+            put_job(&s, ram_compress_wait(pool));
+            ram_compress_retire(pool);
+        }
+        job->offset = off;
+        job->host = ram + off;
+        run = PAGE_SIZE;
+        if (is_dup_page(ram + off)) {
+            job->op = RAM_COMPRESS_NONE;
+            job->ch = ram[off];
+        } else {
+            while (run < RAM_COMPRESS_MAX_LEN && off + run < len &&
+                   !is_dup_page(ram + off + run)) {
+                run += PAGE_SIZE;
+            }
+            job->op = RAM_COMPRESS_DEFLATE;
+        }
+        job->len = run;
+        ram_compress_submit(pool, job);
+    }
+    while ((job = ram_compress_wait(pool)) != NULL) {
+        if (job->ret) {
+            printf("deflate failed\n");
+            exit(1);
+        }
+        put_job(&s, job);
+        ram_compress_retire(pool);
+    }
+    return s - stream;
+}
+
+static int restore(RAMCompressPool *pool, const uint8_t *stream,
+                   size_t stream_len, uint8_t *ram)
+{
+    const uint8_t *s = stream;
+    RAMCompressJob *job;
+    uint32_t off, len, zlen;
+    int ret = 0;
+
+    while (s < stream + stream_len) {
+        off = get32(&s);
+        len = get32(&s);
+        zlen = get32(&s);
+        if (zlen == 0) {
+            memset(ram + off, *s++, len);
+        } else if (!pool) {
+            memcpy(ram + off, s, len);
+            s += len;
+        } else {
+            while ((job = ram_compress_next(pool)) == NULL) {
+                ret |= ram_compress_wait(pool)->ret;
+                ram_compress_retire(pool);
+            }
+            memcpy(job->buf, s, zlen);
+            s += zlen;
+            job->op = RAM_COMPRESS_INFLATE;
+            job->host = ram + off;
+            job->len = len;
+            job->buf_len = zlen;
+            ram_compress_submit(pool, job);
+        }
+    }
+    while (pool && (job = ram_compress_wait(pool)) != NULL) {
+        ret |= job->ret;
+        ram_compress_retire(pool);
+    }
+    return ret;
+}
+
+static void report(const char *name, size_t len, size_t stream_len,
+                   double t_save, double t_load)
+{
+    printf("  %-14s %6.1f%% %9.1f MB/s save %9.1f MB/s restore\n", name,
+           100.0 * stream_len / len, len / t_save / (1024 * 1024),
+           len / t_load / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+    static const int threads[] = { 1, 2, 4, 8, 0 };
+    size_t len = 64 << 20, stream_len;
+    uint8_t *ram, *copy, *stream;
+    RAMCompressPool *deflate_pool, *inflate_pool;
+    double t_save, t_load;
+    char name[32];
+    unsigned i;
+    int ret;
+
+    if (argc > 1) {
+        len = strtoul(argv[1], NULL, 0) << 20;
+    }
+
+    ram = malloc(len);
+    copy = malloc(len);
+    stream = malloc(len + len / PAGE_SIZE * 16 + RAM_COMPRESS_MAX_LEN);
+    srand(0x8900);
+    fill_ram(ram, len);
+
+    printf("%zu MB of guest RAM, %d byte pages:\n", len >> 20, PAGE_SIZE);
+
+    t_save = now();
+    stream_len = save_raw(ram, len, stream);
+    t_save = now() - t_save;
+    memset(copy, 0x55, len);
+    t_load = now();
+    restore(NULL, stream, stream_len, copy);
+    t_load = now() - t_load;
+    if (memcmp(ram, copy, len)) {
+        printf("raw restore mismatch\n");
+        return 1;
+    }
+    report("raw pages", len, stream_len, t_save, t_load);
+
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        deflate_pool = ram_compress_pool_new(threads[i], 1);
+        inflate_pool = ram_compress_pool_new(threads[i], -1);
+        if (!deflate_pool || !inflate_pool) {
+            printf("could not create compression pools\n");
+            return 1;
+        }
+
+        t_save = now();
+        stream_len = save_compressed(deflate_pool, ram, len, stream);
+        t_save = now() - t_save;
+        memset(copy, 0x55, len);
+        t_load = now();
+        ret = restore(inflate_pool, stream, stream_len, copy);
+        t_load = now() - t_load;
+        if (ret || memcmp(ram, copy, len)) {
+            printf("zlib restore mismatch\n");
+            return 1;
+        }
+
+        if (threads[i]) {
+            snprintf(name, sizeof(name), "zlib x%d", threads[i]);
+        } else {
+            snprintf(name, sizeof(name), "zlib, all cpus");
+        }
+        report(name, len, stream_len, t_save, t_load);
+
+        ram_compress_pool_free(deflate_pool);
+        ram_compress_pool_free(inflate_pool);
+    }
+
+    return 0;
+}